@@ -0,0 +1,124 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Pool Of Aligned Buffers For Direct Reads
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_ALIGNED_BUFFER_POOL_H_
+#define CABINET_ALIGNED_BUFFER_POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+
+namespace cabinet {
+// class AlignedBufferPool
+// buffers aligned to kAlignment, as reads of a file opened with O_DIRECT
+// want them. sizes are rounded up to a power of two, at least
+// kAlignment, and a released buffer is kept for the next read of its
+// size while the kept ones take no more than capacity bytes. so the
+// memory of direct reads is what is in flight plus capacity. one may be
+// shared by threads and by cabinets, e.g. all dbs of a server.
+class AlignedBufferPool {
+ public:
+  static const size_t kAlignment = 4096;
+
+  explicit AlignedBufferPool(uint64_t capacity) : capacity_(capacity), bytes_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+  ~AlignedBufferPool() {
+    for (size_t i = 0; i < kClasses; ++i) {
+      for (size_t j = 0; j < free_[i].size(); ++j) {
+        free(free_[i][j]);
+      }
+    }
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // a buffer of at least size bytes, given back by Release(size).
+  char* Acquire(size_t size) {
+    size_t index = ClassOf(size);
+    pthread_mutex_lock(&mutex_);
+    if (!free_[index].empty()) {
+      char* buf = free_[index].back();
+      free_[index].pop_back();
+      bytes_ -= ClassSize(index);
+      pthread_mutex_unlock(&mutex_);
+      return buf;
+    }
+    pthread_mutex_unlock(&mutex_);
+    void* buf = NULL;
+    if (posix_memalign(&buf, kAlignment, ClassSize(index)) != 0) {
+      throw std::bad_alloc();
+    }
+    return (char*)buf;
+  }
+
+  void Release(char* buf, size_t size) {
+    size_t index = ClassOf(size);
+    pthread_mutex_lock(&mutex_);
+    if (bytes_ + ClassSize(index) <= capacity_) {
+      free_[index].push_back(buf);
+      bytes_ += ClassSize(index);
+      buf = NULL;
+    }
+    pthread_mutex_unlock(&mutex_);
+    free(buf);
+  }
+
+  uint64_t GetCapacity() const { return capacity_; }
+  // bytes of the buffers kept for reuse.
+  uint64_t GetBytes() {
+    pthread_mutex_lock(&mutex_);
+    uint64_t bytes = bytes_;
+    pthread_mutex_unlock(&mutex_);
+    return bytes;
+  }
+
+ private:
+  static const size_t kClasses = 64;
+
+  static size_t ClassOf(size_t size) {
+    size_t index = 0;
+    while (ClassSize(index) < size) {
+      ++index;
+    }
+    return index;
+  }
+  static size_t ClassSize(size_t index) { return kAlignment << index; }
+
+  AlignedBufferPool(const AlignedBufferPool&);
+  void operator=(const AlignedBufferPool&);
+
+  const uint64_t capacity_;
+  uint64_t bytes_;
+  pthread_mutex_t mutex_;
+  std::vector<char*> free_[kClasses];
+};
+
+// class AlignedBuffer
+// a buffer of a pool for a scope.
+class AlignedBuffer {
+ public:
+  AlignedBuffer(AlignedBufferPool* pool, size_t size)
+    : pool_(pool), size_(size), data_(pool->Acquire(size)) {}
+  ~AlignedBuffer() { pool_->Release(data_, size_); }
+
+  char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  AlignedBuffer(const AlignedBuffer&);
+  void operator=(const AlignedBuffer&);
+
+  AlignedBufferPool* pool_;
+  size_t size_;
+  char* data_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_ALIGNED_BUFFER_POOL_H_
@@ -0,0 +1,403 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Batched Asynchronous Reads By io_uring Or A pread Thread Pool
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_ASYNC_READER_H_
+#define CABINET_ASYNC_READER_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <deque>
+#include <utility>
+#include <vector>
+
+// io_uring is used through raw syscalls, no liburing needed.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define CABINET_HAVE_IO_URING 1
+#endif
+#endif
+
+namespace cabinet {
+// one read of a batch, into buf, or scattered over iovcnt iovecs at iov
+// that add up to size.
+struct AsyncRead {
+  int fd;
+  uint64_t offset;
+  uint32_t size;
+  char* buf;
+  const struct iovec* iov;
+  int iovcnt;
+  int64_t result;  // bytes read, size unless at the end of the file, or -errno.
+};
+
+// class AsyncReader
+// runs the reads of a batch at once instead of one pread after another.
+// with io_uring, a batch puts up to queue_depth reads in flight from the
+// calling thread, through a ring of its own. without it, or with
+// queue_depth 0, the reads go to threads pread workers. it may be shared
+// by threads, e.g. all BatchGets of a server.
+class AsyncReader {
+ public:
+  class Callback {
+   public:
+    virtual ~Callback() {}
+    // read i of the batch is complete. on the pool it is called by the
+    // workers, maybe at once for different reads. it must not throw.
+    virtual void Done(size_t i, const AsyncRead& read) = 0;
+  };
+
+  AsyncReader(uint32_t queue_depth, int threads)
+    : queue_depth_(queue_depth), io_uring_(false), stopping_(false) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+#ifdef CABINET_HAVE_IO_URING
+    if (queue_depth_ > 0) {
+      Ring* ring = OpenRing(queue_depth_);
+      if (ring != NULL) {
+        io_uring_ = true;
+        rings_.push_back(ring);
+      }
+    }
+#endif
+    for (int i = 0; i < threads && !io_uring_; ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, WorkerThread, this) == 0) {
+        workers_.push_back(thread);
+      }
+    }
+  }
+
+  ~AsyncReader() {
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    for (size_t i = 0; i < workers_.size(); ++i) {
+      pthread_join(workers_[i], NULL);
+    }
+#ifdef CABINET_HAVE_IO_URING
+    for (size_t i = 0; i < rings_.size(); ++i) {
+      CloseRing(rings_[i]);
+    }
+#endif
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  bool UsesIoUring() const { return io_uring_; }
+
+  // the reads one after another in the calling thread.
+  static void ReadEach(AsyncRead* reads, size_t count, Callback* callback) {
+    for (size_t i = 0; i < count; ++i) {
+      PreadFully(&reads[i]);
+      callback->Done(i, reads[i]);
+    }
+  }
+
+  // returns once every read is done and passed to callback.
+  void Read(AsyncRead* reads, size_t count, Callback* callback) {
+#ifdef CABINET_HAVE_IO_URING
+    if (io_uring_) {
+      RingRead(reads, count, callback);
+      return;
+    }
+#endif
+    if (workers_.empty()) {
+      ReadEach(reads, count, callback);
+      return;
+    }
+    Batch batch;
+    batch.reads = reads;
+    batch.callback = callback;
+    batch.remaining = count;
+    pthread_cond_init(&batch.done, NULL);
+    pthread_mutex_lock(&mutex_);
+    for (size_t i = 0; i < count; ++i) {
+      jobs_.push_back(std::make_pair(&batch, i));
+    }
+    pthread_cond_broadcast(&cond_);
+    while (batch.remaining > 0) {
+      pthread_cond_wait(&batch.done, &mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+    pthread_cond_destroy(&batch.done);
+  }
+
+ private:
+  struct Batch {
+    AsyncRead* reads;
+    Callback* callback;
+    size_t remaining;
+    pthread_cond_t done;
+  };
+
+  // reads on after a short read, as a plain pread would.
+  static void PreadFully(AsyncRead* read) {
+    read->result = 0;
+    FinishRead(read);
+  }
+
+  static void FinishRead(AsyncRead* read) {
+    while (read->result >= 0 && read->result < read->size) {
+      ssize_t ret;
+      if (read->iovcnt == 0) {
+        ret = pread(read->fd, read->buf + read->result, read->size - read->result,
+          read->offset + read->result);
+      } else {
+        std::vector<struct iovec> rest;
+        uint64_t skip = read->result;
+        for (int i = 0; i < read->iovcnt; ++i) {
+          if (skip >= read->iov[i].iov_len) {
+            skip -= read->iov[i].iov_len;
+            continue;
+          }
+          struct iovec iov;
+          iov.iov_base = (char*)read->iov[i].iov_base + skip;
+          iov.iov_len = read->iov[i].iov_len - skip;
+          rest.push_back(iov);
+          skip = 0;
+        }
+        ret = preadv(read->fd, &rest[0], rest.size(), read->offset + read->result);
+      }
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        if (ret < 0) {
+          read->result = -errno;
+        }
+        return;
+      }
+      read->result += ret;
+    }
+  }
+
+  static void* WorkerThread(void* arg) {
+    AsyncReader* reader = (AsyncReader*)arg;
+    pthread_mutex_lock(&reader->mutex_);
+    for (;;) {
+      while (reader->jobs_.empty() && !reader->stopping_) {
+        pthread_cond_wait(&reader->cond_, &reader->mutex_);
+      }
+      if (reader->jobs_.empty()) {
+        break;
+      }
+      Batch* batch = reader->jobs_.front().first;
+      size_t i = reader->jobs_.front().second;
+      reader->jobs_.pop_front();
+      pthread_mutex_unlock(&reader->mutex_);
+      PreadFully(&batch->reads[i]);
+      batch->callback->Done(i, batch->reads[i]);
+      pthread_mutex_lock(&reader->mutex_);
+      if (--batch->remaining == 0) {
+        pthread_cond_signal(&batch->done);
+      }
+    }
+    pthread_mutex_unlock(&reader->mutex_);
+    return NULL;
+  }
+
+#ifdef CABINET_HAVE_IO_URING
+  struct Ring {
+    int fd;
+    uint32_t entries;
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+  };
+
+  static Ring* OpenRing(uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0) {
+      return NULL;
+    }
+    Ring* ring = new Ring;
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_SQ_RING);
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_CQ_RING);
+    void* sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_SQES);
+    if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+      ring->sqes = sqes == MAP_FAILED ? NULL : (struct io_uring_sqe*)sqes;
+      CloseRing(ring);
+      return NULL;
+    }
+    ring->sqes = (struct io_uring_sqe*)sqes;
+    char* sq = (char*)ring->sq_ptr;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    char* cq = (char*)ring->cq_ptr;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return ring;
+  }
+
+  static void CloseRing(Ring* ring) {
+    if (ring->sq_ptr != NULL && ring->sq_ptr != MAP_FAILED) {
+      munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if (ring->cq_ptr != NULL && ring->cq_ptr != MAP_FAILED) {
+      munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sqes != NULL) {
+      munmap(ring->sqes, ring->sqes_size);
+    }
+    close(ring->fd);
+    delete ring;
+  }
+
+  // a ring serves one batch at a time, concurrent batches open more.
+  Ring* AcquireRing() {
+    pthread_mutex_lock(&mutex_);
+    Ring* ring = NULL;
+    if (!rings_.empty()) {
+      ring = rings_.back();
+      rings_.pop_back();
+    }
+    pthread_mutex_unlock(&mutex_);
+    return ring != NULL ? ring : OpenRing(queue_depth_);
+  }
+
+  void ReleaseRing(Ring* ring) {
+    pthread_mutex_lock(&mutex_);
+    rings_.push_back(ring);
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  void RingRead(AsyncRead* reads, size_t count, Callback* callback) {
+    Ring* ring = AcquireRing();
+    if (ring == NULL) {
+      ReadEach(reads, count, callback);
+      return;
+    }
+    std::vector<struct iovec> iovs(count);
+    std::vector<bool> finished(count, false);
+    size_t next = 0;  // the first read not queued yet.
+    size_t done = 0;
+    uint32_t in_flight = 0;  // queued, not completed.
+    uint32_t pending = 0;  // queued, not submitted.
+    while (done < count) {
+      unsigned tail = *ring->sq_tail;
+      unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+      while (next < count && in_flight < ring->entries && tail - head < ring->entries) {
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe* sqe = &ring->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        iovs[next].iov_base = reads[next].buf;
+        iovs[next].iov_len = reads[next].size;
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = reads[next].fd;
+        sqe->off = reads[next].offset;
+        if (reads[next].iovcnt == 0) {
+          sqe->addr = (uint64_t)(uintptr_t)&iovs[next];
+          sqe->len = 1;
+        } else {
+          sqe->addr = (uint64_t)(uintptr_t)reads[next].iov;
+          sqe->len = reads[next].iovcnt;
+        }
+        sqe->user_data = next;
+        ring->sq_array[index] = index;
+        ++tail;
+        ++next;
+        ++in_flight;
+        ++pending;
+      }
+      __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+      int ret = syscall(__NR_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS,
+        NULL, 0);
+      if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        // the ring is broken: closing it cancels what is in flight, and
+        // the reads left fail.
+        int err = errno;
+        CloseRing(ring);
+        for (size_t i = 0; i < count; ++i) {
+          if (i < next && !finished[i]) {
+            reads[i].result = -err;
+            callback->Done(i, reads[i]);
+          } else if (i >= next) {
+            PreadFully(&reads[i]);
+            callback->Done(i, reads[i]);
+          }
+        }
+        return;
+      }
+      if (ret > 0) {
+        pending -= ret;
+      }
+
+      unsigned cq_head = *ring->cq_head;
+      unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      while (cq_head != cq_tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[cq_head & *ring->cq_mask];
+        size_t i = cqe->user_data;
+        reads[i].result = cqe->res;
+        ++cq_head;
+        --in_flight;
+        ++done;
+        finished[i] = true;
+        if (reads[i].result > 0) {
+          FinishRead(&reads[i]);
+        }
+        callback->Done(i, reads[i]);
+      }
+      __atomic_store_n(ring->cq_head, cq_head, __ATOMIC_RELEASE);
+    }
+    ReleaseRing(ring);
+  }
+#endif
+
+  AsyncReader(const AsyncReader&);
+  void operator=(const AsyncReader&);
+
+  uint32_t queue_depth_;
+  bool io_uring_;
+  bool stopping_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;  // jobs_ or stopping_ changed.
+  std::deque<std::pair<Batch*, size_t> > jobs_;
+  std::vector<pthread_t> workers_;
+#ifdef CABINET_HAVE_IO_URING
+  std::vector<Ring*> rings_;  // idle rings.
+#endif
+};
+}  // namespace cabinet
+
+#endif  // CABINET_ASYNC_READER_H_
@@ -0,0 +1,152 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Background Thread Writing Full Buffers
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_BACKGROUND_FLUSHER_H_
+#define CABINET_BACKGROUND_FLUSHER_H_
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace cabinet {
+// class BackgroundFlusher
+// runs the jobs submitted to it on threads of its own. the jobs of one
+// queue, e.g. of one cabinet, run one at a time in the order they came,
+// so that they append to its files in order. jobs of different queues
+// run at once on different threads. a job is not owned and must live
+// until it is done. one may be shared by cabinets, e.g. all dbs of a
+// server. jobs run in the calling thread if no thread could be started.
+class BackgroundFlusher {
+ public:
+  class Job {
+   public:
+    Job() : done_(false) {}
+    virtual ~Job() {}
+    // runs on the flusher's thread. it must not throw.
+    virtual void Run() = 0;
+
+   private:
+    friend class BackgroundFlusher;
+    bool done_;
+  };
+
+  BackgroundFlusher() : stopping_(false) { Start(1); }
+  explicit BackgroundFlusher(int threads) : stopping_(false) { Start(threads); }
+  // runs the jobs left first.
+  ~BackgroundFlusher() {
+    pthread_mutex_lock(&mutex_);
+    stopping_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+    for (size_t i = 0; i < threads_.size(); ++i) {
+      pthread_join(threads_[i], NULL);
+    }
+    pthread_cond_destroy(&done_);
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  // queues job after the earlier jobs of queue, any pointer that tells
+  // the submitter apart.
+  void Submit(Job* job, const void* queue) {
+    job->done_ = false;
+    if (threads_.empty()) {
+      job->Run();
+      job->done_ = true;
+      return;
+    }
+    pthread_mutex_lock(&mutex_);
+    std::deque<Job*>& jobs = queues_[queue];
+    jobs.push_back(job);
+    if (jobs.size() == 1) {
+      ready_.push_back(queue);
+      pthread_cond_signal(&cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+  bool IsDone(Job* job) {
+    pthread_mutex_lock(&mutex_);
+    bool done = job->done_;
+    pthread_mutex_unlock(&mutex_);
+    return done;
+  }
+
+  void Wait(Job* job) {
+    pthread_mutex_lock(&mutex_);
+    while (!job->done_) {
+      pthread_cond_wait(&done_, &mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+ private:
+  void Start(int threads) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+    pthread_cond_init(&done_, NULL);
+    for (int i = 0; i < std::max(threads, 1); ++i) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, FlusherThread, this) == 0) {
+        threads_.push_back(thread);
+      }
+    }
+  }
+
+  // a queue is taken by one thread at a time, for its first job. it is
+  // ready again once that job is done, if it has more.
+  static void* FlusherThread(void* arg) {
+    BackgroundFlusher* flusher = (BackgroundFlusher*)arg;
+    pthread_mutex_lock(&flusher->mutex_);
+    for (;;) {
+      while (flusher->ready_.empty() && !flusher->stopping_) {
+        pthread_cond_wait(&flusher->cond_, &flusher->mutex_);
+      }
+      if (flusher->ready_.empty()) {
+        break;
+      }
+      const void* queue = flusher->ready_.front();
+      flusher->ready_.pop_front();
+      std::deque<Job*>& jobs = flusher->queues_[queue];
+      Job* job = jobs.front();
+      pthread_mutex_unlock(&flusher->mutex_);
+      job->Run();
+      pthread_mutex_lock(&flusher->mutex_);
+      job->done_ = true;
+      pthread_cond_broadcast(&flusher->done_);
+      jobs.pop_front();
+      if (jobs.empty()) {
+        flusher->queues_.erase(queue);
+      } else {
+        flusher->ready_.push_back(queue);
+        pthread_cond_signal(&flusher->cond_);
+      }
+    }
+    pthread_mutex_unlock(&flusher->mutex_);
+    return NULL;
+  }
+
+  BackgroundFlusher(const BackgroundFlusher&);
+  void operator=(const BackgroundFlusher&);
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;  // a queue is ready, or stopping_.
+  pthread_cond_t done_;  // a job is done.
+  std::vector<pthread_t> threads_;
+  bool stopping_;
+  // the jobs not done yet by queue, the first one is running or next.
+  std::map<const void*, std::deque<Job*> > queues_;
+  // the queues whose first job waits for a thread.
+  std::deque<const void*> ready_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_BACKGROUND_FLUSHER_H_
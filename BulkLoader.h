@@ -0,0 +1,270 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Offline Loader Writing The Files Of A New Cabinet.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_BULK_LOADER_H_
+#define CABINET_BULK_LOADER_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "BackgroundFlusher.h"
+#include "CabinetExceptions.h"
+#include "TCabinet.h"
+
+namespace cabinet {
+// class TBulkLoader
+// builds a new cabinet from a stream of entries without going through
+// Set(): values are appended to "data" a large buffer at a time and
+// their records to "index", in batches of the current format, with no
+// hash index to keep up. a key added
+// again wins over the earlier one, as in the index log. the db is built
+// in "<path>.loading" and renamed to path by Finish(), so that a server
+// never sees it half written. it has a single data file and one shard,
+// and is neither compressed nor checksummed. its first Open() replays
+// the index, see CabinetOptions::load_threads, and its Close() writes
+// the checkpoint.
+template <class KeyType, class KeyWriter>
+class TBulkLoader {
+ public:
+  // a data buffer, a larger value is written alone.
+  static const uint32_t kBufferBytes = 8 * 1024 * 1024;
+  static const uint32_t kIndexBufferBytes = 4 * 1024 * 1024;
+
+  // flusher writes a full buffer while the other one is filled, not
+  // owned. NULL writes it in Add().
+  explicit TBulkLoader(BackgroundFlusher* flusher = NULL)
+    : flusher_(flusher), data_fd_(-1), index_(NULL), log_(NULL), data_length_(0),
+      entry_count_(0) {
+    filling_ = &jobs_[0];
+  }
+  ~TBulkLoader() { Abort(); }
+
+  // starts the db at path, which must not exist yet. a "<path>.loading"
+  // left by an earlier load is overwritten.
+  void Open(const char* path) {
+    Abort();
+    path_ = path;
+    while (path_.size() > 1 && *path_.rbegin() == '/') {
+      path_.erase(path_.size() - 1);
+    }
+    struct stat st;
+    if (lstat(path_.c_str(), &st) == 0) {
+      throw OpenFileException(__FILE__, __LINE__, EEXIST, strerror(EEXIST));
+    }
+    loading_ = path_ + ".loading/";
+    if (mkdir(loading_.c_str(), S_IRUSR | S_IWUSR | S_IEXEC) != 0 && errno != EEXIST) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    data_fd_ = open((loading_ + "data").c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (data_fd_ == -1) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    index_ = fopen((loading_ + "index").c_str(), "wb");
+    if (!index_) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    setvbuf(index_, NULL, _IOFBF, kIndexBufferBytes);
+    IndexLogWriter<KeyType, KeyWriter>::WriteHeader(index_);
+    log_ = new IndexLogWriter<KeyType, KeyWriter>(index_, kIndexVersion);
+    for (size_t i = 0; i < sizeof(jobs_) / sizeof(jobs_[0]); ++i) {
+      jobs_[i].fd = data_fd_;
+      jobs_[i].buf.resize(kBufferBytes);
+      jobs_[i].length = 0;
+      jobs_[i].submitted = false;
+    }
+    filling_ = &jobs_[0];
+    data_length_ = 0;
+    entry_count_ = 0;
+  }
+
+  void Add(const KeyType& key, const uint8_t* value, uint32_t size) {
+    if (filling_->length + size > kBufferBytes) {
+      Submit();
+    }
+    uint64_t position = data_length_ + filling_->length;
+    if (size > kBufferBytes) {
+      WaitAll();
+      int err = PwriteFully(data_fd_, value, size, data_length_);
+      if (err) {
+        throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+      }
+      data_length_ += size;
+    } else if (size > 0) {
+      memcpy(&filling_->buf[filling_->length], value, size);
+      filling_->length += size;
+    }
+
+    BlockInfo block;
+    block.size = size;
+    block.position = position;
+    log_->Add(key, block);
+    ++entry_count_;
+  }
+
+  // writes out and syncs the files, then renames the db into place.
+  void Finish() {
+    Submit();
+    WaitAll();
+    if (fdatasync(data_fd_) != 0) {
+      throw SyncFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    log_->Finish();
+    if (fflush(index_) != 0 || fsync(fileno(index_)) != 0) {
+      throw SyncFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    fclose(index_);
+    index_ = NULL;
+    delete log_;
+    log_ = NULL;
+    close(data_fd_);
+    data_fd_ = -1;
+    SyncDirectory(loading_);
+    if (rename(loading_.c_str(), path_.c_str()) != 0) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    size_t slash = path_.rfind('/');
+    SyncDirectory(slash == std::string::npos ? "." : path_.substr(0, slash + 1));
+    loading_.clear();
+  }
+
+  // drops a load not finished, and its files.
+  void Abort() {
+    try {
+      WaitAll();
+    } catch (...) {
+      // the files go anyway.
+    }
+    delete log_;
+    log_ = NULL;
+    if (index_) {
+      fclose(index_);
+      index_ = NULL;
+    }
+    if (data_fd_ != -1) {
+      close(data_fd_);
+      data_fd_ = -1;
+    }
+    if (!loading_.empty()) {
+      unlink((loading_ + "data").c_str());
+      unlink((loading_ + "index").c_str());
+      rmdir(loading_.c_str());
+      loading_.clear();
+    }
+  }
+
+  uint64_t GetEntryCount() const { return entry_count_; }
+  uint64_t GetDataBytes() const { return data_length_ + filling_->length; }
+
+ private:
+  // returns 0, or the errno of the failed write.
+  static int PwriteFully(int fd, const uint8_t* data, size_t length, uint64_t offset) {
+    size_t done = 0;
+    while (done < length) {
+      ssize_t ret = pwrite(fd, data + done, length - done, offset + done);
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      } else if (ret <= 0) {
+        return ret < 0 ? errno : EIO;
+      }
+      done += ret;
+    }
+    return 0;
+  }
+
+  // writes buf to the data file at offset.
+  struct WriteJob : public BackgroundFlusher::Job {
+    int fd;
+    std::vector<uint8_t> buf;
+    size_t length;
+    uint64_t offset;
+    bool submitted;
+    int error;
+
+    WriteJob() : fd(-1), length(0), offset(0), submitted(false), error(0) {}
+    void Run() { error = PwriteFully(fd, &buf[0], length, offset); }
+  };
+
+  // hands the filling buffer to the flusher and takes the other one.
+  void Submit() {
+    if (filling_->length == 0) {
+      return;
+    }
+    filling_->offset = data_length_;
+    data_length_ += filling_->length;
+    if (flusher_) {
+      filling_->submitted = true;
+      flusher_->Submit(filling_, this);
+    } else {
+      filling_->Run();
+      CheckJob(filling_);
+    }
+    filling_ = filling_ == &jobs_[0] ? &jobs_[1] : &jobs_[0];
+    Wait(filling_);
+  }
+
+  void Wait(WriteJob* job) {
+    if (job->submitted) {
+      flusher_->Wait(job);
+      job->submitted = false;
+      CheckJob(job);
+    }
+    job->length = 0;
+  }
+
+  void WaitAll() {
+    // the filling buffer was never submitted, its length stays.
+    WriteJob* other = filling_ == &jobs_[0] ? &jobs_[1] : &jobs_[0];
+    if (other->submitted) {
+      Wait(other);
+    }
+  }
+
+  void CheckJob(WriteJob* job) {
+    if (job->error) {
+      throw WriteFileException(__FILE__, __LINE__, job->error, strerror(job->error));
+    }
+  }
+
+  static void SyncDirectory(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    int ret = fsync(fd);
+    int err = errno;
+    close(fd);
+    if (ret != 0) {
+      throw SyncFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+  }
+
+  TBulkLoader(const TBulkLoader&);
+  void operator=(const TBulkLoader&);
+
+  BackgroundFlusher* flusher_;
+  std::string path_;
+  std::string loading_;  // empty unless a load is open.
+  int data_fd_;
+  FILE* index_;
+  IndexLogWriter<KeyType, KeyWriter>* log_;  // appends to index_.
+  WriteJob jobs_[2];
+  WriteJob* filling_;  // one of jobs_.
+  uint64_t data_length_;  // bytes submitted so far.
+  uint64_t entry_count_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_BULK_LOADER_H_
@@ -0,0 +1,1365 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Cabinet Micro Benchmarks
+ *
+ * usage: cabinet_bench <mode> [args...]
+ *   index [keys]    lookup ns/op and bytes/key of hash_map vs FlatHashMap,
+ *                   and of hash_map<string> vs StringIndexMap.
+ *   startup [keys] [path]
+ *                   Open() time of a U64Cabinet from checkpoint + log tail
+ *                   vs full index log replay, e.g. keys = 10000000.
+ *   replay [keys] [threads] [path]
+ *                   Open() time of full index log replay with 1 up to
+ *                   threads load threads.
+ *   get [keys] [path]
+ *                   random Get() ns/op by pread, from the mapping into a
+ *                   string, and as a pinned ValueView.
+ *   compact [keys] [path]
+ *                   Get/Set latency percentiles alone, along with a
+ *                   background compaction, and with a blocking Compact().
+ *   segments [keys] [segment_mb] [path]
+ *                   Compact() time and bytes reclaimed for a single data
+ *                   file vs segments, once the oldest fifth of the keys is
+ *                   overwritten.
+ *   compress [keys] [path]
+ *                   disk bytes, Set and Get ns/op of JSON-like values kept
+ *                   raw, compressed, and compressed with a dictionary.
+ *   sync [clients] [seconds] [path]
+ *                   durable writes/s of 1 up to clients threads that each
+ *                   Set() and wait for the write to be on disk, with a
+ *                   Sync() per write vs group commit.
+ *   batchget [keys] [batch] [path]
+ *                   batches of random and of related keys from a cold
+ *                   page cache: Get() one by one vs MultiGet() with and
+ *                   without merged reads, by io_uring and by a pread pool.
+ *   shards [threads] [seconds] [path]
+ *                   Set and Get/Set mix ops/s of 1 up to threads threads
+ *                   on one shard, i.e. one lock, vs 16 shards.
+ *   flushread [keys] [seconds] [path]
+ *                   Get latency percentiles on one thread while another
+ *                   overwrites keys, with the lock held for whole Set()
+ *                   calls vs the lock given back while flushes write.
+ *   cache [keys] [cache_mb] [path]
+ *                   Zipfian Get() ns/op and hit ratio of raw and
+ *                   compressed values without and with a value cache,
+ *                   and the hit ratio again after a scan of all keys.
+ *   setlatency [keys] [path]
+ *                   Set() latency percentiles of 1KB values with full
+ *                   buffers written in Set() vs by a background flusher
+ *                   with 2 and 4 buffers.
+ *   direct [keys] [path]
+ *                   data file size, cold random Get() ns/op and page cache
+ *                   taken by the data file of buffered, random and direct
+ *                   reads.
+ *   scan [keys] [path]
+ *                   MB/s of reading every value of a db from a cold page
+ *                   cache, by Get() in key order vs CabinetIterator, and
+ *                   of reading the data file alone.
+ *   freeze [keys] [path]
+ *                   Freeze() time, then Open() time, index bytes and random
+ *                   Get() ns/op of the loaded hash index vs the mapped
+ *                   frozen index.
+ *   checksums [keys] [path]
+ *                   CRC32C MB/s by table and by the SSE4.2 instruction,
+ *                   then Set, mapped Get ns/op of 4KB values without and
+ *                   with checksums, and Scrub() MB/s.
+ *   inline [keys] [path]
+ *                   pread Get() ns/op of 16 byte values, and the memory
+ *                   taken, without and with inline_value_bytes.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "CabinetTypes.h"
+#include "GroupCommit.h"
+
+using cabinet::AsyncReader;
+using cabinet::BlockInfo;
+using cabinet::CabinetBase;
+using cabinet::CabinetIterator;
+using cabinet::CabinetOptions;
+using cabinet::FlatHashMap;
+using cabinet::ShardedU64Cabinet;
+using cabinet::GroupCommit;
+using cabinet::Mix64;
+using cabinet::StringIndexMap;
+using cabinet::SyncPoint;
+using cabinet::U64Cabinet;
+using cabinet::ValueCache;
+using cabinet::ValueView;
+
+namespace {
+double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+uint64_t Random64() {
+  return ((uint64_t)rand() << 42) ^ ((uint64_t)rand() << 21) ^ (uint64_t)rand();
+}
+
+// counts heap bytes of the node based hash_map.
+size_t g_allocated = 0;
+
+template <class T>
+class CountingAllocator : public std::allocator<T> {
+ public:
+  template <class U> struct rebind { typedef CountingAllocator<U> other; };
+  CountingAllocator() {}
+  CountingAllocator(const CountingAllocator&) : std::allocator<T>() {}
+  template <class U> CountingAllocator(const CountingAllocator<U>&) {}
+  T* allocate(size_t n, const void* = 0) {
+    g_allocated += n * sizeof(T);
+    return std::allocator<T>::allocate(n);
+  }
+  void deallocate(T* p, size_t n) {
+    g_allocated -= n * sizeof(T);
+    std::allocator<T>::deallocate(p, n);
+  }
+};
+
+template <class MapType, class KeyType>
+double LookupNsPerOp(MapType& map, const std::vector<KeyType>& keys) {
+  double start = NowSeconds();
+  uint64_t sum = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    typename MapType::iterator itr = map.find(keys[i]);
+    if (itr != map.end()) {
+      sum += itr->second.size;
+    }
+  }
+  double elapsed = NowSeconds() - start;
+  if (sum == 0) {
+    fprintf(stderr, "unexpected empty lookups.\n");
+  }
+  return elapsed * 1e9 / keys.size();
+}
+
+template <class KeyType>
+void BenchIndex(const char* name, size_t count) {
+  typedef __gnu_cxx::hash_map<KeyType, BlockInfo, __gnu_cxx::hash<KeyType>,
+    std::equal_to<KeyType>, CountingAllocator<BlockInfo> > NodeMap;
+  typedef FlatHashMap<KeyType, BlockInfo, __gnu_cxx::hash<KeyType> > FlatMap;
+
+  std::vector<KeyType> keys;
+  keys.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back((KeyType)Random64());
+  }
+  BlockInfo blk;
+  blk.size = 1;
+
+  g_allocated = 0;
+  NodeMap node_map;
+  double start = NowSeconds();
+  for (size_t i = 0; i < count; ++i) {
+    blk.position = i;
+    node_map[keys[i]] = blk;
+  }
+  double node_insert = NowSeconds() - start;
+  size_t node_bytes = g_allocated;
+
+  FlatMap flat_map;
+  start = NowSeconds();
+  for (size_t i = 0; i < count; ++i) {
+    blk.position = i;
+    flat_map[keys[i]] = blk;
+  }
+  double flat_insert = NowSeconds() - start;
+  size_t flat_bytes = flat_map.MemoryUsage();
+
+  std::random_shuffle(keys.begin(), keys.end());
+  double node_lookup = LookupNsPerOp(node_map, keys);
+  double flat_lookup = LookupNsPerOp(flat_map, keys);
+
+  size_t entries = node_map.size();
+  fprintf(stderr, "%s keys: %lu\n", name, (unsigned long)entries);
+  fprintf(stderr, "  hash_map:    insert %.1f ns/op, lookup %.1f ns/op, %.1f bytes/key\n",
+    node_insert * 1e9 / count, node_lookup, (double)node_bytes / entries);
+  fprintf(stderr, "  FlatHashMap: insert %.1f ns/op, lookup %.1f ns/op, %.1f bytes/key\n",
+    flat_insert * 1e9 / count, flat_lookup, (double)flat_bytes / entries);
+}
+
+// string keys of 12-20 bytes, looked up through std::string like
+// StringCabinet::Get does. hash_map bytes leave out the heap buffers of
+// keys longer than the std::string inline capacity.
+void BenchStringIndex(size_t count) {
+  typedef __gnu_cxx::hash_map<std::string, BlockInfo, cabinet::StringHashFunc,
+    std::equal_to<std::string>, CountingAllocator<BlockInfo> > NodeMap;
+
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  char buf[64];
+  for (size_t i = 0; i < count; ++i) {
+    snprintf(buf, sizeof(buf), "user:%lu:%lu", (unsigned long)Random64() % 1000000000,
+      (unsigned long)(i % 997));
+    keys.push_back(buf);
+  }
+  size_t key_bytes = 0;
+  for (size_t i = 0; i < count; ++i) {
+    key_bytes += keys[i].size();
+  }
+  BlockInfo blk;
+  blk.size = 1;
+
+  g_allocated = 0;
+  NodeMap node_map;
+  double start = NowSeconds();
+  for (size_t i = 0; i < count; ++i) {
+    blk.position = i;
+    node_map[keys[i]] = blk;
+  }
+  double node_insert = NowSeconds() - start;
+  size_t node_bytes = g_allocated;
+
+  StringIndexMap<BlockInfo> arena_map;
+  start = NowSeconds();
+  for (size_t i = 0; i < count; ++i) {
+    blk.position = i;
+    arena_map[keys[i]] = blk;
+  }
+  double arena_insert = NowSeconds() - start;
+  size_t arena_bytes = arena_map.MemoryUsage();
+
+  std::random_shuffle(keys.begin(), keys.end());
+  double node_lookup = LookupNsPerOp(node_map, keys);
+  double arena_lookup = LookupNsPerOp(arena_map, keys);
+
+  size_t entries = node_map.size();
+  fprintf(stderr, "string keys: %lu, %.1f bytes/key on average\n",
+    (unsigned long)entries, (double)key_bytes / count);
+  fprintf(stderr, "  hash_map:       insert %.1f ns/op, lookup %.1f ns/op, %.1f bytes/key\n",
+    node_insert * 1e9 / count, node_lookup, (double)node_bytes / entries);
+  fprintf(stderr, "  StringIndexMap: insert %.1f ns/op, lookup %.1f ns/op, %.1f bytes/key\n",
+    arena_insert * 1e9 / count, arena_lookup, (double)arena_bytes / entries);
+}
+
+// builds a db whose index log holds superseded entries and tombstones,
+// then times Open() with and without the checkpoint.
+void BenchStartup(size_t count, const std::string& path) {
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+
+  double start = NowSeconds();
+  uint8_t value[16];
+  memset(value, 'v', sizeof(value));
+  {
+    U64Cabinet cab(path.c_str());
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(i, value, sizeof(value));
+    }
+    for (size_t i = 0; i < count; i += 2) {
+      cab.Set(i, value, sizeof(value));
+    }
+    for (size_t i = 0; i < count; i += 8) {
+      cab.Delete(i);
+    }
+    cab.Close();
+  }
+  fprintf(stderr, "build %lu keys: %.2f s\n", (unsigned long)count, NowSeconds() - start);
+
+  uint64_t entries = 0;
+  start = NowSeconds();
+  {
+    U64Cabinet cab(path.c_str());
+    entries = cab.GetEntryCount();
+  }
+  fprintf(stderr, "  open from checkpoint: %.2f s, %lu entries\n",
+    NowSeconds() - start, (unsigned long)entries);
+
+  cmdline = "mv " + path + "/checkpoint " + path + "/checkpoint.bench";
+  system(cmdline.c_str());
+  start = NowSeconds();
+  {
+    U64Cabinet cab;
+    cab.Open(path.c_str());
+    entries = cab.GetEntryCount();
+    fprintf(stderr, "  open by log replay:   %.2f s, %lu entries\n",
+      NowSeconds() - start, (unsigned long)entries);
+  }
+  cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// replays the whole index log with more and more load threads.
+void BenchReplay(size_t count, int max_threads, const std::string& path) {
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+
+  uint8_t value[16];
+  memset(value, 'v', sizeof(value));
+  {
+    U64Cabinet cab(path.c_str());
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(Random64(), value, sizeof(value));
+    }
+    cab.Close();
+  }
+  std::string checkpoint = path + "/checkpoint";
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    unlink(checkpoint.c_str());
+    CabinetOptions options;
+    options.load_threads = threads;
+    double start = NowSeconds();
+    U64Cabinet cab(path.c_str(), options);
+    fprintf(stderr, "  %2d load threads: %.2f s, %lu entries\n", threads,
+      NowSeconds() - start, (unsigned long)cab.GetEntryCount());
+  }
+  cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// random reads of values with a warm page cache.
+void BenchGet(size_t count, const std::string& path) {
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+
+  uint8_t value[256];
+  memset(value, 'v', sizeof(value));
+  {
+    U64Cabinet cab(path.c_str());
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(i, value, i % sizeof(value));
+    }
+    cab.Close();
+  }
+  std::vector<uint64_t> keys;
+  keys.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back(i);
+  }
+  std::random_shuffle(keys.begin(), keys.end());
+
+  for (int mmap_reads = 0; mmap_reads < 2; ++mmap_reads) {
+    CabinetOptions options;
+    options.mmap_reads = mmap_reads;
+    U64Cabinet cab(path.c_str(), options);
+    std::string str;
+    uint64_t bytes = 0;
+    double start = NowSeconds();
+    for (size_t i = 0; i < count; ++i) {
+      cab.Get(keys[i], &str);
+      bytes += str.size();
+    }
+    fprintf(stderr, "  %s Get(string):    %.1f ns/op\n", mmap_reads ? "mmap " : "pread",
+      (NowSeconds() - start) * 1e9 / count);
+    if (mmap_reads) {
+      ValueView view;
+      uint64_t view_bytes = 0;
+      start = NowSeconds();
+      for (size_t i = 0; i < count; ++i) {
+        cab.Get(keys[i], &view);
+        view_bytes += view.size();
+      }
+      fprintf(stderr, "  mmap  Get(ValueView): %.1f ns/op\n",
+        (NowSeconds() - start) * 1e9 / count);
+      if (view_bytes != bytes) {
+        fprintf(stderr, "unexpected view reads.\n");
+      }
+    }
+    if (bytes == 0) {
+      fprintf(stderr, "unexpected empty reads.\n");
+    }
+  }
+  cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// the db and the lock a server would hold around it.
+struct CompactBench {
+  U64Cabinet* cab;
+  pthread_rwlock_t lock;
+  bool blocking;
+  volatile bool done;
+};
+
+void* CompactThread(void* arg) {
+  CompactBench* bench = static_cast<CompactBench*>(arg);
+  if (bench->blocking) {
+    pthread_rwlock_wrlock(&bench->lock);
+    bench->cab->Compact();
+    pthread_rwlock_unlock(&bench->lock);
+  } else {
+    pthread_rwlock_wrlock(&bench->lock);
+    bench->cab->BeginCompact();
+    pthread_rwlock_unlock(&bench->lock);
+    bench->cab->RunCompact();
+    pthread_rwlock_wrlock(&bench->lock);
+    bench->cab->FinishCompact();
+    pthread_rwlock_unlock(&bench->lock);
+  }
+  bench->done = true;
+  return NULL;
+}
+
+// 90% Get and 10% Set of random keys, each under the lock, for count ops
+// or until done is set.
+void RunOps(CompactBench* bench, size_t keys, size_t count, std::vector<double>* latencies) {
+  uint8_t value[100];
+  memset(value, 'v', sizeof(value));
+  std::string str;
+  latencies->clear();
+  for (size_t i = 0; i < count || !bench->done; ++i) {
+    uint64_t key = Random64() % keys;
+    double start = NowSeconds();
+    if (i % 10 == 0) {
+      pthread_rwlock_wrlock(&bench->lock);
+      bench->cab->Set(key, value, sizeof(value));
+    } else {
+      pthread_rwlock_rdlock(&bench->lock);
+      bench->cab->Get(key, &str);
+    }
+    pthread_rwlock_unlock(&bench->lock);
+    latencies->push_back(NowSeconds() - start);
+  }
+}
+
+void PrintLatencies(const char* name, std::vector<double>* latencies) {
+  std::sort(latencies->begin(), latencies->end());
+  size_t n = latencies->size();
+  fprintf(stderr, "  %-20s %8lu ops, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f ms\n", name,
+    (unsigned long)n, (*latencies)[n / 2] * 1e6, (*latencies)[n * 99 / 100] * 1e6,
+    (*latencies)[n * 999 / 1000] * 1e6, (*latencies)[n - 1] * 1e3);
+}
+
+void BenchCompact(size_t count, const std::string& path) {
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+
+  uint8_t value[100];
+  memset(value, 'v', sizeof(value));
+  U64Cabinet cab(path.c_str());
+  CompactBench bench;
+  bench.cab = &cab;
+  pthread_rwlock_init(&bench.lock, NULL);
+  std::vector<double> latencies;
+  for (int blocking = 0; blocking < 2; ++blocking) {
+    // half of the data file is garbage.
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(i, value, sizeof(value));
+    }
+    for (size_t i = 0; i < count; i += 2) {
+      cab.Set(i, value, sizeof(value));
+    }
+    cab.Flush();
+
+    bench.done = true;
+    RunOps(&bench, count, 200000, &latencies);
+    PrintLatencies("baseline", &latencies);
+
+    bench.blocking = blocking;
+    bench.done = false;
+    double start = NowSeconds();
+    pthread_t tid;
+    pthread_create(&tid, NULL, CompactThread, &bench);
+    RunOps(&bench, count, 0, &latencies);
+    pthread_join(tid, NULL);
+    fprintf(stderr, "  %s compaction took %.2f s\n", blocking ? "blocking" : "background",
+      NowSeconds() - start);
+    PrintLatencies(blocking ? "blocking Compact" : "background compact", &latencies);
+  }
+  pthread_rwlock_destroy(&bench.lock);
+  cab.Close();
+  cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+void BenchSegments(size_t count, uint64_t segment_mb, const std::string& path) {
+  uint8_t value[100];
+  memset(value, 'v', sizeof(value));
+  for (int segmented = 0; segmented < 2; ++segmented) {
+    std::string cmdline = "rm -rf " + path;
+    system(cmdline.c_str());
+    CabinetOptions options;
+    options.segment_size = segmented ? segment_mb * 1024 * 1024 : 0;
+    U64Cabinet cab(path.c_str(), options);
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(i, value, sizeof(value));
+    }
+    for (size_t i = 0; i < count / 5; ++i) {
+      cab.Set(i, value, sizeof(value));
+    }
+    cab.Flush();
+    uint64_t size = cab.GetDataFileSize();
+    double start = NowSeconds();
+    cab.Compact();
+    fprintf(stderr, "  %-10s Compact() %.3f s, %lu of %lu bytes reclaimed, %lu bytes left\n",
+      segmented ? "segments" : "one file", NowSeconds() - start,
+      (unsigned long)(size - cab.GetDataFileSize()), (unsigned long)size,
+      (unsigned long)cab.GetDataFileSize());
+    cab.Close();
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// a JSON-like document of about 150 to 1200 bytes.
+std::string MakeDocument(uint64_t i) {
+  static const char* kNames[] = { "alice", "bob", "carol", "dave", "erin", "frank" };
+  char buf[256];
+  std::string doc = "{\"id\": ";
+  snprintf(buf, sizeof(buf), "%lu, \"items\": [", (unsigned long)i);
+  doc += buf;
+  for (uint64_t item = 0; item < 1 + Random64() % 8; ++item) {
+    snprintf(buf, sizeof(buf), "{\"sku\": \"SKU-%06lu\", \"owner\": \"%s\", "
+      "\"price\": %lu.%02lu, \"in_stock\": %s}, ", (unsigned long)(Random64() % 1000000),
+      kNames[Random64() % 6], (unsigned long)(Random64() % 1000), (unsigned long)(Random64() % 100),
+      Random64() % 2 ? "true" : "false");
+    doc += buf;
+  }
+  return doc + "]}";
+}
+
+void BenchCompress(size_t count, const std::string& path) {
+  std::vector<std::string> docs;
+  for (size_t i = 0; i < count; ++i) {
+    docs.push_back(MakeDocument(i));
+  }
+  std::vector<uint64_t> keys;
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back(i);
+  }
+  std::random_shuffle(keys.begin(), keys.end());
+
+  const char* names[] = { "raw", "deflate", "dictionary" };
+  for (int mode = 0; mode < 3; ++mode) {
+    std::string cmdline = "rm -rf " + path;
+    system(cmdline.c_str());
+    CabinetOptions options;
+    options.compress = mode > 0;
+    options.compress_dictionary = mode > 1;
+    options.mmap_reads = true;
+    U64Cabinet cab(path.c_str(), options);
+    double start = NowSeconds();
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(i, (const uint8_t*)docs[i].data(), docs[i].size());
+    }
+    cab.Flush();
+    double set_ns = (NowSeconds() - start) * 1e9 / count;
+    std::string str;
+    uint64_t bytes = 0;
+    start = NowSeconds();
+    for (size_t i = 0; i < count; ++i) {
+      cab.Get(keys[i], &str);
+      bytes += str.size();
+    }
+    double get_ns = (NowSeconds() - start) * 1e9 / count;
+    fprintf(stderr, "  %-10s %10lu of %10lu bytes on disk (%.2fx), Set %.0f ns/op, Get %.0f ns/op\n",
+      names[mode], (unsigned long)cab.GetDataFileSize(), (unsigned long)bytes,
+      (double)bytes / cab.GetDataFileSize(), set_ns, get_ns);
+    cab.Close();
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+struct SyncBench : public GroupCommit::Syncer {
+  U64Cabinet* cab;
+  pthread_mutex_t lock;
+  GroupCommit* group;  // NULL for a Sync() per write.
+  double deadline;
+  uint64_t next_key;
+  uint64_t writes;
+
+  // as the server: flush under the db lock, fsync without it.
+  void Sync() {
+    SyncPoint point;
+    pthread_mutex_lock(&lock);
+    cab->PrepareSync(&point);
+    pthread_mutex_unlock(&lock);
+    CabinetBase::CommitSync(&point);
+  }
+};
+
+void* SyncClient(void* arg) {
+  SyncBench* bench = (SyncBench*)arg;
+  uint8_t value[100];
+  memset(value, 'v', sizeof(value));
+  while (NowSeconds() < bench->deadline) {
+    pthread_mutex_lock(&bench->lock);
+    bench->cab->Set(bench->next_key++, value, sizeof(value));
+    if (bench->group == NULL) {
+      bench->cab->Sync();
+    }
+    pthread_mutex_unlock(&bench->lock);
+    if (bench->group != NULL) {
+      bench->group->Commit(bench);
+    }
+    __sync_fetch_and_add(&bench->writes, 1);
+  }
+  return NULL;
+}
+
+void BenchSync(int max_clients, double seconds, const std::string& path) {
+  const char* names[] = { "Sync() per write", "group commit", "group commit 200us" };
+  for (int clients = 1; clients <= max_clients; clients *= 2) {
+    for (int mode = 0; mode < 3; ++mode) {
+      std::string cmdline = "rm -rf " + path;
+      system(cmdline.c_str());
+      U64Cabinet cab(path.c_str());
+      GroupCommit group(mode == 2 ? 200 : 0);
+      SyncBench bench;
+      bench.cab = &cab;
+      pthread_mutex_init(&bench.lock, NULL);
+      bench.group = mode > 0 ? &group : NULL;
+      bench.deadline = NowSeconds() + seconds;
+      bench.next_key = 0;
+      bench.writes = 0;
+      std::vector<pthread_t> threads(clients);
+      for (int i = 0; i < clients; ++i) {
+        pthread_create(&threads[i], NULL, SyncClient, &bench);
+      }
+      for (int i = 0; i < clients; ++i) {
+        pthread_join(threads[i], NULL);
+      }
+      fprintf(stderr, "  %3d clients %-18s %8.0f writes/s, %.1f writes/fsync\n", clients,
+        names[mode], bench.writes / seconds,
+        mode > 0 ? (double)bench.writes / std::max<uint64_t>(group.GetSyncCount(), 1) : 1.0);
+      pthread_mutex_destroy(&bench.lock);
+      cab.Close();
+    }
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// evicts the db's files from the page cache.
+void DropCache(const std::string& path) {
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    int fd = open((path + "/" + entry->d_name).c_str(), O_RDONLY);
+    if (fd != -1) {
+      fdatasync(fd);
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  }
+  closedir(dir);
+}
+
+void BenchBatchGet(size_t count, size_t batch, const std::string& path) {
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+  uint8_t value[1024];
+  memset(value, 'v', sizeof(value));
+  {
+    U64Cabinet cab(path.c_str());
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(i, value, 512 + i % 512);
+    }
+    cab.Close();
+  }
+  size_t batches = std::max<size_t>(count / batch / 10, 1);
+  AsyncReader ring(128, 0);
+  AsyncReader pool(0, 16);
+  AsyncReader* readers[] = { NULL, NULL, &ring, &ring, &pool };
+  const char* names[] = { "Get() one by one", "MultiGet sorted", "MultiGet io_uring",
+    "MultiGet io_uring sorted", "MultiGet pread pool sorted" };
+  // random keys, and related keys, i.e. written together, in random order.
+  for (int related = 0; related < 2; ++related) {
+    std::vector<uint64_t> keys;
+    for (size_t i = 0; i < count; ++i) {
+      keys.push_back(related ? i / batch * batch * 2 % count + Random64() % (batch * 2) : i);
+    }
+    if (!related) {
+      std::random_shuffle(keys.begin(), keys.end());
+    }
+    fprintf(stderr, " %s keys:\n", related ? "related" : "random");
+    for (int mode = 0; mode < 5; ++mode) {
+      if (readers[mode] == &ring && !ring.UsesIoUring()) {
+        fprintf(stderr, "  io_uring not available.\n");
+        continue;
+      }
+      CabinetOptions options;
+      // without merging the reads only run in file order.
+      options.read_coalesce_bytes = mode == 0 || mode == 2 ? 0 : options.read_coalesce_bytes;
+      U64Cabinet cab(path.c_str(), options);
+      DropCache(path);
+      std::vector<std::string> values;
+      std::vector<bool> found;
+      uint64_t bytes = 0;
+      double start = NowSeconds();
+      for (size_t b = 0; b < batches; ++b) {
+        std::vector<uint64_t> batch_keys(keys.begin() + b * batch % count,
+          keys.begin() + std::min(b * batch % count + batch, count));
+        if (mode == 0) {
+          values.resize(batch_keys.size());
+          for (size_t i = 0; i < batch_keys.size(); ++i) {
+            cab.Get(batch_keys[i], &values[i]);
+          }
+        } else {
+          cab.MultiGet(batch_keys, readers[mode], &values, &found);
+        }
+        for (size_t i = 0; i < values.size(); ++i) {
+          bytes += values[i].size();
+        }
+      }
+      double elapsed = NowSeconds() - start;
+      fprintf(stderr, "  %-27s %8.0f us/batch of %lu, %lu bytes\n", names[mode],
+        elapsed * 1e6 / batches, (unsigned long)batch, (unsigned long)bytes);
+      cab.Close();
+    }
+  }
+  cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+struct ShardBench {
+  ShardedU64Cabinet* cab;
+  double deadline;
+  int get_percent;
+  uint64_t ops;
+};
+
+void* ShardClient(void* arg) {
+  ShardBench* bench = (ShardBench*)arg;
+  uint8_t value[100];
+  memset(value, 'v', sizeof(value));
+  std::string str;
+  uint64_t ops = 0;
+  // rand() takes a lock, each thread runs an xorshift of its own.
+  uint64_t seed = (uint64_t)(uintptr_t)&str | 1;
+  while ((ops & 255) != 0 || NowSeconds() < bench->deadline) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    uint64_t key = seed % 1000000;
+    if ((int)(key % 100) < bench->get_percent) {
+      bench->cab->Get(key, &str);
+    } else {
+      bench->cab->Set(key, value, sizeof(value));
+    }
+    ++ops;
+  }
+  __sync_fetch_and_add(&bench->ops, ops);
+  return NULL;
+}
+
+void BenchShards(int max_threads, double seconds, const std::string& path) {
+  for (int get_percent = 0; get_percent <= 80; get_percent += 80) {
+    fprintf(stderr, " %d%% Get, %d%% Set:\n", get_percent, 100 - get_percent);
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      for (int shards = 1; shards <= 16; shards *= 16) {
+        std::string cmdline = "rm -rf " + path;
+        system(cmdline.c_str());
+        CabinetOptions options;
+        options.shards = shards;
+        ShardedU64Cabinet cab(path.c_str(), options);
+        ShardBench bench;
+        bench.cab = &cab;
+        bench.deadline = NowSeconds() + seconds;
+        bench.get_percent = get_percent;
+        bench.ops = 0;
+        std::vector<pthread_t> ids(threads);
+        for (int i = 0; i < threads; ++i) {
+          pthread_create(&ids[i], NULL, ShardClient, &bench);
+        }
+        for (int i = 0; i < threads; ++i) {
+          pthread_join(ids[i], NULL);
+        }
+        fprintf(stderr, "  %3d threads %2d shards %10.0f ops/s\n", threads, shards,
+          bench.ops / seconds);
+        cab.Close();
+      }
+    }
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// a writer thread overwriting keys, alone on cab or under lock.
+struct FlushReadBench {
+  U64Cabinet* cab;
+  ShardedU64Cabinet* sharded;
+  pthread_rwlock_t lock;
+  size_t keys;
+  volatile bool done;
+};
+
+void* FlushWriter(void* arg) {
+  FlushReadBench* bench = (FlushReadBench*)arg;
+  uint8_t value[1000];
+  memset(value, 'v', sizeof(value));
+  for (uint64_t i = 0; !bench->done; ++i) {
+    uint64_t key = i % bench->keys;
+    if (bench->cab) {
+      pthread_rwlock_wrlock(&bench->lock);
+      bench->cab->Set(key, value, sizeof(value));
+      pthread_rwlock_unlock(&bench->lock);
+    } else {
+      bench->sharded->Set(key, value, sizeof(value));
+    }
+  }
+  return NULL;
+}
+
+void BenchFlushRead(size_t count, double seconds, const std::string& path) {
+  uint8_t value[1000];
+  memset(value, 'v', sizeof(value));
+  std::string str;
+  std::vector<double> latencies;
+  for (int gated = 0; gated < 2; ++gated) {
+    std::string cmdline = "rm -rf " + path;
+    system(cmdline.c_str());
+    U64Cabinet cab;
+    ShardedU64Cabinet sharded;
+    FlushReadBench bench;
+    bench.cab = gated ? NULL : &cab;
+    bench.sharded = gated ? &sharded : NULL;
+    pthread_rwlock_init(&bench.lock, NULL);
+    bench.keys = count;
+    bench.done = false;
+    if (gated) {
+      sharded.Open(path.c_str());
+    } else {
+      cab.Open(path.c_str());
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (gated) {
+        sharded.Set(i, value, sizeof(value));
+      } else {
+        cab.Set(i, value, sizeof(value));
+      }
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, FlushWriter, &bench);
+    latencies.clear();
+    double deadline = NowSeconds() + seconds;
+    while (NowSeconds() < deadline) {
+      uint64_t key = Random64() % count;
+      double start = NowSeconds();
+      if (gated) {
+        sharded.Get(key, &str);
+      } else {
+        pthread_rwlock_rdlock(&bench.lock);
+        cab.Get(key, &str);
+        pthread_rwlock_unlock(&bench.lock);
+      }
+      latencies.push_back(NowSeconds() - start);
+    }
+    bench.done = true;
+    pthread_join(tid, NULL);
+    PrintLatencies(gated ? "lock given back" : "lock per Set", &latencies);
+    pthread_rwlock_destroy(&bench.lock);
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// ranks 0..n-1 drawn with probability proportional to 1 / (rank + 1)^s.
+class Zipf {
+ public:
+  Zipf(size_t n, double s) : cdf_(n) {
+    double sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+      sum += 1.0 / pow(i + 1.0, s);
+      cdf_[i] = sum;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      cdf_[i] /= sum;
+    }
+  }
+  size_t Next() {
+    double u = (Random64() >> 11) * (1.0 / 9007199254740992.0);
+    return std::min<size_t>(std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin(),
+      cdf_.size() - 1);
+  }
+
+ private:
+  std::vector<double> cdf_;
+};
+
+void BenchCache(size_t count, uint64_t cache_mb, const std::string& path) {
+  static const size_t kGets = 1000000;
+  Zipf zipf(count, 0.99);
+  std::vector<uint64_t> keys(kGets);
+  for (size_t i = 0; i < kGets; ++i) {
+    // hot keys spread over the file.
+    keys[i] = Mix64(zipf.Next()) % count;
+  }
+  for (int compress = 0; compress < 2; ++compress) {
+    for (int cached = 0; cached < 2; ++cached) {
+      std::string cmdline = "rm -rf " + path;
+      system(cmdline.c_str());
+      ValueCache cache(cache_mb * 1024 * 1024);
+      CabinetOptions options;
+      options.compress = compress;
+      options.value_cache = cached ? &cache : NULL;
+      U64Cabinet cab(path.c_str(), options);
+      for (size_t i = 0; i < count; ++i) {
+        std::string doc = MakeDocument(i);
+        cab.Set(i, (const uint8_t*)doc.data(), doc.size());
+      }
+      cab.Flush();
+      std::string str;
+      double start = NowSeconds();
+      for (size_t i = 0; i < kGets; ++i) {
+        cab.Get(keys[i], &str);
+      }
+      double get_ns = (NowSeconds() - start) * 1e9 / kGets;
+      uint64_t hits = cab.GetCacheHits();
+      uint64_t misses = cab.GetCacheMisses();
+      // a scan reads every key once, then the hot keys again.
+      for (size_t i = 0; i < count; ++i) {
+        cab.Get(i, &str);
+      }
+      uint64_t scan_hits = cab.GetCacheHits();
+      uint64_t scan_misses = cab.GetCacheMisses();
+      for (size_t i = 0; i < kGets / 10; ++i) {
+        cab.Get(keys[i], &str);
+      }
+      fprintf(stderr, "  %-10s %-8s Get %6.0f ns/op, hit ratio %.2f, after a scan %.2f\n",
+        compress ? "compressed" : "raw", cached ? "cache" : "no cache", get_ns,
+        (double)hits / std::max<uint64_t>(hits + misses, 1),
+        (double)(cab.GetCacheHits() - scan_hits) /
+          std::max<uint64_t>(cab.GetCacheHits() - scan_hits + cab.GetCacheMisses() - scan_misses, 1));
+      cab.Close();
+    }
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+void BenchSetLatency(size_t count, const std::string& path) {
+  uint8_t value[1024];
+  memset(value, 'v', sizeof(value));
+  cabinet::BackgroundFlusher flusher;
+  static const uint32_t kBuffers[] = { 1, 2, 4 };
+  static const char* kNames[] = { "written in Set", "2 buffers", "4 buffers" };
+  std::vector<double> latencies;
+  for (int mode = 0; mode < 3; ++mode) {
+    std::string cmdline = "rm -rf " + path;
+    system(cmdline.c_str());
+    CabinetOptions options;
+    options.flusher = kBuffers[mode] > 1 ? &flusher : NULL;
+    options.write_buffers = kBuffers[mode];
+    U64Cabinet cab(path.c_str(), options);
+    latencies.clear();
+    for (size_t i = 0; i < count; ++i) {
+      double start = NowSeconds();
+      cab.Set(Random64() % count, value, sizeof(value));
+      latencies.push_back(NowSeconds() - start);
+    }
+    PrintLatencies(kNames[mode], &latencies);
+    fprintf(stderr, "  %-20s Sets over 100 us %lu, over 1 ms %lu\n", "",
+      (unsigned long)(latencies.end() - std::lower_bound(latencies.begin(), latencies.end(), 100e-6)),
+      (unsigned long)(latencies.end() - std::lower_bound(latencies.begin(), latencies.end(), 1e-3)));
+    cab.Close();
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// bytes of a file in the page cache.
+uint64_t ResidentBytes(const std::string& file) {
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  off_t length = lseek(fd, 0, SEEK_END);
+  uint64_t bytes = 0;
+  void* base = length > 0 ? mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  if (base != MAP_FAILED) {
+    long page = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> pages((length + page - 1) / page);
+    if (mincore(base, length, &pages[0]) == 0) {
+      for (size_t i = 0; i < pages.size(); ++i) {
+        bytes += (pages[i] & 1) ? page : 0;
+      }
+    }
+    munmap(base, length);
+  }
+  close(fd);
+  return bytes;
+}
+
+void BenchDirect(size_t count, const std::string& path) {
+  static const size_t kGets = 50000;
+  static const char* kNames[] = { "buffered", "random", "direct" };
+  static const cabinet::ReadMode kModes[] = {
+    cabinet::kReadBuffered, cabinet::kReadRandom, cabinet::kReadDirect };
+  cabinet::AlignedBufferPool pool(16 * 1024 * 1024);
+  for (int mode = 0; mode < 3; ++mode) {
+    std::string cmdline = "rm -rf " + path;
+    system(cmdline.c_str());
+    CabinetOptions options;
+    options.read_mode = kModes[mode];
+    options.read_buffers = &pool;
+    U64Cabinet cab(path.c_str(), options);
+    srand(0);
+    std::string value;
+    for (size_t i = 0; i < count; ++i) {
+      // documents, and one in four a value of up to 8K.
+      value = i % 4 == 0 ? std::string(Random64() % 8192 + 1, 'v') : MakeDocument(i);
+      cab.Set(i, (const uint8_t*)value.data(), value.size());
+    }
+    cab.Flush();
+    DropCache(path);
+    double start = NowSeconds();
+    for (size_t i = 0; i < kGets; ++i) {
+      cab.Get(Random64() % count, &value);
+    }
+    double get_ns = (NowSeconds() - start) * 1e9 / kGets;
+    fprintf(stderr, "  %-8s data %6.1f MB, cold Get %7.0f ns/op, page cache %6.1f MB\n",
+      kNames[mode], cab.GetDataFileSize() / 1048576.0, get_ns,
+      ResidentBytes(path + "/data") / 1048576.0);
+    cab.Close();
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+void BenchScan(size_t count, const std::string& path) {
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+  U64Cabinet cab(path.c_str());
+  std::string value;
+  // keys are written in random order, and a third of them twice.
+  for (size_t i = 0; i < count + count / 3; ++i) {
+    uint64_t key = Mix64(i % count) % count;
+    value = MakeDocument(i);
+    cab.Set(key, (const uint8_t*)value.data(), value.size());
+  }
+  cab.Flush();
+  uint64_t live = cab.GetDataBytes();
+
+  DropCache(path);
+  double start = NowSeconds();
+  uint64_t bytes = 0;
+  for (size_t key = 0; key < count; ++key) {
+    if (cab.Get(key, &value)) {
+      bytes += value.size();
+    }
+  }
+  double seconds = NowSeconds() - start;
+  fprintf(stderr, "  Get() in key order  %8.1f MB/s, %lu of %lu bytes\n",
+    bytes / seconds / 1048576, (unsigned long)bytes, (unsigned long)live);
+
+  DropCache(path);
+  start = NowSeconds();
+  bytes = 0;
+  CabinetIterator<U64Cabinet, uint64_t> itr(&cab);
+  std::vector<uint64_t> keys;
+  std::vector<std::string> values;
+  while (itr.Next(1000, NULL, &keys, &values)) {
+    for (size_t i = 0; i < values.size(); ++i) {
+      bytes += values[i].size();
+    }
+  }
+  seconds = NowSeconds() - start;
+  fprintf(stderr, "  CabinetIterator     %8.1f MB/s, %lu of %lu bytes\n",
+    bytes / seconds / 1048576, (unsigned long)bytes, (unsigned long)live);
+
+  // the disk's sequential rate, garbage included.
+  DropCache(path);
+  start = NowSeconds();
+  bytes = 0;
+  int fd = open((path + "/data").c_str(), O_RDONLY);
+  std::vector<char> buf(1024 * 1024);
+  ssize_t ret;
+  while (fd != -1 && (ret = read(fd, &buf[0], buf.size())) > 0) {
+    bytes += ret;
+  }
+  close(fd);
+  seconds = NowSeconds() - start;
+  fprintf(stderr, "  read() of data file %8.1f MB/s, %lu bytes\n",
+    bytes / seconds / 1048576, (unsigned long)bytes);
+  cab.Close();
+  system(cmdline.c_str());
+}
+
+// opens a db by loading its index and from its frozen index.
+void BenchFreeze(size_t count, const std::string& path) {
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+
+  uint8_t value[64];
+  memset(value, 'v', sizeof(value));
+  std::vector<uint64_t> keys;
+  keys.reserve(count);
+  {
+    U64Cabinet cab(path.c_str());
+    for (size_t i = 0; i < count; ++i) {
+      keys.push_back(Random64());
+      cab.Set(keys.back(), value, sizeof(value));
+    }
+    double start = NowSeconds();
+    cab.Freeze();
+    fprintf(stderr, "  Freeze() %lu keys: %.2f s\n", (unsigned long)count, NowSeconds() - start);
+  }
+  std::random_shuffle(keys.begin(), keys.end());
+
+  struct stat st;
+  for (int frozen = 0; frozen < 2; ++frozen) {
+    CabinetOptions options;
+    options.frozen = frozen;
+    double start = NowSeconds();
+    U64Cabinet cab(path.c_str(), options);
+    double open = NowSeconds() - start;
+    std::string str;
+    uint64_t found = 0;
+    start = NowSeconds();
+    for (size_t i = 0; i < count; ++i) {
+      found += cab.Get(keys[i], &str);
+    }
+    double get = NowSeconds() - start;
+    stat((path + (frozen ? "/frozen" : "/index")).c_str(), &st);
+    fprintf(stderr, "  %s Open(): %.3f s, Get(): %.1f ns/op, %s %.1f MB\n",
+      frozen ? "frozen" : "loaded", open, get * 1e9 / count,
+      frozen ? "mapped" : "index file", st.st_size / 1048576.0);
+    if (found != count) {
+      fprintf(stderr, "unexpected missing keys.\n");
+    }
+  }
+  cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// what checksums cost on the paths that compute or check them.
+void BenchChecksums(size_t count, const std::string& path) {
+  std::vector<uint8_t> buf(1024 * 1024);
+  for (size_t i = 0; i < buf.size(); ++i) {
+    buf[i] = Random64();
+  }
+  const int rounds = 256;
+  double start = NowSeconds();
+  uint32_t crc = 0;
+  for (int i = 0; i < rounds; ++i) {
+    crc = ~cabinet::crc32c_internal::Software(~crc, &buf[0], buf.size());
+  }
+  fprintf(stderr, "  CRC32C slicing-by-8 %8.1f MB/s\n", rounds / (NowSeconds() - start));
+#if defined(__x86_64__)
+  if (cabinet::crc32c_internal::HasHardware()) {
+    start = NowSeconds();
+    for (int i = 0; i < rounds; ++i) {
+      crc = ~cabinet::crc32c_internal::Hardware(~crc, &buf[0], buf.size());
+    }
+    fprintf(stderr, "  CRC32C sse4.2       %8.1f MB/s\n", rounds / (NowSeconds() - start));
+  }
+#endif
+  if (crc == 0) {
+    fprintf(stderr, "  (crc 0)\n");
+  }
+
+  uint8_t value[4096];
+  memset(value, 'v', sizeof(value));
+  std::vector<uint64_t> keys;
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back(i);
+  }
+  std::random_shuffle(keys.begin(), keys.end());
+  for (int checksums = 0; checksums < 2; ++checksums) {
+    std::string cmdline = "rm -rf " + path;
+    system(cmdline.c_str());
+    CabinetOptions options;
+    options.checksums = checksums;
+    options.mmap_reads = true;
+    U64Cabinet cab(path.c_str(), options);
+    start = NowSeconds();
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(i, value, sizeof(value));
+    }
+    cab.Flush();
+    double set_ns = (NowSeconds() - start) * 1e9 / count;
+    // the first pass faults the mapping in.
+    ValueView view;
+    for (size_t i = 0; i < count; ++i) {
+      cab.Get(keys[i], &view);
+    }
+    start = NowSeconds();
+    for (size_t i = 0; i < count; ++i) {
+      cab.Get(keys[i], &view);
+    }
+    double get_ns = (NowSeconds() - start) * 1e9 / count;
+    start = NowSeconds();
+    cab.Scrub();
+    double scrub = NowSeconds() - start;
+    fprintf(stderr, "  %-13s Set %.0f ns/op, Get %.0f ns/op, Scrub() %.1f MB/s\n",
+      checksums ? "checksums" : "no checksums", set_ns, get_ns,
+      cab.GetDataFileSize() / scrub / 1048576);
+    cab.Close();
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+// small values read from disk vs kept inline, and what inline costs.
+void BenchInline(size_t count, const std::string& path) {
+  uint8_t value[16];
+  memset(value, 'v', sizeof(value));
+  std::vector<uint64_t> keys;
+  for (size_t i = 0; i < count; ++i) {
+    keys.push_back(i);
+  }
+  std::random_shuffle(keys.begin(), keys.end());
+  for (int inline_bytes = 0; inline_bytes <= 32; inline_bytes += 32) {
+    std::string cmdline = "rm -rf " + path;
+    system(cmdline.c_str());
+    CabinetOptions options;
+    options.inline_value_bytes = inline_bytes;
+    U64Cabinet cab(path.c_str(), options);
+    for (size_t i = 0; i < count; ++i) {
+      cab.Set(i, value, sizeof(value));
+    }
+    cab.Close();
+    double start = NowSeconds();
+    cab.Open(path.c_str());
+    double open_s = NowSeconds() - start;
+    std::string got;
+    // the first pass warms the page cache.
+    for (size_t i = 0; i < count; ++i) {
+      cab.Get(keys[i], &got);
+    }
+    start = NowSeconds();
+    for (size_t i = 0; i < count; ++i) {
+      cab.Get(keys[i], &got);
+    }
+    double get_ns = (NowSeconds() - start) * 1e9 / count;
+    fprintf(stderr, "  inline %2d  Open() %.2f s, Get %.0f ns/op, %llu inline, %.1f MB\n",
+      inline_bytes, open_s, get_ns, (unsigned long long)cab.GetInlineValueCount(),
+      cab.GetInlineValueBytes() / 1048576.0);
+    cab.Close();
+  }
+  std::string cmdline = "rm -rf " + path;
+  system(cmdline.c_str());
+}
+
+void Usage() {
+  fprintf(stderr, "usage: cabinet_bench <mode> [args...]\n"
+    "  index [keys]    lookup ns/op and bytes/key of hash_map vs FlatHashMap,\n"
+    "                  and of hash_map<string> vs StringIndexMap.\n"
+    "  startup [keys] [path]\n"
+    "                  Open() time from checkpoint vs full index log replay.\n"
+    "  replay [keys] [threads] [path]\n"
+    "                  Open() time of index log replay by load threads.\n"
+    "  get [keys] [path]\n"
+    "                  Get() ns/op by pread, mmap and pinned ValueView.\n"
+    "  compact [keys] [path]\n"
+    "                  Get/Set latency during background and blocking compaction.\n"
+    "  segments [keys] [segment_mb] [path]\n"
+    "                  Compact() cost of a single data file vs segments.\n"
+    "  compress [keys] [path]\n"
+    "                  disk bytes and Set/Get ns/op of raw vs compressed values.\n"
+    "  sync [clients] [seconds] [path]\n"
+    "                  durable writes/s by clients, Sync() per write vs group commit.\n"
+    "  batchget [keys] [batch] [path]\n"
+    "                  cold BatchGet latency, Get() one by one vs io_uring vs pread pool.\n"
+    "  shards [threads] [seconds] [path]\n"
+    "                  ops/s by threads on one shard vs 16 shards.\n"
+    "  flushread [keys] [seconds] [path]\n"
+    "                  Get latency while writing, lock per Set vs given back in flushes.\n"
+    "  cache [keys] [cache_mb] [path]\n"
+    "                  Zipfian Get() ns/op and hit ratio without and with a value cache.\n"
+    "  setlatency [keys] [path]\n"
+    "                  Set() latency, full buffers written in Set() vs in the background.\n"
+    "  direct [keys] [path]\n"
+    "                  cold Get() ns/op and page cache taken, buffered vs random vs direct reads.\n"
+    "  scan [keys] [path]\n"
+    "                  cold full scan MB/s, Get() in key order vs CabinetIterator.\n"
+    "  freeze [keys] [path]\n"
+    "                  Open() time and Get() ns/op, loaded index vs frozen index.\n"
+    "  checksums [keys] [path]\n"
+    "                  CRC32C MB/s, Set/Get ns/op without and with checksums, Scrub() MB/s.\n"
+    "  inline [keys] [path]\n"
+    "                  small value Get() ns/op and memory, read from disk vs inline.\n");
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    Usage();
+    return 1;
+  }
+  srand(0);
+  if (strcmp(argv[1], "index") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    BenchIndex<uint32_t>("uint32", count);
+    BenchIndex<uint64_t>("uint64", count);
+    BenchStringIndex(count);
+  } else if (strcmp(argv[1], "startup") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    BenchStartup(count, argc > 3 ? argv[3] : "bench-startup");
+  } else if (strcmp(argv[1], "replay") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    int threads = argc > 3 ? atoi(argv[3]) : 8;
+    BenchReplay(count, threads, argc > 4 ? argv[4] : "bench-replay");
+  } else if (strcmp(argv[1], "get") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    BenchGet(count, argc > 3 ? argv[3] : "bench-get");
+  } else if (strcmp(argv[1], "compact") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    BenchCompact(count, argc > 3 ? argv[3] : "bench-compact");
+  } else if (strcmp(argv[1], "segments") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    uint64_t segment_mb = argc > 3 ? strtoull(argv[3], NULL, 10) : 8;
+    BenchSegments(count, segment_mb, argc > 4 ? argv[4] : "bench-segments");
+  } else if (strcmp(argv[1], "compress") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+    BenchCompress(count, argc > 3 ? argv[3] : "bench-compress");
+  } else if (strcmp(argv[1], "sync") == 0) {
+    int clients = argc > 2 ? atoi(argv[2]) : 32;
+    double seconds = argc > 3 ? atof(argv[3]) : 3;
+    BenchSync(clients, seconds, argc > 4 ? argv[4] : "bench-sync");
+  } else if (strcmp(argv[1], "batchget") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+    size_t batch = argc > 3 ? strtoul(argv[3], NULL, 10) : 500;
+    BenchBatchGet(count, batch, argc > 4 ? argv[4] : "bench-batchget");
+  } else if (strcmp(argv[1], "shards") == 0) {
+    int threads = argc > 2 ? atoi(argv[2]) : 16;
+    double seconds = argc > 3 ? atof(argv[3]) : 3;
+    BenchShards(threads, seconds, argc > 4 ? argv[4] : "bench-shards");
+  } else if (strcmp(argv[1], "flushread") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+    double seconds = argc > 3 ? atof(argv[3]) : 5;
+    BenchFlushRead(count, seconds, argc > 4 ? argv[4] : "bench-flushread");
+  } else if (strcmp(argv[1], "cache") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 500000;
+    uint64_t cache_mb = argc > 3 ? strtoull(argv[3], NULL, 10) : 32;
+    BenchCache(count, cache_mb, argc > 4 ? argv[4] : "bench-cache");
+  } else if (strcmp(argv[1], "setlatency") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    BenchSetLatency(count, argc > 3 ? argv[3] : "bench-setlatency");
+  } else if (strcmp(argv[1], "direct") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+    BenchDirect(count, argc > 3 ? argv[3] : "bench-direct");
+  } else if (strcmp(argv[1], "scan") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    BenchScan(count, argc > 3 ? argv[3] : "bench-scan");
+  } else if (strcmp(argv[1], "freeze") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    BenchFreeze(count, argc > 3 ? argv[3] : "bench-freeze");
+  } else if (strcmp(argv[1], "checksums") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+    BenchChecksums(count, argc > 3 ? argv[3] : "bench-checksums");
+  } else if (strcmp(argv[1], "inline") == 0) {
+    size_t count = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    BenchInline(count, argc > 3 ? argv[3] : "bench-inline");
+  } else {
+    Usage();
+    return 1;
+  }
+  return 0;
+}
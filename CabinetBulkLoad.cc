@@ -0,0 +1,148 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Offline Cabinet Loader
+ *
+ * usage: cabinet_bulkload <I32|I64|STR> <db path> [input]
+ *   writes a new db at db path from the entries of input, or of stdin if
+ *   it is missing or "-", see TBulkLoader. an entry is its key size and
+ *   value size, each a little endian uint32, then the key and the value
+ *   bytes. the key of an I32 or I64 db is a little endian integer of 4
+ *   or 8 bytes. a db loaded into the data path of a running cabinetd is
+ *   opened by Attach, or at the next start once Attach wrote its meta.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include "CabinetTypes.h"
+
+using cabinet::BackgroundFlusher;
+using cabinet::StringBulkLoader;
+using cabinet::U32BulkLoader;
+using cabinet::U64BulkLoader;
+
+namespace {
+const size_t kInputBufferBytes = 16 * 1024 * 1024;
+
+double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+bool DecodeKey(const std::string& bytes, uint32_t* key) {
+  if (bytes.size() != sizeof(*key)) {
+    return false;
+  }
+  memcpy(key, bytes.data(), sizeof(*key));
+  *key = le32toh(*key);
+  return true;
+}
+
+bool DecodeKey(const std::string& bytes, uint64_t* key) {
+  if (bytes.size() != sizeof(*key)) {
+    return false;
+  }
+  memcpy(key, bytes.data(), sizeof(*key));
+  *key = le64toh(*key);
+  return true;
+}
+
+bool DecodeKey(const std::string& bytes, std::string* key) {
+  *key = bytes;
+  return true;
+}
+
+// returns the exit code.
+template <class Loader, class KeyType>
+int Load(FILE* input, const char* path) {
+  BackgroundFlusher flusher;
+  Loader loader(&flusher);
+  loader.Open(path);
+
+  double start = NowSeconds();
+  std::string bytes;
+  std::vector<uint8_t> value;
+  KeyType key;
+  uint32_t sizes[2];
+  while (fread(sizes, sizeof(sizes), 1, input) == 1) {
+    bytes.resize(le32toh(sizes[0]));
+    value.resize(le32toh(sizes[1]));
+    if ((!bytes.empty() && fread(&bytes[0], bytes.size(), 1, input) != 1) ||
+        (!value.empty() && fread(&value[0], value.size(), 1, input) != 1)) {
+      fprintf(stderr, "input ends inside entry %llu.\n",
+        (unsigned long long)loader.GetEntryCount());
+      return 1;
+    }
+    if (!DecodeKey(bytes, &key)) {
+      fprintf(stderr, "bad key size %lu of entry %llu.\n", (unsigned long)bytes.size(),
+        (unsigned long long)loader.GetEntryCount());
+      return 1;
+    }
+    loader.Add(key, value.empty() ? NULL : &value[0], value.size());
+  }
+  if (ferror(input)) {
+    perror("read input");
+    return 1;
+  }
+  loader.Finish();
+
+  double seconds = NowSeconds() - start;
+  double mb = loader.GetDataBytes() / 1048576.0;
+  fprintf(stderr, "loaded %llu entries, %.1f MB in %.2f s, %.1f MB/s\n",
+    (unsigned long long)loader.GetEntryCount(), mb, seconds, seconds > 0 ? mb / seconds : 0);
+  return 0;
+}
+
+void Usage() {
+  fprintf(stderr, "usage: cabinet_bulkload <I32|I64|STR> <db path> [input]\n"
+    "  writes a new db from input, or stdin, of entries: key size and value\n"
+    "  size as little endian uint32, then the key and the value. I32 and I64\n"
+    "  keys are little endian integers.\n");
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    Usage();
+    return 1;
+  }
+  FILE* input = stdin;
+  if (argc > 3 && strcmp(argv[3], "-") != 0) {
+    input = fopen(argv[3], "rb");
+    if (!input) {
+      perror(argv[3]);
+      return 1;
+    }
+  }
+  setvbuf(input, NULL, _IOFBF, kInputBufferBytes);
+
+  int ret = 1;
+  try {
+    if (strcmp(argv[1], "I32") == 0) {
+      ret = Load<U32BulkLoader, uint32_t>(input, argv[2]);
+    } else if (strcmp(argv[1], "I64") == 0) {
+      ret = Load<U64BulkLoader, uint64_t>(input, argv[2]);
+    } else if (strcmp(argv[1], "STR") == 0) {
+      ret = Load<StringBulkLoader, std::string>(input, argv[2]);
+    } else {
+      Usage();
+    }
+  } catch (std::exception& e) {
+    fprintf(stderr, "load failed: %s\n", e.what());
+  }
+  if (input != stdin) {
+    fclose(input);
+  }
+  return ret;
+}
@@ -67,10 +67,27 @@ class TruncateFileException : public CabinetException {
   TruncateFileException(const char* filename, int lineno, int err, const char* errstr) : CabinetException("Truncate", filename, lineno, err, errstr) {}
 };
 
+class SyncFileException : public CabinetException {
+ public:
+   SyncFileException(const char* filename, int lineno, int err, const char* errstr) : CabinetException("Sync", filename, lineno, err, errstr) {}
+};
+
 class FileCorruptException : public CabinetException {
  public:
    FileCorruptException(const char* filename, int lineno, int err, const char* errstr) : CabinetException("FileCorrupt", filename, lineno, err, errstr) {}
 };
+
+// a value read back does not match the checksum stored with it.
+class ChecksumMismatchException : public CabinetException {
+ public:
+   ChecksumMismatchException(const char* filename, int lineno, int err, const char* errstr) : CabinetException("ChecksumMismatch", filename, lineno, err, errstr) {}
+};
+
+// a compaction or scrub given up, see CabinetBase::CancelMaintenance().
+class CancelledException : public CabinetException {
+ public:
+   CancelledException(const char* filename, int lineno, int err, const char* errstr) : CabinetException("Cancelled", filename, lineno, err, errstr) {}
+};
 }  // namespace cabinet
 
 #endif  // CABINET_EXCEPTIONS_H_
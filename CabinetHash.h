@@ -0,0 +1,147 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Hash Functions.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_HASH_H_
+#define CABINET_HASH_H_
+
+#include <endian.h>
+#include <stdint.h>
+#include <cstring>
+
+namespace cabinet {
+// 64-bit MurmurHash2 (MurmurHash64A) by Austin Appleby, public domain.
+// consumes 8 bytes per step and hashes all len bytes, embedded NULs
+// included.
+inline uint64_t Hash64(const void* key, size_t len, uint64_t seed = 0) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+
+  const uint8_t* data = static_cast<const uint8_t*>(key);
+  const uint8_t* end = data + (len & ~(size_t)7);
+  while (data != end) {
+    uint64_t k;
+    memcpy(&k, data, sizeof(k));
+    data += sizeof(k);
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+
+  switch (len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48;  // fallthrough
+    case 6: h ^= (uint64_t)data[5] << 40;  // fallthrough
+    case 5: h ^= (uint64_t)data[4] << 32;  // fallthrough
+    case 4: h ^= (uint64_t)data[3] << 24;  // fallthrough
+    case 3: h ^= (uint64_t)data[2] << 16;  // fallthrough
+    case 2: h ^= (uint64_t)data[1] << 8;  // fallthrough
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+// the MurmurHash3 finalizer, a bijection that spreads every input bit
+// over the output, so that a hash can be split again independently.
+inline uint64_t Mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+namespace crc32c_internal {
+// the reflected Castagnoli polynomial, one table per byte of a step of
+// 8 bytes (slicing-by-8).
+struct Tables {
+  uint32_t t[8][256];
+  Tables() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; ++k) {
+        crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+      }
+      t[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int k = 1; k < 8; ++k) {
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+inline uint32_t Software(uint32_t crc, const uint8_t* p, size_t len) {
+  static const Tables tables;
+  const uint32_t (*t)[256] = tables.t;
+  while (len >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + 4, sizeof(hi));
+    lo = le32toh(lo) ^ crc;
+    hi = le32toh(hi);
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^
+      t[4][lo >> 24] ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+      t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+// the crc32 instruction of SSE4.2, 8 bytes a step.
+__attribute__((target("sse4.2")))
+inline uint32_t Hardware(uint32_t crc, const uint8_t* p, size_t len) {
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc64 = __builtin_ia32_crc32di(crc64, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t)crc64;
+  while (len-- > 0) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  }
+  return crc;
+}
+
+inline bool HasHardware() {
+  static const bool has = __builtin_cpu_supports("sse4.2");
+  return has;
+}
+#endif
+}  // namespace crc32c_internal
+
+// CRC32C (Castagnoli) of len bytes, continuing crc, with the SSE4.2
+// instruction where the cpu has it.
+inline uint32_t Crc32c(const void* data, size_t len, uint32_t crc = 0) {
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+#if defined(__x86_64__)
+  if (crc32c_internal::HasHardware()) {
+    return ~crc32c_internal::Hardware(~crc, p, len);
+  }
+#endif
+  return ~crc32c_internal::Software(~crc, p, len);
+}
+}  // namespace cabinet
+
+#endif  // CABINET_HASH_H_
@@ -0,0 +1,82 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Iterator Over The Entries Of A Cabinet In Data File Order
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_CABINET_ITERATOR_H_
+#define CABINET_CABINET_ITERATOR_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "AsyncReader.h"
+
+namespace cabinet {
+// class CabinetIterator
+// walks the entries of a TCabinet or a TShardedCabinet that were live
+// when it was made, in data file order, so that a scan reads the files
+// mostly sequentially and nearby values with one preadv, see
+// CabinetOptions::read_coalesce_bytes. it keeps the keys only: an entry
+// deleted since is skipped, one set since gives its new value, one
+// added since is not seen, and values moved by a compaction are read
+// from their new place. scanned values do not go to value_cache.
+//
+// a TCabinet must not be used by others during the constructor and
+// Next(), as for its other calls, a TShardedCabinet locks itself. the
+// cabinet must outlive the iterator.
+template <class Cabinet, class KeyType>
+class CabinetIterator {
+ public:
+  explicit CabinetIterator(Cabinet* cab) : cab_(cab), next_(0) {
+    cab->GetKeysInFileOrder(&keys_);
+  }
+
+  // the next entries, at most count of them, read through reader as by
+  // MultiGet(). returns false once every entry was returned.
+  bool Next(size_t count, AsyncReader* reader, std::vector<KeyType>* keys,
+      std::vector<std::string>* values) {
+    keys->clear();
+    values->clear();
+    count = std::max<size_t>(count, 1);
+    std::vector<KeyType> batch;
+    std::vector<std::string> got;
+    std::vector<bool> found;
+    // a batch whose keys were all deleted meanwhile is no end.
+    while (keys->empty() && next_ < keys_.size()) {
+      size_t end = std::min(keys_.size(), next_ + count);
+      batch.assign(keys_.begin() + next_, keys_.begin() + end);
+      next_ = end;
+      cab_->MultiGet(batch, reader, &got, &found, false);
+      for (size_t i = 0; i < batch.size(); ++i) {
+        if (found[i]) {
+          keys->push_back(batch[i]);
+          values->push_back(std::string());
+          values->back().swap(got[i]);
+        }
+      }
+    }
+    return !keys->empty();
+  }
+
+  bool Done() const { return next_ >= keys_.size(); }
+  // the entries taken when made, and those not reached yet.
+  uint64_t GetCount() const { return keys_.size(); }
+  uint64_t GetRemaining() const { return keys_.size() - next_; }
+
+ private:
+  CabinetIterator(const CabinetIterator&);
+  void operator=(const CabinetIterator&);
+
+  Cabinet* cab_;
+  std::vector<KeyType> keys_;
+  size_t next_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_CABINET_ITERATOR_H_
@@ -1,10 +1,10 @@
-// TODO: daemonize, thrift iterator interface, merge KeyHeaderExtractor, KeyDataExtractor (no type in cabinet)
+// TODO: daemonize, merge KeyHeaderExtractor, KeyDataExtractor (no type in cabinet)
 // 压缩
 // 添加thirdparty
 // logfile, bind address, serverCron
 // 在写错误的情况下，允许读，但是不允许写,ipython
 // glog文件路径
-// 定时刷新、关闭超时cursor的线程
+// 定时刷新
 // 测试的点:
 // 1)log文件,logappedn;
 
@@ -18,13 +18,17 @@
 
 #include <signal.h>
 #include <dirent.h>
+#include <time.h>
+#include <algorithm>
 #include <map>
 #include <stdexcept>
 #include <string>
+#include <vector>
 #include <sys/file.h>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <thrift/concurrency/Monitor.h>
 #include <thrift/concurrency/Mutex.h>
 #include <thrift/concurrency/PosixThreadFactory.h>
 #include <thrift/protocol/TCompactProtocol.h>
@@ -36,7 +40,12 @@
 #include <thrift/transport/TTransportException.h>
 #include "gen-cpp/CabinetStorageService.h"
 #include "CabinetTypes.h"
+#include "GroupCommit.h"
 
+using ::apache::thrift::concurrency::Guard;
+using ::apache::thrift::concurrency::Monitor;
+using ::apache::thrift::concurrency::Mutex;
+using ::apache::thrift::concurrency::Synchronized;
 using ::apache::thrift::concurrency::RWGuard;
 using ::apache::thrift::concurrency::ReadWriteMutex;
 using ::apache::thrift::concurrency::RW_WRITE;
@@ -70,23 +79,41 @@ using std::stringstream;
 using std::vector;
 using boost::shared_ptr;
 
+using cabinet::AlignedBufferPool;
+using cabinet::AsyncReader;
+using cabinet::BackgroundFlusher;
 using cabinet::CabinetBase;
+using cabinet::ChecksumMismatchException;
+using cabinet::CabinetIterator;
+using cabinet::CabinetOptions;
+using cabinet::GroupCommit;
+using cabinet::RateLimiter;
+using cabinet::ReadMode;
+using cabinet::SyncPoint;
+using cabinet::ValueCache;
+using cabinet::ValueView;
 using cabinet::CabinetStorageServiceClient;
 using cabinet::CabinetStorageServiceIf;
 using cabinet::CabinetStorageServiceProcessor;
 using cabinet::DbType;
 using cabinet::DbInfo;
 using cabinet::GetInfo;
+using cabinet::CursorBatch;
+using cabinet::RangeBatch;
 using cabinet::ServerInfo;
 using cabinet::DbMeta;
 using cabinet::KeyType;
-using cabinet::U32Cabinet;
-using cabinet::U64Cabinet;
-using cabinet::StringCabinet;
+using cabinet::ShardedU32Cabinet;
+using cabinet::ShardedU64Cabinet;
+using cabinet::ShardedStringCabinet;
 using cabinet::BadDbName;
 using cabinet::DbExists;
 using cabinet::DbNotExist;
 using cabinet::IOException;
+using cabinet::CursorNotExist;
+using cabinet::NoOrderedIndex;
+using cabinet::ChecksumMismatch;
+using cabinet::StringPiece;
 
 DEFINE_string(data_root, "/data/cabinet/", "cabinet data root path.");
 DEFINE_string(log_path, "", "cabinet daemon log file.");
@@ -95,16 +122,168 @@ DEFINE_string(address, "localhost", "specify bind address.");
 DEFINE_int32(port, 9527, "cabinet server bind port.");
 DEFINE_int32(flushinterval, 10,
     "flush & fsync db if time past this interval since last flush time.");
+DEFINE_int32(compact_interval, 60,
+    "seconds between checks for dbs to compact, 0 disables auto compaction.");
+DEFINE_double(compact_garbage_ratio, 0.5,
+    "auto compact a db, or its segments, once this share of its data file, "
+    "or of a segment, is garbage.");
+DEFINE_int32(compact_min_garbage_mb, 256,
+    "auto compact a db only if it reclaims at least this many MB.");
+DEFINE_int32(compact_rate_mb, 20, "compaction I/O limit in MB/s, 0 for unlimited.");
+DEFINE_int32(open_threads, 4, "dbs opened in parallel at startup.");
+DEFINE_int32(load_threads, 4, "threads replaying the index log of one db.");
+DEFINE_bool(mmap_reads, false, "serve reads from memory mapped data files.");
+DEFINE_int32(segment_mb, 0,
+    "split the data of new dbs into segments of this many MB, 0 for a single file.");
+DEFINE_int32(sync_delay_us, 0,
+    "microseconds a Sync waits for concurrent Syncs of the db to share its fsync.");
+DEFINE_int32(read_queue_depth, 128,
+    "reads of a BatchGet in flight at once through io_uring, 0 for read_threads.");
+DEFINE_int32(read_threads, 16,
+    "pread threads serving BatchGet when io_uring is not available.");
+DEFINE_int32(read_coalesce_kb, 256,
+    "BatchGet merges reads of nearby values up to this many KB, 0 reads each alone.");
+DEFINE_int32(worker_threads, 16,
+    "threads serving requests, concurrent Syncs of a db share one fsync.");
+DEFINE_int32(value_cache_mb, 0,
+    "MB of hot values kept in memory for all dbs, 0 disables the cache.");
+DEFINE_bool(random_reads, false,
+    "turn readahead off for the data files of dbs without directIo.");
+DEFINE_int32(read_buffer_mb, 16,
+    "MB of aligned buffers kept for the reads of directIo dbs.");
+DEFINE_int32(write_buffers, 2,
+    "4MB write buffers of a db shard, full ones are written in the background. 1 writes them in Set.");
+DEFINE_int32(flush_threads, 4,
+    "threads writing full write buffers, the buffers of one db shard are written in order.");
+DEFINE_int32(large_value_kb, 256,
+    "values of at least this many KB are written by Set itself, without a copy into the write buffer.");
+DEFINE_int32(cursor_timeout, 300, "seconds a cursor may stay unused before it is closed.");
+DEFINE_int32(max_cursors, 64, "cursors open at once, each holds the keys of its db.");
+DEFINE_int32(scrub_interval, 24,
+    "hours between scrubs of the dbs with checksums, 0 disables them.");
+DEFINE_int32(scrub_rate_mb, 10, "scrub read limit in MB/s, 0 for unlimited.");
+
+// a Next returns at most this many entries.
+static const int32_t kMaxCursorBatch = 10000;
+// and so does a GetRange or a GetPrefix.
+static const int32_t kMaxRangeLimit = 10000;
 
 struct SyncCabinet {
   shared_ptr<CabinetBase> ptr;
   DbMeta meta;
+  // the cabinet locks its shards itself, reads and writes take this one
+  // shared. it is exclusive to begin and finish a compaction.
   shared_ptr<ReadWriteMutex> rwmutex_;
+  // held for a whole compaction, which runs without rwmutex_ mostly.
+  shared_ptr<Mutex> compact_mutex_;
+  // bumped under compact_mutex_ and the server's lock when Freeze
+  // replaces ptr or Drop drops it, so that a compaction or scrub that
+  // waited for compact_mutex_ with a copy of ptr finds it stale.
+  shared_ptr<uint64_t> generation_;
+  // set under rwmutex_ for writing once Freeze writes the frozen index,
+  // and until the frozen db replaces ptr. writes are refused meanwhile,
+  // as the frozen db refuses them, so that none is left out of it.
+  shared_ptr<bool> freezing_;
+  shared_ptr<GroupCommit> group_commit_;
+};
+
+// flushes under the shard locks, fsyncs without them.
+class CabinetSyncer : public GroupCommit::Syncer {
+ public:
+  explicit CabinetSyncer(const SyncCabinet& sync) : sync_(sync) {}
+  void Sync() {
+    SyncPoint point;
+    {
+      RWGuard guard(*sync_.rwmutex_, RW_READ);
+      sync_.ptr->PrepareSync(&point);
+    }
+    try {
+      CabinetBase::CommitSync(&point);
+    } catch (...) {
+      // not acknowledged by a later Sync either.
+      RWGuard guard(*sync_.rwmutex_, RW_READ);
+      sync_.ptr->AbandonSync();
+      throw;
+    }
+  }
+
+ private:
+  const SyncCabinet& sync_;
+};
+
+// holds the compact_mutex_ of a db. a compaction or scrub holding it is
+// cancelled rather than waited out.
+class CancellingGuard {
+ public:
+  explicit CancellingGuard(const SyncCabinet& sync) : mutex_(*sync.compact_mutex_) {
+    sync.ptr->CancelMaintenance();
+    mutex_.lock();
+    sync.ptr->ResumeMaintenance();
+  }
+  ~CancellingGuard() { mutex_.unlock(); }
+
+ private:
+  CancellingGuard(const CancellingGuard&);
+  void operator=(const CancellingGuard&);
+
+  const Mutex& mutex_;
+};
+
+static void toThriftKey(uint32_t key, KeyType* ret) { ret->__set_intKey(key); }
+static void toThriftKey(uint64_t key, KeyType* ret) { ret->__set_longKey(key); }
+static void toThriftKey(const string& key, KeyType* ret) { ret->__set_strKey(key); }
+
+// a scan of a db, see CabinetIterator. Next takes the cursor's mutex and
+// the db's lock shared, the iterator locks the shards itself.
+class Cursor {
+ public:
+  Cursor(const string& dbName, const SyncCabinet& sync)
+    : lastUsed_(time(NULL)), dbName_(dbName), sync_(sync) {}
+  virtual ~Cursor() {}
+
+  virtual void Next(size_t count, AsyncReader* reader, CursorBatch& ret) = 0;
+
+  const string& dbName() const { return dbName_; }
+  const SyncCabinet& sync() const { return sync_; }
+  Mutex& mutex() { return mutex_; }
+  // guarded by the handler's cursor mutex.
+  time_t lastUsed_;
+
+ private:
+  string dbName_;
+  SyncCabinet sync_;
+  Mutex mutex_;
+};
+
+template <class Cabinet, class Key>
+class TypedCursor : public Cursor {
+ public:
+  TypedCursor(const string& dbName, const SyncCabinet& sync)
+    : Cursor(dbName, sync), itr_((Cabinet*)sync.ptr.get()) {}
+
+  void Next(size_t count, AsyncReader* reader, CursorBatch& ret) {
+    vector<Key> keys;
+    itr_.Next(count, reader, &keys, &ret.values);
+    ret.keys.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      toThriftKey(keys[i], &ret.keys[i]);
+    }
+    ret.done = itr_.Done();
+  }
+
+ private:
+  CabinetIterator<Cabinet, Key> itr_;
 };
 
 class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
  public:
-  explicit CabinetStorageHandler(const char* data_path) : lockFile_(-1) {
+  explicit CabinetStorageHandler(const char* data_path)
+    : value_cache_((uint64_t)FLAGS_value_cache_mb * 1024 * 1024),
+      read_buffers_((uint64_t)FLAGS_read_buffer_mb * 1024 * 1024), flusher_(FLAGS_flush_threads),
+      lockFile_(-1),
+      compact_limiter_((uint64_t)FLAGS_compact_rate_mb * 1024 * 1024),
+      scrub_limiter_((uint64_t)FLAGS_scrub_rate_mb * 1024 * 1024),
+      stopping_(false), reader_(FLAGS_read_queue_depth, FLAGS_read_threads), next_cursor_id_(0) {
     data_path_ = data_path;
     if ((*data_path_.rbegin()) != '/') {
       data_path_.push_back('/');
@@ -115,9 +294,49 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
 
     // Opening dbs.
     _OpenDbs(); // should check dbname.
+
+    if (FLAGS_compact_interval > 0) {
+      PosixThreadFactory factory(PosixThreadFactory::ROUND_ROBIN,
+        PosixThreadFactory::NORMAL, 1, false);
+      compact_thread_ = factory.newThread(shared_ptr<Runnable>(new AutoCompactTask(this)));
+      compact_thread_->start();
+    }
+    if (FLAGS_cursor_timeout > 0) {
+      PosixThreadFactory factory(PosixThreadFactory::ROUND_ROBIN,
+        PosixThreadFactory::NORMAL, 1, false);
+      cursor_thread_ = factory.newThread(shared_ptr<Runnable>(new ExpireCursorsTask(this)));
+      cursor_thread_->start();
+    }
+    if (FLAGS_scrub_interval > 0) {
+      PosixThreadFactory factory(PosixThreadFactory::ROUND_ROBIN,
+        PosixThreadFactory::NORMAL, 1, false);
+      scrub_thread_ = factory.newThread(shared_ptr<Runnable>(new ScrubTask(this)));
+      scrub_thread_->start();
+    }
   }
 
   virtual ~CabinetStorageHandler() {
+    {
+      Synchronized s(compact_monitor_);
+      stopping_ = true;
+      compact_monitor_.notifyAll();
+    }
+    {
+      // a running compaction or scrub is not waited out.
+      RWGuard guard(rwmutex_, RW_READ);
+      for (map<string, SyncCabinet>::iterator itr = dbs_.begin(); itr != dbs_.end(); ++itr) {
+        itr->second.ptr->CancelMaintenance();
+      }
+    }
+    if (compact_thread_) {
+      compact_thread_->join();
+    }
+    if (cursor_thread_) {
+      cursor_thread_->join();
+    }
+    if (scrub_thread_) {
+      scrub_thread_->join();
+    }
     _ReleasePathLock();
   }
 
@@ -131,6 +350,12 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     for (std::map<string, SyncCabinet>::iterator itr = dbs_.begin(); itr != dbs_.end(); ++itr) {
       ret.dbs[itr->first] = _GetDbInfo(itr);
     }
+    ret.cacheCapacity = value_cache_.GetCapacity();
+    ret.cacheBytes = value_cache_.GetBytes();
+    ret.cacheHits = value_cache_.GetHits();
+    ret.cacheMisses = value_cache_.GetMisses();
+    ret.readBufferCapacity = read_buffers_.GetCapacity();
+    ret.readBufferBytes = read_buffers_.GetBytes();
   };
 
   void Create(const std::string& dbName, const DbMeta& meta) {
@@ -140,39 +365,90 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     if (dbs_.find(dbName) != dbs_.end()) {
       throw DbExists();
     }
+    if (meta.__isset.frozen && meta.frozen) {
+      LOG(INFO) << "Create db " << dbName << ": a new db is not frozen";
+      throw IOException();
+    }
     SyncCabinet sync;
-    const char* path = (data_path_ + dbName).c_str();
+    sync.meta = meta;
+    string path = data_path_ + dbName;
+    CabinetOptions options = _GetDbOptions(meta);
+    options.shards = meta.__isset.shards && meta.shards > 1 ? meta.shards : 1;
     try {
-      if (meta.type == DbType::INT32) {
-        sync.ptr.reset(new U32Cabinet(path));
-      } else if (meta.type == DbType::INT64) {
-        sync.ptr.reset(new U64Cabinet(path));
-      } else {  // DbType::STRING
-        sync.ptr.reset(new StringCabinet(path));
-      }
+      _NewCabinet(path, options, &sync);
+      _PutDbMeta(dbName, meta);
     } catch (exception& e) {
       LOG(INFO) << "Cabinet Open Exception: " << e.what();
       throw IOException();
     }
     sync.rwmutex_.reset(new ReadWriteMutex);
+    sync.compact_mutex_.reset(new Mutex);
+    sync.generation_.reset(new uint64_t(0));
+    sync.freezing_.reset(new bool(false));
+    sync.group_commit_.reset(new GroupCommit(FLAGS_sync_delay_us));
     dbs_[dbName] = sync;
   };
 
-  void Drop(const std::string& dbName) {
+  // opens a db put in the data path while the server runs, e.g. by
+  // cabinet_bulkload, and writes its meta so that it opens at the next
+  // start too. the db keeps the layout it was written with.
+  void Attach(const std::string& dbName, const DbMeta& meta) {
     RWGuard guard(rwmutex_, RW_WRITE);
 
     _CheckDbName(dbName);
-    map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
-
-    // here no need to lock again.
+    if (dbs_.find(dbName) != dbs_.end()) {
+      throw DbExists();
+    }
+    string path = data_path_ + dbName;
+    struct stat st;
+    if (lstat((path + "/index").c_str(), &st) != 0 && lstat((path + "/shards").c_str(), &st) != 0) {
+      LOG(INFO) << "Attach db " << dbName << ": no db at " << path;
+      throw IOException();
+    }
+    SyncCabinet sync;
+    sync.meta = meta;
     try {
-      (itr->second.ptr.get())->Drop();
+      _NewCabinet(path, _GetDbOptions(meta), &sync);
+      _PutDbMeta(dbName, meta);
     } catch (exception& e) {
-      LOG(INFO) << "Drop db " << dbName << " exception: " << e.what();
+      LOG(INFO) << "Attach db " << dbName << " exception: " << e.what();
       throw IOException();
     }
+    sync.rwmutex_.reset(new ReadWriteMutex);
+    sync.compact_mutex_.reset(new Mutex);
+    sync.generation_.reset(new uint64_t(0));
+    sync.freezing_.reset(new bool(false));
+    sync.group_commit_.reset(new GroupCommit(FLAGS_sync_delay_us));
+    dbs_[dbName] = sync;
+  }
 
-    dbs_.erase(itr);
+  // cancels a running compaction or scrub of the db and waits for it
+  // without the server's lock, which is only taken to remove the db once
+  // its files are gone.
+  void Drop(const std::string& dbName) {
+    SyncCabinet sync;
+    for (;;) {
+      uint64_t generation = _GetSyncCabinet(dbName, &sync);
+      CancellingGuard compacting(sync);
+      if (*sync.generation_ != generation) {
+        continue;
+      }
+      try {
+        RWGuard subGuard(*sync.rwmutex_, RW_WRITE);
+        sync.ptr->Drop();
+        unlink((data_path_ + dbName + "/meta").c_str());
+      } catch (exception& e) {
+        LOG(INFO) << "Drop db " << dbName << " exception: " << e.what();
+        throw IOException();
+      }
+      {
+        RWGuard guard(rwmutex_, RW_WRITE);
+        ++*sync.generation_;
+        dbs_.erase(dbName);
+      }
+      _CloseCursors(dbName);
+      return;
+    }
   };
 
   void GetDbInfo(DbInfo& ret, const std::string& dbName) {
@@ -183,12 +459,63 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     ret = _GetDbInfo(itr);
   }
 
+  // the db stays available while compacting, its lock is only held to
+  // take the snapshot and to catch up and swap the files at the end.
   void Compact(const std::string& dbName) {
-    RWGuard guard(rwmutex_, RW_READ);
-    _CheckDbName(dbName);
-    map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
-    RWGuard subGuard(*(itr->second.rwmutex_), RW_WRITE);
-    (itr->second.ptr.get())->Compact();
+    SyncCabinet sync;
+    for (;;) {
+      uint64_t generation = _GetSyncCabinet(dbName, &sync);
+      Guard compacting(*sync.compact_mutex_);
+      if (*sync.generation_ != generation) {
+        continue;
+      }
+      CabinetBase* cab = sync.ptr.get();
+      try {
+        {
+          RWGuard subGuard(*sync.rwmutex_, RW_WRITE);
+          cab->BeginCompact();
+        }
+        cab->RunCompact();
+        {
+          RWGuard subGuard(*sync.rwmutex_, RW_WRITE);
+          cab->FinishCompact();
+        }
+      } catch (exception& e) {
+        LOG(INFO) << "Exception occurs while Compact: " << e.what();
+        throw IOException();
+      }
+      return;
+    }
+  }
+
+  // like Compact, the db stays available while its values are read. the
+  // shards lock themselves to take the snapshot, see BeginScrub().
+  int64_t Scrub(const std::string& dbName) {
+    SyncCabinet sync;
+    int64_t bad;
+    for (;;) {
+      uint64_t generation = _GetSyncCabinet(dbName, &sync);
+      Guard scrubbing(*sync.compact_mutex_);
+      if (*sync.generation_ != generation) {
+        continue;
+      }
+      CabinetBase* cab = sync.ptr.get();
+      try {
+        {
+          RWGuard subGuard(*sync.rwmutex_, RW_READ);
+          cab->BeginScrub();
+        }
+        bad = cab->RunScrub();
+      } catch (exception& e) {
+        LOG(INFO) << "Exception occurs while Scrub: " << e.what();
+        throw IOException();
+      }
+      break;
+    }
+    if (bad > 0) {
+      LOG(INFO) << "scrub of " << dbName << " found " << bad << " corrupt values.";
+    }
+    return bad;
   }
 
   void Get(GetInfo& ret, const std::string& dbName, const KeyType& key) {
@@ -198,12 +525,15 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
     try {
       if (itr->second.meta.type == DbType::INT32) {
-        ret.got = ((U32Cabinet*)(itr->second.ptr.get()))->Get(key.intKey, &ret.value);
+        ret.got = _Get((ShardedU32Cabinet*)(itr->second.ptr.get()), key.intKey, &ret.value);
       } else if (itr->second.meta.type == DbType::INT64) {
-        ret.got = ((U64Cabinet*)(itr->second.ptr.get()))->Get(key.longKey, &ret.value);
+        ret.got = _Get((ShardedU64Cabinet*)(itr->second.ptr.get()), key.longKey, &ret.value);
       } else {  // String
-        ret.got = ((StringCabinet*)(itr->second.ptr.get()))->Get(key.strKey, &ret.value);
+        ret.got = _Get((ShardedStringCabinet*)(itr->second.ptr.get()), key.strKey, &ret.value);
       }
+    } catch (ChecksumMismatchException& e) {
+      LOG(INFO) << "Corrupt value in " << dbName << ": " << e.what();
+      throw ChecksumMismatch();
     } catch (exception& e) {
       LOG(INFO) << "Exception while Get(" << dbName << ", " << ": " << e.what();
       throw IOException();
@@ -214,14 +544,15 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     RWGuard guard(rwmutex_, RW_READ);
     _CheckDbName(dbName);
     map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
-    RWGuard subGuard(*(itr->second.rwmutex_), RW_WRITE);
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
+    _CheckWritable(dbName, itr->second);
     try {
       if (itr->second.meta.type == DbType::INT32) {
-        ((U32Cabinet*)(itr->second.ptr.get()))->Set(key.intKey, (const uint8_t*)value.c_str(), value.size());
+        ((ShardedU32Cabinet*)(itr->second.ptr.get()))->Set(key.intKey, (const uint8_t*)value.c_str(), value.size());
       } else if (itr->second.meta.type == DbType::INT64) {
-        ((U64Cabinet*)(itr->second.ptr.get()))->Set(key.longKey, (const uint8_t*)value.c_str(), value.size());
+        ((ShardedU64Cabinet*)(itr->second.ptr.get()))->Set(key.longKey, (const uint8_t*)value.c_str(), value.size());
       } else {
-        ((StringCabinet*)(itr->second.ptr.get()))->Set(key.strKey, (const uint8_t*)value.c_str(), value.size());
+        ((ShardedStringCabinet*)(itr->second.ptr.get()))->Set(key.strKey, (const uint8_t*)value.c_str(), value.size());
       }
     } catch (exception& e) {
       LOG(INFO) << "Exception occurs while Set: " << e.what();
@@ -233,14 +564,15 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     RWGuard guard(rwmutex_, RW_READ);
     _CheckDbName(dbName);
     map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
-    RWGuard subGuard(*(itr->second.rwmutex_), RW_WRITE);
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
+    _CheckWritable(dbName, itr->second);
     try {
       if (itr->second.meta.type == DbType::INT32) {
-        ((U32Cabinet*)(itr->second.ptr.get()))->Delete(key.intKey);
+        ((ShardedU32Cabinet*)(itr->second.ptr.get()))->Delete(key.intKey);
       } else if (itr->second.meta.type == DbType::INT64) {
-        ((U64Cabinet*)(itr->second.ptr.get()))->Delete(key.longKey);
+        ((ShardedU64Cabinet*)(itr->second.ptr.get()))->Delete(key.longKey);
       } else {
-        ((StringCabinet*)(itr->second.ptr.get()))->Delete(key.strKey);
+        ((ShardedStringCabinet*)(itr->second.ptr.get()))->Delete(key.strKey);
       }
     } catch (exception& e) {
       LOG(INFO) << "Exception occurs while Delete: " << e.what();
@@ -252,7 +584,7 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     RWGuard guard(rwmutex_, RW_READ);
     _CheckDbName(dbName);
     map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
-    RWGuard subGuard(*(itr->second.rwmutex_), RW_WRITE);
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
     try {
       (itr->second.ptr.get())->Flush();
     } catch (exception& e) {
@@ -261,48 +593,113 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     }
   }
 
+  // returns once the db's writes so far are on disk. concurrent Syncs of
+  // a db share one fsync, see GroupCommit.
   void Sync(const std::string& dbName) {
-    RWGuard guard(rwmutex_, RW_READ);
-    _CheckDbName(dbName);
-    map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
-    RWGuard subGuard(*(itr->second.rwmutex_), RW_WRITE);
+    SyncCabinet sync;
+    {
+      RWGuard guard(rwmutex_, RW_READ);
+      _CheckDbName(dbName);
+      sync = _GetSafeIterator(dbName)->second;
+    }
+    CabinetSyncer syncer(sync);
     try {
-      (itr->second.ptr.get())->Flush();
+      sync.group_commit_->Commit(&syncer);
     } catch (exception& e) {
       LOG(INFO) << "Exception occurs while Sync: " << e.what();
       throw IOException();
     }
   }
 
+  // cancels a running compaction or scrub of the db, then writes the
+  // frozen index and opens the db from it under the db's own locks,
+  // writes are refused from then on. the server's lock is only
+  // taken to write the meta and swap in the frozen db, so that no request
+  // sees the db in between. its cursors scan the cabinet replaced, they
+  // are closed.
+  void Freeze(const std::string& dbName) {
+    SyncCabinet sync;
+    for (;;) {
+      uint64_t generation = _GetSyncCabinet(dbName, &sync);
+      if (sync.meta.__isset.frozen && sync.meta.frozen) {
+        return;
+      }
+      CancellingGuard compacting(sync);
+      if (*sync.generation_ != generation) {
+        continue;
+      }
+      // the meta says frozen only once the frozen db opened, and goes
+      // back if it cannot be written.
+      SyncCabinet frozen = sync;
+      frozen.meta.__set_frozen(true);
+      try {
+        {
+          RWGuard subGuard(*sync.rwmutex_, RW_WRITE);
+          *sync.freezing_ = true;
+          sync.ptr->Freeze();
+        }
+        _NewCabinet(data_path_ + dbName, _GetDbOptions(frozen.meta), &frozen);
+      } catch (exception& e) {
+        LOG(INFO) << "Freeze db " << dbName << " exception: " << e.what();
+        RWGuard subGuard(*sync.rwmutex_, RW_WRITE);
+        *sync.freezing_ = false;
+        throw IOException();
+      }
+      {
+        RWGuard guard(rwmutex_, RW_WRITE);
+        SyncCabinet& entry = _GetSafeIterator(dbName)->second;
+        try {
+          _PutDbMeta(dbName, frozen.meta);
+        } catch (exception& e) {
+          LOG(INFO) << "Freeze db " << dbName << " exception: " << e.what();
+          try {
+            _PutDbMeta(dbName, sync.meta);
+          } catch (exception& restore) {
+            LOG(INFO) << "Restore meta of " << dbName << " exception: " << restore.what();
+          }
+          RWGuard subGuard(*sync.rwmutex_, RW_WRITE);
+          *sync.freezing_ = false;
+          throw IOException();
+        }
+        entry.ptr = frozen.ptr;
+        entry.meta = frozen.meta;
+        ++*entry.generation_;
+        // the frozen db refuses writes itself.
+        *entry.freezing_ = false;
+      }
+      _CloseCursors(dbName);
+      return;
+    }
+  }
+
   void BatchGet(std::vector<GetInfo>& ret, const std::string& dbName, const std::vector<KeyType>& keys) {
      RWGuard guard(rwmutex_, RW_READ);
     _CheckDbName(dbName);
     map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
     RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
-    GetInfo info;
     try {
       if (itr->second.meta.type == DbType::INT32) {
-        U32Cabinet* cab = (U32Cabinet*)(itr->second.ptr.get());
+        vector<uint32_t> typed;
         for (std::vector<KeyType>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
-          info.value = "";
-          info.got = cab->Get(i->intKey, &info.value);
-          ret.push_back(info);
+          typed.push_back(i->intKey);
         }
+        _MultiGet((ShardedU32Cabinet*)(itr->second.ptr.get()), typed, ret);
       } else if (itr->second.meta.type == DbType::INT64) {
-        U64Cabinet* cab = (U64Cabinet*)(itr->second.ptr.get());
+        vector<uint64_t> typed;
         for (std::vector<KeyType>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
-          info.value = "";
-          info.got = cab->Get(i->longKey, &info.value);
-          ret.push_back(info);
+          typed.push_back(i->longKey);
         }
+        _MultiGet((ShardedU64Cabinet*)(itr->second.ptr.get()), typed, ret);
       } else {
-        StringCabinet* cab = (StringCabinet*)(itr->second.ptr.get());
+        vector<string> typed;
         for (std::vector<KeyType>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
-          info.value = "";
-          info.got = cab->Get(i->strKey.c_str(), &info.value);
-          ret.push_back(info);
+          typed.push_back(i->strKey);
         }
+        _MultiGet((ShardedStringCabinet*)(itr->second.ptr.get()), typed, ret);
       }
+    } catch (ChecksumMismatchException& e) {
+      LOG(INFO) << "Corrupt value in " << dbName << ": " << e.what();
+      throw ChecksumMismatch();
     } catch (exception& e) {
       LOG(INFO) << "Exception occurs when BatchGet: " << e.what();
       throw IOException();
@@ -313,23 +710,24 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
      RWGuard guard(rwmutex_, RW_READ);
     _CheckDbName(dbName);
     map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
-    RWGuard subGuard(*(itr->second.rwmutex_), RW_WRITE);
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
+    _CheckWritable(dbName, itr->second);
 
     std::vector<KeyType>::const_iterator i = keys.begin();
     std::vector<std::string>::const_iterator j = values.begin();
     try {
       if (itr->second.meta.type == DbType::INT32) {
-        U32Cabinet* cab = ((U32Cabinet*)itr->second.ptr.get());
+        ShardedU32Cabinet* cab = ((ShardedU32Cabinet*)itr->second.ptr.get());
         for (; i != keys.end() && j != values.end(); ++i, ++j) {
           cab->Set(i->intKey, (const uint8_t*)(j->c_str()), j->size());
         }
       } else if (itr->second.meta.type == DbType::INT64) {
-        U64Cabinet* cab = ((U64Cabinet*)itr->second.ptr.get());
+        ShardedU64Cabinet* cab = ((ShardedU64Cabinet*)itr->second.ptr.get());
         for (; i != keys.end() && j != values.end(); ++i, ++j) {
           cab->Set(i->longKey, (const uint8_t*)(j->c_str()), j->size());
         }
       } else {
-        StringCabinet* cab = ((StringCabinet*)itr->second.ptr.get());
+        ShardedStringCabinet* cab = ((ShardedStringCabinet*)itr->second.ptr.get());
         for (; i != keys.end() && j != values.end(); ++i, ++j) {
           cab->Set(i->strKey, (const uint8_t*)(j->c_str()), j->size());
         }
@@ -344,19 +742,21 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
      RWGuard guard(rwmutex_, RW_READ);
     _CheckDbName(dbName);
     map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
+    _CheckWritable(dbName, itr->second);
     try {
       if (itr->second.meta.type == DbType::INT32) {
-        U32Cabinet* cab = (U32Cabinet*)(itr->second.ptr.get());
+        ShardedU32Cabinet* cab = (ShardedU32Cabinet*)(itr->second.ptr.get());
         for (std::vector<KeyType>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
           cab->Delete(i->intKey);
         }
       } else if (itr->second.meta.type == DbType::INT64) {
-        U64Cabinet* cab = (U64Cabinet*)(itr->second.ptr.get());
+        ShardedU64Cabinet* cab = (ShardedU64Cabinet*)(itr->second.ptr.get());
         for (std::vector<KeyType>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
           cab->Delete(i->longKey);
         }
       } else {
-        StringCabinet* cab = (StringCabinet*)(itr->second.ptr.get());
+        ShardedStringCabinet* cab = (ShardedStringCabinet*)(itr->second.ptr.get());
         for (std::vector<KeyType>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
           cab->Delete(i->strKey);
         }
@@ -367,7 +767,384 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     }
   }
 
+  // a cursor holds the keys of its db in data file order, which takes a
+  // copy of the index, see FLAGS_max_cursors.
+  int64_t OpenCursor(const std::string& dbName) {
+    RWGuard guard(rwmutex_, RW_READ);
+    _CheckDbName(dbName);
+    map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
+    {
+      Guard cursorGuard(cursor_mutex_);
+      if (cursors_.size() >= (size_t)FLAGS_max_cursors) {
+        LOG(INFO) << "OpenCursor(" << dbName << "): " << cursors_.size() << " cursors open.";
+        throw IOException();
+      }
+    }
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
+    shared_ptr<Cursor> cursor;
+    try {
+      if (itr->second.meta.type == DbType::INT32) {
+        cursor.reset(new TypedCursor<ShardedU32Cabinet, uint32_t>(dbName, itr->second));
+      } else if (itr->second.meta.type == DbType::INT64) {
+        cursor.reset(new TypedCursor<ShardedU64Cabinet, uint64_t>(dbName, itr->second));
+      } else {
+        cursor.reset(new TypedCursor<ShardedStringCabinet, string>(dbName, itr->second));
+      }
+    } catch (exception& e) {
+      LOG(INFO) << "Exception occurs while OpenCursor: " << e.what();
+      throw IOException();
+    }
+    Guard cursorGuard(cursor_mutex_);
+    int64_t id = ++next_cursor_id_;
+    cursors_[id] = cursor;
+    return id;
+  }
+
+  // the reads of a batch are merged like those of BatchGet.
+  void Next(CursorBatch& ret, const int64_t cursorId, const int32_t batchSize) {
+    shared_ptr<Cursor> cursor = _GetCursor(cursorId);
+    Guard nextGuard(cursor->mutex());
+    RWGuard guard(rwmutex_, RW_READ);
+    map<std::string, SyncCabinet>::iterator itr = dbs_.find(cursor->dbName());
+    if (itr == dbs_.end() || itr->second.ptr != cursor->sync().ptr) {
+      _CloseCursor(cursorId);
+      throw CursorNotExist();
+    }
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
+    try {
+      cursor->Next(std::min(std::max(batchSize, 1), kMaxCursorBatch), &reader_, ret);
+    } catch (ChecksumMismatchException& e) {
+      LOG(INFO) << "Corrupt value in " << cursor->dbName() << ": " << e.what();
+      throw ChecksumMismatch();
+    } catch (exception& e) {
+      LOG(INFO) << "Exception occurs while Next: " << e.what();
+      throw IOException();
+    }
+    if (ret.done) {
+      _CloseCursor(cursorId);
+    }
+  }
+
+  void CloseCursor(const int64_t cursorId) {
+    _CloseCursor(cursorId);
+  }
+
+  void GetRange(RangeBatch& ret, const std::string& dbName, const KeyType& begin,
+      const KeyType& end, const int32_t limit) {
+    RWGuard guard(rwmutex_, RW_READ);
+    _CheckDbName(dbName);
+    map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
+    _CheckOrderedIndex(itr->second.meta);
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
+    size_t count = std::min(std::max(limit, 1), kMaxRangeLimit);
+    bool bounded = end.__isset.intKey || end.__isset.longKey || end.__isset.strKey;
+    try {
+      if (itr->second.meta.type == DbType::INT32) {
+        uint32_t from = begin.intKey, to = end.intKey;
+        _GetRange((ShardedU32Cabinet*)(itr->second.ptr.get()), from, bounded ? &to : NULL, count, ret);
+      } else if (itr->second.meta.type == DbType::INT64) {
+        uint64_t from = begin.longKey, to = end.longKey;
+        _GetRange((ShardedU64Cabinet*)(itr->second.ptr.get()), from, bounded ? &to : NULL, count, ret);
+      } else {
+        _GetRange((ShardedStringCabinet*)(itr->second.ptr.get()), begin.strKey,
+          bounded ? &end.strKey : NULL, count, ret);
+      }
+    } catch (ChecksumMismatchException& e) {
+      LOG(INFO) << "Corrupt value in " << dbName << ": " << e.what();
+      throw ChecksumMismatch();
+    } catch (exception& e) {
+      LOG(INFO) << "Exception occurs while GetRange: " << e.what();
+      throw IOException();
+    }
+  }
+
+  void GetPrefix(RangeBatch& ret, const std::string& dbName, const std::string& prefix,
+      const int32_t limit) {
+    RWGuard guard(rwmutex_, RW_READ);
+    _CheckDbName(dbName);
+    map<std::string, SyncCabinet>::iterator itr = _GetSafeIterator(dbName);
+    _CheckOrderedIndex(itr->second.meta);
+    RWGuard subGuard(*(itr->second.rwmutex_), RW_READ);
+    size_t count = std::min(std::max(limit, 1), kMaxRangeLimit);
+    try {
+      if (itr->second.meta.type == DbType::INT32) {
+        _GetPrefix<ShardedU32Cabinet, uint32_t>((ShardedU32Cabinet*)(itr->second.ptr.get()), prefix, count, ret);
+      } else if (itr->second.meta.type == DbType::INT64) {
+        _GetPrefix<ShardedU64Cabinet, uint64_t>((ShardedU64Cabinet*)(itr->second.ptr.get()), prefix, count, ret);
+      } else {
+        _GetPrefix<ShardedStringCabinet, string>((ShardedStringCabinet*)(itr->second.ptr.get()), prefix, count, ret);
+      }
+    } catch (ChecksumMismatchException& e) {
+      LOG(INFO) << "Corrupt value in " << dbName << ": " << e.what();
+      throw ChecksumMismatch();
+    } catch (exception& e) {
+      LOG(INFO) << "Exception occurs while GetPrefix: " << e.what();
+      throw IOException();
+    }
+  }
+
  private:
+  // with mmap_reads the value is copied once, from the mapping straight
+  // into the reply.
+  template <class Cabinet, class Key>
+  bool _Get(Cabinet* cab, const Key& key, string* value) {
+    if (!FLAGS_mmap_reads) {
+      return cab->Get(key, value);
+    }
+    ValueView view;
+    if (!cab->Get(key, &view)) {
+      return false;
+    }
+    value->assign(view.data(), view.size());
+    return true;
+  }
+
+  // the reads of a batch are sorted, merged and all in flight at once, see
+  // TCabinet::MultiGet().
+  template <class Cabinet, class Key>
+  void _MultiGet(Cabinet* cab, const vector<Key>& keys, std::vector<GetInfo>& ret) {
+    vector<string> values;
+    vector<bool> found;
+    cab->MultiGet(keys, &reader_, &values, &found);
+    ret.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      ret[i].got = found[i];
+      ret[i].value.swap(values[i]);
+    }
+  }
+
+  // one key past limit tells whether more are left. the values are read
+  // like those of a cursor, an entry deleted meanwhile is left out.
+  template <class Cabinet, class Key>
+  void _GetRange(Cabinet* cab, const Key& begin, const Key* end, size_t limit, RangeBatch& ret) {
+    vector<Key> keys;
+    cab->GetKeyRange(begin, end, limit + 1, &keys);
+    _FillRange(cab, &keys, limit, ret);
+  }
+
+  template <class Cabinet, class Key>
+  void _GetPrefix(Cabinet* cab, const string& prefix, size_t limit, RangeBatch& ret) {
+    vector<Key> keys;
+    cab->GetKeysWithPrefix(StringPiece(prefix), limit + 1, &keys);
+    _FillRange(cab, &keys, limit, ret);
+  }
+
+  template <class Cabinet, class Key>
+  void _FillRange(Cabinet* cab, vector<Key>* keys, size_t limit, RangeBatch& ret) {
+    ret.more = keys->size() > limit;
+    keys->resize(std::min(keys->size(), limit));
+    vector<string> values;
+    vector<bool> found;
+    cab->MultiGet(*keys, &reader_, &values, &found, false);
+    for (size_t i = 0; i < keys->size(); ++i) {
+      if (found[i]) {
+        ret.keys.push_back(KeyType());
+        toThriftKey((*keys)[i], &ret.keys.back());
+        ret.values.push_back(string());
+        ret.values.back().swap(values[i]);
+      }
+    }
+  }
+
+  // checks the dbs every compact_interval seconds.
+  class AutoCompactTask : public Runnable {
+   public:
+    explicit AutoCompactTask(CabinetStorageHandler* handler) : handler_(handler) {}
+
+    void run() {
+      for (;;) {
+        {
+          Synchronized s(handler_->compact_monitor_);
+          if (!handler_->stopping_) {
+            handler_->compact_monitor_.waitForTimeRelative(FLAGS_compact_interval * 1000LL);
+          }
+          if (handler_->stopping_) {
+            return;
+          }
+        }
+        while (!handler_->stopping_ && handler_->_AutoCompact()) {
+        }
+      }
+    }
+
+   private:
+    CabinetStorageHandler* handler_;
+  };
+
+  // scrubs the dbs with checksums every scrub_interval hours, one at a
+  // time, see Scrub().
+  class ScrubTask : public Runnable {
+   public:
+    explicit ScrubTask(CabinetStorageHandler* handler) : handler_(handler) {}
+
+    void run() {
+      for (;;) {
+        {
+          Synchronized s(handler_->compact_monitor_);
+          if (!handler_->stopping_) {
+            handler_->compact_monitor_.waitForTimeRelative(FLAGS_scrub_interval * 3600 * 1000LL);
+          }
+          if (handler_->stopping_) {
+            return;
+          }
+        }
+        handler_->_ScrubAll();
+      }
+    }
+
+   private:
+    CabinetStorageHandler* handler_;
+  };
+
+  // closes the cursors unused for cursor_timeout seconds, checked four
+  // times as often.
+  class ExpireCursorsTask : public Runnable {
+   public:
+    explicit ExpireCursorsTask(CabinetStorageHandler* handler) : handler_(handler) {}
+
+    void run() {
+      for (;;) {
+        {
+          Synchronized s(handler_->compact_monitor_);
+          if (!handler_->stopping_) {
+            handler_->compact_monitor_.waitForTimeRelative(FLAGS_cursor_timeout * 250LL);
+          }
+          if (handler_->stopping_) {
+            return;
+          }
+        }
+        handler_->_ExpireCursors();
+      }
+    }
+
+   private:
+    CabinetStorageHandler* handler_;
+  };
+
+  void _ExpireCursors() {
+    time_t now = time(NULL);
+    Guard guard(cursor_mutex_);
+    for (map<int64_t, shared_ptr<Cursor> >::iterator itr = cursors_.begin(); itr != cursors_.end();) {
+      if (now - itr->second->lastUsed_ >= FLAGS_cursor_timeout) {
+        LOG(INFO) << "cursor " << itr->first << " of " << itr->second->dbName() << " expired.";
+        cursors_.erase(itr++);
+      } else {
+        ++itr;
+      }
+    }
+  }
+
+  shared_ptr<Cursor> _GetCursor(int64_t cursorId) {
+    Guard guard(cursor_mutex_);
+    map<int64_t, shared_ptr<Cursor> >::iterator itr = cursors_.find(cursorId);
+    if (itr == cursors_.end()) {
+      throw CursorNotExist();
+    }
+    itr->second->lastUsed_ = time(NULL);
+    return itr->second;
+  }
+
+  // a Next still running keeps its cursor until it returns.
+  void _CloseCursor(int64_t cursorId) {
+    Guard guard(cursor_mutex_);
+    cursors_.erase(cursorId);
+  }
+
+  void _CloseCursors(const string& dbName) {
+    Guard guard(cursor_mutex_);
+    for (map<int64_t, shared_ptr<Cursor> >::iterator itr = cursors_.begin(); itr != cursors_.end();) {
+      if (itr->second->dbName() == dbName) {
+        cursors_.erase(itr++);
+      } else {
+        ++itr;
+      }
+    }
+  }
+
+  void _ScrubAll() {
+    vector<string> names;
+    {
+      RWGuard guard(rwmutex_, RW_READ);
+      for (map<string, SyncCabinet>::iterator itr = dbs_.begin(); itr != dbs_.end(); ++itr) {
+        if (itr->second.meta.__isset.checksums && itr->second.meta.checksums) {
+          names.push_back(itr->first);
+        }
+      }
+    }
+    for (size_t i = 0; i < names.size() && !stopping_; ++i) {
+      try {
+        Scrub(names[i]);
+      } catch (DbNotExist&) {
+        // dropped meanwhile.
+      } catch (IOException&) {
+        // logged by Scrub.
+      }
+    }
+  }
+
+  // compacts the db that reclaims the most among those over the
+  // thresholds, returns false if there is none.
+  bool _AutoCompact() {
+    string best;
+    int64_t best_garbage = 0;
+    {
+      RWGuard guard(rwmutex_, RW_READ);
+      for (map<string, SyncCabinet>::iterator itr = dbs_.begin(); itr != dbs_.end(); ++itr) {
+        // compact_garbage_ratio is applied by the cabinet, see
+        // _GetCabinetOptions().
+        int64_t garbage;
+        {
+          RWGuard db_guard(*itr->second.rwmutex_, RW_READ);
+          garbage = itr->second.ptr->GetReclaimableBytes();
+        }
+        if (garbage < (int64_t)FLAGS_compact_min_garbage_mb * 1024 * 1024) {
+          continue;
+        }
+        if (garbage > best_garbage) {
+          best = itr->first;
+          best_garbage = garbage;
+        }
+      }
+    }
+    if (best.empty()) {
+      return false;
+    }
+    LOG(INFO) << "auto compacting " << best << ", " << best_garbage << " bytes of garbage.";
+    try {
+      Compact(best);
+    } catch (exception& e) {
+      LOG(INFO) << "auto compaction of " << best << " failed: " << e.what();
+      return false;
+    }
+    return true;
+  }
+
+  CabinetOptions _GetCabinetOptions() {
+    CabinetOptions options;
+    // more threads than cpus only adds merging work.
+    options.load_threads = std::max<long>(1,
+      std::min<long>(FLAGS_load_threads, sysconf(_SC_NPROCESSORS_ONLN)));
+    options.mmap_reads = FLAGS_mmap_reads;
+    options.compact_limiter = &compact_limiter_;
+    options.scrub_limiter = &scrub_limiter_;
+    options.compact_garbage_ratio = FLAGS_compact_garbage_ratio;
+    options.segment_size = (uint64_t)FLAGS_segment_mb * 1024 * 1024;
+    options.read_coalesce_bytes = (uint32_t)FLAGS_read_coalesce_kb * 1024;
+    options.value_cache = FLAGS_value_cache_mb > 0 ? &value_cache_ : NULL;
+    options.read_buffers = &read_buffers_;
+    options.flusher = FLAGS_write_buffers > 1 ? &flusher_ : NULL;
+    options.write_buffers = FLAGS_write_buffers;
+    options.large_value_bytes = (uint32_t)FLAGS_large_value_kb * 1024;
+    return options;
+  }
+
+  ReadMode _GetReadMode(const DbMeta& meta) {
+    if (meta.__isset.directIo && meta.directIo) {
+      return cabinet::kReadDirect;
+    }
+    return FLAGS_random_reads ? cabinet::kReadRandom : cabinet::kReadBuffered;
+  }
+
   map<std::string, SyncCabinet>::iterator _GetSafeIterator(const std::string& dbName) {
     map<std::string, SyncCabinet>::iterator itr = dbs_.find(dbName);
     if (itr == dbs_.end()) {
@@ -384,9 +1161,42 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     info.entryCount = cab->GetEntryCount();
     info.dataBytes = cab->GetDataBytes();
     info.dataFileSize = cab->GetDataFileSize();
+    info.rawBytesWritten = cab->GetRawBytesWritten();
+    info.storedBytesWritten = cab->GetStoredBytesWritten();
+    info.compressionRatio = info.storedBytesWritten > 0 ?
+      (double)info.rawBytesWritten / info.storedBytesWritten : 1.0;
+    info.cacheHits = cab->GetCacheHits();
+    info.cacheMisses = cab->GetCacheMisses();
+    info.orderedIndexBytes = cab->GetOrderedIndexBytes();
+    info.checksumErrors = cab->GetChecksumErrors();
+    info.inlineValueCount = cab->GetInlineValueCount();
+    info.inlineValueBytes = cab->GetInlineValueBytes();
     return info;
   }
 
+  // copies the SyncCabinet of dbName and returns its generation_, see
+  // there.
+  uint64_t _GetSyncCabinet(const std::string& dbName, SyncCabinet* sync) {
+    RWGuard guard(rwmutex_, RW_READ);
+    _CheckDbName(dbName);
+    *sync = _GetSafeIterator(dbName)->second;
+    return *sync->generation_;
+  }
+
+  // under the db's lock, see SyncCabinet::freezing_.
+  void _CheckWritable(const std::string& dbName, const SyncCabinet& sync) {
+    if (*sync.freezing_) {
+      LOG(INFO) << "Write to " << dbName << " while it is frozen";
+      throw IOException();
+    }
+  }
+
+  void _CheckOrderedIndex(const DbMeta& meta) {
+    if (!meta.__isset.orderedIndex || !meta.orderedIndex) {
+      throw NoOrderedIndex();
+    }
+  }
+
   void _CheckDbName(const std::string& dbName) {
     if (dbName.empty() || dbName.find('/') != string::npos) {
       throw BadDbName();
@@ -423,42 +1233,138 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
     fsync(lockFile_);
   }
 
+  // opens the dbs of queue_, run by several threads at startup.
+  class OpenDbTask : public Runnable {
+   public:
+    explicit OpenDbTask(CabinetStorageHandler* handler) : handler_(handler) {}
+
+    void run() {
+      for (;;) {
+        string dbname;
+        {
+          Guard guard(handler_->open_mutex_);
+          if (handler_->open_queue_.empty() || !handler_->open_error_.empty()) {
+            return;
+          }
+          dbname = handler_->open_queue_.back();
+          handler_->open_queue_.pop_back();
+        }
+        try {
+          handler_->_OpenDb(dbname.c_str());
+        } catch (exception& e) {
+          Guard guard(handler_->open_mutex_);
+          handler_->open_error_ = dbname + ": " + e.what();
+        }
+      }
+    }
+
+   private:
+    CabinetStorageHandler* handler_;
+  };
+
   void _OpenDbs() {
     DIR* dir = opendir(data_path_.c_str());
+    if (dir == NULL) {
+      throw runtime_error("Open data path failed!");
+    }
     struct dirent* entry = NULL;
     while ((entry = readdir(dir)) != NULL) {
       if (entry->d_type != DT_DIR || strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
         continue;
       }
-      _OpenDb(entry->d_name);
+      // dropped dbs leave their directory without meta.
+      if (access((data_path_ + entry->d_name + "/meta").c_str(), F_OK) != 0) {
+        LOG(INFO) << "skip " << entry->d_name << ", no meta file.";
+        continue;
+      }
+      open_queue_.push_back(entry->d_name);
     }
     closedir(dir);
+
+    // each db replays its own index log, open several at once.
+    PosixThreadFactory factory(PosixThreadFactory::ROUND_ROBIN,
+      PosixThreadFactory::NORMAL, 1, false);
+    vector<shared_ptr<Thread> > threads;
+    int count = std::min<int>(FLAGS_open_threads, open_queue_.size());
+    for (int i = 0; i < count; ++i) {
+      threads.push_back(factory.newThread(shared_ptr<Runnable>(new OpenDbTask(this))));
+      threads.back()->start();
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+      threads[i]->join();
+    }
+    // run here when no thread was asked for.
+    OpenDbTask(this).run();
+    if (!open_error_.empty()) {
+      throw runtime_error("Open db " + open_error_);
+    }
   }
 
   void _OpenDb(const char* dbname) {
     SyncCabinet cab;
     std::string dbPath = data_path_ + dbname;
-    DbMeta meta = _GetDbMeta(dbname);
-    if (meta.type == DbType::INT32) {
-      cab.ptr.reset(new U32Cabinet(dbPath.c_str()));
-    } else if (meta.type == DbType::INT64) {
-      cab.ptr.reset(new U64Cabinet(dbPath.c_str()));
-    } else {  // DbType.STRING
-      cab.ptr.reset(new StringCabinet(dbPath.c_str()));
-    }
+    cab.meta = _GetDbMeta(dbname);
+    _NewCabinet(dbPath, _GetDbOptions(cab.meta), &cab);
+    cab.rwmutex_.reset(new ReadWriteMutex);
+    cab.compact_mutex_.reset(new Mutex);
+    cab.generation_.reset(new uint64_t(0));
+    cab.freezing_.reset(new bool(false));
+    cab.group_commit_.reset(new GroupCommit(FLAGS_sync_delay_us));
+    Guard guard(open_mutex_);
     dbs_[dbname] = cab;
   }
 
-  DbMeta _GetDbMeta(const char* dbname) {
-    FILE* fp = fopen((data_path_ + dbname).c_str(), "rb");
+  // the server's options with those of meta.
+  CabinetOptions _GetDbOptions(const DbMeta& meta) {
+    CabinetOptions options = _GetCabinetOptions();
+    options.compress = meta.compressed;
+    options.read_mode = _GetReadMode(meta);
+    options.ordered_index = meta.__isset.orderedIndex && meta.orderedIndex;
+    options.frozen = meta.__isset.frozen && meta.frozen;
+    options.checksums = meta.__isset.checksums && meta.checksums;
+    options.inline_value_bytes = meta.__isset.inlineValueBytes && meta.inlineValueBytes > 0 ?
+      meta.inlineValueBytes : 0;
+    return options;
+  }
+
+  // opens the cabinet of sync->meta, an existing db keeps its shard count.
+  void _NewCabinet(const string& path, const CabinetOptions& options, SyncCabinet* sync) {
+    if (sync->meta.type == DbType::INT32) {
+      _OpenCabinet<ShardedU32Cabinet>(path, options, sync);
+    } else if (sync->meta.type == DbType::INT64) {
+      _OpenCabinet<ShardedU64Cabinet>(path, options, sync);
+    } else {  // DbType::STRING
+      _OpenCabinet<ShardedStringCabinet>(path, options, sync);
+    }
+  }
+
+  template <class Cabinet>
+  void _OpenCabinet(const string& path, const CabinetOptions& options, SyncCabinet* sync) {
+    Cabinet* cab = new Cabinet(path.c_str(), options);
+    sync->ptr.reset(cab);
+    sync->meta.__set_shards(cab->GetShardCount());
+  }
+
+  DbMeta _GetDbMeta(const string& dbname) {
+    FILE* fp = fopen((data_path_ + dbname + "/meta").c_str(), "rb");
     if (fp == NULL) {
       throw runtime_error("Db meta file missing!");
     }
     char buf[1024], type[1024];
     int compress = 0;
-    size_t count = fread(buf, 1, sizeof(buf), fp);
+    int direct = 0;
+    int ordered = 0;
+    int frozen = 0;
+    int checksums = 0;
+    int inline_bytes = 0;
+    size_t count = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
     buf[count] = '\0';
-    if (sscanf(buf, "%s%d", type, &compress) != 2) {
+    // directIo, orderedIndex, frozen, checksums and inlineValueBytes were
+    // added later, older files lack them.
+    int fields = sscanf(buf, "%1023s%d%d%d%d%d%d", type, &compress, &direct, &ordered, &frozen,
+      &checksums, &inline_bytes);
+    if (fields < 2) {
       throw runtime_error("Db meta file invalid!");
     }
     DbMeta ret;
@@ -470,13 +1376,79 @@ class CabinetStorageHandler : virtual public CabinetStorageServiceIf {
       ret.type = DbType::STRING;
     }
     ret.compressed = (compress != 0);
+    if (fields >= 3) {
+      ret.__set_directIo(direct != 0);
+    }
+    if (fields >= 4) {
+      ret.__set_orderedIndex(ordered != 0);
+    }
+    if (fields >= 5) {
+      ret.__set_frozen(frozen != 0);
+    }
+    if (fields >= 6) {
+      ret.__set_checksums(checksums != 0);
+    }
+    if (fields >= 7) {
+      ret.__set_inlineValueBytes(inline_bytes);
+    }
+    return ret;
+  }
+
+  void _PutDbMeta(const string& dbname, const DbMeta& meta) {
+    const char* type = "STR";
+    if (meta.type == DbType::INT32) {
+      type = "I32";
+    } else if (meta.type == DbType::INT64) {
+      type = "I64";
+    }
+    FILE* fp = fopen((data_path_ + dbname + "/meta").c_str(), "wb");
+    if (fp == NULL) {
+      throw runtime_error("Create db meta file failed!");
+    }
+    fprintf(fp, "%s %d %d %d %d %d %d\n", type, meta.compressed ? 1 : 0,
+      meta.__isset.directIo && meta.directIo ? 1 : 0,
+      meta.__isset.orderedIndex && meta.orderedIndex ? 1 : 0,
+      meta.__isset.frozen && meta.frozen ? 1 : 0,
+      meta.__isset.checksums && meta.checksums ? 1 : 0,
+      meta.__isset.inlineValueBytes && meta.inlineValueBytes > 0 ? meta.inlineValueBytes : 0);
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+      fclose(fp);
+      throw runtime_error("Write db meta file failed!");
+    }
     fclose(fp);
   }
 
+  // shared by all dbs, see FLAGS_value_cache_mb. it outlives them.
+  ValueCache value_cache_;
+  // shared by the directIo dbs, see FLAGS_read_buffer_mb. it outlives them.
+  AlignedBufferPool read_buffers_;
+  // writes the full buffers of all dbs, see FLAGS_write_buffers and
+  // FLAGS_flush_threads. it outlives them.
+  BackgroundFlusher flusher_;
   map<string, SyncCabinet> dbs_;
   ReadWriteMutex rwmutex_;
+  // startup only, see _OpenDbs().
+  Mutex open_mutex_;
+  vector<string> open_queue_;
+  string open_error_;
   string data_path_;
   int lockFile_;
+  // shared by all compactions, manual or automatic.
+  RateLimiter compact_limiter_;
+  // shared by all scrubs.
+  RateLimiter scrub_limiter_;
+  // wakes the compaction, cursor and scrub threads.
+  Monitor compact_monitor_;
+  bool stopping_;
+  shared_ptr<Thread> compact_thread_;
+  shared_ptr<Thread> cursor_thread_;
+  shared_ptr<Thread> scrub_thread_;
+  // shared by all BatchGets and cursors.
+  AsyncReader reader_;
+  // the open cursors by id, see OpenCursor().
+  Mutex cursor_mutex_;
+  map<int64_t, shared_ptr<Cursor> > cursors_;
+  int64_t next_cursor_id_;
 };
 
 TNonblockingServer* g_server = NULL;
@@ -535,9 +1507,9 @@ int main(int argc, char **argv) {
   shared_ptr<TProcessor> processor(new CabinetStorageServiceProcessor(handler));
   shared_ptr<TProtocolFactory> protocolFactory(new TCompactProtocolFactory());
 
-  // thread manager, thread number default set to 2*CPU
+  // Sync blocks its worker on fsync, so there are more workers than CPUs.
   shared_ptr<ThreadManager> threadManager =
-    ThreadManager::newSimpleThreadManager();
+    ThreadManager::newSimpleThreadManager(FLAGS_worker_threads);
   shared_ptr<ThreadFactory> threadFactory =
     shared_ptr<PosixThreadFactory>(new PosixThreadFactory());
   threadManager->threadFactory(threadFactory);
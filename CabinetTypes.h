@@ -13,12 +13,20 @@
 #include <exception>
 #include <stdexcept>
 #include "TCabinet.tcc"
+#include "BulkLoader.h"
+#include "CabinetIterator.h"
+#include "ShardedCabinet.h"
 
 // Currently there are three types of cabinet instance:
 // U32Cabinet: store with uint32_t keys.
 // U64Cabinet: store with uint64_t keys.
 // StringCabinet: store with string keys.
+// and a Sharded one of each.
 namespace cabinet {
+  // KeyReader decodes a key either from a FILE, or from memory where it
+  // returns the bytes consumed, 0 if the buffer ends inside the key.
+  // KeyWriter encodes a key the same way, to a FILE, which it closes if
+  // the write fails, or to the end of a string.
   struct U32KeyReader : public std::binary_function<bool, FILE*, uint32_t&> {
     uint32_t operator()(FILE* file, uint32_t& ret) const {
       if (fread(&ret, sizeof(ret), 1, file) != 1) {
@@ -27,6 +35,14 @@ namespace cabinet {
       ret = le32toh(ret);
       return true;
     }
+    size_t operator()(const char* data, size_t size, uint32_t& ret) const {
+      if (size < sizeof(ret)) {
+        return 0;
+      }
+      memcpy(&ret, data, sizeof(ret));
+      ret = le32toh(ret);
+      return sizeof(ret);
+    }
   };
 
   struct U32KeyWriter : public std::binary_function<void, FILE*, const uint32_t&> {
@@ -38,6 +54,10 @@ namespace cabinet {
         throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
       }
     }
+    void operator()(std::string* out, uint32_t key) const {
+      key = htole32(key);
+      out->append(reinterpret_cast<const char*>(&key), sizeof(key));
+    }
   };
  
   typedef TCabinet<uint32_t, U32KeyReader, U32KeyWriter> U32Cabinet;
@@ -50,6 +70,14 @@ namespace cabinet {
       ret = le64toh(ret);
       return true;
     }
+    size_t operator()(const char* data, size_t size, uint64_t& ret) const {
+      if (size < sizeof(ret)) {
+        return 0;
+      }
+      memcpy(&ret, data, sizeof(ret));
+      ret = le64toh(ret);
+      return sizeof(ret);
+    }
   };
 
   struct U64KeyWriter : public std::binary_function<void, FILE*, uint64_t> {
@@ -61,6 +89,10 @@ namespace cabinet {
         throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
       }
     }
+    void operator()(std::string* out, uint64_t key) const {
+      key = htole64(key);
+      out->append(reinterpret_cast<const char*>(&key), sizeof(key));
+    }
   };
  
   typedef TCabinet<uint64_t, U64KeyReader, U64KeyWriter> U64Cabinet;
@@ -81,29 +113,64 @@ namespace cabinet {
       }
       return true;
     }
+    size_t operator()(const char* data, size_t size, std::string& ret) const {
+      uint32_t len;
+      if (size < sizeof(len)) {
+        return 0;
+      }
+      memcpy(&len, data, sizeof(len));
+      len = le32toh(len);
+      if (size - sizeof(len) < len) {
+        return 0;
+      }
+      ret.assign(data + sizeof(len), len);
+      return sizeof(len) + len;
+    }
   };
 
-  struct StringKeyWriter : public std::binary_function<void, FILE*,const std::string&> {
-    void operator()(FILE* file, const std::string& str) const {
+  // takes a StringPiece so that keys can be written straight from the
+  // index arena, std::string converts implicitly.
+  struct StringKeyWriter : public std::binary_function<void, FILE*, const StringPiece&> {
+    void operator()(FILE* file, const StringPiece& str) const {
       if (str.size() > (uint64_t)0xffffffff) {
         throw std::runtime_error("String too large!");
       }
       uint32_t size = htole32((uint32_t)str.size());
-      if (fwrite(&size, sizeof(size), 1, file) != 1 || fwrite(str.c_str(), size, 1, file) != 1) {
+      if (fwrite(&size, sizeof(size), 1, file) != 1 ||
+          (str.size() > 0 && fwrite(str.data(), str.size(), 1, file) != 1)) {
         int err = errno;
         fclose(file);
         throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
       }
     }
+    void operator()(std::string* out, const StringPiece& str) const {
+      if (str.size() > (uint64_t)0xffffffff) {
+        throw std::runtime_error("String too large!");
+      }
+      uint32_t size = htole32((uint32_t)str.size());
+      out->append(reinterpret_cast<const char*>(&size), sizeof(size));
+      out->append(str.data(), str.size());
+    }
   };
 
+  // hashes every byte of the key, 8 at a time.
   struct StringHashFunc : public std::unary_function<size_t, const std::string &> {
     size_t operator()(const std::string& str) const {
-      return __gnu_cxx::hash<const char*>()(str.c_str());
+      return Hash64(str.data(), str.size());
     }
   };
 
   typedef TCabinet<std::string, StringKeyReader, StringKeyWriter, StringHashFunc> StringCabinet;
+
+  // the same, spread over shards that lock themselves, see TShardedCabinet.
+  typedef TShardedCabinet<U32Cabinet, uint32_t, __gnu_cxx::hash<uint32_t> > ShardedU32Cabinet;
+  typedef TShardedCabinet<U64Cabinet, uint64_t, __gnu_cxx::hash<uint64_t> > ShardedU64Cabinet;
+  typedef TShardedCabinet<StringCabinet, std::string, StringHashFunc> ShardedStringCabinet;
+
+  // build a new db of each, see TBulkLoader.
+  typedef TBulkLoader<uint32_t, U32KeyWriter> U32BulkLoader;
+  typedef TBulkLoader<uint64_t, U64KeyWriter> U64BulkLoader;
+  typedef TBulkLoader<std::string, StringKeyWriter> StringBulkLoader;
 }  // namespace cabinet
 
 #endif  // CABINET_TYPES_H_
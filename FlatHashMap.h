@@ -0,0 +1,463 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Open-addressing Hash Map For Cabinet Indexes.
+ *
+ * Slots live in one flat array next to an array of control bytes. Each
+ * control byte holds 7 bits of the key hash (or an empty/deleted marker),
+ * and lookups compare 16 control bytes at a time with SSE2, so a probe
+ * usually touches one control cache line and one slot.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_FLAT_HASH_MAP_H_
+#define CABINET_FLAT_HASH_MAP_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace cabinet {
+namespace flat_internal {
+
+static const int8_t kEmpty = -128;   // 0b10000000
+static const int8_t kDeleted = -2;   // 0b11111110
+static const size_t kGroupWidth = 16;
+
+// finalizer of murmur3, spreads identity hashes (like hash<uint32_t>)
+// over all bits so that both the group index and the 7-bit tag are useful.
+inline uint64_t MixHash(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+inline uint32_t TrailingZeros(uint32_t mask) {
+  return __builtin_ctz(mask);
+}
+
+// 16 control bytes, matched in parallel.
+class Group {
+ public:
+  explicit Group(const int8_t* ctrl) {
+#ifdef __SSE2__
+    ctrl_ = _mm_load_si128(reinterpret_cast<const __m128i*>(ctrl));
+#else
+    ctrl_ = ctrl;
+#endif
+  }
+
+  // bit i set if ctrl[i] == tag.
+  uint32_t Match(int8_t tag) const {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(tag), ctrl_));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      mask |= (uint32_t)(ctrl_[i] == tag) << i;
+    }
+    return mask;
+#endif
+  }
+
+  uint32_t MatchEmpty() const {
+    return Match(kEmpty);
+  }
+
+  // empty and deleted are the only negative control bytes.
+  uint32_t MatchEmptyOrDeleted() const {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(ctrl_);
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      mask |= (uint32_t)(ctrl_[i] < 0) << i;
+    }
+    return mask;
+#endif
+  }
+
+ private:
+#ifdef __SSE2__
+  __m128i ctrl_;
+#else
+  const int8_t* ctrl_;
+#endif
+};
+
+// storage of control bytes, aligned for _mm_load_si128.
+inline int8_t* AllocCtrl(size_t capacity) {
+  void* ptr = NULL;
+  if (posix_memalign(&ptr, kGroupWidth, capacity) != 0) {
+    throw std::bad_alloc();
+  }
+  memset(ptr, kEmpty, capacity);
+  return static_cast<int8_t*>(ptr);
+}
+
+struct EmptyValue {};
+}  // namespace flat_internal
+
+// key and value side by side without padding, 20 bytes for a
+// uint64_t key and a BlockInfo instead of 24.
+template <class Key, class Value>
+struct FlatSlot {
+  Key first;
+  Value second;
+} __attribute__((packed));
+
+// class FlatHashMap
+// A subset of the hash_map interface (find/erase/operator[]/iteration)
+// over a single open-addressing table. Key and Value must be plain old
+// data, they are moved around with memcpy. Iterators and references are
+// invalidated by any insertion, erase(itr) keeps the slot readable until
+// the next insertion.
+template <class Key, class Value, class Hash,
+          class Equal = std::equal_to<Key> >
+class FlatHashMap {
+ public:
+  typedef Key key_type;
+  typedef Value mapped_type;
+  typedef FlatSlot<Key, Value> value_type;
+
+  class iterator {
+   public:
+    iterator() : ctrl_(NULL), slots_(NULL), index_(0), capacity_(0) {}
+    value_type& operator*() const { return slots_[index_]; }
+    value_type* operator->() const { return &slots_[index_]; }
+    iterator& operator++() {
+      ++index_;
+      SkipEmpty();
+      return *this;
+    }
+    bool operator==(const iterator& other) const { return index_ == other.index_; }
+    bool operator!=(const iterator& other) const { return index_ != other.index_; }
+
+   private:
+    friend class FlatHashMap;
+    iterator(const int8_t* ctrl, value_type* slots, size_t index, size_t capacity)
+        : ctrl_(ctrl), slots_(slots), index_(index), capacity_(capacity) {}
+    void SkipEmpty() {
+      while (index_ < capacity_ && ctrl_[index_] < 0) {
+        ++index_;
+      }
+    }
+    const int8_t* ctrl_;
+    value_type* slots_;
+    size_t index_;
+    size_t capacity_;
+  };
+
+  FlatHashMap() : ctrl_(NULL), slots_(NULL), capacity_(0), size_(0), growth_left_(0) {}
+
+  FlatHashMap(const FlatHashMap& other)
+      : ctrl_(NULL), slots_(NULL), capacity_(0), size_(0), growth_left_(0) {
+    CopyFrom(other);
+  }
+
+  FlatHashMap& operator=(const FlatHashMap& other) {
+    if (this != &other) {
+      FlatHashMap tmp(other);
+      swap(tmp);
+    }
+    return *this;
+  }
+
+  ~FlatHashMap() {
+    Destroy();
+  }
+
+  iterator begin() {
+    iterator itr(ctrl_, slots_, 0, capacity_);
+    itr.SkipEmpty();
+    return itr;
+  }
+  iterator end() {
+    return iterator(ctrl_, slots_, capacity_, capacity_);
+  }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  iterator find(const Key& key) {
+    return iterator(ctrl_, slots_, FindIndex(key), capacity_);
+  }
+
+  size_t count(const Key& key) const {
+    return FindIndex(key) != capacity_ ? 1 : 0;
+  }
+
+  Value& operator[](const Key& key) {
+    size_t index = FindIndex(key);
+    if (index == capacity_) {
+      index = InsertNew(key, Value());
+    }
+    return slots_[index].second;
+  }
+
+  std::pair<iterator, bool> insert(const value_type& value) {
+    size_t index = FindIndex(value.first);
+    bool inserted = false;
+    if (index == capacity_) {
+      index = InsertNew(value.first, value.second);
+      inserted = true;
+    }
+    return std::make_pair(iterator(ctrl_, slots_, index, capacity_), inserted);
+  }
+
+  void erase(iterator itr) {
+    EraseIndex(itr.index_);
+  }
+
+  size_t erase(const Key& key) {
+    size_t index = FindIndex(key);
+    if (index == capacity_) {
+      return 0;
+    }
+    EraseIndex(index);
+    return 1;
+  }
+
+  void clear() {
+    Destroy();
+  }
+
+  // whether n more elements go in without rehashing.
+  bool fits(size_t n) const { return n <= growth_left_; }
+
+  // make room for n elements without rehashing.
+  void reserve(size_t n) {
+    size_t capacity = kMinCapacity;
+    while (MaxLoad(capacity) < n) {
+      capacity <<= 1;
+    }
+    if (capacity > capacity_) {
+      Rehash(capacity);
+    }
+  }
+
+  void swap(FlatHashMap& other) {
+    std::swap(ctrl_, other.ctrl_);
+    std::swap(slots_, other.slots_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(size_, other.size_);
+    std::swap(growth_left_, other.growth_left_);
+    std::swap(hash_, other.hash_);
+    std::swap(equal_, other.equal_);
+  }
+
+  // heap bytes held by the table.
+  size_t MemoryUsage() const {
+    return capacity_ * (sizeof(int8_t) + sizeof(value_type));
+  }
+
+ private:
+  static const size_t kMinCapacity = flat_internal::kGroupWidth;
+
+  // keep at least 1/8 of the slots empty so that misses stop early.
+  static size_t MaxLoad(size_t capacity) {
+    return capacity - capacity / 8;
+  }
+
+  size_t FindIndex(const Key& key) const {
+    if (capacity_ == 0) {
+      return capacity_;
+    }
+    uint64_t hash = flat_internal::MixHash(hash_(key));
+    int8_t tag = (int8_t)(hash & 0x7f);
+    size_t group_mask = capacity_ / flat_internal::kGroupWidth - 1;
+    size_t group = (hash >> 7) & group_mask;
+    for (size_t step = 1; ; ++step) {
+      size_t base = group * flat_internal::kGroupWidth;
+      flat_internal::Group g(ctrl_ + base);
+      for (uint32_t mask = g.Match(tag); mask != 0; mask &= mask - 1) {
+        size_t index = base + flat_internal::TrailingZeros(mask);
+        if (equal_(slots_[index].first, key)) {
+          return index;
+        }
+      }
+      if (g.MatchEmpty() != 0) {
+        return capacity_;
+      }
+      // triangular probing visits every group of a power-of-two table.
+      group = (group + step) & group_mask;
+    }
+  }
+
+  // the key must not be present.
+  size_t InsertNew(const Key& key, const Value& value) {
+    if (growth_left_ == 0) {
+      // drop tombstones in place unless the table is really filling up.
+      size_t capacity = capacity_ == 0 ? kMinCapacity : capacity_;
+      if (size_ + 1 > MaxLoad(capacity) / 2) {
+        capacity <<= 1;
+      }
+      Rehash(capacity);
+    }
+    uint64_t hash = flat_internal::MixHash(hash_(key));
+    size_t index = FindSlotForInsert(hash);
+    if (ctrl_[index] == flat_internal::kEmpty) {
+      --growth_left_;
+    }
+    ctrl_[index] = (int8_t)(hash & 0x7f);
+    slots_[index].first = key;
+    slots_[index].second = value;
+    ++size_;
+    return index;
+  }
+
+  size_t FindSlotForInsert(uint64_t hash) const {
+    size_t group_mask = capacity_ / flat_internal::kGroupWidth - 1;
+    size_t group = (hash >> 7) & group_mask;
+    for (size_t step = 1; ; ++step) {
+      size_t base = group * flat_internal::kGroupWidth;
+      uint32_t mask = flat_internal::Group(ctrl_ + base).MatchEmptyOrDeleted();
+      if (mask != 0) {
+        return base + flat_internal::TrailingZeros(mask);
+      }
+      group = (group + step) & group_mask;
+    }
+  }
+
+  void EraseIndex(size_t index) {
+    --size_;
+    // a group that still has an empty slot never made a probe continue,
+    // so the slot can become empty again instead of a tombstone.
+    size_t base = index & ~(flat_internal::kGroupWidth - 1);
+    if (flat_internal::Group(ctrl_ + base).MatchEmpty() != 0) {
+      ctrl_[index] = flat_internal::kEmpty;
+      ++growth_left_;
+    } else {
+      ctrl_[index] = flat_internal::kDeleted;
+    }
+  }
+
+  void Rehash(size_t capacity) {
+    int8_t* old_ctrl = ctrl_;
+    value_type* old_slots = slots_;
+    size_t old_capacity = capacity_;
+
+    ctrl_ = flat_internal::AllocCtrl(capacity);
+    slots_ = static_cast<value_type*>(malloc(capacity * sizeof(value_type)));
+    if (!slots_) {
+      free(ctrl_);
+      ctrl_ = old_ctrl;
+      slots_ = old_slots;
+      throw std::bad_alloc();
+    }
+    capacity_ = capacity;
+    growth_left_ = MaxLoad(capacity) - size_;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_ctrl[i] >= 0) {
+        uint64_t hash = flat_internal::MixHash(hash_(old_slots[i].first));
+        size_t index = FindSlotForInsert(hash);
+        ctrl_[index] = (int8_t)(hash & 0x7f);
+        slots_[index] = old_slots[i];
+      }
+    }
+    free(old_ctrl);
+    free(old_slots);
+  }
+
+  void CopyFrom(const FlatHashMap& other) {
+    if (other.capacity_ == 0) {
+      return;
+    }
+    ctrl_ = flat_internal::AllocCtrl(other.capacity_);
+    slots_ = static_cast<value_type*>(malloc(other.capacity_ * sizeof(value_type)));
+    if (!slots_) {
+      free(ctrl_);
+      ctrl_ = NULL;
+      throw std::bad_alloc();
+    }
+    memcpy(ctrl_, other.ctrl_, other.capacity_);
+    memcpy(slots_, other.slots_, other.capacity_ * sizeof(value_type));
+    capacity_ = other.capacity_;
+    size_ = other.size_;
+    growth_left_ = other.growth_left_;
+  }
+
+  void Destroy() {
+    free(ctrl_);
+    free(slots_);
+    ctrl_ = NULL;
+    slots_ = NULL;
+    capacity_ = size_ = growth_left_ = 0;
+  }
+
+  int8_t* ctrl_;
+  value_type* slots_;
+  size_t capacity_;
+  size_t size_;
+  size_t growth_left_;  // empty slots usable before a rehash.
+  Hash hash_;
+  Equal equal_;
+};
+
+// class FlatHashSet
+// hash_set interface on top of FlatHashMap.
+template <class Key, class Hash,
+          class Equal = std::equal_to<Key> >
+class FlatHashSet {
+  typedef FlatHashMap<Key, flat_internal::EmptyValue, Hash, Equal> MapType;
+
+ public:
+  typedef Key key_type;
+  typedef Key value_type;
+
+  class iterator {
+   public:
+    iterator() {}
+    Key operator*() const { return itr_->first; }
+    iterator& operator++() {
+      ++itr_;
+      return *this;
+    }
+    bool operator==(const iterator& other) const { return itr_ == other.itr_; }
+    bool operator!=(const iterator& other) const { return itr_ != other.itr_; }
+
+   private:
+    friend class FlatHashSet;
+    explicit iterator(typename MapType::iterator itr) : itr_(itr) {}
+    typename MapType::iterator itr_;
+  };
+
+  iterator begin() { return iterator(map_.begin()); }
+  iterator end() { return iterator(map_.end()); }
+  size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  iterator find(const Key& key) { return iterator(map_.find(key)); }
+  size_t count(const Key& key) const { return map_.count(key); }
+
+  std::pair<iterator, bool> insert(const Key& key) {
+    typename MapType::value_type slot;
+    slot.first = key;
+    std::pair<typename MapType::iterator, bool> ret = map_.insert(slot);
+    return std::make_pair(iterator(ret.first), ret.second);
+  }
+
+  void erase(iterator itr) { map_.erase(itr.itr_); }
+  size_t erase(const Key& key) { return map_.erase(key); }
+  void clear() { map_.clear(); }
+  void reserve(size_t n) { map_.reserve(n); }
+  void swap(FlatHashSet& other) { map_.swap(other.map_); }
+  size_t MemoryUsage() const { return map_.MemoryUsage(); }
+
+ private:
+  MapType map_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_FLAT_HASH_MAP_H_
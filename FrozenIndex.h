@@ -0,0 +1,375 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Read Only Index Mapped From A File.
+ *
+ * The keys are placed by a minimal perfect hash, built by hash and
+ * displace: keys are hashed into buckets of about kBucketKeys, and each
+ * bucket, largest first, gets the first displacement that sends all its
+ * keys to slots still free. A lookup hashes the key, reads the
+ * displacement of its bucket and compares the one slot that leads to, so
+ * it costs about two cache misses and no probing. Opening only maps the
+ * file, the pages come from the page cache and are shared by every
+ * process that maps it.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_FROZEN_INDEX_H_
+#define CABINET_FROZEN_INDEX_H_
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CabinetExceptions.h"
+#include "CabinetHash.h"
+#include "StringPiece.h"
+
+namespace cabinet {
+namespace frozen {
+// the file: a FileHeader, bucket_count displacements padded to 8 bytes,
+// entry_count slots, then the keys longer than 8 bytes. all in host byte
+// order, like the index file.
+struct FileHeader {
+  char magic[8];
+  uint64_t entry_count;
+  uint64_t bucket_count;
+  uint64_t seed;
+  uint64_t slot_size;  // a file written for another Value is rejected.
+  uint64_t keys_size;
+  uint64_t user_data;
+};
+
+const char kMagic[8] = {'C', 'A', 'B', 'F', 'R', 'Z', 'N', '1'};
+const uint64_t kBucketKeys = 4;
+const int kMaxSeeds = 16;
+const uint64_t kMaxDisplacement = 0xffffffffULL;
+
+// a slot keeps a key of up to 8 bytes in key, a longer one at offset key
+// of the key area.
+template <class Value>
+struct Slot {
+  Value value;
+  uint32_t key_size;
+  uint64_t key;
+} __attribute__((packed));
+
+inline uint64_t SlotOf(uint64_t hash, uint64_t displacement, uint64_t count) {
+  return Mix64(hash + displacement * 0x9e3779b97f4a7c15ULL) % count;
+}
+
+inline uint64_t DisplacementsSize(uint64_t bucket_count) {
+  return (bucket_count * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+}
+}  // namespace frozen
+
+// class FrozenIndex
+// maps a file written by FrozenIndexBuilder, Value must be a plain struct.
+template <class Value>
+class FrozenIndex {
+  typedef frozen::Slot<Value> Slot;
+
+ public:
+  FrozenIndex() : map_(NULL), length_(0), header_(NULL), displacements_(NULL),
+      slots_(NULL), keys_(NULL) {}
+  ~FrozenIndex() { Close(); }
+
+  void Open(const std::string& path) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    struct stat f_stat;
+    if (fstat(fd, &f_stat) != 0) {
+      int err = errno;
+      close(fd);
+      throw StatFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+    length_ = f_stat.st_size;
+    if (length_ < sizeof(frozen::FileHeader)) {
+      close(fd);
+      throw FileCorruptException(__FILE__, __LINE__, 0, "bad frozen index");
+    }
+    void* addr = mmap(NULL, length_, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (addr == MAP_FAILED) {
+      throw OpenFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+    map_ = static_cast<const char*>(addr);
+    header_ = reinterpret_cast<const frozen::FileHeader*>(map_);
+    uint64_t displacements = frozen::DisplacementsSize(header_->bucket_count);
+    if (memcmp(header_->magic, frozen::kMagic, sizeof(frozen::kMagic)) != 0 ||
+        header_->slot_size != sizeof(Slot) ||
+        (header_->entry_count > 0) != (header_->bucket_count > 0) ||
+        length_ != sizeof(frozen::FileHeader) + displacements +
+          header_->entry_count * sizeof(Slot) + header_->keys_size) {
+      Close();
+      throw FileCorruptException(__FILE__, __LINE__, 0, "bad frozen index");
+    }
+    displacements_ = reinterpret_cast<const uint32_t*>(map_ + sizeof(frozen::FileHeader));
+    slots_ = reinterpret_cast<const Slot*>(map_ + sizeof(frozen::FileHeader) + displacements);
+    keys_ = reinterpret_cast<const char*>(slots_ + header_->entry_count);
+    madvise(const_cast<char*>(map_), length_, MADV_RANDOM);
+  }
+
+  void Close() {
+    if (map_) {
+      munmap(const_cast<char*>(map_), length_);
+    }
+    map_ = NULL;
+    length_ = 0;
+    header_ = NULL;
+    displacements_ = NULL;
+    slots_ = NULL;
+    keys_ = NULL;
+  }
+
+  // NULL if key is not there.
+  const Value* Find(const StringPiece& key) const {
+    uint64_t count = header_->entry_count;
+    if (count == 0) {
+      return NULL;
+    }
+    uint64_t hash = Hash64(key.data(), key.size(), header_->seed);
+    const Slot& slot =
+      slots_[frozen::SlotOf(hash, displacements_[hash % header_->bucket_count], count)];
+    return slot.key_size == key.size() && KeyAt(slot) == key ? &slot.value : NULL;
+  }
+
+  // entries are read by slot, in no particular order.
+  uint64_t size() const { return header_ ? header_->entry_count : 0; }
+  StringPiece KeyAt(uint64_t slot) const { return KeyAt(slots_[slot]); }
+  const Value& ValueAt(uint64_t slot) const { return slots_[slot].value; }
+
+  // the number passed to FrozenIndexBuilder::Write().
+  uint64_t GetUserData() const { return header_->user_data; }
+
+  // bytes of the mapped file, in the page cache rather than on the heap.
+  uint64_t MappedBytes() const { return length_; }
+
+ private:
+  StringPiece KeyAt(const Slot& slot) const {
+    if (slot.key_size <= sizeof(slot.key)) {
+      return StringPiece(reinterpret_cast<const char*>(&slot.key), slot.key_size);
+    }
+    return StringPiece(keys_ + slot.key, slot.key_size);
+  }
+
+  FrozenIndex(const FrozenIndex&);
+  void operator=(const FrozenIndex&);
+
+  const char* map_;
+  uint64_t length_;
+  const frozen::FileHeader* header_;
+  const uint32_t* displacements_;
+  const Slot* slots_;
+  const char* keys_;
+};
+
+// class FrozenIndexBuilder
+// collects the entries of a FrozenIndex and writes its file.
+template <class Value>
+class FrozenIndexBuilder {
+  typedef frozen::Slot<Value> Slot;
+
+ public:
+  FrozenIndexBuilder() {}
+
+  // keys must be distinct.
+  void Add(const StringPiece& key, const Value& value) {
+    offsets_.push_back(keys_.size());
+    keys_.append(key.data(), key.size());
+    values_.push_back(value);
+  }
+
+  size_t size() const { return values_.size(); }
+
+  // writes the index to path through a temporary file that is synced and
+  // renamed, so path is either the old file or the whole new one. throws
+  // std::invalid_argument if a key was added twice.
+  void Write(const std::string& path, uint64_t user_data) const {
+    if (values_.size() >= 0xffffffffULL) {
+      throw std::invalid_argument("too many keys to freeze");
+    }
+    uint64_t count = values_.size();
+    uint64_t bucket_count = count ? (count + frozen::kBucketKeys - 1) / frozen::kBucketKeys : 0;
+    std::vector<uint32_t> displacements(bucket_count, 0);
+    std::vector<uint32_t> entries;
+    uint64_t seed = 0;
+    for (int i = 0; count > 0; ++i) {
+      if (i == frozen::kMaxSeeds) {
+        throw std::runtime_error("no perfect hash found");
+      }
+      seed = Mix64(i + 1);
+      if (Place(seed, &displacements, &entries)) {
+        break;
+      }
+    }
+
+    frozen::FileHeader header;
+    memcpy(header.magic, frozen::kMagic, sizeof(header.magic));
+    header.entry_count = count;
+    header.bucket_count = bucket_count;
+    header.seed = seed;
+    header.slot_size = sizeof(Slot);
+    header.keys_size = 0;
+    header.user_data = user_data;
+    std::vector<Slot> slots(count);
+    for (uint64_t i = 0; i < count; ++i) {
+      StringPiece key = Key(entries[i]);
+      Slot& slot = slots[i];
+      slot.value = values_[entries[i]];
+      slot.key_size = key.size();
+      slot.key = 0;
+      if (key.size() <= sizeof(slot.key)) {
+        memcpy(&slot.key, key.data(), key.size());
+      } else {
+        slot.key = header.keys_size;
+        header.keys_size += key.size();
+      }
+    }
+
+    std::string tmpPath = path + ".tmp";
+    FILE* file = fopen(tmpPath.c_str(), "w");
+    if (!file) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    displacements.resize(frozen::DisplacementsSize(bucket_count) / sizeof(uint32_t), 0);
+    fwrite(&header, sizeof(header), 1, file);
+    if (count > 0) {
+      fwrite(&displacements[0], sizeof(uint32_t), displacements.size(), file);
+      fwrite(&slots[0], sizeof(Slot), slots.size(), file);
+    }
+    for (uint64_t i = 0; i < count; ++i) {
+      if (slots[i].key_size > sizeof(slots[i].key)) {
+        StringPiece key = Key(entries[i]);
+        fwrite(key.data(), 1, key.size(), file);
+      }
+    }
+    // a failed fwrite above sets the error indicator.
+    if (ferror(file) || fflush(file) != 0 || fsync(fileno(file)) != 0) {
+      int err = errno ? errno : EIO;
+      fclose(file);
+      unlink(tmpPath.c_str());
+      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+    if (fclose(file) != 0) {
+      int err = errno;
+      unlink(tmpPath.c_str());
+      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+  }
+
+ private:
+  StringPiece Key(uint32_t i) const {
+    size_t end = i + 1 < offsets_.size() ? offsets_[i + 1] : keys_.size();
+    return StringPiece(keys_.data() + offsets_[i], end - offsets_[i]);
+  }
+
+  // orders buckets largest first.
+  struct BucketGreater {
+    explicit BucketGreater(const std::vector<uint32_t>& starts) : starts_(&starts) {}
+    bool operator()(uint32_t a, uint32_t b) const {
+      return (*starts_)[a + 1] - (*starts_)[a] > (*starts_)[b + 1] - (*starts_)[b];
+    }
+    const std::vector<uint32_t>* starts_;
+  };
+
+  // finds the displacements for seed and the entry of each slot. false if
+  // two keys hash the same, so that another seed is needed.
+  bool Place(uint64_t seed, std::vector<uint32_t>* displacements,
+      std::vector<uint32_t>* entries) const {
+    uint64_t count = values_.size();
+    uint64_t bucket_count = displacements->size();
+    std::vector<uint64_t> hashes(count);
+    std::vector<uint32_t> starts(bucket_count + 1, 0);
+    for (uint64_t i = 0; i < count; ++i) {
+      StringPiece key = Key(i);
+      hashes[i] = Hash64(key.data(), key.size(), seed);
+      ++starts[hashes[i] % bucket_count + 1];
+    }
+    for (uint64_t b = 0; b < bucket_count; ++b) {
+      starts[b + 1] += starts[b];
+    }
+    std::vector<uint32_t> members(count);
+    std::vector<uint32_t> next(starts.begin(), starts.end() - 1);
+    for (uint64_t i = 0; i < count; ++i) {
+      members[next[hashes[i] % bucket_count]++] = i;
+    }
+    std::vector<uint32_t> buckets(bucket_count);
+    for (uint64_t b = 0; b < bucket_count; ++b) {
+      buckets[b] = b;
+    }
+    std::sort(buckets.begin(), buckets.end(), BucketGreater(starts));
+
+    std::vector<bool> taken(count, false);
+    entries->assign(count, 0);
+    std::vector<uint64_t> slots;
+    for (uint64_t i = 0; i < bucket_count; ++i) {
+      uint32_t b = buckets[i];
+      const uint32_t* first = &members[0] + starts[b];
+      uint32_t size = starts[b + 1] - starts[b];
+      if (size == 0) {
+        break;
+      }
+      for (uint32_t j = 1; j < size; ++j) {
+        for (uint32_t k = 0; k < j; ++k) {
+          if (hashes[first[j]] == hashes[first[k]]) {
+            if (Key(first[j]) == Key(first[k])) {
+              throw std::invalid_argument("duplicate key");
+            }
+            return false;
+          }
+        }
+      }
+      uint64_t d = 0;
+      for (; d < frozen::kMaxDisplacement; ++d) {
+        slots.clear();
+        for (uint32_t j = 0; j < size; ++j) {
+          uint64_t slot = frozen::SlotOf(hashes[first[j]], d, count);
+          if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+            break;
+          }
+          slots.push_back(slot);
+        }
+        if (slots.size() == size) {
+          break;
+        }
+      }
+      if (d == frozen::kMaxDisplacement) {
+        return false;
+      }
+      (*displacements)[b] = d;
+      for (uint32_t j = 0; j < size; ++j) {
+        taken[slots[j]] = true;
+        (*entries)[slots[j]] = first[j];
+      }
+    }
+    return true;
+  }
+
+  FrozenIndexBuilder(const FrozenIndexBuilder&);
+  void operator=(const FrozenIndexBuilder&);
+
+  std::string keys_;
+  std::vector<uint64_t> offsets_;
+  std::vector<Value> values_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_FROZEN_INDEX_H_
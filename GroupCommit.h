@@ -0,0 +1,96 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Group Commit Of Concurrent Syncs
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_GROUP_COMMIT_H_
+#define CABINET_GROUP_COMMIT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+
+namespace cabinet {
+// class GroupCommit
+// makes concurrent Commit() calls share one sync. the first caller leads:
+// it waits up to max_delay_us for others to join, then syncs for all that
+// arrived by then, while those arriving later wait for the next leader.
+// every caller returns once a sync that started after its call is done,
+// so whatever it wrote before calling is durable. one per db.
+class GroupCommit {
+ public:
+  class Syncer {
+   public:
+    virtual ~Syncer() {}
+    // makes everything written before it was called durable.
+    virtual void Sync() = 0;
+  };
+
+  explicit GroupCommit(uint32_t max_delay_us)
+    : max_delay_us_(max_delay_us), requested_(0), durable_(0), syncing_(false), syncs_(0) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+  }
+  ~GroupCommit() {
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+
+  void SetMaxDelay(uint32_t max_delay_us) { max_delay_us_ = max_delay_us; }
+  // syncs run so far, to tell how many commits shared one.
+  uint64_t GetSyncCount() const { return syncs_; }
+
+  // a syncer that throws fails its own call only, the callers it led
+  // retry with a sync of their own.
+  void Commit(Syncer* syncer) {
+    pthread_mutex_lock(&mutex_);
+    uint64_t ticket = ++requested_;
+    while (durable_ < ticket) {
+      if (syncing_) {
+        pthread_cond_wait(&cond_, &mutex_);
+        continue;
+      }
+      syncing_ = true;
+      pthread_mutex_unlock(&mutex_);
+      if (max_delay_us_ > 0) {
+        usleep(max_delay_us_);
+      }
+      pthread_mutex_lock(&mutex_);
+      uint64_t target = requested_;
+      pthread_mutex_unlock(&mutex_);
+      try {
+        syncer->Sync();
+      } catch (...) {
+        pthread_mutex_lock(&mutex_);
+        syncing_ = false;
+        pthread_cond_broadcast(&cond_);
+        pthread_mutex_unlock(&mutex_);
+        throw;
+      }
+      pthread_mutex_lock(&mutex_);
+      durable_ = target;
+      syncing_ = false;
+      ++syncs_;
+      pthread_cond_broadcast(&cond_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+
+ private:
+  GroupCommit(const GroupCommit&);
+  void operator=(const GroupCommit&);
+
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+  uint32_t max_delay_us_;
+  uint64_t requested_;  // tickets handed out.
+  uint64_t durable_;    // tickets covered by a finished sync.
+  bool syncing_;
+  uint64_t syncs_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_GROUP_COMMIT_H_
@@ -0,0 +1,138 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * In-memory Copies Of The Small Values Of A Cabinet.
+ *
+ * A value up to a cabinet's inline_value_bytes is kept in memory next to
+ * its index entry, so that reading it never touches a data file. The
+ * value bytes live in a StringKeyArena and a hash map from the key holds
+ * their arena ref, so a value costs its arena entry (a varint length and
+ * the bytes, padded to 4) plus a map slot of the key and a 4 byte ref,
+ * and for a string key a second copy of the key.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_INLINE_VALUE_MAP_H_
+#define CABINET_INLINE_VALUE_MAP_H_
+
+#include <stdint.h>
+#include <functional>
+#include <hash_map>
+#include <string>
+
+#include "FlatHashMap.h"
+#include "StringIndexMap.h"
+#include "StringPiece.h"
+
+namespace cabinet {
+// packed like BlockInfo, so that a packed slot can hand out a reference.
+struct InlineRef {
+  uint32_t ref;
+} __attribute__((packed));
+
+// the map from a key to the arena ref of its value.
+template <class KeyType, class KeyHashFunc>
+struct InlineRefTraits {
+  typedef __gnu_cxx::hash_map<KeyType, InlineRef, KeyHashFunc> MapType;
+  static size_t MemoryUsage(const MapType& map) {
+    return map.bucket_count() * sizeof(void*) +
+      map.size() * (sizeof(typename MapType::value_type) + sizeof(void*));
+  }
+};
+
+template <class KeyHashFunc>
+struct InlineRefTraits<uint32_t, KeyHashFunc> {
+  typedef FlatHashMap<uint32_t, InlineRef, KeyHashFunc> MapType;
+  static size_t MemoryUsage(const MapType& map) { return map.MemoryUsage(); }
+};
+
+template <class KeyHashFunc>
+struct InlineRefTraits<uint64_t, KeyHashFunc> {
+  typedef FlatHashMap<uint64_t, InlineRef, KeyHashFunc> MapType;
+  static size_t MemoryUsage(const MapType& map) { return map.MemoryUsage(); }
+};
+
+template <class KeyHashFunc>
+struct InlineRefTraits<std::string, KeyHashFunc> {
+  typedef StringIndexMap<InlineRef> MapType;
+  static size_t MemoryUsage(const MapType& map) { return map.MemoryUsage(); }
+};
+
+// class InlineValueMap
+// values by key. the cabinet changes it under its writer's lock, along
+// with the index, and reads it like the index.
+template <class KeyType, class KeyHashFunc>
+class InlineValueMap {
+  typedef InlineRefTraits<KeyType, KeyHashFunc> Traits;
+  typedef typename Traits::MapType MapType;
+
+ public:
+  InlineValueMap() {}
+
+  // returns false if key has no value here.
+  bool Get(const KeyType& key, std::string* value) {
+    typename MapType::iterator itr = refs_.find(key);
+    if (itr == refs_.end()) {
+      return false;
+    }
+    StringPiece bytes = arena_.Get(itr->second.ref);
+    value->assign(bytes.data(), bytes.size());
+    return true;
+  }
+
+  void Put(const KeyType& key, const StringPiece& value) {
+    uint32_t ref = arena_.Append(value);
+    typename MapType::iterator itr = refs_.find(key);
+    if (itr == refs_.end()) {
+      refs_[key].ref = ref;
+      return;
+    }
+    arena_.Release(itr->second.ref);
+    itr->second.ref = ref;
+    MaybeRepack();
+  }
+
+  void Erase(const KeyType& key) {
+    typename MapType::iterator itr = refs_.find(key);
+    if (itr != refs_.end()) {
+      arena_.Release(itr->second.ref);
+      refs_.erase(itr);
+      MaybeRepack();
+    }
+  }
+
+  void Clear() {
+    MapType().swap(refs_);
+    arena_.Clear();
+  }
+
+  size_t size() const { return refs_.size(); }
+
+  // heap bytes held by the map and the value arena.
+  size_t MemoryUsage() const {
+    return Traits::MemoryUsage(refs_) + arena_.Capacity();
+  }
+
+ private:
+  // drops the values overwritten or erased once they are half the arena.
+  void MaybeRepack() {
+    if (arena_.DeadBytes() <= (1 << 20) || arena_.DeadBytes() <= arena_.Size() / 2) {
+      return;
+    }
+    StringKeyArena arena;
+    for (typename MapType::iterator itr = refs_.begin(); itr != refs_.end(); ++itr) {
+      itr->second.ref = arena.Append(arena_.Get(itr->second.ref));
+    }
+    arena_.swap(arena);
+  }
+
+  InlineValueMap(const InlineValueMap&);
+  void operator=(const InlineValueMap&);
+
+  MapType refs_;
+  StringKeyArena arena_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_INLINE_VALUE_MAP_H_
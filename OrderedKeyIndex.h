@@ -0,0 +1,336 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Ordered Index Of Keys For Prefix And Range Queries.
+ *
+ * Keys are compared as bytes, see OrderedKeyBytes. Their bytes live in
+ * a StringKeyArena and the index itself is a two level B-tree of arena
+ * refs: a sorted vector of leaves, each a sorted array of up to
+ * kLeafSize refs. So a key costs its arena entry plus about 5 bytes,
+ * and a range is read by walking the leaves in order.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_ORDERED_KEY_INDEX_H_
+#define CABINET_ORDERED_KEY_INDEX_H_
+
+#include <endian.h>
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "StringIndexMap.h"
+#include "StringPiece.h"
+
+namespace cabinet {
+// the bytes of a key that sort as the key does: integers big endian,
+// strings as they are. a string key is not copied.
+class OrderedKeyBytes {
+ public:
+  explicit OrderedKeyBytes(uint32_t key) {
+    key = htobe32(key);
+    memcpy(buf_, &key, sizeof(key));
+    piece_ = StringPiece(buf_, sizeof(key));
+  }
+  explicit OrderedKeyBytes(uint64_t key) {
+    key = htobe64(key);
+    memcpy(buf_, &key, sizeof(key));
+    piece_ = StringPiece(buf_, sizeof(key));
+  }
+  explicit OrderedKeyBytes(const StringPiece& key) : piece_(key) {}
+
+  const StringPiece& piece() const { return piece_; }
+
+ private:
+  OrderedKeyBytes(const OrderedKeyBytes&);
+  void operator=(const OrderedKeyBytes&);
+
+  char buf_[8];
+  StringPiece piece_;
+};
+
+inline void DecodeOrderedKey(const StringPiece& bytes, uint32_t* key) {
+  memcpy(key, bytes.data(), sizeof(*key));
+  *key = be32toh(*key);
+}
+inline void DecodeOrderedKey(const StringPiece& bytes, uint64_t* key) {
+  memcpy(key, bytes.data(), sizeof(*key));
+  *key = be64toh(*key);
+}
+inline void DecodeOrderedKey(const StringPiece& bytes, std::string* key) {
+  key->assign(bytes.data(), bytes.size());
+}
+
+// class OrderedKeyIndex
+// a sorted set of byte strings. iterators and the pieces they give stay
+// valid until the next change of the index.
+class OrderedKeyIndex {
+  static const uint32_t kLeafSize = 128;
+
+  struct Leaf {
+    uint32_t count;
+    uint32_t refs[kLeafSize];
+  };
+
+ public:
+  class iterator {
+   public:
+    iterator() : index_(NULL), leaf_(0), pos_(0) {}
+    StringPiece operator*() const {
+      return index_->arena_.Get(index_->leaves_[leaf_]->refs[pos_]);
+    }
+    iterator& operator++() {
+      if (++pos_ == index_->leaves_[leaf_]->count) {
+        ++leaf_;
+        pos_ = 0;
+      }
+      return *this;
+    }
+    bool operator==(const iterator& other) const {
+      return leaf_ == other.leaf_ && pos_ == other.pos_;
+    }
+    bool operator!=(const iterator& other) const { return !(*this == other); }
+
+   private:
+    friend class OrderedKeyIndex;
+    iterator(const OrderedKeyIndex* index, size_t leaf, uint32_t pos)
+      : index_(index), leaf_(leaf), pos_(pos) {}
+    const OrderedKeyIndex* index_;
+    size_t leaf_;
+    uint32_t pos_;
+  };
+
+  OrderedKeyIndex() : size_(0) {}
+  ~OrderedKeyIndex() { clear(); }
+
+  iterator begin() const { return iterator(this, 0, 0); }
+  iterator end() const { return iterator(this, leaves_.size(), 0); }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  // the first key not less than key.
+  iterator lower_bound(const StringPiece& key) const {
+    if (leaves_.empty()) {
+      return end();
+    }
+    size_t leaf = FindLeaf(key);
+    uint32_t pos = FindPos(*leaves_[leaf], key);
+    if (pos == leaves_[leaf]->count) {
+      return iterator(this, leaf + 1, 0);
+    }
+    return iterator(this, leaf, pos);
+  }
+
+  // returns false if key is there already.
+  bool insert(const StringPiece& key) {
+    if (leaves_.empty()) {
+      leaves_.push_back(new Leaf);
+      leaves_[0]->count = 1;
+      leaves_[0]->refs[0] = arena_.Append(key);
+      size_ = 1;
+      return true;
+    }
+    size_t leaf = FindLeaf(key);
+    uint32_t pos = FindPos(*leaves_[leaf], key);
+    if (pos < leaves_[leaf]->count && Key(leaves_[leaf]->refs[pos]) == key) {
+      return false;
+    }
+    if (leaves_[leaf]->count == kLeafSize) {
+      Split(leaf);
+      if (pos > kLeafSize / 2) {
+        pos -= kLeafSize / 2;
+        ++leaf;
+      }
+    }
+    Leaf* l = leaves_[leaf];
+    memmove(&l->refs[pos + 1], &l->refs[pos], (l->count - pos) * sizeof(uint32_t));
+    l->refs[pos] = arena_.Append(key);
+    ++l->count;
+    ++size_;
+    return true;
+  }
+
+  // returns false if key is not there.
+  bool erase(const StringPiece& key) {
+    if (leaves_.empty()) {
+      return false;
+    }
+    size_t leaf = FindLeaf(key);
+    Leaf* l = leaves_[leaf];
+    uint32_t pos = FindPos(*l, key);
+    if (pos == l->count || Key(l->refs[pos]) != key) {
+      return false;
+    }
+    arena_.Release(l->refs[pos]);
+    memmove(&l->refs[pos], &l->refs[pos + 1], (l->count - pos - 1) * sizeof(uint32_t));
+    --l->count;
+    --size_;
+    if (l->count == 0) {
+      delete l;
+      leaves_.erase(leaves_.begin() + leaf);
+    } else if (l->count < kLeafSize / 4) {
+      Merge(leaf);
+    }
+    if (arena_.DeadBytes() > (1 << 20) && arena_.DeadBytes() > arena_.Size() / 2) {
+      Repack();
+    }
+    return true;
+  }
+
+  void clear() {
+    for (size_t i = 0; i < leaves_.size(); ++i) {
+      delete leaves_[i];
+    }
+    std::vector<Leaf*>().swap(leaves_);
+    std::vector<uint32_t>().swap(staged_);
+    arena_.Clear();
+    size_ = 0;
+  }
+
+  // loads many keys faster than insert(): Stage() each of them once, in
+  // any order, then Build(). the index must be empty.
+  void Stage(const StringPiece& key) {
+    staged_.push_back(arena_.Append(key));
+  }
+  void Build() {
+    // sorting by the first 8 bytes first keeps most comparisons off the
+    // arena.
+    std::vector<std::pair<uint64_t, uint32_t> > sorted;
+    sorted.reserve(staged_.size());
+    for (size_t i = 0; i < staged_.size(); ++i) {
+      sorted.push_back(std::make_pair(KeyPrefix(Key(staged_[i])), staged_[i]));
+    }
+    std::vector<uint32_t>().swap(staged_);
+    std::sort(sorted.begin(), sorted.end(), PrefixLess(arena_));
+
+    // leaves are left a quarter empty, so that inserts rarely split.
+    StringKeyArena arena;
+    const uint32_t fill = kLeafSize - kLeafSize / 4;
+    for (size_t i = 0; i < sorted.size(); ++i) {
+      if (i % fill == 0) {
+        leaves_.push_back(new Leaf);
+        leaves_.back()->count = 0;
+      }
+      Leaf* l = leaves_.back();
+      l->refs[l->count++] = arena.Append(Key(sorted[i].second));
+    }
+    arena_.swap(arena);
+    size_ = sorted.size();
+  }
+
+  // heap bytes held by the leaves and the key arena.
+  size_t MemoryUsage() const {
+    return leaves_.capacity() * sizeof(Leaf*) + leaves_.size() * sizeof(Leaf) +
+      staged_.capacity() * sizeof(uint32_t) + arena_.Capacity();
+  }
+
+ private:
+  // orders staged keys by their first 8 bytes, then by all of them.
+  struct PrefixLess {
+    explicit PrefixLess(const StringKeyArena& arena) : arena_(&arena) {}
+    bool operator()(const std::pair<uint64_t, uint32_t>& a,
+        const std::pair<uint64_t, uint32_t>& b) const {
+      if (a.first != b.first) {
+        return a.first < b.first;
+      }
+      return arena_->Get(a.second) < arena_->Get(b.second);
+    }
+    const StringKeyArena* arena_;
+  };
+
+  static uint64_t KeyPrefix(const StringPiece& key) {
+    uint64_t prefix = 0;
+    memcpy(&prefix, key.data(), std::min<size_t>(key.size(), sizeof(prefix)));
+    return be64toh(prefix);
+  }
+
+  StringPiece Key(uint32_t ref) const { return arena_.Get(ref); }
+
+  // the leaf key belongs in: the last one whose first key is not greater
+  // than key, or the first.
+  size_t FindLeaf(const StringPiece& key) const {
+    size_t lo = 0;
+    size_t hi = leaves_.size();
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (key < Key(leaves_[mid]->refs[0])) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    return lo == 0 ? 0 : lo - 1;
+  }
+
+  // the first position of leaf whose key is not less than key.
+  uint32_t FindPos(const Leaf& leaf, const StringPiece& key) const {
+    uint32_t lo = 0;
+    uint32_t hi = leaf.count;
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (Key(leaf.refs[mid]) < key) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // moves the upper half of a full leaf to a new one after it.
+  void Split(size_t leaf) {
+    Leaf* l = leaves_[leaf];
+    Leaf* next = new Leaf;
+    next->count = l->count - kLeafSize / 2;
+    memcpy(next->refs, &l->refs[kLeafSize / 2], next->count * sizeof(uint32_t));
+    l->count = kLeafSize / 2;
+    leaves_.insert(leaves_.begin() + leaf + 1, next);
+  }
+
+  // joins a leaf gone small with a neighbour that leaves room for inserts.
+  void Merge(size_t leaf) {
+    const uint32_t most = kLeafSize - kLeafSize / 4;
+    if (leaf + 1 < leaves_.size() && leaves_[leaf]->count + leaves_[leaf + 1]->count <= most) {
+      Join(leaf);
+    } else if (leaf > 0 && leaves_[leaf - 1]->count + leaves_[leaf]->count <= most) {
+      Join(leaf - 1);
+    }
+  }
+
+  // appends leaf + 1 to leaf.
+  void Join(size_t leaf) {
+    Leaf* l = leaves_[leaf];
+    Leaf* next = leaves_[leaf + 1];
+    memcpy(&l->refs[l->count], next->refs, next->count * sizeof(uint32_t));
+    l->count += next->count;
+    delete next;
+    leaves_.erase(leaves_.begin() + leaf + 1);
+  }
+
+  // drops the erased keys from the arena, which is in key order after.
+  void Repack() {
+    StringKeyArena arena;
+    for (size_t i = 0; i < leaves_.size(); ++i) {
+      Leaf* l = leaves_[i];
+      for (uint32_t j = 0; j < l->count; ++j) {
+        l->refs[j] = arena.Append(Key(l->refs[j]));
+      }
+    }
+    arena_.swap(arena);
+  }
+
+  OrderedKeyIndex(const OrderedKeyIndex&);
+  void operator=(const OrderedKeyIndex&);
+
+  std::vector<Leaf*> leaves_;  // none empty.
+  std::vector<uint32_t> staged_;  // see Stage().
+  StringKeyArena arena_;
+  size_t size_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_ORDERED_KEY_INDEX_H_
@@ -0,0 +1,80 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Token Bucket Rate Limiter For Background I/O
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_RATE_LIMITER_H_
+#define CABINET_RATE_LIMITER_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <time.h>
+
+namespace cabinet {
+// class RateLimiter
+// tokens are bytes, refilled at bytes_per_second up to a burst of 100ms.
+// Acquire() takes its bytes even when the bucket runs short and sleeps
+// off the debt, so large requests pass at the same average rate. it may
+// be shared by threads, e.g. all compactions of a server.
+class RateLimiter {
+ public:
+  // bytes_per_second 0 means unlimited.
+  explicit RateLimiter(uint64_t bytes_per_second)
+    : rate_(bytes_per_second), tokens_(0), last_(Now()) {
+    pthread_mutex_init(&mutex_, NULL);
+  }
+  ~RateLimiter() { pthread_mutex_destroy(&mutex_); }
+
+  void SetRate(uint64_t bytes_per_second) {
+    pthread_mutex_lock(&mutex_);
+    rate_ = bytes_per_second;
+    pthread_mutex_unlock(&mutex_);
+  }
+  uint64_t GetRate() const { return rate_; }
+
+  void Acquire(uint64_t bytes) {
+    pthread_mutex_lock(&mutex_);
+    if (rate_ == 0) {
+      pthread_mutex_unlock(&mutex_);
+      return;
+    }
+    double now = Now();
+    tokens_ += (now - last_) * rate_;
+    last_ = now;
+    if (tokens_ > rate_ / 10.0) {
+      tokens_ = rate_ / 10.0;
+    }
+    tokens_ -= bytes;
+    double wait = tokens_ < 0 ? -tokens_ / rate_ : 0;
+    pthread_mutex_unlock(&mutex_);
+
+    if (wait > 0) {
+      struct timespec ts;
+      ts.tv_sec = (time_t)wait;
+      ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+      nanosleep(&ts, NULL);
+    }
+  }
+
+ private:
+  static double Now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+  }
+
+  RateLimiter(const RateLimiter&);
+  void operator=(const RateLimiter&);
+
+  pthread_mutex_t mutex_;
+  uint64_t rate_;
+  double tokens_;  // negative while callers sleep off a debt.
+  double last_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_RATE_LIMITER_H_
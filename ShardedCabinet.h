@@ -0,0 +1,453 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Cabinet Hash Partitioned Over Shards With A Lock Each
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_SHARDED_CABINET_H_
+#define CABINET_SHARDED_CABINET_H_
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "CabinetExceptions.h"
+#include "CabinetHash.h"
+#include "TCabinet.h"
+
+namespace cabinet {
+// class TShardedCabinet
+// spreads the keys of a db over shards, each a Cabinet with its own
+// lock, write buffer, data and index files, so that writers to different
+// shards run in parallel and do not block each other's readers. unlike
+// TCabinet it locks itself: calls may come from any thread, only Open
+// and Close must not run along with others.
+//
+// writers of a shard take its writer mutex and then its lock for
+// writing. the shard is the ReaderGate of its cabinet: the lock goes
+// back to readers while a flush writes files, the writer mutex keeps
+// other writers out meanwhile, so a Get waits for the in-memory part of
+// a flush only.
+//
+// the shard count is options.shards when the db is created and kept in
+// "shards". a db with one shard is a plain Cabinet at the db path, so
+// dbs created before sharding open as one shard. otherwise shard i lives
+// in "shard.<i>".
+template <class Cabinet, class KeyType, class KeyHashFunc>
+class TShardedCabinet : public CabinetBase {
+ public:
+  // a db has at most this many shards, each takes a 4MB write buffer.
+  static const uint32_t kMaxShards = 64;
+
+  TShardedCabinet() {}
+  explicit TShardedCabinet(const char* location) { Open(location); }
+  TShardedCabinet(const char* location, const CabinetOptions& options) : options_(options) {
+    Open(location);
+  }
+  virtual ~TShardedCabinet() { Close(); }
+
+  void SetOptions(const CabinetOptions& options) { options_ = options; }
+
+  void Open(const char* location) {
+    Close();
+    path_ = location;
+    if (*path_.rbegin() != '/') {
+      path_ += '/';
+    }
+    mkdir(path_.c_str(), S_IRUSR | S_IWUSR | S_IEXEC);
+    uint32_t count = ReadShardCount();
+    for (uint32_t i = 0; i < count; ++i) {
+      Shard* shard = new Shard;
+      shard->cabinet.SetOptions(options_);
+      shards_.push_back(shard);
+      shard->cabinet.Open(count == 1 ? path_.c_str() : ShardPath(i).c_str());
+      shard->cabinet.SetReaderGate(shard);
+    }
+  }
+
+  void Close() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      delete shards_[i];
+    }
+    shards_.clear();
+    path_.clear();
+  }
+
+  // empties every shard, the shard count stays.
+  void Drop() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], true);
+      shards_[i]->cabinet.Drop();
+    }
+  }
+
+  void Flush() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], true);
+      shards_[i]->cabinet.Flush();
+    }
+  }
+
+  // each shard writes its own frozen index.
+  void Freeze() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], true);
+      shards_[i]->cabinet.Freeze();
+    }
+  }
+  bool IsFrozen() const { return !shards_.empty() && shards_[0]->cabinet.IsFrozen(); }
+
+  // a shard's compaction is begun and finished under its lock only.
+  void Compact() {
+    BeginCompact();
+    RunCompact();
+    FinishCompact();
+  }
+  void BeginCompact() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], true);
+      shards_[i]->cabinet.BeginCompact();
+    }
+  }
+  void RunCompact() {
+    size_t i = 0;
+    try {
+      for (; i < shards_.size(); ++i) {
+        shards_[i]->cabinet.RunCompact();
+      }
+    } catch (...) {
+      // the failed shard dropped its compaction, the later ones would
+      // hold their snapshots and files until the next compaction.
+      for (++i; i < shards_.size(); ++i) {
+        ShardLock lock(shards_[i], true);
+        shards_[i]->cabinet.AbortCompact();
+      }
+      throw;
+    }
+  }
+  void FinishCompact() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], true);
+      shards_[i]->cabinet.FinishCompact();
+    }
+  }
+
+  // as compaction, a shard's scrub is begun under its lock only.
+  uint64_t Scrub() {
+    BeginScrub();
+    return RunScrub();
+  }
+  void BeginScrub() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], true);
+      shards_[i]->cabinet.BeginScrub();
+    }
+  }
+  uint64_t RunScrub() {
+    uint64_t bad = 0;
+    size_t i = 0;
+    try {
+      for (; i < shards_.size(); ++i) {
+        bad += shards_[i]->cabinet.RunScrub();
+      }
+    } catch (...) {
+      // the snapshots left would be run by the next scrub.
+      for (++i; i < shards_.size(); ++i) {
+        shards_[i]->cabinet.AbortScrub();
+      }
+      throw;
+    }
+    return bad;
+  }
+  void CancelMaintenance() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      shards_[i]->cabinet.CancelMaintenance();
+    }
+  }
+  void ResumeMaintenance() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      shards_[i]->cabinet.ResumeMaintenance();
+    }
+  }
+
+  void Sync() {
+    SyncPoint point;
+    PrepareSync(&point);
+    try {
+      CommitSync(&point);
+    } catch (...) {
+      AbandonSync();
+      throw;
+    }
+  }
+  void PrepareSync(SyncPoint* point) {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], true);
+      shards_[i]->cabinet.PrepareSync(point);
+    }
+  }
+  void AbandonSync() {
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], true);
+      shards_[i]->cabinet.AbandonSync();
+    }
+  }
+
+  void Set(const KeyType& key, const uint8_t* value, uint32_t size) {
+    Shard* shard = ShardOf(key);
+    ShardLock lock(shard, true);
+    shard->cabinet.Set(key, value, size);
+  }
+  bool Get(const KeyType& key, std::string* value) {
+    Shard* shard = ShardOf(key);
+    ShardLock lock(shard, false);
+    return shard->cabinet.Get(key, value);
+  }
+  // a pinned view outlives the lock, see ValueView.
+  bool Get(const KeyType& key, ValueView* value) {
+    Shard* shard = ShardOf(key);
+    ShardLock lock(shard, false);
+    return shard->cabinet.Get(key, value);
+  }
+  void Delete(const KeyType& key) {
+    Shard* shard = ShardOf(key);
+    ShardLock lock(shard, true);
+    shard->cabinet.Delete(key);
+  }
+
+  // TCabinet::MultiGet() on each shard with keys, one after another.
+  void MultiGet(const std::vector<KeyType>& keys, AsyncReader* reader,
+      std::vector<std::string>* values, std::vector<bool>* found) {
+    MultiGet(keys, reader, values, found, true);
+  }
+  void MultiGet(const std::vector<KeyType>& keys, AsyncReader* reader,
+      std::vector<std::string>* values, std::vector<bool>* found, bool fill_cache) {
+    values->assign(keys.size(), std::string());
+    found->assign(keys.size(), false);
+    std::vector<std::vector<size_t> > owners(shards_.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+      owners[ShardIndex(keys[i])].push_back(i);
+    }
+    std::vector<KeyType> shard_keys;
+    std::vector<std::string> shard_values;
+    std::vector<bool> shard_found;
+    for (size_t s = 0; s < shards_.size(); ++s) {
+      if (owners[s].empty()) {
+        continue;
+      }
+      shard_keys.clear();
+      for (size_t i = 0; i < owners[s].size(); ++i) {
+        shard_keys.push_back(keys[owners[s][i]]);
+      }
+      {
+        ShardLock lock(shards_[s], false);
+        shards_[s]->cabinet.MultiGet(shard_keys, reader, &shard_values, &shard_found, fill_cache);
+      }
+      for (size_t i = 0; i < owners[s].size(); ++i) {
+        (*values)[owners[s][i]].swap(shard_values[i]);
+        (*found)[owners[s][i]] = shard_found[i];
+      }
+    }
+  }
+
+  // the keys of one shard after the other, each in its data file order,
+  // see CabinetIterator. a shard is locked while its index is copied
+  // only.
+  void GetKeysInFileOrder(std::vector<KeyType>* keys) {
+    std::vector<std::pair<uint64_t, KeyType> > entries;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      entries.clear();
+      {
+        ShardLock lock(shards_[i], false);
+        shards_[i]->cabinet.GetLiveEntries(&entries);
+      }
+      Cabinet::AppendInFileOrder(&entries, keys);
+    }
+  }
+
+  // the keys of TCabinet::GetKeyRange() from every shard, merged in key
+  // order. a shard is locked while its keys are copied only.
+  void GetKeyRange(const KeyType& begin, const KeyType* end, size_t limit,
+      std::vector<KeyType>* keys) {
+    std::vector<KeyType> found;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], false);
+      shards_[i]->cabinet.GetKeyRange(begin, end, limit, &found);
+    }
+    AppendMerged(&found, limit, keys);
+  }
+  void GetKeysWithPrefix(const StringPiece& prefix, size_t limit, std::vector<KeyType>* keys) {
+    std::vector<KeyType> found;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], false);
+      shards_[i]->cabinet.GetKeysWithPrefix(prefix, limit, &found);
+    }
+    AppendMerged(&found, limit, keys);
+  }
+
+  uint64_t GetEntryCount() const { return Sum(&Cabinet::GetEntryCount); }
+  uint64_t GetChangedCount() const { return Sum(&Cabinet::GetChangedCount); }
+  uint64_t GetDataFileSize() const { return Sum(&Cabinet::GetDataFileSize); }
+  uint64_t GetDataBytes() const { return Sum(&Cabinet::GetDataBytes); }
+  uint64_t GetReclaimableBytes() const { return Sum(&Cabinet::GetReclaimableBytes); }
+  uint64_t GetRawBytesWritten() const { return Sum(&Cabinet::GetRawBytesWritten); }
+  uint64_t GetStoredBytesWritten() const { return Sum(&Cabinet::GetStoredBytesWritten); }
+  uint64_t GetCacheHits() const { return Sum(&Cabinet::GetCacheHits); }
+  uint64_t GetCacheMisses() const { return Sum(&Cabinet::GetCacheMisses); }
+  uint64_t GetOrderedIndexBytes() const { return Sum(&Cabinet::GetOrderedIndexBytes); }
+  uint64_t GetChecksumErrors() const { return Sum(&Cabinet::GetChecksumErrors); }
+  uint64_t GetInlineValueCount() const { return Sum(&Cabinet::GetInlineValueCount); }
+  uint64_t GetInlineValueBytes() const { return Sum(&Cabinet::GetInlineValueBytes); }
+  uint32_t GetShardCount() const { return shards_.size(); }
+
+  std::string GetPath() const {
+    return path_;
+  }
+
+ private:
+  // the gate is only used by calls of a writer, which holds both locks.
+  struct Shard : public ReaderGate {
+    Cabinet cabinet;
+    pthread_mutex_t writer;
+    pthread_rwlock_t lock;
+
+    Shard() {
+      pthread_mutex_init(&writer, NULL);
+      pthread_rwlock_init(&lock, NULL);
+    }
+    ~Shard() {
+      // closes the cabinet without a gate, no lock is held.
+      cabinet.SetReaderGate(NULL);
+      cabinet.Close();
+      pthread_rwlock_destroy(&lock);
+      pthread_mutex_destroy(&writer);
+    }
+
+    void AdmitReaders() {
+      pthread_rwlock_unlock(&lock);
+      pthread_rwlock_rdlock(&lock);
+    }
+    void ExcludeReaders() {
+      pthread_rwlock_unlock(&lock);
+      pthread_rwlock_wrlock(&lock);
+    }
+  };
+
+  // holds the locks of a shard for a scope, both of them to write.
+  class ShardLock {
+   public:
+    ShardLock(Shard* shard, bool write) : shard_(shard), write_(write) {
+      if (write) {
+        pthread_mutex_lock(&shard->writer);
+        pthread_rwlock_wrlock(&shard->lock);
+      } else {
+        pthread_rwlock_rdlock(&shard->lock);
+      }
+    }
+    ~ShardLock() {
+      pthread_rwlock_unlock(&shard_->lock);
+      if (write_) {
+        pthread_mutex_unlock(&shard_->writer);
+      }
+    }
+
+   private:
+    Shard* shard_;
+    bool write_;
+  };
+
+  // the shard index uses other bits of the hash than the shard's own
+  // hash table, which would otherwise only fill one slot in count.
+  size_t ShardIndex(const KeyType& key) const {
+    return shards_.size() == 1 ? 0 : Mix64(KeyHashFunc()(key)) % shards_.size();
+  }
+  Shard* ShardOf(const KeyType& key) const { return shards_[ShardIndex(key)]; }
+
+  // found holds up to limit keys of each shard, each shard's in order.
+  // the keys of the integer types and std::string sort as their
+  // OrderedKeyBytes do.
+  void AppendMerged(std::vector<KeyType>* found, size_t limit, std::vector<KeyType>* keys) const {
+    if (shards_.size() > 1) {
+      std::sort(found->begin(), found->end());
+    }
+    if (limit != 0 && found->size() > limit) {
+      found->resize(limit);
+    }
+    keys->insert(keys->end(), found->begin(), found->end());
+  }
+
+  uint64_t Sum(uint64_t (Cabinet::*getter)() const) const {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      ShardLock lock(shards_[i], false);
+      sum += (shards_[i]->cabinet.*getter)();
+    }
+    return sum;
+  }
+
+  std::string ShardPath(size_t i) const {
+    char name[32];
+    snprintf(name, sizeof(name), "shard.%lu", (unsigned long)i);
+    return path_ + name;
+  }
+
+  // an existing db keeps its count, a plain cabinet is one shard.
+  uint32_t ReadShardCount() {
+    FILE* file = fopen((path_ + "shards").c_str(), "r");
+    if (file) {
+      unsigned long count = 0;
+      int ret = fscanf(file, "%lu", &count);
+      fclose(file);
+      if (ret != 1 || count == 0 || count > kMaxShards) {
+        throw FileCorruptException(__FILE__, __LINE__, 0, "bad shards file");
+      }
+      return count;
+    }
+    struct stat st;
+    if (lstat((path_ + "index").c_str(), &st) == 0 || options_.shards <= 1) {
+      return 1;
+    }
+    uint32_t count = std::min(options_.shards, kMaxShards);
+    std::string tmpPath = path_ + "shards.tmp";
+    file = fopen(tmpPath.c_str(), "w");
+    if (!file) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    fprintf(file, "%lu\n", (unsigned long)count);
+    if (fflush(file) != 0) {
+      int err = errno;
+      fclose(file);
+      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+    fsync(fileno(file));
+    fclose(file);
+    if (rename(tmpPath.c_str(), (path_ + "shards").c_str()) != 0) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    return count;
+  }
+
+  TShardedCabinet(const TShardedCabinet&);
+  void operator=(const TShardedCabinet&);
+
+  CabinetOptions options_;
+  std::string path_;
+  std::vector<Shard*> shards_;
+};
+
+template <class Cabinet, class KeyType, class KeyHashFunc>
+const uint32_t TShardedCabinet<Cabinet, KeyType, KeyHashFunc>::kMaxShards;
+}  // namespace cabinet
+
+#endif  // CABINET_SHARDED_CABINET_H_
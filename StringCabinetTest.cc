@@ -16,10 +16,17 @@
 #include <cstdio>
 #include <ctime>
 #include <iostream>
+#include <map>
+#include <set>
 #include <boost/test/included/unit_test.hpp>
 
 #include "CabinetTypes.h"
 
+using cabinet::CabinetException;
+using cabinet::CabinetIterator;
+using cabinet::CabinetOptions;
+using cabinet::ShardedStringCabinet;
+using cabinet::StringBulkLoader;
 using cabinet::StringCabinet;
 
 static const char* cab_path = "stringcab";
@@ -269,4 +276,297 @@ BOOST_FIXTURE_TEST_CASE(test_case_5, TestFixture) {
     times, time(NULL) - old_time);
 }
 
+// test case 6
+// binary keys sharing a prefix up to a NUL byte, plus delete/re-set churn
+// that makes the key arena reclaim erased keys, then reopen.
+BOOST_FIXTURE_TEST_CASE(test_case_6, TestFixture) {
+  StringCabinet cab(cab_path);
+
+  std::string value;
+  uint8_t buffer[256];
+  for (uint32_t round = 0; round < 20; ++round) {
+    for (uint32_t i = 0; i < times; ++i) {
+      std::string key = u32tostr(i);
+      key.push_back('\0');
+      key += u32tostr(round % 2);
+      cab.Delete(key);
+      memset(buffer, (uint8_t)((i + round) % 251), sizeof(buffer));
+      cab.Set(key, buffer, (i + round) % sizeof(buffer));
+    }
+  }
+  cab.Set(std::string(), buffer, 1);
+  BOOST_REQUIRE(cab.GetEntryCount() == 2 * times + 1);
+  cab.Close();
+  cab.Open(cab_path);
+  BOOST_REQUIRE(cab.GetEntryCount() == 2 * times + 1);
+
+  for (uint32_t i = 0; i < times; ++i) {
+    for (uint32_t last = 18; last < 20; ++last) {
+      std::string key = u32tostr(i);
+      key.push_back('\0');
+      key += u32tostr(last % 2);
+      BOOST_REQUIRE(cab.Get(key, &value));
+      BOOST_REQUIRE(value.size() == (i + last) % sizeof(buffer));
+      if (!value.empty()) {
+        BOOST_REQUIRE((uint8_t)value[0] == (uint8_t)((i + last) % 251));
+      }
+    }
+    BOOST_REQUIRE(!cab.Get(u32tostr(i), &value));
+  }
+  BOOST_REQUIRE(cab.Get(std::string(), &value));
+  BOOST_REQUIRE(value.size() == 1);
+  cab.Close();
+}
+
+// test case 7
+// iterating string keys, flushed and buffered, the empty key included.
+BOOST_FIXTURE_TEST_CASE(test_case_7, TestFixture) {
+  StringCabinet cab(cab_path);
+  for (uint32_t i = 0; i < times; ++i) {
+    std::string key = u32tostr(i);
+    cab.Set(key, (const uint8_t*)key.data(), key.size());
+    if (i == times / 2) {
+      cab.Flush();
+    }
+  }
+  cab.Set(std::string(), NULL, 0);
+  cab.Delete(u32tostr(7));
+
+  CabinetIterator<StringCabinet, std::string> itr(&cab);
+  BOOST_REQUIRE(itr.GetCount() == times);
+  std::set<std::string> seen;
+  std::vector<std::string> keys, values;
+  while (itr.Next(1000, NULL, &keys, &values)) {
+    for (size_t i = 0; i < keys.size(); ++i) {
+      BOOST_REQUIRE(values[i] == keys[i]);
+      BOOST_REQUIRE(seen.insert(keys[i]).second);
+    }
+  }
+  BOOST_REQUIRE(seen.size() == times);
+  BOOST_REQUIRE(seen.count(std::string()) == 1 && seen.count(u32tostr(7)) == 0);
+  cab.Close();
+}
+
+// checks the ranges and prefixes of cab against expected.
+template <class Cabinet>
+static void CheckOrdered(Cabinet& cab, const std::set<std::string>& expected) {
+  std::vector<std::string> keys;
+  cab.GetKeyRange(std::string(), NULL, 0, &keys);
+  BOOST_REQUIRE(keys == std::vector<std::string>(expected.begin(), expected.end()));
+  for (uint32_t i = 0; i < 200; ++i) {
+    std::string begin = u32tostr(i * 97 % times);
+    std::string end = u32tostr(i * 89 % times);
+    size_t limit = i % 4 == 0 ? 0 : i * 13;
+    keys.clear();
+    cab.GetKeyRange(begin, &end, limit, &keys);
+    std::vector<std::string> want;
+    for (std::set<std::string>::const_iterator itr = expected.lower_bound(begin);
+        itr != expected.end() && *itr < end && (limit == 0 || want.size() < limit); ++itr) {
+      want.push_back(*itr);
+    }
+    BOOST_REQUIRE(keys == want);
+
+    std::string prefix = u32tostr(i);
+    keys.clear();
+    cab.GetKeysWithPrefix(prefix, limit, &keys);
+    want.clear();
+    for (std::set<std::string>::const_iterator itr = expected.lower_bound(prefix);
+        itr != expected.end() && itr->compare(0, prefix.size(), prefix) == 0 &&
+        (limit == 0 || want.size() < limit); ++itr) {
+      want.push_back(*itr);
+    }
+    BOOST_REQUIRE(keys == want);
+  }
+}
+
+// test case 8
+// the ordered index through set and delete churn, a flush, a reopen that
+// rebuilds it, and over shards.
+BOOST_FIXTURE_TEST_CASE(test_case_8, TestFixture) {
+  std::vector<std::string> keys;
+  {
+    StringCabinet plain(cab_path);
+    BOOST_REQUIRE_THROW(plain.GetKeyRange(std::string(), NULL, 0, &keys), std::logic_error);
+    BOOST_REQUIRE_EQUAL(plain.GetOrderedIndexBytes(), 0);
+    plain.Drop();
+  }
+
+  CabinetOptions options;
+  options.ordered_index = true;
+  StringCabinet cab(cab_path, options);
+  std::set<std::string> expected;
+  CheckOrdered(cab, expected);
+  for (uint32_t i = 0; i < 3 * times; ++i) {
+    std::string key = u32tostr(i * 7919 % times);
+    if (i % 5 == 0) {
+      cab.Delete(key);
+      expected.erase(key);
+    } else {
+      cab.Set(key, (const uint8_t*)key.data(), key.size());
+      expected.insert(key);
+    }
+    if (i == times) {
+      cab.Flush();
+    }
+  }
+  cab.Set(std::string(), NULL, 0);
+  expected.insert(std::string());
+  CheckOrdered(cab, expected);
+  BOOST_REQUIRE(cab.GetOrderedIndexBytes() > 0);
+  cab.Close();
+  cab.Open(cab_path);
+  CheckOrdered(cab, expected);
+  cab.Close();
+  system((std::string("rm -rf ") + cab_path).c_str());
+
+  options.shards = 3;
+  ShardedStringCabinet sharded(cab_path, options);
+  for (std::set<std::string>::const_iterator itr = expected.begin(); itr != expected.end(); ++itr) {
+    sharded.Set(*itr, (const uint8_t*)itr->data(), itr->size());
+  }
+  CheckOrdered(sharded, expected);
+  sharded.Close();
+}
+
+// test case 9
+// a sharded db frozen with keys short enough to live in the slots and
+// longer ones, opened from the frozen index, and compacted after.
+BOOST_FIXTURE_TEST_CASE(test_case_9, TestFixture) {
+  CabinetOptions options;
+  options.shards = 3;
+  std::map<std::string, std::string> expected;
+  ShardedStringCabinet cab(cab_path, options);
+  for (uint32_t i = 0; i < times; ++i) {
+    std::string key = u32tostr(i) + std::string(i % 13, 'k');
+    std::string value = u32tostr(i * 31);
+    cab.Set(key, (const uint8_t*)value.data(), value.size());
+    expected[key] = value;
+  }
+  cab.Set(std::string(), (const uint8_t*)"empty", 5);
+  expected[std::string()] = "empty";
+  cab.Freeze();
+  cab.Close();
+
+  options.frozen = true;
+  cab.SetOptions(options);
+  cab.Open(cab_path);
+  BOOST_REQUIRE_EQUAL(cab.GetEntryCount(), expected.size());
+  std::string value;
+  for (std::map<std::string, std::string>::iterator itr = expected.begin();
+      itr != expected.end(); ++itr) {
+    BOOST_REQUIRE(cab.Get(itr->first, &value) && value == itr->second);
+    BOOST_REQUIRE(!cab.Get(itr->first + "x", &value));
+  }
+  BOOST_REQUIRE_THROW(cab.Set("a", (const uint8_t*)"b", 1), std::logic_error);
+  cab.Close();
+
+  // compaction moves the values, the frozen index goes.
+  options.frozen = false;
+  cab.SetOptions(options);
+  cab.Open(cab_path);
+  cab.Compact();
+  cab.Close();
+  options.frozen = true;
+  cab.SetOptions(options);
+  BOOST_REQUIRE_THROW(cab.Open(cab_path), CabinetException);
+}
+
+// test case 10
+// a db written by the bulk loader, and a load given up.
+BOOST_FIXTURE_TEST_CASE(test_case_10, TestFixture) {
+  std::string loading = std::string(cab_path) + ".loading";
+  {
+    StringBulkLoader loader;
+    loader.Open(cab_path);
+    loader.Add("dropped", (const uint8_t*)"x", 1);
+  }
+  struct stat st;
+  BOOST_REQUIRE(lstat(loading.c_str(), &st) != 0 && lstat(cab_path, &st) != 0);
+
+  StringBulkLoader loader;
+  loader.Open(cab_path);
+  for (uint32_t i = 0; i < times; ++i) {
+    std::string key = u32tostr(i);
+    loader.Add(key, (const uint8_t*)key.data(), key.size());
+  }
+  loader.Add(std::string(), (const uint8_t*)"empty", 5);
+  loader.Finish();
+  BOOST_REQUIRE(lstat(loading.c_str(), &st) != 0);
+  BOOST_REQUIRE_EQUAL(loader.GetEntryCount(), times + 1);
+
+  StringCabinet cab(cab_path);
+  BOOST_REQUIRE_EQUAL(cab.GetEntryCount(), times + 1);
+  std::string value;
+  for (uint32_t i = 0; i < times; ++i) {
+    BOOST_REQUIRE(cab.Get(u32tostr(i), &value) && value == u32tostr(i));
+  }
+  BOOST_REQUIRE(cab.Get(std::string(), &value) && value == "empty");
+  BOOST_REQUIRE(!cab.Get("dropped", &value));
+  cab.Close();
+}
+
+// test case 11
+// string keys make records of any width in the v2 index log, a torn tail
+// is cut off and the replay is split at batch boundaries.
+BOOST_FIXTURE_TEST_CASE(test_case_11, TestFixture) {
+  std::string index = std::string(cab_path) + "/index";
+  std::string checkpoint = std::string(cab_path) + "/checkpoint";
+  const uint32_t keys = 400000;
+  {
+    StringCabinet cab(cab_path);
+    for (uint32_t i = 0; i < keys; ++i) {
+      std::string key = u32tostr(i) + std::string(i % 20, 'k');
+      cab.Set(key, (const uint8_t*)key.data(), i % 4);
+    }
+    cab.Close();
+  }
+  unlink(checkpoint.c_str());
+  struct stat st;
+  BOOST_REQUIRE(lstat(index.c_str(), &st) == 0);
+  uint64_t length = st.st_size;
+  FILE* file = fopen(index.c_str(), "ab");
+  BOOST_REQUIRE(file && fwrite("torn tail", 9, 1, file) == 1);
+  fclose(file);
+
+  CabinetOptions options;
+  options.load_threads = 4;
+  StringCabinet cab(cab_path, options);
+  BOOST_REQUIRE_EQUAL(cab.GetEntryCount(), keys);
+  BOOST_REQUIRE(lstat(index.c_str(), &st) == 0 && (uint64_t)st.st_size == length);
+  std::string value;
+  for (uint32_t i = 0; i < keys; i += 7) {
+    std::string key = u32tostr(i) + std::string(i % 20, 'k');
+    BOOST_REQUIRE(cab.Get(key, &value) && value == key.substr(0, i % 4));
+  }
+  cab.Close();
+}
+
+// test case 12
+// small values of string keys are kept in memory, and loaded at Open.
+BOOST_FIXTURE_TEST_CASE(test_case_12, TestFixture) {
+  CabinetOptions options;
+  options.inline_value_bytes = 8;
+  const uint32_t keys = 1000;
+  uint64_t count = 0;
+  StringCabinet cab(cab_path, options);
+  for (uint32_t i = 0; i < keys; ++i) {
+    std::string key = "key" + u32tostr(i);
+    std::string value(i % 16, 'v');
+    cab.Set(key, (const uint8_t*)value.data(), value.size());
+    count += !value.empty() && value.size() <= options.inline_value_bytes;
+  }
+  cab.Delete("key1");
+  --count;
+  BOOST_REQUIRE_EQUAL(cab.GetInlineValueCount(), count);
+  cab.Close();
+  cab.Open(cab_path);
+  BOOST_REQUIRE_EQUAL(cab.GetInlineValueCount(), count);
+  std::string value;
+  for (uint32_t i = 2; i < keys; ++i) {
+    BOOST_REQUIRE(cab.Get("key" + u32tostr(i), &value) && value == std::string(i % 16, 'v'));
+  }
+  BOOST_REQUIRE(!cab.Get("key1", &value));
+  cab.Close();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
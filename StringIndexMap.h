@@ -0,0 +1,472 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Arena Backed Hash Map For String Keys.
+ *
+ * Key bytes are appended to one contiguous arena, a slot only keeps a
+ * 32-bit fingerprint of the key hash and the arena offset of the key.
+ * Probing uses the same 16-wide control byte groups as FlatHashMap, and
+ * the fingerprint is compared before the key bytes are touched.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_STRING_INDEX_MAP_H_
+#define CABINET_STRING_INDEX_MAP_H_
+
+#include <stdint.h>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "CabinetHash.h"
+#include "FlatHashMap.h"
+#include "StringPiece.h"
+
+namespace cabinet {
+// class StringKeyArena
+// append-only storage of keys. an entry is a varint length followed by
+// the key bytes, padded to 4 bytes; it is addressed by a 32-bit offset in
+// 4-byte units, which covers 16GB of keys.
+class StringKeyArena {
+ public:
+  StringKeyArena() : data_(NULL), size_(0), capacity_(0), dead_(0) {}
+  StringKeyArena(const StringKeyArena& other)
+      : data_(NULL), size_(0), capacity_(0), dead_(other.dead_) {
+    if (other.size_ > 0) {
+      Grow(other.size_);
+      memcpy(data_, other.data_, other.size_);
+      size_ = other.size_;
+    }
+  }
+  ~StringKeyArena() { free(data_); }
+
+  uint32_t Append(const StringPiece& key) {
+    size_t need = EntrySize(key.size());
+    if (size_ + need > capacity_) {
+      Grow(size_ + need);
+    }
+    uint8_t* p = reinterpret_cast<uint8_t*>(data_ + size_);
+    uint32_t len = (uint32_t)key.size();
+    while (len >= 0x80) {
+      *p++ = (uint8_t)(len | 0x80);
+      len >>= 7;
+    }
+    *p++ = (uint8_t)len;
+    memcpy(p, key.data(), key.size());
+    uint32_t ref = (uint32_t)(size_ / kAlign);
+    size_ += need;
+    return ref;
+  }
+
+  StringPiece Get(uint32_t ref) const {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(data_ + (size_t)ref * kAlign);
+    uint32_t len = 0;
+    for (int shift = 0; ; shift += 7) {
+      uint8_t byte = *p++;
+      len |= (uint32_t)(byte & 0x7f) << shift;
+      if (byte < 0x80) {
+        break;
+      }
+    }
+    return StringPiece(reinterpret_cast<const char*>(p), len);
+  }
+
+  void Release(uint32_t ref) {
+    dead_ += EntrySize(Get(ref).size());
+  }
+
+  size_t Size() const { return size_; }
+  size_t DeadBytes() const { return dead_; }
+  size_t Capacity() const { return capacity_; }
+
+  void swap(StringKeyArena& other) {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(dead_, other.dead_);
+  }
+
+  void Clear() {
+    free(data_);
+    data_ = NULL;
+    size_ = capacity_ = dead_ = 0;
+  }
+
+ private:
+  static const size_t kAlign = 4;
+  static const size_t kMaxSize = (size_t)0xffffffff * kAlign;
+
+  static size_t EntrySize(size_t len) {
+    size_t header = 1;
+    for (size_t l = len; l >= 0x80; l >>= 7) {
+      ++header;
+    }
+    return (header + len + kAlign - 1) & ~(kAlign - 1);
+  }
+
+  void Grow(size_t need) {
+    if (need > kMaxSize) {
+      throw std::length_error("StringKeyArena full");
+    }
+    size_t capacity = capacity_ == 0 ? 4096 : capacity_;
+    while (capacity < need) {
+      capacity += capacity / 2;
+    }
+    if (capacity > kMaxSize) {
+      capacity = kMaxSize;
+    }
+    char* data = static_cast<char*>(realloc(data_, capacity));
+    if (!data) {
+      throw std::bad_alloc();
+    }
+    data_ = data;
+    capacity_ = capacity;
+  }
+
+  void operator=(const StringKeyArena&);
+
+  char* data_;
+  size_t size_;
+  size_t capacity_;
+  size_t dead_;  // bytes of erased keys, reclaimed by the next rehash.
+};
+
+// class StringIndexMap
+// hash_map<std::string, Value> replacement used by StringCabinet.
+// iterators give a StringPiece key that points into the arena; it stays
+// valid until the next insertion into the same map. Value must be plain
+// old data.
+template <class Value>
+class StringIndexMap {
+  struct Slot {
+    uint32_t fingerprint;  // low 32 bits of Hash64(key).
+    uint32_t key_ref;
+    Value value;
+  } __attribute__((packed));
+
+ public:
+  typedef StringPiece key_type;
+  typedef Value mapped_type;
+
+  struct reference {
+    StringPiece first;
+    Value& second;
+    reference* operator->() { return this; }
+  };
+
+  class iterator {
+   public:
+    iterator() : map_(NULL), index_(0) {}
+    reference operator*() const {
+      Slot& slot = map_->slots_[index_];
+      reference ref = { map_->arena_.Get(slot.key_ref), slot.value };
+      return ref;
+    }
+    // returns a proxy, whose operator-> yields the pair.
+    reference operator->() const { return **this; }
+    iterator& operator++() {
+      ++index_;
+      SkipEmpty();
+      return *this;
+    }
+    bool operator==(const iterator& other) const { return index_ == other.index_; }
+    bool operator!=(const iterator& other) const { return index_ != other.index_; }
+
+   private:
+    friend class StringIndexMap;
+    iterator(StringIndexMap* map, size_t index) : map_(map), index_(index) {}
+    void SkipEmpty() {
+      while (index_ < map_->capacity_ && map_->ctrl_[index_] < 0) {
+        ++index_;
+      }
+    }
+    StringIndexMap* map_;
+    size_t index_;
+  };
+
+  StringIndexMap() : ctrl_(NULL), slots_(NULL), capacity_(0), size_(0), growth_left_(0) {}
+  // copies the table and the arena as they are, key refs stay valid.
+  StringIndexMap(const StringIndexMap& other)
+      : ctrl_(NULL), slots_(NULL), capacity_(0), size_(0), growth_left_(0),
+        arena_(other.arena_) {
+    if (other.capacity_ == 0) {
+      return;
+    }
+    ctrl_ = flat_internal::AllocCtrl(other.capacity_);
+    slots_ = static_cast<Slot*>(malloc(other.capacity_ * sizeof(Slot)));
+    if (!slots_) {
+      free(ctrl_);
+      ctrl_ = NULL;
+      throw std::bad_alloc();
+    }
+    memcpy(ctrl_, other.ctrl_, other.capacity_);
+    memcpy(slots_, other.slots_, other.capacity_ * sizeof(Slot));
+    capacity_ = other.capacity_;
+    size_ = other.size_;
+    growth_left_ = other.growth_left_;
+  }
+  StringIndexMap& operator=(const StringIndexMap& other) {
+    if (this != &other) {
+      StringIndexMap tmp(other);
+      swap(tmp);
+    }
+    return *this;
+  }
+  ~StringIndexMap() { clear(); }
+
+  iterator begin() {
+    iterator itr(this, 0);
+    itr.SkipEmpty();
+    return itr;
+  }
+  iterator end() { return iterator(this, capacity_); }
+
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  iterator find(const StringPiece& key) {
+    return iterator(this, FindIndex(key, Hash64(key.data(), key.size())));
+  }
+
+  size_t count(const StringPiece& key) const {
+    return FindIndex(key, Hash64(key.data(), key.size())) != capacity_ ? 1 : 0;
+  }
+
+  Value& operator[](const StringPiece& key) {
+    uint32_t fingerprint = (uint32_t)Hash64(key.data(), key.size());
+    size_t index = FindIndex(key, fingerprint);
+    if (index == capacity_) {
+      index = InsertNew(key, fingerprint, Value());
+    }
+    return slots_[index].value;
+  }
+
+  std::pair<iterator, bool> insert(const StringPiece& key, const Value& value) {
+    uint32_t fingerprint = (uint32_t)Hash64(key.data(), key.size());
+    size_t index = FindIndex(key, fingerprint);
+    bool inserted = false;
+    if (index == capacity_) {
+      index = InsertNew(key, fingerprint, value);
+      inserted = true;
+    }
+    return std::make_pair(iterator(this, index), inserted);
+  }
+
+  void erase(iterator itr) {
+    EraseIndex(itr.index_);
+  }
+
+  size_t erase(const StringPiece& key) {
+    size_t index = FindIndex(key, Hash64(key.data(), key.size()));
+    if (index == capacity_) {
+      return 0;
+    }
+    EraseIndex(index);
+    return 1;
+  }
+
+  void clear() {
+    free(ctrl_);
+    free(slots_);
+    ctrl_ = NULL;
+    slots_ = NULL;
+    capacity_ = size_ = growth_left_ = 0;
+    arena_.Clear();
+  }
+
+  // whether n more entries go in without rehashing.
+  bool fits(size_t n) const { return n <= growth_left_ && !ArenaWasted(); }
+
+  void reserve(size_t n) {
+    size_t capacity = flat_internal::kGroupWidth;
+    while (MaxLoad(capacity) < n) {
+      capacity <<= 1;
+    }
+    if (capacity > capacity_) {
+      Rehash(capacity);
+    }
+  }
+
+  void swap(StringIndexMap& other) {
+    std::swap(ctrl_, other.ctrl_);
+    std::swap(slots_, other.slots_);
+    std::swap(capacity_, other.capacity_);
+    std::swap(size_, other.size_);
+    std::swap(growth_left_, other.growth_left_);
+    arena_.swap(other.arena_);
+  }
+
+  // heap bytes held by the table and the key arena.
+  size_t MemoryUsage() const {
+    return capacity_ * (sizeof(int8_t) + sizeof(Slot)) + arena_.Capacity();
+  }
+
+ private:
+  static size_t MaxLoad(size_t capacity) {
+    return capacity - capacity / 8;
+  }
+
+  // rehashing also drops the keys of erased entries from the arena.
+  bool ArenaWasted() const {
+    return arena_.DeadBytes() > (1 << 20) && arena_.DeadBytes() > arena_.Size() / 2;
+  }
+
+  // the fingerprint is also the probe hash: 7 bits for the control byte
+  // and the next 25 bits to pick the first group.
+  size_t FindIndex(const StringPiece& key, uint32_t fingerprint) const {
+    if (capacity_ == 0) {
+      return capacity_;
+    }
+    int8_t tag = (int8_t)(fingerprint & 0x7f);
+    size_t group_mask = capacity_ / flat_internal::kGroupWidth - 1;
+    size_t group = (fingerprint >> 7) & group_mask;
+    for (size_t step = 1; ; ++step) {
+      size_t base = group * flat_internal::kGroupWidth;
+      flat_internal::Group g(ctrl_ + base);
+      for (uint32_t mask = g.Match(tag); mask != 0; mask &= mask - 1) {
+        size_t index = base + flat_internal::TrailingZeros(mask);
+        if (slots_[index].fingerprint == fingerprint &&
+            arena_.Get(slots_[index].key_ref) == key) {
+          return index;
+        }
+      }
+      if (g.MatchEmpty() != 0) {
+        return capacity_;
+      }
+      group = (group + step) & group_mask;
+    }
+  }
+
+  size_t FindSlotForInsert(uint32_t fingerprint) const {
+    size_t group_mask = capacity_ / flat_internal::kGroupWidth - 1;
+    size_t group = (fingerprint >> 7) & group_mask;
+    for (size_t step = 1; ; ++step) {
+      size_t base = group * flat_internal::kGroupWidth;
+      uint32_t mask = flat_internal::Group(ctrl_ + base).MatchEmptyOrDeleted();
+      if (mask != 0) {
+        return base + flat_internal::TrailingZeros(mask);
+      }
+      group = (group + step) & group_mask;
+    }
+  }
+
+  size_t InsertNew(const StringPiece& key, uint32_t fingerprint, const Value& value) {
+    if (growth_left_ == 0 || ArenaWasted()) {
+      size_t capacity = capacity_ == 0 ? flat_internal::kGroupWidth : capacity_;
+      if (size_ + 1 > MaxLoad(capacity) / 2) {
+        capacity <<= 1;
+      }
+      Rehash(capacity);
+    }
+    size_t index = FindSlotForInsert(fingerprint);
+    if (ctrl_[index] == flat_internal::kEmpty) {
+      --growth_left_;
+    }
+    ctrl_[index] = (int8_t)(fingerprint & 0x7f);
+    slots_[index].fingerprint = fingerprint;
+    slots_[index].key_ref = arena_.Append(key);
+    slots_[index].value = value;
+    ++size_;
+    return index;
+  }
+
+  void EraseIndex(size_t index) {
+    arena_.Release(slots_[index].key_ref);
+    --size_;
+    size_t base = index & ~(flat_internal::kGroupWidth - 1);
+    if (flat_internal::Group(ctrl_ + base).MatchEmpty() != 0) {
+      ctrl_[index] = flat_internal::kEmpty;
+      ++growth_left_;
+    } else {
+      ctrl_[index] = flat_internal::kDeleted;
+    }
+  }
+
+  // builds the new table aside and swaps it in once complete, so that a
+  // failed allocation leaves this one as it was.
+  void Rehash(size_t capacity) {
+    StringIndexMap fresh;
+    fresh.ctrl_ = flat_internal::AllocCtrl(capacity);
+    fresh.slots_ = static_cast<Slot*>(malloc(capacity * sizeof(Slot)));
+    if (!fresh.slots_) {
+      throw std::bad_alloc();
+    }
+    fresh.capacity_ = capacity;
+    fresh.size_ = size_;
+    fresh.growth_left_ = MaxLoad(capacity) - size_;
+
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0) {
+        size_t index = fresh.FindSlotForInsert(slots_[i].fingerprint);
+        fresh.ctrl_[index] = ctrl_[i];
+        fresh.slots_[index].fingerprint = slots_[i].fingerprint;
+        fresh.slots_[index].key_ref = fresh.arena_.Append(arena_.Get(slots_[i].key_ref));
+        fresh.slots_[index].value = slots_[i].value;
+      }
+    }
+    swap(fresh);
+  }
+
+
+  int8_t* ctrl_;
+  Slot* slots_;
+  size_t capacity_;
+  size_t size_;
+  size_t growth_left_;
+  StringKeyArena arena_;
+};
+
+// class StringIndexSet
+// hash_set<std::string> replacement on top of StringIndexMap.
+class StringIndexSet {
+  typedef StringIndexMap<flat_internal::EmptyValue> MapType;
+
+ public:
+  typedef StringPiece key_type;
+  typedef StringPiece value_type;
+
+  class iterator {
+   public:
+    iterator() {}
+    StringPiece operator*() const { return (*itr_).first; }
+    iterator& operator++() {
+      ++itr_;
+      return *this;
+    }
+    bool operator==(const iterator& other) const { return itr_ == other.itr_; }
+    bool operator!=(const iterator& other) const { return itr_ != other.itr_; }
+
+   private:
+    friend class StringIndexSet;
+    explicit iterator(MapType::iterator itr) : itr_(itr) {}
+    MapType::iterator itr_;
+  };
+
+  iterator begin() { return iterator(map_.begin()); }
+  iterator end() { return iterator(map_.end()); }
+  size_t size() const { return map_.size(); }
+  bool empty() const { return map_.empty(); }
+  iterator find(const StringPiece& key) { return iterator(map_.find(key)); }
+  size_t count(const StringPiece& key) const { return map_.count(key); }
+
+  std::pair<iterator, bool> insert(const StringPiece& key) {
+    std::pair<MapType::iterator, bool> ret = map_.insert(key, flat_internal::EmptyValue());
+    return std::make_pair(iterator(ret.first), ret.second);
+  }
+
+  void erase(iterator itr) { map_.erase(itr.itr_); }
+  size_t erase(const StringPiece& key) { return map_.erase(key); }
+  void clear() { map_.clear(); }
+  void reserve(size_t n) { map_.reserve(n); }
+  void swap(StringIndexSet& other) { map_.swap(other.map_); }
+  size_t MemoryUsage() const { return map_.MemoryUsage(); }
+
+ private:
+  MapType map_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_STRING_INDEX_MAP_H_
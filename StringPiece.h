@@ -0,0 +1,64 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Non-owning Reference To A Byte String.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_STRING_PIECE_H_
+#define CABINET_STRING_PIECE_H_
+
+#include <stdint.h>
+#include <cstring>
+#include <string>
+
+namespace cabinet {
+// StringPiece points to bytes owned by someone else, e.g. a std::string
+// or an index arena. It converts implicitly from std::string so that
+// string keys can be passed wherever a StringPiece is expected.
+class StringPiece {
+ public:
+  StringPiece() : data_(""), size_(0) {}
+  StringPiece(const char* data, size_t size) : data_(data), size_(size) {}
+  StringPiece(const char* str) : data_(str), size_(strlen(str)) {}
+  StringPiece(const std::string& str) : data_(str.data()), size_(str.size()) {}
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  std::string ToString() const { return std::string(data_, size_); }
+
+  int compare(const StringPiece& other) const {
+    size_t len = size_ < other.size_ ? size_ : other.size_;
+    int ret = len == 0 ? 0 : memcmp(data_, other.data_, len);
+    if (ret == 0) {
+      ret = size_ < other.size_ ? -1 : (size_ > other.size_ ? 1 : 0);
+    }
+    return ret;
+  }
+
+  bool starts_with(const StringPiece& prefix) const {
+    return size_ >= prefix.size_ && memcmp(data_, prefix.data_, prefix.size_) == 0;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+};
+
+inline bool operator==(const StringPiece& a, const StringPiece& b) {
+  return a.size() == b.size() && memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+inline bool operator!=(const StringPiece& a, const StringPiece& b) {
+  return !(a == b);
+}
+
+inline bool operator<(const StringPiece& a, const StringPiece& b) {
+  return a.compare(b) < 0;
+}
+}  // namespace cabinet
+
+#endif  // CABINET_STRING_PIECE_H_
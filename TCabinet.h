@@ -9,17 +9,316 @@
 #ifndef CABINET_CABINET_H_
 #define CABINET_CABINET_H_
 
+#include <endian.h>
+#include <errno.h>
 #include <ext/pool_allocator.h>
+#include <stdio.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <deque>
 #include <hash_map>
 #include <hash_set>
 #include <functional>
+#include <map>
 #include <string>
+#include <utility>
 #include <vector>
+#include <cstring>
 #include <exception>
 #include <sstream>
 
+#include "AlignedBufferPool.h"
+#include "AsyncReader.h"
+#include "BackgroundFlusher.h"
+#include "CabinetExceptions.h"
+#include "CabinetHash.h"
+#include "FlatHashMap.h"
+#include "FrozenIndex.h"
+#include "InlineValueMap.h"
+#include "OrderedKeyIndex.h"
+#include "RateLimiter.h"
+#include "StringIndexMap.h"
+#include "ValueCache.h"
+#include "ValueCompressor.h"
+#include "ValueView.h"
+
 namespace cabinet {
+// location of a value in the data file.
+// packed to 12 bytes, it is stored once per key in memory.
+struct BlockInfo {
+  uint32_t size;
+  uint64_t position;
+} __attribute__((packed));
+
+// on-disk layout of BlockInfo in the index file, kept with the padding of
+// the original unpacked struct so that existing index files stay readable.
+struct IndexRecord {
+  uint32_t size;
+  uint32_t padding;
+  uint64_t position;
+};
+
+// the index log. a v1 file holds bare records, each a key written by
+// KeyWriter and an IndexRecord. a v2 file starts with an IndexFileHeader
+// and holds batches, each an IndexBatchHeader and then records of a key
+// and a little endian BlockInfo, packed. so a record of an integer key
+// is always key_width + 12 bytes, and a write torn by a crash fails the
+// crc of its batch, which Open() cuts off.
+const char kIndexFileMagic[8] = { 'C', 'A', 'B', 'I', 'N', 'D', 'X', '2' };
+const uint32_t kIndexVersion = 2;
+const uint32_t kIndexBatchMagic = 0x48435442;
+// a batch is closed once its records reach this, so that replay can be
+// split at batch boundaries.
+const uint32_t kIndexBatchBytes = 1024 * 1024;
+
+struct IndexFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t key_width;  // of an integer key, 0 for strings.
+};
+
+struct IndexBatchHeader {
+  uint32_t magic;
+  uint32_t crc;  // CRC32C of the records.
+  uint64_t bytes;  // of the records that follow.
+};
+
+template <class KeyType>
+struct IndexKeyWidth {
+  static const uint32_t value = 0;
+};
+template <>
+struct IndexKeyWidth<uint32_t> {
+  static const uint32_t value = sizeof(uint32_t);
+};
+template <>
+struct IndexKeyWidth<uint64_t> {
+  static const uint32_t value = sizeof(uint64_t);
+};
+
+// class IndexLogWriter
+// appends records to an index file in the format of its version. a
+// failed write throws and leaves the file open.
+template <class KeyType, class KeyWriter>
+class IndexLogWriter {
+ public:
+  IndexLogWriter(FILE* file, uint32_t version) : file_(file), version_(version) {}
+
+  // starts a new file in the current version.
+  static void WriteHeader(FILE* file) {
+    IndexFileHeader header;
+    memcpy(header.magic, kIndexFileMagic, sizeof(header.magic));
+    header.version = htole32(kIndexVersion);
+    header.key_width = htole32(IndexKeyWidth<KeyType>::value);
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+  }
+
+  template <class Key>
+  void Add(const Key& key, const BlockInfo& block) {
+    KeyWriter()(&batch_, key);
+    if (version_ < 2) {
+      IndexRecord record;
+      record.size = htole32(block.size);
+      record.padding = 0;
+      record.position = htole64(block.position);
+      batch_.append(reinterpret_cast<const char*>(&record), sizeof(record));
+    } else {
+      BlockInfo packed;
+      packed.size = htole32(block.size);
+      packed.position = htole64(block.position);
+      batch_.append(reinterpret_cast<const char*>(&packed), sizeof(packed));
+    }
+    if (batch_.size() >= kIndexBatchBytes) {
+      Finish();
+    }
+  }
+
+  // writes the records added so far, as a batch in v2.
+  void Finish() {
+    if (batch_.empty()) {
+      return;
+    }
+    if (version_ >= 2) {
+      IndexBatchHeader header;
+      header.magic = htole32(kIndexBatchMagic);
+      header.crc = htole32(Crc32c(batch_.data(), batch_.size()));
+      header.bytes = htole64(batch_.size());
+      if (fwrite(&header, sizeof(header), 1, file_) != 1) {
+        throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+    }
+    if (fwrite(batch_.data(), batch_.size(), 1, file_) != 1) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    batch_.clear();
+  }
+
+ private:
+  FILE* file_;
+  uint32_t version_;
+  std::string batch_;
+};
+
+// index containers used by TCabinet.
+// integer keys use the open-addressing FlatHashMap, string keys the arena
+// backed StringIndexMap, other keys stay on the node based hash_map.
+template <class KeyType, class KeyHashFunc>
+struct IndexTraits {
+  typedef __gnu_cxx::hash_map<KeyType, BlockInfo, KeyHashFunc,
+    std::equal_to<KeyType>, __gnu_cxx::__pool_alloc<BlockInfo> > MapType;
+  typedef __gnu_cxx::hash_set<KeyType, KeyHashFunc,
+    std::equal_to<KeyType>, __gnu_cxx::__pool_alloc<KeyType> > SetType;
+};
+
+template <class KeyHashFunc>
+struct IndexTraits<uint32_t, KeyHashFunc> {
+  typedef FlatHashMap<uint32_t, BlockInfo, KeyHashFunc> MapType;
+  typedef FlatHashSet<uint32_t, KeyHashFunc> SetType;
+};
+
+template <class KeyHashFunc>
+struct IndexTraits<uint64_t, KeyHashFunc> {
+  typedef FlatHashMap<uint64_t, BlockInfo, KeyHashFunc> MapType;
+  typedef FlatHashSet<uint64_t, KeyHashFunc> SetType;
+};
+
+template <class KeyHashFunc>
+struct IndexTraits<std::string, KeyHashFunc> {
+  typedef StringIndexMap<BlockInfo> MapType;
+  typedef StringIndexSet SetType;
+};
+
+// how a cabinet reads values from its data files.
+enum ReadMode {
+  // through the page cache, with the kernel's readahead.
+  kReadBuffered,
+  // through the page cache, with readahead turned off by posix_fadvise,
+  // so that a read pulls in the pages of its value only.
+  kReadRandom,
+  // with O_DIRECT, bypassing the page cache, see read_buffers. values
+  // are placed so that each is read with as few 4K blocks as it spans,
+  // and the pages of written data are dropped once written back.
+  // mmap_reads is ignored.
+  kReadDirect
+};
+
+// tunables of a cabinet, take effect at the next Open().
+struct CabinetOptions {
+  // threads parsing the index log at Open(), less than 1 means 1. the log
+  // is split into byte ranges parsed in parallel, then merged in log
+  // order. a v1 log of string keys is split by a serial walk over it.
+  int load_threads;
+  // map the data file and serve reads from the mapping, see
+  // Get(key, ValueView*).
+  bool mmap_reads;
+  // throttles the reads and writes of RunCompact(), not owned. NULL
+  // leaves compaction unthrottled.
+  RateLimiter* compact_limiter;
+  // share of garbage that makes a data file, or a segment, worth
+  // rewriting. see GetReclaimableBytes().
+  double compact_garbage_ratio;
+  // when creating a db, splits its data into segment files of this size
+  // so that compaction only rewrites the segments with garbage. 0 keeps
+  // a single data file. an existing db keeps the layout it was created
+  // with.
+  uint64_t segment_size;
+  // when creating a db, stores its values compressed, see
+  // ValueCompressor. an existing db keeps what it was created with.
+  bool compress;
+  // trains a dictionary on the first values of a compressed db.
+  bool compress_dictionary;
+  // MultiGet() reads values close to each other in a data file with one
+  // preadv of up to this many bytes, gaps included. 0 reads each alone.
+  uint32_t read_coalesce_bytes;
+  // when TShardedCabinet creates a db, spreads its keys over this many
+  // TCabinets with a lock each. an existing db keeps its shard count.
+  uint32_t shards;
+  // keeps values read from the data files, decompressed, not owned. it
+  // may be shared by dbs. values in the buffer, or mapped and stored
+  // raw, are not worth it and skip it. NULL disables caching.
+  ValueCache* value_cache;
+  ReadMode read_mode;
+  // the aligned buffers of kReadDirect, not owned. it may be shared by
+  // dbs. NULL gives the cabinet a small pool of its own.
+  AlignedBufferPool* read_buffers;
+  // writes full buffers in the background, not owned. it may be shared
+  // by dbs, each cabinet is a queue of its own. Set() then fills the next of write_buffers buffers, and only
+  // waits when all of the others are still being written. NULL writes a
+  // full buffer in Set() itself.
+  BackgroundFlusher* flusher;
+  uint32_t write_buffers;
+  // Set() writes values of at least this many bytes, and any larger than
+  // a write buffer, to the data file itself instead of copying them into
+  // the buffer, along with what the buffer holds.
+  uint32_t large_value_bytes;
+  // keeps the keys in order too, for GetKeyRange() and
+  // GetKeysWithPrefix(). the index is in memory only, built from the hash
+  // index at Open().
+  bool ordered_index;
+  // opens the db read only from the index Freeze() wrote, which is mapped
+  // rather than loaded, see FrozenIndex. Set, Delete and compaction throw
+  // std::logic_error then, Drop() empties the db and reopens it writable.
+  bool frozen;
+  // when creating a db, stores the CRC32C of each value after it, checked
+  // whenever the value is read from a data file: by Get, MultiGet,
+  // compaction and RunScrub(). a mismatch throws
+  // ChecksumMismatchException. an existing db keeps what it was created
+  // with.
+  bool checksums;
+  // throttles the reads of RunScrub(), not owned. NULL leaves it
+  // unthrottled.
+  RateLimiter* scrub_limiter;
+  // keeps a copy of each value of at most this many bytes in memory, see
+  // InlineValueMap, so that Get and MultiGet never read it from disk. the
+  // values are still written to the data files, Open() reads them back.
+  // 0, the default, keeps none. a frozen db keeps none either.
+  uint32_t inline_value_bytes;
+
+  CabinetOptions() : load_threads(1), mmap_reads(false), compact_limiter(NULL),
+    compact_garbage_ratio(0.5), segment_size(0), compress(false),
+    compress_dictionary(true), read_coalesce_bytes(256 * 1024), shards(1),
+    value_cache(NULL), read_mode(kReadBuffered), read_buffers(NULL),
+    flusher(NULL), write_buffers(2), large_value_bytes(256 * 1024),
+    ordered_index(false), frozen(false), checksums(false), scrub_limiter(NULL),
+    inline_value_bytes(0) {}
+};
+
+// the files a Sync() makes durable, taken by PrepareSync(). they are
+// duplicated descriptors, so that CommitSync() runs without the cabinet's
+// lock, even while the files are replaced. a sharded cabinet adds the
+// files of every shard.
+struct SyncPoint {
+  std::vector<int> fds;
+
+  SyncPoint() {}
+  // closes what a failed PrepareSync() left.
+  ~SyncPoint() {
+    for (size_t i = 0; i < fds.size(); ++i) {
+      close(fds[i]);
+    }
+  }
+
+ private:
+  SyncPoint(const SyncPoint&);
+  void operator=(const SyncPoint&);
+};
+
+// class ReaderGate
+// lets the readers of a cabinet in while one of its calls writes files.
+// a cabinet given a gate calls AdmitReaders() before Flush() writes the
+// buffer, the index log or a checkpoint, or a segment roll syncs, and
+// ExcludeReaders() before it changes what Get() looks at again. readers
+// then wait for the in-memory part of a flush only, which is the owner's
+// lock held for writing. the owner must keep other writers out all along,
+// see TShardedCabinet.
+class ReaderGate {
+ public:
+  virtual ~ReaderGate() {}
+  virtual void AdmitReaders() = 0;
+  virtual void ExcludeReaders() = 0;
+};
 
 // we use this superclass for convenience.
 // we assume that these interfaces are not called frequently.
@@ -32,12 +331,39 @@ class CabinetBase {
   virtual void Drop() = 0;
   virtual void Flush() = 0;
   virtual void Compact() = 0;
+  virtual void BeginCompact() = 0;
+  virtual void RunCompact() = 0;
+  virtual void FinishCompact() = 0;
+  virtual uint64_t Scrub() = 0;
+  virtual void BeginScrub() = 0;
+  virtual uint64_t RunScrub() = 0;
+  // may be called from any thread. a RunCompact() or RunScrub() running,
+  // or started before the matching ResumeMaintenance(), gives up with
+  // CancelledException. calls nest.
+  virtual void CancelMaintenance() = 0;
+  virtual void ResumeMaintenance() = 0;
   virtual void Sync() = 0;
+  virtual void PrepareSync(SyncPoint* point) = 0;
+  // called under the same lock as PrepareSync() once the CommitSync() of
+  // its point failed, so that the next PrepareSync() syncs again.
+  virtual void AbandonSync() = 0;
+  virtual void Freeze() = 0;
+  // fdatasyncs and closes the files of point.
+  static void CommitSync(SyncPoint* point);
 
   virtual uint64_t GetEntryCount() const = 0;
   virtual uint64_t GetChangedCount() const = 0;
   virtual uint64_t GetDataFileSize() const = 0;
   virtual uint64_t GetDataBytes() const = 0;
+  virtual uint64_t GetReclaimableBytes() const = 0;
+  virtual uint64_t GetRawBytesWritten() const = 0;
+  virtual uint64_t GetStoredBytesWritten() const = 0;
+  virtual uint64_t GetCacheHits() const = 0;
+  virtual uint64_t GetCacheMisses() const = 0;
+  virtual uint64_t GetOrderedIndexBytes() const = 0;
+  virtual uint64_t GetChecksumErrors() const = 0;
+  virtual uint64_t GetInlineValueCount() const = 0;
+  virtual uint64_t GetInlineValueBytes() const = 0;
 
   virtual std::string GetPath() const = 0;
 };
@@ -53,52 +379,362 @@ class TCabinet : public CabinetBase {
  public:
   TCabinet();
   explicit TCabinet(const char* location);
+  TCabinet(const char* location, const CabinetOptions& options);
   virtual ~TCabinet();
 
+  void SetOptions(const CabinetOptions& options) { options_ = options; }
+  // not owned. NULL, the default, keeps readers out for a whole call.
+  void SetReaderGate(ReaderGate* gate) { gate_ = gate; }
+
   void Open(const char* location);
   void Close();
   void Drop();
   void Flush();
-  void Compact();
+  // Sync() is PrepareSync() and CommitSync() in a row. PrepareSync()
+  // flushes, CommitSync() then needs no lock, so that a server may run
+  // it once for the writes of several clients, see GroupCommit.
   void Sync();
+  void PrepareSync(SyncPoint* point);
+  void AbandonSync() { synced_ = false; }
+  // writes the live entries to the "frozen" file, for opening the db with
+  // options.frozen. it is a snapshot: later writes are not in it, and
+  // compaction removes it, so a db is best compacted before. the data
+  // files stay as they are.
+  void Freeze();
+  bool IsFrozen() const { return frozen_ != NULL; }
+
+  // Compact() is BeginCompact(), RunCompact() and FinishCompact() in a
+  // row. only BeginCompact() and FinishCompact() need to exclude other
+  // calls: RunCompact() rewrites a snapshot of the index into new files
+  // and may run along with Get/Set/Delete/Flush, but not Open/Close/Drop.
+  // FinishCompact() then catches up with the writes made meanwhile.
+  // a single data file is rewritten as a whole. with segments, only the
+  // sealed segments over compact_garbage_ratio are, their live values
+  // move to new segments.
+  void Compact();
+  void BeginCompact();
+  void RunCompact();
+  void FinishCompact();
+  void AbortCompact();
+  bool IsCompacting() const { return compaction_ != NULL; }
+
+  // Scrub() is BeginScrub() and RunScrub() in a row. BeginScrub() takes
+  // the positions of the values flushed so far and needs to exclude other
+  // calls, RunScrub() then reads them in data file order through its own
+  // fds, see scrub_limiter, and may run along with anything but
+  // Open/Close/Drop and compaction. returns the values whose checksum
+  // failed, a db without checksums only finds those that fail to read.
+  uint64_t Scrub();
+  void BeginScrub();
+  uint64_t RunScrub();
+  void AbortScrub();
+  void CancelMaintenance() { __sync_fetch_and_add(&cancels_, 1); }
+  void ResumeMaintenance() { __sync_fetch_and_sub(&cancels_, 1); }
 
   void Set(const KeyType& key, const uint8_t* value, uint32_t size);
   bool Get(const KeyType& key, std::string* value);
+  // like Get(key, value), but with mmap_reads a value already flushed to
+  // the data file is pinned in place instead of copied.
+  bool Get(const KeyType& key, ValueView* value);
+  // gets the values of keys. values in memory are copied, the others
+  // are read in file order, nearby ones merged into one preadv, see
+  // read_coalesce_bytes. the reads are all in flight at once through
+  // reader, or run one by one if it is NULL. (*found)[i] tells whether
+  // keys[i] has (*values)[i].
+  void MultiGet(const std::vector<KeyType>& keys, AsyncReader* reader,
+      std::vector<std::string>* values, std::vector<bool>* found) {
+    MultiGet(keys, reader, values, found, true);
+  }
+  // fill_cache false leaves value_cache as it is, so that a scan does
+  // not push the hot values out.
+  void MultiGet(const std::vector<KeyType>& keys, AsyncReader* reader,
+    std::vector<std::string>* values, std::vector<bool>* found, bool fill_cache);
   void Delete(const KeyType& key);
 
+  // appends the position and the key of every live entry, in no order.
+  void GetLiveEntries(std::vector<std::pair<uint64_t, KeyType> >* entries);
+  // appends the keys of the live entries in data file order, so that
+  // reading their values goes mostly sequentially, see CabinetIterator.
+  void GetKeysInFileOrder(std::vector<KeyType>* keys);
+  // sorts entries by position and appends their keys.
+  static void AppendInFileOrder(std::vector<std::pair<uint64_t, KeyType> >* entries,
+    std::vector<KeyType>* keys);
+
+  // with ordered_index, appends the keys from begin on, and before end
+  // unless it is NULL, in key order, at most limit of them, 0 for no
+  // limit. throws std::logic_error without it.
+  void GetKeyRange(const KeyType& begin, const KeyType* end, size_t limit,
+    std::vector<KeyType>* keys);
+  // the same for the keys whose OrderedKeyBytes start with prefix, which
+  // for string keys are the keys themselves.
+  void GetKeysWithPrefix(const StringPiece& prefix, size_t limit, std::vector<KeyType>* keys);
+  bool HasOrderedIndex() const { return ordered_ != NULL; }
+
+  // a key lives in at most one of original_index_ and inses_, deleted
+  // keys are already erased from both.
   uint64_t GetEntryCount() const {
-    return original_index_.size() + inses_.size() - dels_.size();
+    return original_index_.size() + inses_.size() + (frozen_ ? frozen_->size() : 0);
   }
   uint64_t GetChangedCount() const {
     return inses_.size() + dels_.size();
   }
-  uint64_t GetDataFileSize() const { return data_file_length_; }
+  uint64_t GetDataFileSize() const;
   uint64_t GetDataBytes() const { return actual_bytes_; }
+  // bytes BeginCompact() would reclaim: the garbage of a single data file
+  // once it is over compact_garbage_ratio, or of the segments over it.
+  uint64_t GetReclaimableBytes() const;
+  uint64_t GetSegmentCount() const { return segments_.size(); }
+  // value bytes given to Set since Open, and what they took stored. the
+  // same unless the db is compressed.
+  uint64_t GetRawBytesWritten() const { return raw_bytes_written_; }
+  uint64_t GetStoredBytesWritten() const { return stored_bytes_written_; }
+  // reads of values from the data files since Open that value_cache
+  // served, and that it did not.
+  uint64_t GetCacheHits() const { return cache_hits_; }
+  uint64_t GetCacheMisses() const { return cache_misses_; }
+  // heap bytes of the ordered index, 0 without one.
+  uint64_t GetOrderedIndexBytes() const {
+    return ordered_ ? ordered_->MemoryUsage() : 0;
+  }
+  bool IsCompressed() const { return compressor_ != NULL; }
+  bool HasChecksums() const { return checksums_; }
+  // values read since Open whose checksum failed, RunScrub() included.
+  uint64_t GetChecksumErrors() const { return checksum_errors_; }
+  // the values kept in memory by inline_value_bytes, and the heap bytes
+  // they take.
+  uint64_t GetInlineValueCount() const { return inline_ ? inline_->size() : 0; }
+  uint64_t GetInlineValueBytes() const { return inline_ ? inline_->MemoryUsage() : 0; }
 
   std::string GetPath() const {
     return path_;
   }
 
  private:
-  struct BlockInfo {
-    uint32_t size;
-    uint64_t position;
-  };
+  typedef typename IndexTraits<KeyType, KeyHashFunc>::MapType MapType;
+  typedef typename IndexTraits<KeyType, KeyHashFunc>::SetType SetType;
+
+  const BlockInfo* FindBlockInfo(const KeyType& key);
+  void LoadIndex();
+  bool RemoveEntry(const KeyType& key);
+  void BuildOrderedIndex();
+  void LoadInlineValues();
+  void KeepInline(const KeyType& key, const uint8_t* value, uint32_t size);
+  bool ReadInline(const KeyType& key, const BlockInfo& blk, std::string* value);
+  void AppendOrderedKeys(OrderedKeyIndex::iterator itr, const StringPiece* end,
+    const StringPiece* prefix, size_t limit, std::vector<KeyType>* keys);
   bool ReadBlockInfo(const BlockInfo& blk,
     std::string* value);
+  bool ReadBlockInfo(const BlockInfo& blk, ValueView* value);
+  const char* FindStoredBytes(const BlockInfo& blk);
+  void ReadStoredBytes(const BlockInfo& blk, std::string* value);
+  void ReadDirect(int fd, uint64_t offset, uint32_t size, char* out);
+  bool LookupCache(const BlockInfo& blk, std::string* value);
+  void EraseCache(const BlockInfo& blk);
+  void OpenCompression(bool created);
+  void WriteCompression(const std::string& dictionary);
+  void OpenChecksums(bool created);
+  static bool ChecksumMatches(const char* data, uint32_t size);
+  uint32_t CheckStored(const char* data, const BlockInfo& blk);
+  void SampleValue(const uint8_t* value, uint32_t size);
+
+  // completes the reads of MultiGet(), which go straight into values.
+  struct MultiGetReads : public AsyncReader::Callback {
+    std::vector<std::string>* values;
+    // read i fills the values of owners[firsts[i]] up to owners[firsts[i + 1]].
+    std::vector<size_t> owners;
+    std::vector<size_t> firsts;
+    const std::string* dictionary;  // NULL unless compressed.
+    bool checksums;  // the values end with their checksum.
+    // the first failure, -1 for a bad compressed value, -2 for a bad
+    // checksum.
+    int error;
+    // a direct read i goes to an aligned buffer of pool, the value of
+    // owners[j] is at offsets[j] of it. empty unless some read is direct.
+    std::vector<char> direct;
+    std::vector<uint64_t> offsets;
+    AlignedBufferPool* pool;
+    std::vector<std::pair<char*, size_t> > buffers;  // released when done.
+
+    MultiGetReads() : pool(NULL) {}
+    ~MultiGetReads();
+    void Done(size_t i, const AsyncRead& read);
+  };
+
+  // a data file. a db created without segment_size has the single
+  // segment 0 in "data", which is never sealed. otherwise segment id
+  // holds the positions from id * segment_size_ on in "data.<id>"; a
+  // value larger than a segment gets a segment of its own and the ids it
+  // spans are skipped.
+  struct Segment {
+    int fd;
+    int direct_fd;  // reads with kReadDirect, -1 otherwise.
+    uint64_t length;
+    uint64_t live;  // bytes of the values the index refers to.
+    DataMapping* mapping;  // with mmap_reads.
+  };
+  typedef std::map<uint64_t, Segment> SegmentMap;
+
+  uint64_t SegmentOf(uint64_t position) const {
+    return segment_size_ ? position / segment_size_ : 0;
+  }
+  uint64_t SegmentBase(uint64_t id) const { return id * segment_size_; }
+  uint64_t SegmentSpan(uint64_t length) const {
+    return length > segment_size_ ? (length + segment_size_ - 1) / segment_size_ : 1;
+  }
+  std::string SegmentPath(uint64_t id) const;
+  void OpenSegments(bool created);
+  Segment& OpenSegment(uint64_t id);
+  void CloseSegment(typename SegmentMap::iterator itr, bool remove);
+  void RollSegment(uint32_t size);
+  void SyncDirectory();
+  void CommitCompactFiles();
+  void SwapCompactFiles(const std::string& data_path, const std::string& index_path, bool with_data);
+  void ResumeCompactSwap();
+  void MapSegment(Segment& segment);
+  void AdviseSegment(Segment& segment, const std::string& path);
+  void CheckCancelled() const;
+  uint32_t PlacementPadding(uint32_t size) const;
+  uint32_t PlacementPadding(uint64_t offset, uint32_t size) const;
+  void AddLiveBytes(const BlockInfo& blk, bool add);
+  bool IsReclaimable(uint64_t id, const Segment& segment) const;
+  bool InBuffer(const BlockInfo& blk) const {
+    return blk.position >= data_file_length_ && blk.position - data_file_length_ < buf_pos_;
+  }
+  // in the buffer or in one being written, i.e. not in a file yet.
+  bool InWriteBuffers(const BlockInfo& blk) const;
+
+  // a full buffer written by options_.flusher: its values go to the data
+  // file at offset, the records of the changes made until then, which
+  // are in original_index_ already, to the index log.
+  struct FlushJob : public BackgroundFlusher::Job {
+    std::vector<uint8_t> buf;
+    uint32_t length;
+    uint64_t position;  // of buf in the db.
+    int fd;
+    uint64_t offset;
+    bool direct;  // the pages written are dropped, see kReadDirect.
+    std::string index_path;
+    uint32_t index_version;
+    MapType inses;
+    SetType dels;
+    // the length of the index file before its records, -1 until written.
+    int64_t index_start;
+    uint64_t index_length;  // once done.
+    int error;
+    bool* failed;  // the flush_failed_ of its cabinet.
+
+    // writes unless an earlier job of the cabinet failed.
+    void Run();
+    void Write();
+  };
+  void SetLarge(const KeyType& key, const uint8_t* value, uint32_t size, const uint32_t* crc,
+    uint32_t pad);
+  void RotateBuffer();
+  void FinishFlushJobs(bool wait);
+  static void WriteIndexRecords(FILE* file, uint32_t version, MapType& inses, SetType& dels);
+  void ApplyChanges(MapType& inses, SetType& dels, bool grow, MapType& grown);
+  void BeginSegmentCompact();
+  void RunSegmentCompact();
+  void FinishSegmentCompact();
+
+  // a compaction between BeginCompact() and FinishCompact().
+  struct Compaction {
+    MapType index;  // snapshot, moved to positions in the new data file.
+    uint64_t data_length;  // file lengths when the snapshot was taken.
+    uint64_t index_length;
+    uint64_t byte_count;  // bytes in the new data file.
+    int data_fd;  // reads the snapshot values.
+    FILE* data_file;
+    FILE* index_file;
+    std::string data_path;
+    std::string index_path;
+    // with segments, index only holds the values in the victims, which
+    // are read through their own fds, and no file above is used.
+    std::map<uint64_t, int> victims;
+    std::vector<uint64_t> outputs;  // new segments.
+    bool done;  // RunCompact() completed.
+    bool committed;  // the new files are being swapped in, see CommitCompactFiles().
+  };
+
+  // the values a scrub reads, between BeginScrub() and RunScrub().
+  struct ScrubSnapshot {
+    std::vector<BlockInfo> blocks;
+    std::map<uint64_t, int> fds;  // of the segments, duplicated.
+  };
+
+  // one byte range of the index log, parsed by its own thread.
+  struct ReplayChunk {
+    const char* data;
+    size_t size;
+    uint32_t version;
+    MapType index;  // last record of each key, tombstones included.
+    size_t parsed;
+    bool failed;
+  };
+  static void* ReplayChunkThread(void* arg);
+  static size_t ApplyIndexRecords(const char* data, size_t size, size_t block_size,
+    MapType& index, bool keep_tombstones, uint64_t* bytes);
+  static size_t ApplyIndexLog(const char* data, size_t size, uint32_t version,
+    MapType& index, bool keep_tombstones, uint64_t* bytes);
+  static bool FindIndexBatch(const char* data, size_t size);
+  uint32_t ReadIndexVersion(int fd, uint64_t length);
+  uint64_t ReplayIndex(int fd, uint64_t offset, uint64_t length);
+  bool LoadCheckpoint(uint64_t index_length);
+  uint64_t HashIndexHead(uint64_t index_offset);
+  void WriteCheckpoint();
+  CabinetOptions options_;
+  ReaderGate* gate_;
   std::string path_;
-  int fd_;  // data.cab fd, use along with buffer.
+  int fd_;  // fd of the active segment, use along with buffer.
+  // the position after the active segment, where the buffer goes.
   uint64_t data_file_length_;
+  SegmentMap segments_;
+  uint64_t segment_size_;  // 0 for a single data file.
+  uint64_t active_id_;  // the segment appended to.
+  uint64_t next_segment_id_;  // taken atomically, RunCompact() takes some.
+  Compaction* compaction_;
+  ScrubSnapshot* scrub_;
+  int cancels_;  // see CancelMaintenance().
+  ValueCompressor* compressor_;  // NULL unless the db is compressed.
+  std::string stored_;  // a value compressed by Set.
+  bool checksums_;  // values end with their CRC32C, see OpenChecksums().
+  uint64_t checksum_errors_;
+  bool sampling_;  // collecting samples_ to train the dictionary.
+  std::vector<std::string> samples_;
+  uint64_t sample_bytes_;
+  uint64_t raw_bytes_written_;
+  uint64_t stored_bytes_written_;
+  ValueCache* cache_;  // options_.value_cache as of Open.
+  uint64_t cache_owner_;  // the id of the data file positions in cache_.
+  uint64_t cache_hits_;
+  uint64_t cache_misses_;
+  AlignedBufferPool* buffers_;  // options_.read_buffers, or own_buffers_.
+  AlignedBufferPool* own_buffers_;
   uint64_t actual_bytes_;
-  typedef __gnu_cxx::hash_map<KeyType, BlockInfo, KeyHashFunc,
-    std::equal_to<KeyType>, __gnu_cxx::__pool_alloc<BlockInfo> > MapType;
-  typedef __gnu_cxx::hash_set<KeyType, KeyHashFunc,
-    std::equal_to<KeyType>, __gnu_cxx::__pool_alloc<KeyType> > SetType;
+  uint64_t index_file_length_;
+  uint32_t index_version_;  // of the index file, see IndexFileHeader.
+  uint64_t checkpoint_offset_;  // index file length covered by the checkpoint.
+  uint64_t checkpoint_bytes_;
   MapType original_index_;
   MapType inses_;
   SetType dels_;
+  // the live keys in order, NULL unless options_.ordered_index.
+  OrderedKeyIndex* ordered_;
+  // the small values, NULL unless options_.inline_value_bytes.
+  InlineValueMap<KeyType, KeyHashFunc>* inline_;
+  // the index with options_.frozen, the other ones are empty then.
+  FrozenIndex<BlockInfo>* frozen_;
   std::vector<uint8_t> buf_;
   uint32_t buf_pos_;
+  // being written by options_.flusher, oldest first. their changes are
+  // in original_index_ already, their values served from their buffers.
+  std::deque<FlushJob*> flushing_;
+  std::vector<FlushJob*> idle_jobs_;  // with buffers to reuse.
+  // a job failed, the ones after it skip until it is written again.
+  bool flush_failed_;
+  int index_fd_;  // syncs the index file, appends go through Flush().
+  // nothing was flushed since the last PrepareSync(), whose CommitSync()
+  // is done or running. AbandonSync() clears it if that failed.
   bool synced_;
 };
 }  // namespace cabinet
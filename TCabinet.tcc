@@ -8,20 +8,27 @@
 
 #include "TCabinet.h"
 
+#include <dirent.h>
 #include <endian.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <hash_map>
 #include <hash_set>
+#include <stdexcept>
 
 #include "CabinetExceptions.h"
+#include "CabinetHash.h"
 
 struct KeyData {
   void* ptr;
@@ -32,20 +39,195 @@ namespace {
 static const uint32_t sBufferSize = 4 * 1024 * 1024;
 static const uint64_t sInvalidPosition = 0xffffffffffffffff;
 static const uint32_t sInvalidSize = 0xffffffff;
+static const uint32_t sFileBufferSize = 1024 * 1024;
+// a value stored in at most this many bytes past inline_value_bytes may
+// be inline: a compression tag byte and a checksum.
+static const uint32_t sInlineOverhead = 1 + sizeof(uint32_t);
+// Flush rewrites the checkpoint once the index log tail grew larger than
+// both this and the checkpoint itself, which bounds replay work at Open
+// and keeps the rewrite cost proportional to the logged updates.
+static const uint64_t sCheckpointMinTail = 64 * 1024 * 1024;
+static const char sCheckpointMagic[8] = { 'C', 'A', 'B', 'C', 'K', 'P', 'T', '1' };
+
+// checkpoint file layout:
+//   CheckpointHeader
+//   entry_count * (key written by KeyWriter, packed little endian BlockInfo)
+//   CheckpointHeader again, so that a torn file is rejected.
+struct CheckpointHeader {
+  char magic[8];
+  uint64_t index_offset;  // index records before this offset are included.
+  uint64_t index_head;    // hash of the index file head, see HashIndexHead().
+  uint64_t entry_count;
+};
+static const uint64_t sIndexHeadSize = 4096;
+// a single data file mapping is at least this long, and twice the file
+// length when remapped, so that it is rarely remapped while growing. a
+// segment is mapped at the segment size.
+static const uint64_t sMinMappingSize = 64 * 1024 * 1024;
+// a replay thread gets at least this much of the index log.
+static const uint64_t sMinReplayChunk = 4 * 1024 * 1024;
+// a compressed db trains its dictionary once it has seen this much of
+// values no larger than sMaxSampleSize.
+static const uint64_t sDictionarySampleBytes = 256 * 1024;
+static const uint32_t sMaxSampleSize = 16 * 1024;
+// MultiGet() reads values closer than this along with the gap between
+// them, which costs less than another request.
+static const uint64_t sMultiGetGap = 16 * 1024;
+static const size_t sMultiGetMaxIovecs = 64;
+// the buffers a kReadDirect cabinet keeps for itself when it is given no
+// pool, see CabinetOptions::read_buffers.
+static const uint64_t sOwnReadBufferBytes = 1024 * 1024;
+
+// a value MultiGet() reads from a data file.
+struct MultiGetPiece {
+  int fd;
+  uint64_t offset;
+  uint32_t size;
+  uint64_t position;  // in the db, which value_cache goes by.
+  size_t owner;  // index of its key.
+  bool direct;  // fd is opened with O_DIRECT.
+
+  bool operator<(const MultiGetPiece& other) const {
+    return fd != other.fd ? fd < other.fd : offset < other.offset;
+  }
+};
+
+// a key of the index as KeyType, the keys of a StringIndexMap are pieces
+// of its arena.
+template <class KeyType>
+inline const KeyType& CopyKey(const KeyType& key) {
+  return key;
+}
+inline std::string CopyKey(const cabinet::StringPiece& key) {
+  return key.ToString();
+}
+
+// the padding of a large value written by Set(), see PlacementPadding().
+static const uint8_t sZeroPadding[4096] = { 0 };
+
+// writes pad bytes of padding to file.
+inline bool WritePadding(FILE* file, uint32_t pad) {
+  return pad == 0 || fwrite(sZeroPadding, pad, 1, file) == 1;
+}
+
+// cuts what a failed append left at the end of the index file at path.
+// if this fails too, the next append cuts it first.
+inline bool CutIndex(const std::string& path, uint64_t length) {
+  return truncate(path.c_str(), length) == 0;
+}
+
+// pwritev that goes on after a short write. iov is consumed.
+inline bool PwritevFully(int fd, struct iovec* iov, int iovcnt, uint64_t offset) {
+  while (iovcnt > 0) {
+    ssize_t ret = pwritev(fd, iov, iovcnt, offset);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    } else if (ret == 0) {
+      errno = EIO;
+      return false;
+    }
+    offset += ret;
+    while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  return true;
+}
 }  // namespace
 
 namespace cabinet {
 using std::string;
 
+inline bool PositionLess(const BlockInfo* a, const BlockInfo* b) {
+  return a->position < b->position;
+}
+
+inline bool BlockPositionLess(const BlockInfo& a, const BlockInfo& b) {
+  return a.position < b.position;
+}
+
+template <class KeyType>
+bool EntryPositionLess(const std::pair<BlockInfo, KeyType>& a, const std::pair<BlockInfo, KeyType>& b) {
+  return a.first.position < b.first.position;
+}
+
+template <class MapType>
+void ReserveIndex(MapType& map, size_t n) {
+  map.reserve(n);
+}
+
+template <class K, class V, class H, class E, class A>
+void ReserveIndex(__gnu_cxx::hash_map<K, V, H, E, A>& map, size_t n) {
+  map.resize(n);
+}
+
+// whether n more keys go into map without a rehash.
+template <class MapType>
+bool IndexFits(const MapType& map, size_t n) {
+  return map.fits(n);
+}
+
+template <class K, class V, class H, class E, class A>
+bool IndexFits(const __gnu_cxx::hash_map<K, V, H, E, A>& map, size_t n) {
+  return map.size() + n <= map.bucket_count();
+}
+
+// admits the readers of a gate, if any, for a scope.
+class ReadersAdmitted {
+ public:
+  explicit ReadersAdmitted(ReaderGate* gate) : gate_(gate) {
+    if (gate_) {
+      gate_->AdmitReaders();
+    }
+  }
+  ~ReadersAdmitted() {
+    if (gate_) {
+      gate_->ExcludeReaders();
+    }
+  }
+
+ private:
+  ReaderGate* gate_;
+};
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::TCabinet() : gate_(NULL), fd_(-1),
+                     data_file_length_(0), segment_size_(0), active_id_(0), next_segment_id_(0), compaction_(NULL), scrub_(NULL), cancels_(0),
+                  compressor_(NULL), checksums_(false), checksum_errors_(0), sampling_(false), sample_bytes_(0), raw_bytes_written_(0),
+                  stored_bytes_written_(0), cache_(NULL),
+                  cache_owner_(0), cache_hits_(0), cache_misses_(0), buffers_(NULL), own_buffers_(NULL), actual_bytes_(0), index_file_length_(0), index_version_(kIndexVersion),
+                     checkpoint_offset_(0), checkpoint_bytes_(0), ordered_(NULL), inline_(NULL), frozen_(NULL), buf_pos_(0), flush_failed_(false), index_fd_(-1), synced_(false) {
+  buf_.resize(sBufferSize);
+}
+
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::TCabinet() : fd_(-1),
-                     data_file_length_(0), actual_bytes_(0), buf_pos_(0), synced_(false) {
+TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::TCabinet(const char* file_name) : gate_(NULL), fd_(-1),
+                  data_file_length_(0), segment_size_(0), active_id_(0), next_segment_id_(0), compaction_(NULL), scrub_(NULL), cancels_(0),
+                  compressor_(NULL), checksums_(false), checksum_errors_(0), sampling_(false), sample_bytes_(0), raw_bytes_written_(0),
+                  stored_bytes_written_(0), cache_(NULL),
+                  cache_owner_(0), cache_hits_(0), cache_misses_(0), buffers_(NULL), own_buffers_(NULL), actual_bytes_(0), index_file_length_(0), index_version_(kIndexVersion),
+                  checkpoint_offset_(0), checkpoint_bytes_(0), ordered_(NULL), inline_(NULL), frozen_(NULL), buf_pos_(0), flush_failed_(false), index_fd_(-1), synced_(false) {
   buf_.resize(sBufferSize);
+  Open(file_name);
 }
 
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::TCabinet(const char* file_name) : fd_(-1),
-                  data_file_length_(0), actual_bytes_(0), buf_pos_(0), synced_(false) {
+TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::TCabinet(const char* file_name,
+                  const CabinetOptions& options) : options_(options), gate_(NULL), fd_(-1),
+                  data_file_length_(0), segment_size_(0), active_id_(0), next_segment_id_(0), compaction_(NULL), scrub_(NULL), cancels_(0),
+                  compressor_(NULL), checksums_(false), checksum_errors_(0), sampling_(false), sample_bytes_(0), raw_bytes_written_(0),
+                  stored_bytes_written_(0), cache_(NULL),
+                  cache_owner_(0), cache_hits_(0), cache_misses_(0), buffers_(NULL), own_buffers_(NULL), actual_bytes_(0), index_file_length_(0), index_version_(kIndexVersion),
+                  checkpoint_offset_(0), checkpoint_bytes_(0), ordered_(NULL), inline_(NULL), frozen_(NULL), buf_pos_(0), flush_failed_(false), index_fd_(-1), synced_(false) {
   buf_.resize(sBufferSize);
   Open(file_name);
 }
@@ -61,371 +243,2866 @@ void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Open(const char* loca
 
   // normalize path
   path_ = location;
-  if ((*path_.rend()) != '/') {
+  if ((*path_.rbegin()) != '/') {
     path_ += '/';
   }
 
   // mkdir
   mkdir(path_.c_str(), S_IRUSR | S_IWUSR | S_IEXEC);
 
-  // open data file
-  // create the file if not exists
-  fd_ = open((path_ + "data").c_str(),
-    O_RDWR | O_CREAT | O_NONBLOCK, S_IRUSR | S_IWUSR);
-  if (fd_ == -1) {
-    throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+  cache_ = options_.value_cache;
+  if (cache_) {
+    cache_owner_ = cache_->NewOwner();
+  }
+  buffers_ = options_.read_buffers;
+  if (options_.read_mode == kReadDirect && !buffers_) {
+    own_buffers_ = new AlignedBufferPool(sOwnReadBufferBytes);
+    buffers_ = own_buffers_;
   }
 
-  // stat and init file length
-  struct stat f_stat;
-  if (lstat((path_ + "data").c_str(), &f_stat) == -1) {
-    throw StatFileException(__FILE__, __LINE__, errno, strerror(errno));
+  // whatever fails, Close() releases what was opened so far.
+  try {
+    // a compaction cut off while it swapped its files in is finished first.
+    if (!options_.frozen) {
+      ResumeCompactSwap();
+    }
+
+    // a new db takes the data layout and the compression of options_. a
+    // frozen one may have been copied without its index file.
+    struct stat f_stat;
+    bool created = !options_.frozen &&
+      lstat((path_ + "index").c_str(), &f_stat) == -1 && errno == ENOENT;
+
+    // open data files
+    // create them if not exists
+    OpenSegments(created);
+    OpenCompression(created);
+    OpenChecksums(created);
+
+    if (options_.frozen) {
+      // nothing to load, see Freeze().
+      frozen_ = new FrozenIndex<BlockInfo>;
+      frozen_->Open(path_ + "frozen");
+      actual_bytes_ = frozen_->GetUserData();
+    } else {
+      LoadIndex();
+      index_fd_ = open((path_ + "index").c_str(), O_RDONLY);
+      if (index_fd_ == -1) {
+        throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+    }
+    if (options_.ordered_index) {
+      BuildOrderedIndex();
+    }
+    if (options_.inline_value_bytes > 0 && !frozen_) {
+      LoadInlineValues();
+    }
+    // the files of a new db are durable with their directory entries.
+    if (created) {
+      SyncDirectory();
+    }
+  } catch (...) {
+    // no checkpoint of an index that failed to load.
+    checkpoint_offset_ = index_file_length_;
+    Close();
+    throw;
   }
-  data_file_length_ = f_stat.st_size;
+  synced_ = true;
+}
 
+// reads the index file into original_index_, creating it if there is
+// none.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::LoadIndex() {
+  struct stat f_stat;
   // read index from the indexing file
   // create the file if not exists
   FILE* file = fopen((path_ + "index").c_str(), "a");
   if (!file) {
     throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
   }
-  fclose(file);
+  // a new log starts in the current format, an older one is appended to
+  // in its own until Compact() rewrites it.
+  if (fstat(fileno(file), &f_stat) == -1) {
+    int err = errno;
+    fclose(file);
+    throw StatFileException(__FILE__, __LINE__, err, strerror(err));
+  }
+  if (f_stat.st_size == 0) {
+    try {
+      IndexLogWriter<KeyType, KeyWriter>::WriteHeader(file);
+    } catch (...) {
+      fclose(file);
+      throw;
+    }
+  }
+  if (fclose(file) != 0) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
 
   file = fopen((path_ + "index").c_str(), "r");
   if (!file) {
     throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
   }
+  if (fstat(fileno(file), &f_stat) == -1) {
+    int err = errno;
+    fclose(file);
+    throw StatFileException(__FILE__, __LINE__, err, strerror(err));
+  }
+  index_file_length_ = f_stat.st_size;
 
-  KeyType key;
-  BlockInfo block;
-  while (KeyReader()(file, key)) {
-    if (fread(&block, sizeof(block), 1, file) != 1) {
-      int err = errno;
-      fclose(file);
-      throw FileCorruptException(__FILE__, __LINE__, err, strerror(err));
+  // start from the checkpoint if there is a valid one, then replay only
+  // the part of the log written after it.
+  uint64_t offset = LoadCheckpoint(index_file_length_) ? checkpoint_offset_ : 0;
+  uint64_t end;
+  try {
+    index_version_ = ReadIndexVersion(fileno(file), index_file_length_);
+    if (index_version_ >= 2) {
+      offset = std::max<uint64_t>(offset, sizeof(IndexFileHeader));
     }
-    block.position = le64toh(block.position);
-    block.size = le32toh(block.size);
+    end = ReplayIndex(fileno(file), offset, index_file_length_);
+  } catch (...) {
+    fclose(file);
+    throw;
+  }
+  fclose(file);
+  // the tail torn by a crash is cut off, so that appends follow whole
+  // records.
+  if (end < index_file_length_) {
+    if (truncate((path_ + "index").c_str(), end) != 0) {
+      throw TruncateFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    index_file_length_ = end;
+  }
 
-    // if deleted from original index
-    if (block.position == sInvalidPosition &&
-      block.size == sInvalidSize) {
-      typename MapType::iterator itr = original_index_.find(key);
-      if (itr != original_index_.end()) {
-        original_index_.erase(itr);
-        actual_bytes_ -= itr->second.size;
-      }
-    } else {
-      if (original_index_.find(key) == original_index_.end()) {
-        actual_bytes_ += block.size;
+  // a segment nothing refers to was left by an interrupted compaction,
+  // or its values were all overwritten. a frozen index may still point
+  // to it, and goes with it.
+  if (segment_size_) {
+    for (typename MapType::iterator itr = original_index_.begin();
+        itr != original_index_.end(); ++itr) {
+      AddLiveBytes(itr->second, true);
+    }
+    for (typename SegmentMap::iterator itr = segments_.begin(); itr != segments_.end(); ) {
+      if (itr->first != active_id_ && itr->second.live == 0) {
+        CloseSegment(itr++, true);
+        unlink((path_ + "frozen").c_str());
+      } else {
+        ++itr;
       }
-      original_index_[key] = block;
     }
   }
-  fclose(file);
-  synced_ = true;
 }
 
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Close() {
-  if (fd_ == -1) {
-    return;
+std::string TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::SegmentPath(uint64_t id) const {
+  if (!segment_size_) {
+    return path_ + "data";
   }
+  std::stringstream oss;
+  oss << path_ << "data." << id;
+  return oss.str();
+}
 
-  Flush();
-
-  // reset to initial state
-  close(fd_);
-  fd_ = -1;
-  data_file_length_ = 0;
+// a db with a "segments" file, which holds the segment size, keeps its
+// data in segments. a new db gets one if options_.segment_size is set.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::OpenSegments(bool created) {
+  segment_size_ = 0;
+  FILE* file = fopen((path_ + "segments").c_str(), "r");
+  if (file) {
+    unsigned long long size = 0;
+    int ret = fscanf(file, "%llu", &size);
+    fclose(file);
+    if (ret != 1 || size == 0) {
+      throw FileCorruptException(__FILE__, __LINE__, 0, "bad segments file");
+    }
+    segment_size_ = size;
+  } else if (created && options_.segment_size > 0) {
+    string tmpPath = path_ + "segments.tmp";
+    file = fopen(tmpPath.c_str(), "w");
+    if (!file) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    fprintf(file, "%llu\n", (unsigned long long)options_.segment_size);
+    if (fflush(file) != 0) {
+      int err = errno;
+      fclose(file);
+      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+    fsync(fileno(file));
+    fclose(file);
+    if (rename(tmpPath.c_str(), (path_ + "segments").c_str()) != 0) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    segment_size_ = options_.segment_size;
+  }
 
-  original_index_.clear();
-  inses_.clear();
-  dels_.clear();
+  if (segment_size_) {
+    DIR* dir = opendir(path_.c_str());
+    if (!dir) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    std::vector<uint64_t> ids;
+    while (struct dirent* entry = readdir(dir)) {
+      const char* name = entry->d_name;
+      char* end = NULL;
+      if (strncmp(name, "data.", 5) == 0 && isdigit(name[5])) {
+        uint64_t id = strtoull(name + 5, &end, 10);
+        if (*end == '\0') {
+          ids.push_back(id);
+        }
+      }
+    }
+    closedir(dir);
+    for (size_t i = 0; i < ids.size(); ++i) {
+      OpenSegment(ids[i]);
+    }
+  }
+  if (segments_.empty()) {
+    OpenSegment(0);
+  }
 
-  path_.clear();
+  // appends go to the last segment, new ones are numbered after all.
+  next_segment_id_ = 0;
+  for (typename SegmentMap::iterator itr = segments_.begin(); itr != segments_.end(); ++itr) {
+    next_segment_id_ = itr->first + (segment_size_ ? SegmentSpan(itr->second.length) : 1);
+  }
+  active_id_ = segments_.rbegin()->first;
+  fd_ = segments_.rbegin()->second.fd;
+  data_file_length_ = SegmentBase(active_id_) + segments_.rbegin()->second.length;
 }
 
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Drop() {
-  Close();
-  if (truncate((path_ + "data").c_str(), 0) != 0) {
-    throw TruncateFileException(__FILE__, __LINE__, errno, strerror(errno));
+typename TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Segment&
+TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::OpenSegment(uint64_t id) {
+  string path = SegmentPath(id);
+  int flags = options_.frozen ? O_RDONLY : O_RDWR | O_CREAT | O_NONBLOCK;
+  int fd = open(path.c_str(), flags, S_IRUSR | S_IWUSR);
+  if (fd == -1) {
+    throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
   }
-  if (truncate((path_ + "index").c_str(), 0) != 0) {
-    throw TruncateFileException(__FILE__, __LINE__, errno, strerror(errno));
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    int err = errno;
+    close(fd);
+    throw StatFileException(__FILE__, __LINE__, err, strerror(err));
   }
-  Open(path_.c_str());
+  Segment& segment = segments_[id];
+  segment.fd = fd;
+  segment.direct_fd = -1;
+  segment.length = st.st_size;
+  segment.live = 0;
+  segment.mapping = NULL;
+  AdviseSegment(segment, path);
+  MapSegment(segment);
+  return segment;
 }
 
+// closes a segment, and with remove unlinks its file. pinned views still
+// map it.
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Set(const KeyType& key, const uint8_t* value, uint32_t size) {
-  // firstly remove old data
-  Delete(key);
-
-  // write data into buffer
-  if (buf_pos_ + size > buf_.size()) {
-    Flush();
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::CloseSegment(
+    typename SegmentMap::iterator itr, bool remove) {
+  if (remove) {
+    unlink(SegmentPath(itr->first).c_str());
   }
-  if (size > buf_.size()) {
-    ssize_t ret = pwrite(fd_, value, size, data_file_length_);
-    if (ret != size) {
-      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
-    }
-    data_file_length_ += size;
-    typename SetType::iterator itr = dels_.find(key);
-    if (itr != dels_.end()) {
-      dels_.erase(itr);
-    }
-    BlockInfo& blk = inses_[key];
-    blk.position = data_file_length_;
-    blk.size = size;
-    Flush();
+  if (itr->second.fd != -1) {
+    close(itr->second.fd);
   }
-
-  memcpy(&buf_[buf_pos_], value, size);
-  buf_pos_ += size;
-  typename SetType::iterator itr = dels_.find(key);
-  if (itr != dels_.end()) {
-    dels_.erase(itr);
+  if (itr->second.direct_fd != -1) {
+    close(itr->second.direct_fd);
   }
-  BlockInfo& blk = inses_[key];
-  blk.position = data_file_length_ + buf_pos_ - size;
-  blk.size = size;
-  actual_bytes_ += size;
+  if (itr->second.mapping) {
+    itr->second.mapping->Unref();
+  }
+  segments_.erase(itr);
 }
 
+// seals the active segment, whose buffer must be flushed, and starts a
+// new one that takes a value of size.
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Get(const KeyType& key, std::string* value) {
-  // finding in insert map
-  typename MapType::iterator itr = inses_.find(key);
-  if (itr != inses_.end()) {
-    return ReadBlockInfo(itr->second, value);
-  }
-
-  // finding in delete set
-  typename SetType::iterator itr_set = dels_.find(key);
-  if (itr_set != dels_.end()) {
-    return false;
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::RollSegment(uint32_t size) {
+  // a sealed segment is not written again.
+  {
+    ReadersAdmitted admitted(gate_);
+    fsync(fd_);
+    if (segments_[active_id_].direct_fd != -1) {
+      posix_fadvise(fd_, 0, 0, POSIX_FADV_DONTNEED);
+    }
   }
-
-  // finding in original index map
-  itr = original_index_.find(key);
-  if (itr != original_index_.end()) {
-    return ReadBlockInfo(itr->second, value);
+  uint64_t id = __sync_fetch_and_add(&next_segment_id_, SegmentSpan(size));
+  Segment& segment = OpenSegment(id);
+  {
+    ReadersAdmitted admitted(gate_);
+    SyncDirectory();
   }
-
-  return false;
+  active_id_ = id;
+  fd_ = segment.fd;
+  data_file_length_ = SegmentBase(id) + segment.length;
 }
 
+// makes the files created or renamed in the db directory durable.
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Delete(const KeyType& key) {
-  typename MapType::iterator itr = inses_.find(key);
-  if (itr != inses_.end()) {
-    inses_.erase(itr);
-    dels_.insert(key);
-    actual_bytes_ -= itr->second.size;
-  } else if (dels_.find(key) == dels_.end() && (itr = original_index_.find(key)) != original_index_.end()) {
-    original_index_.erase(itr);
-    dels_.insert(key);
-    actual_bytes_ -= itr->second.size;
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::SyncDirectory() {
+  int fd = open(path_.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  int ret = fsync(fd);
+  int err = errno;
+  close(fd);
+  if (ret != 0) {
+    throw SyncFileException(__FILE__, __LINE__, err, strerror(err));
   }
 }
 
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Flush() {
-  if (fd_ == -1 && buf_pos_ == 0 && inses_.empty() && dels_.empty()) {
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::AddLiveBytes(const BlockInfo& blk, bool add) {
+  if (!segment_size_ || blk.size == 0) {
     return;
   }
-
-  // mkdir
-  mkdir(path_.c_str(), S_IRUSR | S_IWUSR | S_IEXEC);
-
-  // writing buffer into data file
-  if (buf_pos_ != 0) {
-    ssize_t ret = pwrite(fd_, &buf_[0], buf_pos_, data_file_length_);
-    if (ret != buf_pos_) {
-      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  typename SegmentMap::iterator itr = segments_.find(SegmentOf(blk.position));
+  if (itr != segments_.end()) {
+    if (add) {
+      itr->second.live += blk.size;
+    } else {
+      itr->second.live -= blk.size;
     }
-    data_file_length_ += buf_pos_;
-    buf_pos_ = 0;
   }
+}
 
-  // appending entries from inses_ & dels_
-  FILE* file = fopen((path_ + "index").c_str(), "ab");
-  if (!file) {
-    throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
-  }
-  // in case the last entry in the file corrupts.
-  struct stat st;
-  if (lstat((path_ + "index").c_str(), &st) == -1) {
-    int err = errno;
-    fclose(file);
-    throw StatFileException(__FILE__, __LINE__, err, strerror(err));
-  }
+// a sealed segment whose garbage is over compact_garbage_ratio.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::IsReclaimable(uint64_t id,
+    const Segment& segment) const {
+  return id != active_id_ &&
+    segment.length - segment.live >= segment.length * options_.compact_garbage_ratio;
+}
 
-  BlockInfo block;
-  for (typename MapType::iterator itr = inses_.begin();
-      itr != inses_.end(); ++itr) {
-    KeyWriter()(file, itr->first);
-    block.position = htole64(itr->second.position);
-    block.size = htole32(itr->second.size);
-    if (fwrite(&block, sizeof(block), 1, file) != 1) {
-      int err = errno;
-      fclose(file);
-      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
-    }
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint64_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::GetDataFileSize() const {
+  uint64_t size = 0;
+  for (typename SegmentMap::const_iterator itr = segments_.begin(); itr != segments_.end(); ++itr) {
+    size += itr->second.length;
   }
+  return size;
+}
 
-  for (typename MapType::iterator itr = inses_.begin();
-      itr != inses_.end(); ++itr) {
-    original_index_[itr->first] = itr->second;
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint64_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::GetReclaimableBytes() const {
+  uint64_t bytes = 0;
+  if (frozen_) {
+    return 0;
   }
-  inses_.clear();
-
-  for (typename SetType::iterator itr = dels_.begin();
-      itr != dels_.end(); ++itr) {
-    KeyWriter()(file, *itr);
-    block.position = sInvalidPosition;
-    block.size = sInvalidSize;
-    if (fwrite(&block, sizeof(block), 1, file) != 1) {
-      int err = errno;
-      fclose(file);
-      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
-    }
+  if (!segment_size_) {
+    // actual_bytes_ counts the buffer too, which is not in the file yet.
+    bytes = data_file_length_ > actual_bytes_ ? data_file_length_ - actual_bytes_ : 0;
+    return bytes > 0 && bytes >= data_file_length_ * options_.compact_garbage_ratio ? bytes : 0;
   }
-
-  typename MapType::iterator itr_map;
-  for (typename SetType::iterator itr = dels_.begin();
-      itr != dels_.end(); ++itr) {
-    itr_map = original_index_.find(*itr);
-    if (itr_map != original_index_.end()) {
-      original_index_.erase(itr_map);
+  for (typename SegmentMap::const_iterator itr = segments_.begin(); itr != segments_.end(); ++itr) {
+    if (IsReclaimable(itr->first, itr->second)) {
+      bytes += itr->second.length - itr->second.live;
     }
   }
-  dels_.clear();
-  fflush(file);
-  fclose(file);
-  synced_ = false;
+  return bytes;
 }
 
+// a db with a "compression" file stores its values compressed, the file
+// holds the dictionary once it is trained. a new db gets one if
+// options_.compress is set.
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Sync() {
-  if (fd_ == -1) {
-    return;
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::OpenCompression(bool created) {
+  if (created && options_.compress) {
+    WriteCompression("");
   }
-
-  Flush();
-  if (!synced_) {
+  FILE* file = fopen((path_ + "compression").c_str(), "rb");
+  if (!file) {
     return;
   }
+  std::string dictionary;
+  char buffer[4096];
+  size_t count;
+  while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    dictionary.append(buffer, count);
+  }
+  int err = ferror(file) ? errno : 0;
+  fclose(file);
+  if (err) {
+    throw ReadFileException(__FILE__, __LINE__, err, strerror(err));
+  }
+  compressor_ = new ValueCompressor;
+  compressor_->SetDictionary(dictionary);
+  sampling_ = dictionary.empty() && options_.compress_dictionary;
+}
 
-  FILE* file = fopen((path_ + "index").c_str(), "ab");
+// the dictionary is durable before any value compressed with it.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::WriteCompression(const std::string& dictionary) {
+  string tmpPath = path_ + "compression.tmp";
+  FILE* file = fopen(tmpPath.c_str(), "wb");
   if (!file) {
     throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
   }
+  if ((!dictionary.empty() && fwrite(dictionary.data(), dictionary.size(), 1, file) != 1) ||
+      fflush(file) != 0) {
+    int err = errno;
+    fclose(file);
+    throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+  }
   fsync(fileno(file));
-  fsync(fd_);
   fclose(file);
-  synced_ = true;
+  if (rename(tmpPath.c_str(), (path_ + "compression").c_str()) != 0) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
 }
 
+// keeps the first values of a compressed db, then trains the dictionary
+// on them. a training that finds nothing common is not retried until
+// the next Open.
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Compact() {
-  if (fd_ == -1) {
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::SampleValue(const uint8_t* value, uint32_t size) {
+  if (size > sMaxSampleSize) {
     return;
   }
-  Flush();
-
-  pid_t pid = getpid();
+  samples_.push_back(std::string((const char*)value, size));
+  sample_bytes_ += size;
+  if (sample_bytes_ < sDictionarySampleBytes) {
+    return;
+  }
+  std::string dictionary = ValueCompressor::Train(samples_);
+  samples_.clear();
+  sample_bytes_ = 0;
+  sampling_ = false;
+  if (!dictionary.empty()) {
+    WriteCompression(dictionary);
+    compressor_->SetDictionary(dictionary);
+  }
+}
+
+// a db with a "checksums" file stores the CRC32C of each value after
+// it, a new db gets one if options_.checksums is set.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::OpenChecksums(bool created) {
+  if (created && options_.checksums) {
+    int fd = open((path_ + "checksums").c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    close(fd);
+  }
+  struct stat st;
+  checksums_ = lstat((path_ + "checksums").c_str(), &st) == 0;
+}
+
+// whether the size stored bytes of a value of a db with checksums end
+// with the checksum of the bytes before it.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ChecksumMatches(const char* data,
+    uint32_t size) {
+  uint32_t crc;
+  if (size < sizeof(crc)) {
+    return false;
+  }
+  memcpy(&crc, data + size - sizeof(crc), sizeof(crc));
+  return Crc32c(data, size - sizeof(crc)) == le32toh(crc);
+}
+
+// the size of the stored bytes of blk before its checksum, if the db has
+// them. a mismatch throws.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint32_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::CheckStored(const char* data,
+    const BlockInfo& blk) {
+  if (!checksums_ || blk.size == 0) {
+    return blk.size;
+  }
+  if (!ChecksumMatches(data, blk.size)) {
+    __sync_fetch_and_add(&checksum_errors_, 1);
+    throw ChecksumMismatchException(__FILE__, __LINE__, 0, "bad value checksum");
+  }
+  return blk.size - sizeof(uint32_t);
+}
+
+// applies the index records in [data, data + size) to index, the last
+// record of a key wins. a record is a key, then block_size bytes: the
+// size of the value first and its position last, see IndexRecord and
+// IndexFileHeader. a tombstone erases the key, or with keep_tombstones
+// is stored as an invalid BlockInfo so that it can erase the key from an
+// older index later. bytes tracks live value bytes. returns the bytes
+// parsed, less than size if the log ends inside a record.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+size_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ApplyIndexRecords(const char* data,
+    size_t size, size_t block_size, MapType& index, bool keep_tombstones, uint64_t* bytes) {
+  KeyType key;
+  BlockInfo block;
+  size_t pos = 0;
+  while (pos < size) {
+    size_t key_size = KeyReader()(data + pos, size - pos, key);
+    if (key_size == 0 || size - pos - key_size < block_size) {
+      break;
+    }
+    const char* record = data + pos + key_size;
+    memcpy(&block.size, record, sizeof(block.size));
+    memcpy(&block.position, record + block_size - sizeof(block.position), sizeof(block.position));
+    pos += key_size + block_size;
+    block.position = le64toh(block.position);
+    block.size = le32toh(block.size);
+
+    // if deleted from original index
+    if (block.position == sInvalidPosition &&
+      block.size == sInvalidSize && !keep_tombstones) {
+      typename MapType::iterator itr = index.find(key);
+      if (itr != index.end()) {
+        if (bytes) {
+          *bytes -= itr->second.size;
+        }
+        index.erase(itr);
+      }
+    } else {
+      BlockInfo& blk = index[key];
+      // a fresh entry is zeroed by operator[].
+      if (bytes) {
+        *bytes -= blk.size;
+        *bytes += block.size;
+      }
+      blk = block;
+    }
+  }
+  return pos;
+}
+
+// applies the log in [data, data + size) of an index file of version,
+// which starts at a record, or in v2 at a batch. returns the bytes
+// parsed, less than size before a v1 record cut short, or before a v2
+// batch that is cut short or fails its crc. a batch is applied only once
+// it checks out.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+size_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ApplyIndexLog(const char* data,
+    size_t size, uint32_t version, MapType& index, bool keep_tombstones, uint64_t* bytes) {
+  if (version < 2) {
+    return ApplyIndexRecords(data, size, sizeof(IndexRecord), index, keep_tombstones, bytes);
+  }
+  IndexBatchHeader header;
+  size_t pos = 0;
+  while (size - pos >= sizeof(header)) {
+    memcpy(&header, data + pos, sizeof(header));
+    const char* records = data + pos + sizeof(header);
+    uint64_t length = le64toh(header.bytes);
+    if (le32toh(header.magic) != kIndexBatchMagic || length > size - pos - sizeof(header) ||
+        Crc32c(records, length) != le32toh(header.crc)) {
+      break;
+    }
+    // integer keys make records of one width, parsed without branching
+    // on the key.
+    if (ApplyIndexRecords(records, length, sizeof(BlockInfo), index,
+        keep_tombstones, bytes) != length) {
+      throw FileCorruptException(__FILE__, __LINE__, 0, "partial index record in batch");
+    }
+    pos += sizeof(header) + length;
+  }
+  return pos;
+}
+
+// whether a v2 batch that checks out starts anywhere in
+// [data, data + size), i.e. the log goes on after a bad batch.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::FindIndexBatch(const char* data,
+    size_t size) {
+  uint32_t magic = htole32(kIndexBatchMagic);
+  IndexBatchHeader header;
+  const char* end = data + size;
+  for (const char* p = data; end - p >= (ssize_t)sizeof(header); ++p) {
+    p = static_cast<const char*>(memmem(p, end - p, &magic, sizeof(magic)));
+    if (!p || end - p < (ssize_t)sizeof(header)) {
+      return false;
+    }
+    memcpy(&header, p, sizeof(header));
+    uint64_t length = le64toh(header.bytes);
+    if (length <= (uint64_t)(end - p) - sizeof(header) &&
+        Crc32c(p + sizeof(header), length) == le32toh(header.crc)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the version of the index file, 1 if it has no header.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint32_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReadIndexVersion(int fd,
+    uint64_t length) {
+  IndexFileHeader header;
+  if (length < sizeof(header)) {
+    return 1;
+  }
+  if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+    throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  if (memcmp(header.magic, kIndexFileMagic, sizeof(header.magic)) != 0) {
+    return 1;
+  }
+  if (le32toh(header.version) != kIndexVersion ||
+      le32toh(header.key_width) != IndexKeyWidth<KeyType>::value) {
+    throw FileCorruptException(__FILE__, __LINE__, 0, "unknown index format");
+  }
+  return kIndexVersion;
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void* TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReplayChunkThread(void* arg) {
+  ReplayChunk* chunk = static_cast<ReplayChunk*>(arg);
+  try {
+    chunk->parsed = ApplyIndexLog(chunk->data, chunk->size, chunk->version, chunk->index,
+      true, NULL);
+  } catch (...) {
+    chunk->failed = true;
+  }
+  return NULL;
+}
+
+// replays the index log between offset and length into original_index_.
+// returns where the log ends: length, or where a tail torn by a crash
+// starts. a bad batch followed by good ones throws, the log is corrupt.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint64_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReplayIndex(int fd,
+    uint64_t offset, uint64_t length) {
+  if (offset >= length) {
+    return length;
+  }
+  void* base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (base == MAP_FAILED) {
+    throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  madvise(base, length, MADV_SEQUENTIAL);
+  const char* data = static_cast<const char*>(base) + offset;
+  size_t size = length - offset;
+  uint32_t version = index_version_;
+
+  // cut the log at record, or batch, boundaries into ranges of similar
+  // size.
+  size_t threads = std::min<uint64_t>(std::max(options_.load_threads, 1),
+    size / sMinReplayChunk);
+  std::vector<size_t> starts(1, 0);
+  size_t record_size = IndexKeyWidth<KeyType>::value + sizeof(IndexRecord);
+  size_t pos = 0;
+  while (starts.size() < threads) {
+    if (version < 2 && IndexKeyWidth<KeyType>::value > 0) {
+      // v1 records of integer keys have one width, a boundary follows from
+      // the offset alone.
+      pos = (size / threads * starts.size() + record_size - 1) / record_size * record_size;
+      if (pos >= size) {
+        break;
+      }
+    } else if (version < 2) {
+      // v1 string keys are found by decoding them one by one, so cutting
+      // such a log is a serial walk over all of it.
+      KeyType key;
+      size_t key_size = KeyReader()(data + pos, size - pos, key);
+      if (key_size == 0 || size - pos - key_size < sizeof(IndexRecord)) {
+        break;
+      }
+      pos += key_size + sizeof(IndexRecord);
+    } else {
+      IndexBatchHeader header;
+      if (size - pos < sizeof(header)) {
+        break;
+      }
+      memcpy(&header, data + pos, sizeof(header));
+      if (le32toh(header.magic) != kIndexBatchMagic ||
+          le64toh(header.bytes) > size - pos - sizeof(header)) {
+        break;
+      }
+      pos += sizeof(header) + le64toh(header.bytes);
+    }
+    if (pos >= size / threads * starts.size() && pos < size) {
+      starts.push_back(pos);
+    }
+  }
+  starts.push_back(size);
+
+  // the first range goes straight into original_index_ on this thread,
+  // the others are parsed aside and merged after it.
+  std::vector<ReplayChunk*> chunks;
+  std::vector<pthread_t> tids;
+  for (size_t i = 1; i + 1 < starts.size(); ++i) {
+    ReplayChunk* chunk = new ReplayChunk;
+    chunk->data = data + starts[i];
+    chunk->size = starts[i + 1] - starts[i];
+    chunk->version = version;
+    chunk->parsed = 0;
+    chunk->failed = false;
+    chunks.push_back(chunk);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, ReplayChunkThread, chunk) != 0) {
+      // parse it here instead.
+      ReplayChunkThread(chunk);
+    } else {
+      tids.push_back(tid);
+    }
+  }
+  bool failed = false;
+  size_t end = size;
+  try {
+    size_t parsed = ApplyIndexLog(data, starts[1], version, original_index_, false, &actual_bytes_);
+    if (parsed < starts[1]) {
+      end = parsed;
+    }
+  } catch (...) {
+    failed = true;
+  }
+  for (size_t i = 0; i < tids.size(); ++i) {
+    pthread_join(tids[i], NULL);
+  }
+
+  // the log ends before the first range that stops short, the ranges
+  // after it are dropped.
+  size_t merged = 0;
+  for (; merged < chunks.size() && end == size; ++merged) {
+    failed = failed || chunks[merged]->failed;
+    if (chunks[merged]->parsed < chunks[merged]->size) {
+      end = starts[merged + 1] + chunks[merged]->parsed;
+    }
+  }
+  if (!failed && end < size && version >= 2 && FindIndexBatch(data + end, size - end)) {
+    failed = true;
+  }
+  munmap(base, length);
+
+  // merge in log order, so later ranges override earlier ones. sizing the
+  // index up front avoids rehashing while merging.
+  size_t entries = original_index_.size();
+  for (size_t i = 0; i < merged; ++i) {
+    entries += chunks[i]->index.size();
+  }
+  if (!failed) {
+    ReserveIndex(original_index_, entries);
+  }
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    if (!failed && i < merged) {
+      MapType& index = chunks[i]->index;
+      for (typename MapType::iterator itr = index.begin(); itr != index.end(); ++itr) {
+        const BlockInfo& block = itr->second;
+        if (block.position == sInvalidPosition && block.size == sInvalidSize) {
+          typename MapType::iterator old = original_index_.find(itr->first);
+          if (old != original_index_.end()) {
+            actual_bytes_ -= old->second.size;
+            original_index_.erase(old);
+          }
+        } else {
+          BlockInfo& blk = original_index_[itr->first];
+          actual_bytes_ -= blk.size;
+          actual_bytes_ += block.size;
+          blk = block;
+        }
+      }
+    }
+    delete chunks[i];
+  }
+  if (failed) {
+    throw FileCorruptException(__FILE__, __LINE__, 0, "corrupt index log");
+  }
+  return offset + end;
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::LoadCheckpoint(uint64_t index_length) {
+  FILE* file = fopen((path_ + "checkpoint").c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+  setvbuf(file, NULL, _IOFBF, sFileBufferSize);
+
+  // header and trailer must match before any key is parsed.
+  CheckpointHeader header, trailer;
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, sCheckpointMagic, sizeof(header.magic)) != 0 ||
+      le64toh(header.index_offset) > index_length ||
+      le64toh(header.index_head) != HashIndexHead(le64toh(header.index_offset)) ||
+      fseeko(file, -(off_t)sizeof(trailer), SEEK_END) != 0 ||
+      fread(&trailer, sizeof(trailer), 1, file) != 1 ||
+      memcmp(&header, &trailer, sizeof(header)) != 0 ||
+      fseeko(file, sizeof(header), SEEK_SET) != 0) {
+    fclose(file);
+    return false;
+  }
+
+  uint64_t count = le64toh(header.entry_count);
+  ReserveIndex(original_index_, count);
+  KeyType key;
+  BlockInfo block;
+  for (uint64_t i = 0; i < count; ++i) {
+    if (!KeyReader()(file, key) || fread(&block, sizeof(block), 1, file) != 1) {
+      fclose(file);
+      original_index_.clear();
+      actual_bytes_ = 0;
+      return false;
+    }
+    block.size = le32toh(block.size);
+    block.position = le64toh(block.position);
+    original_index_[key] = block;
+    actual_bytes_ += block.size;
+  }
+  checkpoint_offset_ = le64toh(header.index_offset);
+  checkpoint_bytes_ = ftello(file) + sizeof(trailer);
+  fclose(file);
+  return true;
+}
+
+// identifies the index file a checkpoint belongs to: Compact and Drop
+// replace the head of the log, appends keep it.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint64_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::HashIndexHead(uint64_t index_offset) {
+  char head[sIndexHeadSize];
+  size_t size = std::min(index_offset, sIndexHeadSize);
+  if (size == 0) {
+    return 0;
+  }
+  int fd = open((path_ + "index").c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  ssize_t ret = pread(fd, head, size, 0);
+  close(fd);
+  return ret == (ssize_t)size ? Hash64(head, size) : 0;
+}
+
+// dumps original_index_, inses_ and dels_ must be empty, i.e. flushed.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::WriteCheckpoint() {
+  string tmpPath = path_ + "checkpoint.tmp";
+  FILE* file = fopen(tmpPath.c_str(), "wb");
+  if (!file) {
+    throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  setvbuf(file, NULL, _IOFBF, sFileBufferSize);
+
+  CheckpointHeader header;
+  memcpy(header.magic, sCheckpointMagic, sizeof(header.magic));
+  header.index_offset = htole64(index_file_length_);
+  header.index_head = htole64(HashIndexHead(index_file_length_));
+  header.entry_count = htole64(original_index_.size());
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    int err = errno;
+    fclose(file);
+    throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+  }
+
+  BlockInfo block;
+  for (typename MapType::iterator itr = original_index_.begin();
+      itr != original_index_.end(); ++itr) {
+    KeyWriter()(file, itr->first);
+    block.size = htole32(itr->second.size);
+    block.position = htole64(itr->second.position);
+    if (fwrite(&block, sizeof(block), 1, file) != 1) {
+      int err = errno;
+      fclose(file);
+      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+  }
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1 || fflush(file) != 0) {
+    int err = errno;
+    fclose(file);
+    throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+  }
+  fsync(fileno(file));
+  checkpoint_bytes_ = ftello(file);
+  fclose(file);
+  if (rename(tmpPath.c_str(), (path_ + "checkpoint").c_str()) != 0) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  checkpoint_offset_ = index_file_length_;
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Close() {
+  // path_ is set from the start of Open(), so that a failed one is
+  // cleaned up as well.
+  if (path_.empty()) {
+    return;
+  }
+
+  AbortCompact();
+  AbortScrub();
+  Flush();
+  if (index_file_length_ != checkpoint_offset_) {
+    WriteCheckpoint();
+  }
+
+  // reset to initial state
+  for (size_t i = 0; i < idle_jobs_.size(); ++i) {
+    delete idle_jobs_[i];
+  }
+  idle_jobs_.clear();
+  while (!segments_.empty()) {
+    CloseSegment(segments_.begin(), false);
+  }
+  fd_ = -1;
+  close(index_fd_);
+  index_fd_ = -1;
+  delete compressor_;
+  compressor_ = NULL;
+  checksums_ = false;
+  checksum_errors_ = 0;
+  sampling_ = false;
+  samples_.clear();
+  sample_bytes_ = 0;
+  raw_bytes_written_ = 0;
+  stored_bytes_written_ = 0;
+  if (cache_) {
+    cache_->EraseOwner(cache_owner_);
+    cache_ = NULL;
+  }
+  cache_hits_ = 0;
+  cache_misses_ = 0;
+  delete own_buffers_;
+  own_buffers_ = NULL;
+  buffers_ = NULL;
+  data_file_length_ = 0;
+  segment_size_ = 0;
+  active_id_ = 0;
+  next_segment_id_ = 0;
+  actual_bytes_ = 0;
+  index_file_length_ = 0;
+  checkpoint_offset_ = 0;
+  checkpoint_bytes_ = 0;
+
+  original_index_.clear();
+  inses_.clear();
+  dels_.clear();
+  delete ordered_;
+  ordered_ = NULL;
+  delete inline_;
+  inline_ = NULL;
+  delete frozen_;
+  frozen_ = NULL;
+
+  path_.clear();
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Drop() {
+  // Close() clears path_.
+  string path = path_;
+  std::vector<string> files;
+  for (typename SegmentMap::iterator itr = segments_.begin(); itr != segments_.end(); ++itr) {
+    files.push_back(SegmentPath(itr->first));
+  }
+  Close();
+  // unlinked rather than truncated, pinned views may still map the data.
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (unlink(files[i].c_str()) != 0 && errno != ENOENT) {
+      throw TruncateFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+  }
+  if (unlink((path + "index").c_str()) != 0 && errno != ENOENT) {
+    throw TruncateFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  unlink((path + "checkpoint").c_str());
+  unlink((path + "segments").c_str());
+  unlink((path + "compression").c_str());
+  unlink((path + "checksums").c_str());
+  unlink((path + "frozen").c_str());
+  // an empty db has nothing frozen, it opens writable.
+  options_.frozen = false;
+  Open(path.c_str());
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Set(const KeyType& key, const uint8_t* value, uint32_t size) {
+  if (frozen_) {
+    throw std::logic_error("read-only cabinet");
+  }
+  raw_bytes_written_ += size;
+  const uint8_t* raw = value;
+  uint32_t raw_size = size;
+  if (compressor_ && size > 0) {
+    if (sampling_) {
+      SampleValue(value, size);
+    }
+    compressor_->Compress((const char*)value, size, &stored_);
+    value = (const uint8_t*)stored_.data();
+    size = stored_.size();
+  }
+  // a value of a db with checksums is followed by the CRC32C of the bytes
+  // before it, which its stored size includes.
+  uint32_t crc = 0;
+  uint32_t stored = size;
+  if (checksums_ && size > 0) {
+    crc = htole32(Crc32c(value, size));
+    stored += sizeof(crc);
+  }
+  stored_bytes_written_ += stored;
+
+  // a value never straddles two segments, and one larger than a segment
+  // starts a segment of its own.
+  uint32_t pad = PlacementPadding(stored);
+  if (segment_size_ && data_file_length_ + buf_pos_ + pad + stored > SegmentBase(active_id_) + segment_size_ &&
+      (data_file_length_ + buf_pos_ > SegmentBase(active_id_) || stored > segment_size_)) {
+    Flush();
+    RollSegment(stored);
+    pad = 0;
+  }
+
+  if (pad + stored > buf_.size() || stored >= options_.large_value_bytes) {
+    SetLarge(key, value, size, stored > size ? &crc : NULL, pad);
+    KeepInline(key, raw, raw_size);
+    return;
+  }
+
+  // write data into buffer
+  if (buf_pos_ + pad + stored > buf_.size()) {
+    if (options_.flusher) {
+      RotateBuffer();
+    } else {
+      Flush();
+    }
+  }
+  bool existed = RemoveEntry(key);
+  memset(&buf_[buf_pos_], 0, pad);
+  buf_pos_ += pad;
+  memcpy(&buf_[buf_pos_], value, size);
+  buf_pos_ += size;
+  memcpy(&buf_[buf_pos_], &crc, stored - size);
+  buf_pos_ += stored - size;
+  typename SetType::iterator itr = dels_.find(key);
+  if (itr != dels_.end()) {
+    dels_.erase(itr);
+  }
+  BlockInfo& blk = inses_[key];
+  blk.position = data_file_length_ + buf_pos_ - stored;
+  blk.size = stored;
+  actual_bytes_ += stored;
+  AddLiveBytes(blk, true);
+  if (ordered_ && !existed) {
+    ordered_->insert(OrderedKeyBytes(key).piece());
+  }
+  KeepInline(key, raw, raw_size);
+}
+
+// writes a large value right after what the buffer holds with one
+// pwritev, instead of copying it into the buffer, once the buffers before
+// it are written. its index record goes with the next flush, as that of
+// a buffered value does. the old value is deleted past the last point
+// that admits readers, so that they never miss the key, see ReaderGate.
+// crc, if not NULL, follows the value.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::SetLarge(const KeyType& key,
+    const uint8_t* value, uint32_t size, const uint32_t* crc, uint32_t pad) {
+  FinishFlushJobs(true);
+  Segment& segment = segments_[active_id_];
+  struct iovec iov[4];
+  int iovcnt = 0;
+  if (buf_pos_ != 0) {
+    iov[iovcnt].iov_base = &buf_[0];
+    iov[iovcnt++].iov_len = buf_pos_;
+  }
+  if (pad != 0) {
+    iov[iovcnt].iov_base = (void*)sZeroPadding;
+    iov[iovcnt++].iov_len = pad;
+  }
+  iov[iovcnt].iov_base = (void*)value;
+  iov[iovcnt++].iov_len = size;
+  if (crc) {
+    iov[iovcnt].iov_base = (void*)crc;
+    iov[iovcnt++].iov_len = sizeof(*crc);
+    size += sizeof(*crc);
+  }
+  uint64_t length = buf_pos_ + pad + size;
+  {
+    ReadersAdmitted admitted(gate_);
+    if (!PwritevFully(fd_, iov, iovcnt, segment.length)) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    // see Flush().
+    if (segment.direct_fd != -1) {
+      sync_file_range(fd_, segment.length, length, SYNC_FILE_RANGE_WRITE);
+      posix_fadvise(fd_, 0, segment.length, POSIX_FADV_DONTNEED);
+    }
+  }
+
+  bool existed = RemoveEntry(key);
+  data_file_length_ += length;
+  segment.length += length;
+  buf_pos_ = 0;
+  MapSegment(segment);
+  synced_ = false;
+  typename SetType::iterator itr = dels_.find(key);
+  if (itr != dels_.end()) {
+    dels_.erase(itr);
+  }
+  BlockInfo& blk = inses_[key];
+  blk.position = data_file_length_ - size;
+  blk.size = size;
+  actual_bytes_ += size;
+  AddLiveBytes(blk, true);
+  if (ordered_ && !existed) {
+    ordered_->insert(OrderedKeyBytes(key).piece());
+  }
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+const BlockInfo* TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::FindBlockInfo(const KeyType& key) {
+  if (frozen_) {
+    return frozen_->Find(OrderedKeyBytes(key).piece());
+  }
+
+  // finding in insert map
+  typename MapType::iterator itr = inses_.find(key);
+  if (itr != inses_.end()) {
+    return &itr->second;
+  }
+
+  // finding in delete set
+  typename SetType::iterator itr_set = dels_.find(key);
+  if (itr_set != dels_.end()) {
+    return NULL;
+  }
+
+  // finding in original index map
+  itr = original_index_.find(key);
+  if (itr != original_index_.end()) {
+    return &itr->second;
+  }
+
+  return NULL;
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Get(const KeyType& key, std::string* value) {
+  const BlockInfo* blk = FindBlockInfo(key);
+  return blk != NULL && (ReadInline(key, *blk, value) || ReadBlockInfo(*blk, value));
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Get(const KeyType& key, ValueView* value) {
+  const BlockInfo* blk = FindBlockInfo(key);
+  return blk != NULL && (ReadInline(key, *blk, value->Own()) || ReadBlockInfo(*blk, value));
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::MultiGet(const std::vector<KeyType>& keys,
+    AsyncReader* reader, std::vector<std::string>* values, std::vector<bool>* found, bool fill_cache) {
+  values->assign(keys.size(), std::string());
+  found->assign(keys.size(), false);
+  std::vector<MultiGetPiece> pieces;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    const BlockInfo* blk = FindBlockInfo(keys[i]);
+    if (blk == NULL) {
+      continue;
+    }
+    (*found)[i] = true;
+    // inline, buffered and mapped values are served from memory.
+    if (ReadInline(keys[i], *blk, &(*values)[i])) {
+      continue;
+    }
+    if (blk->size == 0 || FindStoredBytes(*blk)) {
+      ReadBlockInfo(*blk, &(*values)[i]);
+      continue;
+    }
+    if (LookupCache(*blk, &(*values)[i])) {
+      continue;
+    }
+    typename SegmentMap::iterator itr = segments_.find(SegmentOf(blk->position));
+    if (itr == segments_.end()) {
+      throw FileCorruptException(__FILE__, __LINE__, 0, "missing data segment");
+    }
+    (*values)[i].resize(blk->size);
+    MultiGetPiece piece;
+    piece.direct = itr->second.direct_fd != -1;
+    piece.fd = piece.direct ? itr->second.direct_fd : itr->second.fd;
+    piece.offset = blk->position - SegmentBase(itr->first);
+    piece.size = blk->size;
+    piece.position = blk->position;
+    piece.owner = i;
+    pieces.push_back(piece);
+  }
+  if (pieces.empty()) {
+    return;
+  }
+  std::sort(pieces.begin(), pieces.end());
+
+  // a piece after a gap gets two iovecs, the gap goes to scratch.
+  MultiGetReads done;
+  done.values = values;
+  done.dictionary = compressor_ ? &compressor_->dictionary() : NULL;
+  done.checksums = checksums_;
+  done.error = 0;
+  done.pool = buffers_;
+  std::vector<char> scratch(sMultiGetGap);
+  std::vector<struct iovec> iovs;
+  iovs.reserve(pieces.size() * 2);
+  std::vector<AsyncRead> reads;
+  std::vector<size_t> first_iovs;
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    const MultiGetPiece& piece = pieces[i];
+    // a direct read covers the aligned blocks around its values, they
+    // are copied out of its buffer once it is done.
+    if (piece.direct) {
+      const uint64_t block = AlignedBufferPool::kAlignment;
+      uint64_t begin = piece.offset & ~(block - 1);
+      uint64_t end = (piece.offset + piece.size + block - 1) & ~(block - 1);
+      if (!reads.empty() && done.direct.size() == reads.size() && done.direct.back()) {
+        AsyncRead& last = reads.back();
+        if (last.fd == piece.fd && begin <= last.offset + last.size + sMultiGetGap &&
+            end - last.offset <= std::max<uint64_t>(options_.read_coalesce_bytes, last.size)) {
+          last.size = std::max<uint64_t>(last.size, end - last.offset);
+          done.owners.push_back(piece.owner);
+          done.offsets.push_back(piece.offset - last.offset);
+          continue;
+        }
+      }
+      AsyncRead read;
+      read.fd = piece.fd;
+      read.offset = begin;
+      read.size = end - begin;
+      read.buf = NULL;
+      read.iov = NULL;
+      read.iovcnt = 0;
+      read.result = 0;
+      reads.push_back(read);
+      first_iovs.push_back(iovs.size());
+      done.direct.resize(reads.size(), false);
+      done.direct.back() = true;
+      done.firsts.push_back(done.owners.size());
+      done.owners.push_back(piece.owner);
+      done.offsets.resize(done.owners.size(), 0);
+      done.offsets.back() = piece.offset - begin;
+      continue;
+    }
+    struct iovec iov;
+    iov.iov_base = &(*values)[piece.owner][0];
+    iov.iov_len = piece.size;
+    if (!reads.empty() && (done.direct.size() < reads.size() || !done.direct.back())) {
+      AsyncRead& last = reads.back();
+      uint64_t end = last.offset + last.size;
+      uint64_t gap = piece.offset - end;
+      if (last.fd == piece.fd && piece.offset >= end && gap <= sMultiGetGap &&
+          end + gap + piece.size - last.offset <= options_.read_coalesce_bytes &&
+          iovs.size() - first_iovs.back() + 2 <= sMultiGetMaxIovecs) {
+        if (gap > 0) {
+          struct iovec skip;
+          skip.iov_base = &scratch[0];
+          skip.iov_len = gap;
+          iovs.push_back(skip);
+        }
+        iovs.push_back(iov);
+        last.size += gap + piece.size;
+        done.owners.push_back(piece.owner);
+        continue;
+      }
+    }
+    AsyncRead read;
+    read.fd = piece.fd;
+    read.offset = piece.offset;
+    read.size = piece.size;
+    read.buf = (char*)iov.iov_base;
+    read.iov = NULL;
+    read.iovcnt = 0;
+    read.result = 0;
+    reads.push_back(read);
+    first_iovs.push_back(iovs.size());
+    iovs.push_back(iov);
+    done.firsts.push_back(done.owners.size());
+    done.owners.push_back(piece.owner);
+  }
+  done.firsts.push_back(done.owners.size());
+  if (!done.direct.empty()) {
+    done.direct.resize(reads.size(), false);
+    done.offsets.resize(done.owners.size(), 0);
+  }
+  for (size_t i = 0; i < reads.size(); ++i) {
+    if (!done.direct.empty() && done.direct[i]) {
+      reads[i].buf = buffers_->Acquire(reads[i].size);
+      done.buffers.push_back(std::make_pair(reads[i].buf, (size_t)reads[i].size));
+      continue;
+    }
+    size_t end = i + 1 < reads.size() ? first_iovs[i + 1] : iovs.size();
+    if (end - first_iovs[i] > 1) {
+      reads[i].iov = &iovs[first_iovs[i]];
+      reads[i].iovcnt = end - first_iovs[i];
+    }
+  }
+
+  if (reader != NULL) {
+    reader->Read(&reads[0], reads.size(), &done);
+  } else {
+    AsyncReader::ReadEach(&reads[0], reads.size(), &done);
+  }
+  if (done.error > 0) {
+    throw ReadFileException(__FILE__, __LINE__, done.error, strerror(done.error));
+  } else if (done.error == -2) {
+    __sync_fetch_and_add(&checksum_errors_, 1);
+    throw ChecksumMismatchException(__FILE__, __LINE__, 0, "bad value checksum");
+  } else if (done.error < 0) {
+    throw FileCorruptException(__FILE__, __LINE__, 0, "bad compressed value");
+  }
+  if (cache_ && fill_cache) {
+    for (size_t i = 0; i < pieces.size(); ++i) {
+      cache_->Insert(cache_owner_, pieces[i].position, (*values)[pieces[i].owner]);
+    }
+  }
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::GetLiveEntries(
+    std::vector<std::pair<uint64_t, KeyType> >* entries) {
+  entries->reserve(entries->size() + GetEntryCount());
+  // the positions are copied out, a packed field binds no reference.
+  for (typename MapType::iterator itr = original_index_.begin();
+      itr != original_index_.end(); ++itr) {
+    uint64_t position = itr->second.position;
+    entries->push_back(std::make_pair(position, CopyKey(itr->first)));
+  }
+  for (typename MapType::iterator itr = inses_.begin(); itr != inses_.end(); ++itr) {
+    uint64_t position = itr->second.position;
+    entries->push_back(std::make_pair(position, CopyKey(itr->first)));
+  }
+  for (uint64_t i = 0; frozen_ && i < frozen_->size(); ++i) {
+    entries->push_back(std::make_pair(frozen_->ValueAt(i).position, KeyType()));
+    DecodeOrderedKey(frozen_->KeyAt(i), &entries->back().second);
+  }
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::GetKeysInFileOrder(
+    std::vector<KeyType>* keys) {
+  std::vector<std::pair<uint64_t, KeyType> > entries;
+  GetLiveEntries(&entries);
+  AppendInFileOrder(&entries, keys);
+}
+
+// positions are db wide, segments come in order too.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::AppendInFileOrder(
+    std::vector<std::pair<uint64_t, KeyType> >* entries, std::vector<KeyType>* keys) {
+  std::sort(entries->begin(), entries->end());
+  keys->reserve(keys->size() + entries->size());
+  for (size_t i = 0; i < entries->size(); ++i) {
+    keys->push_back((*entries)[i].second);
+  }
+}
+
+// the keys are loaded at once, which sorts them instead of inserting each.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::BuildOrderedIndex() {
+  ordered_ = new OrderedKeyIndex;
+  for (typename MapType::iterator itr = original_index_.begin();
+      itr != original_index_.end(); ++itr) {
+    ordered_->Stage(OrderedKeyBytes(itr->first).piece());
+  }
+  for (typename MapType::iterator itr = inses_.begin(); itr != inses_.end(); ++itr) {
+    ordered_->Stage(OrderedKeyBytes(itr->first).piece());
+  }
+  for (uint64_t i = 0; frozen_ && i < frozen_->size(); ++i) {
+    ordered_->Stage(frozen_->KeyAt(i));
+  }
+  ordered_->Build();
+}
+
+// reads the values that fit inline_ in position order a window at a time,
+// as a scrub does. one that fails its checksum or to decompress is left
+// to the reads that would find it on disk.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::LoadInlineValues() {
+  inline_ = new InlineValueMap<KeyType, KeyHashFunc>;
+  std::vector<std::pair<BlockInfo, KeyType> > entries;
+  for (typename MapType::iterator itr = original_index_.begin(); itr != original_index_.end(); ++itr) {
+    if (itr->second.size > 0 && itr->second.size <= options_.inline_value_bytes + sInlineOverhead) {
+      entries.push_back(std::make_pair(itr->second, CopyKey(itr->first)));
+    }
+  }
+  for (typename MapType::iterator itr = inses_.begin(); itr != inses_.end(); ++itr) {
+    if (itr->second.size > 0 && itr->second.size <= options_.inline_value_bytes + sInlineOverhead) {
+      entries.push_back(std::make_pair(itr->second, CopyKey(itr->first)));
+    }
+  }
+  std::sort(entries.begin(), entries.end(), EntryPositionLess<KeyType>);
+
+  std::vector<char> window;
+  uint64_t window_pos = 0;
+  uint64_t window_len = 0;
+  std::string value;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const BlockInfo& blk = entries[i].first;
+    // a window ends with its segment, values do not straddle segments.
+    if (blk.position < window_pos || blk.position + blk.size > window_pos + window_len) {
+      size_t want = std::max<size_t>(sFileBufferSize, blk.size);
+      if (window.size() < want) {
+        window.resize(want);
+      }
+      uint64_t id = SegmentOf(blk.position);
+      typename SegmentMap::iterator itr = segments_.find(id);
+      if (itr == segments_.end()) {
+        throw FileCorruptException(__FILE__, __LINE__, 0, "missing data segment");
+      }
+      ssize_t got = pread(itr->second.fd, &window[0], want, blk.position - SegmentBase(id));
+      if (got < (ssize_t)blk.size) {
+        // a short read is a data file that ends inside the value.
+        int err = got < 0 ? errno : EIO;
+        throw ReadFileException(__FILE__, __LINE__, err, strerror(err));
+      }
+      window_pos = blk.position;
+      window_len = got;
+    }
+    const char* data = &window[blk.position - window_pos];
+    uint32_t size = blk.size;
+    if (checksums_) {
+      if (!ChecksumMatches(data, size)) {
+        continue;
+      }
+      size -= sizeof(uint32_t);
+    }
+    if (!compressor_) {
+      value.assign(data, size);
+    } else if (!ValueCompressor::Decompress(data, size, compressor_->dictionary(), &value)) {
+      continue;
+    }
+    if (value.size() <= options_.inline_value_bytes) {
+      inline_->Put(entries[i].second, value);
+    }
+  }
+}
+
+// keeps a value Set() wrote in inline_ if it is small enough.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::KeepInline(const KeyType& key,
+    const uint8_t* value, uint32_t size) {
+  if (inline_ && size > 0 && size <= options_.inline_value_bytes) {
+    inline_->Put(key, StringPiece((const char*)value, size));
+  }
+}
+
+// a stored value larger than sInlineOverhead past inline_value_bytes is
+// not looked up.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReadInline(const KeyType& key,
+    const BlockInfo& blk, std::string* value) {
+  return inline_ && blk.size > 0 && blk.size <= options_.inline_value_bytes + sInlineOverhead &&
+    inline_->Get(key, value);
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::GetKeyRange(const KeyType& begin,
+    const KeyType* end, size_t limit, std::vector<KeyType>* keys) {
+  if (!ordered_) {
+    throw std::logic_error("no ordered index");
+  }
+  OrderedKeyBytes from(begin);
+  if (end == NULL) {
+    AppendOrderedKeys(ordered_->lower_bound(from.piece()), NULL, NULL, limit, keys);
+    return;
+  }
+  OrderedKeyBytes to(*end);
+  AppendOrderedKeys(ordered_->lower_bound(from.piece()), &to.piece(), NULL, limit, keys);
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::GetKeysWithPrefix(
+    const StringPiece& prefix, size_t limit, std::vector<KeyType>* keys) {
+  if (!ordered_) {
+    throw std::logic_error("no ordered index");
+  }
+  AppendOrderedKeys(ordered_->lower_bound(prefix), NULL, &prefix, limit, keys);
+}
+
+// appends the keys from itr on while they are before end, or start with
+// prefix, for those not NULL.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::AppendOrderedKeys(
+    OrderedKeyIndex::iterator itr, const StringPiece* end, const StringPiece* prefix,
+    size_t limit, std::vector<KeyType>* keys) {
+  for (size_t count = 0; itr != ordered_->end() && (limit == 0 || count < limit); ++itr, ++count) {
+    StringPiece bytes = *itr;
+    if ((end && !(bytes < *end)) || (prefix && !bytes.starts_with(*prefix))) {
+      break;
+    }
+    keys->push_back(KeyType());
+    DecodeOrderedKey(bytes, &keys->back());
+  }
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::MultiGetReads::Done(size_t i,
+    const AsyncRead& read) {
+  // a direct read comes up short at the end of the file.
+  bool aligned = !direct.empty() && direct[i];
+  if (read.result < 0 || (!aligned && read.result != read.size)) {
+    __sync_val_compare_and_swap(&error, 0, read.result < 0 ? (int)-read.result : EIO);
+    return;
+  }
+  for (size_t j = firsts[i]; j < firsts[i + 1]; ++j) {
+    std::string& value = (*values)[owners[j]];
+    if (aligned) {
+      if (offsets[j] + value.size() > (uint64_t)read.result) {
+        __sync_val_compare_and_swap(&error, 0, EIO);
+        return;
+      }
+      memcpy(&value[0], read.buf + offsets[j], value.size());
+    }
+    if (checksums && !value.empty()) {
+      if (!ChecksumMatches(value.data(), value.size())) {
+        __sync_val_compare_and_swap(&error, 0, -2);
+        return;
+      }
+      value.resize(value.size() - sizeof(uint32_t));
+    }
+    if (dictionary == NULL) {
+      continue;
+    }
+    std::string raw;
+    if (!ValueCompressor::Decompress(value.data(), value.size(), *dictionary, &raw)) {
+      __sync_val_compare_and_swap(&error, 0, -1);
+      return;
+    }
+    value.swap(raw);
+  }
+}
+
+// gives the buffers of the direct reads back, MultiGet() acquires them
+// once the reads are laid out.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::MultiGetReads::~MultiGetReads() {
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    pool->Release(buffers[i].first, buffers[i].second);
+  }
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Delete(const KeyType& key) {
+  if (frozen_) {
+    throw std::logic_error("read-only cabinet");
+  }
+  if (RemoveEntry(key) && ordered_) {
+    ordered_->erase(OrderedKeyBytes(key).piece());
+  }
+}
+
+// takes key out of the hash index and its value out of inline_, returns
+// whether it was live. Set() keeps it in the ordered index then.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::RemoveEntry(const KeyType& key) {
+  if (inline_) {
+    inline_->Erase(key);
+  }
+  typename MapType::iterator itr = inses_.find(key);
+  if (itr != inses_.end()) {
+    actual_bytes_ -= itr->second.size;
+    AddLiveBytes(itr->second, false);
+    EraseCache(itr->second);
+    inses_.erase(itr);
+    dels_.insert(key);
+    return true;
+  } else if (dels_.find(key) == dels_.end() && (itr = original_index_.find(key)) != original_index_.end()) {
+    actual_bytes_ -= itr->second.size;
+    AddLiveBytes(itr->second, false);
+    EraseCache(itr->second);
+    original_index_.erase(itr);
+    dels_.insert(key);
+    return true;
+  }
+  return false;
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Flush() {
+  if (fd_ == -1) {
+    return;
+  }
+  FinishFlushJobs(true);
+  if (buf_pos_ == 0 && inses_.empty() && dels_.empty()) {
+    return;
+  }
+
+  // mkdir
+  mkdir(path_.c_str(), S_IRUSR | S_IWUSR | S_IEXEC);
+
+  // the files are written with readers admitted, nothing they look at
+  // changes until the new state is published below. neither does the
+  // rehash of original_index_ when inses_ does not fit: a larger copy is
+  // built meanwhile and swapped in.
+  Segment& segment = segments_[active_id_];
+  bool grow = !IndexFits(original_index_, inses_.size());
+  MapType grown;
+  struct stat st;
+  {
+    ReadersAdmitted admitted(gate_);
+
+    // writing buffer into data file
+    if (buf_pos_ != 0) {
+      ssize_t ret = pwrite(fd_, &buf_[0], buf_pos_, segment.length);
+      if (ret != buf_pos_) {
+        throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+    }
+    // direct reads do not need the written pages. writeback of this
+    // flush starts now, the pages of earlier ones are clean by now
+    // mostly and dropped.
+    if (segment.direct_fd != -1) {
+      sync_file_range(fd_, segment.length, buf_pos_, SYNC_FILE_RANGE_WRITE);
+      posix_fadvise(fd_, 0, segment.length, POSIX_FADV_DONTNEED);
+    }
+
+    // appending entries from inses_ & dels_. what a failed append left
+    // after index_file_length_ is cut off, see FlushJob::Write().
+    std::string index_path = path_ + "index";
+    FILE* file = fopen(index_path.c_str(), "ab");
+    if (!file) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    try {
+      if (fstat(fileno(file), &st) == -1) {
+        int err = errno;
+        fclose(file);
+        throw StatFileException(__FILE__, __LINE__, err, strerror(err));
+      }
+      if ((uint64_t)st.st_size > index_file_length_ &&
+          ftruncate(fileno(file), index_file_length_) != 0) {
+        int err = errno;
+        fclose(file);
+        throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+      }
+      WriteIndexRecords(file, index_version_, inses_, dels_);
+      if (fflush(file) != 0) {
+        int err = errno;
+        fclose(file);
+        throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+      }
+      if (fstat(fileno(file), &st) == -1) {
+        int err = errno;
+        fclose(file);
+        throw StatFileException(__FILE__, __LINE__, err, strerror(err));
+      }
+      if (fclose(file) != 0) {
+        throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+    } catch (...) {
+      CutIndex(index_path, index_file_length_);
+      throw;
+    }
+
+    if (grow) {
+      ReserveIndex(grown, (original_index_.size() + inses_.size()) * 2);
+      for (typename MapType::iterator itr = original_index_.begin();
+          itr != original_index_.end(); ++itr) {
+        grown[itr->first] = itr->second;
+      }
+    }
+  }
+
+  if (buf_pos_ != 0) {
+    data_file_length_ += buf_pos_;
+    segment.length += buf_pos_;
+    buf_pos_ = 0;
+    MapSegment(segment);
+  }
+  ApplyChanges(inses_, dels_, grow, grown);
+  inses_.clear();
+  dels_.clear();
+  index_file_length_ = st.st_size;
+  synced_ = false;
+
+  if (index_file_length_ - checkpoint_offset_ >= std::max(sCheckpointMinTail, checkpoint_bytes_)) {
+    ReadersAdmitted admitted(gate_);
+    WriteCheckpoint();
+  }
+}
+
+// writes the records of inses and dels in the format of version, closes
+// file on failure.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::WriteIndexRecords(FILE* file,
+    uint32_t version, MapType& inses, SetType& dels) {
+  IndexLogWriter<KeyType, KeyWriter> writer(file, version);
+  try {
+    for (typename MapType::iterator itr = inses.begin();
+        itr != inses.end(); ++itr) {
+      writer.Add(itr->first, itr->second);
+    }
+
+    BlockInfo tombstone;
+    tombstone.position = sInvalidPosition;
+    tombstone.size = sInvalidSize;
+    for (typename SetType::iterator itr = dels.begin();
+        itr != dels.end(); ++itr) {
+      writer.Add(*itr, tombstone);
+    }
+    writer.Finish();
+  } catch (...) {
+    int err = errno;
+    fclose(file);
+    errno = err;
+    throw;
+  }
+}
+
+// puts inses and dels into original_index_, swapping in grown first if
+// grow.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ApplyChanges(MapType& inses,
+    SetType& dels, bool grow, MapType& grown) {
+  if (grow) {
+    original_index_.swap(grown);
+  }
+  for (typename MapType::iterator itr = inses.begin();
+      itr != inses.end(); ++itr) {
+    original_index_[itr->first] = itr->second;
+  }
+
+  typename MapType::iterator itr_map;
+  for (typename SetType::iterator itr = dels.begin();
+      itr != dels.end(); ++itr) {
+    itr_map = original_index_.find(*itr);
+    if (itr_map != original_index_.end()) {
+      original_index_.erase(itr_map);
+    }
+  }
+}
+
+// hands the full buffer to options_.flusher along with the changes so
+// far, which take effect in memory right away and are logged by the
+// flusher. Set() goes on with the buffer and the emptied maps of an idle
+// job, once there is one.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::RotateBuffer() {
+  FinishFlushJobs(false);
+  while (flushing_.size() + 1 >= std::max<uint32_t>(options_.write_buffers, 2)) {
+    {
+      ReadersAdmitted admitted(gate_);
+      options_.flusher->Wait(flushing_.front());
+    }
+    FinishFlushJobs(false);
+  }
+  if (buf_pos_ == 0 && inses_.empty() && dels_.empty()) {
+    return;
+  }
+  mkdir(path_.c_str(), S_IRUSR | S_IWUSR | S_IEXEC);
+
+  FlushJob* job;
+  if (idle_jobs_.empty()) {
+    job = new FlushJob;
+    job->buf.resize(sBufferSize);
+  } else {
+    job = idle_jobs_.back();
+    idle_jobs_.pop_back();
+  }
+  bool grow = !IndexFits(original_index_, inses_.size());
+  MapType grown;
+  if (grow) {
+    ReadersAdmitted admitted(gate_);
+    ReserveIndex(grown, (original_index_.size() + inses_.size()) * 2);
+    for (typename MapType::iterator itr = original_index_.begin();
+        itr != original_index_.end(); ++itr) {
+      grown[itr->first] = itr->second;
+    }
+  }
+
+  job->buf.swap(buf_);
+  job->inses.swap(inses_);
+  job->dels.swap(dels_);
+  job->length = buf_pos_;
+  job->position = data_file_length_;
+  job->fd = fd_;
+  job->offset = data_file_length_ - SegmentBase(active_id_);
+  job->direct = segments_[active_id_].direct_fd != -1;
+  job->index_path = path_ + "index";
+  job->index_version = index_version_;
+  job->index_start = -1;
+  job->index_length = 0;
+  job->error = 0;
+  job->failed = &flush_failed_;
+  data_file_length_ += buf_pos_;
+  buf_pos_ = 0;
+  ApplyChanges(job->inses, job->dels, grow, grown);
+  synced_ = false;
+  flushing_.push_back(job);
+  options_.flusher->Submit(job, this);
+}
+
+// publishes the jobs done, oldest first, or waits for all of them. the
+// active segment grows by their buffers, which go idle. a job that
+// failed is run again here, and left for the next call if it fails
+// again, so that its values are still served.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::FinishFlushJobs(bool wait) {
+  while (!flushing_.empty()) {
+    FlushJob* job = flushing_.front();
+    if (wait) {
+      ReadersAdmitted admitted(gate_);
+      options_.flusher->Wait(job);
+    } else if (!options_.flusher->IsDone(job)) {
+      return;
+    }
+    if (job->error) {
+      // the jobs after it skip, see FlushJob::Run(). once none is in
+      // flight, they are written again in order here.
+      ReadersAdmitted admitted(gate_);
+      options_.flusher->Wait(flushing_.back());
+      job->error = 0;
+      job->Write();
+      if (job->error) {
+        throw WriteFileException(__FILE__, __LINE__, job->error, strerror(job->error));
+      }
+    }
+    Segment& segment = segments_[active_id_];
+    segment.length += job->length;
+    MapSegment(segment);
+    index_file_length_ = job->index_length;
+    job->inses.clear();
+    job->dels.clear();
+    flushing_.pop_front();
+    idle_jobs_.push_back(job);
+    if (flushing_.empty() &&
+        index_file_length_ - checkpoint_offset_ >= std::max(sCheckpointMinTail, checkpoint_bytes_)) {
+      ReadersAdmitted admitted(gate_);
+      WriteCheckpoint();
+    }
+  }
+  // none is in flight.
+  flush_failed_ = false;
+}
+
+// a job after one that failed writes nothing, so that its records do not
+// go before those of the failed one. the jobs of a cabinet run in order,
+// see BackgroundFlusher, which orders the accesses of failed as well.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::FlushJob::Run() {
+  if (*failed) {
+    error = ECANCELED;
+    return;
+  }
+  Write();
+  if (error) {
+    *failed = true;
+  }
+}
+
+// a retry after a failure writes the same bytes again. a torn append of
+// the index records is cut off, by this try or the next one, since
+// records after it would make the log look corrupt rather than torn at
+// the next Open(). inses and dels are left as they are until
+// FinishFlushJobs() takes the job.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::FlushJob::Write() {
+  if (pwrite(fd, &buf[0], length, offset) != (ssize_t)length) {
+    error = errno ? errno : EIO;
+    return;
+  }
+  if (direct) {
+    sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(fd, 0, offset, POSIX_FADV_DONTNEED);
+  }
+  FILE* file = fopen(index_path.c_str(), "ab");
+  if (!file) {
+    error = errno;
+    return;
+  }
+  struct stat st;
+  if (fstat(fileno(file), &st) == -1) {
+    error = errno;
+    fclose(file);
+    return;
+  }
+  if (index_start < 0) {
+    index_start = st.st_size;
+  } else if (st.st_size > index_start && ftruncate(fileno(file), index_start) != 0) {
+    error = errno;
+    fclose(file);
+    return;
+  }
+  try {
+    WriteIndexRecords(file, index_version, inses, dels);
+  } catch (...) {
+    // file is closed.
+    error = errno ? errno : EIO;
+    CutIndex(index_path, index_start);
+    return;
+  }
+  if (fflush(file) != 0 || fstat(fileno(file), &st) == -1) {
+    error = errno ? errno : EIO;
+    fclose(file);
+    CutIndex(index_path, index_start);
+    return;
+  }
+  if (fclose(file) != 0) {
+    error = errno ? errno : EIO;
+    CutIndex(index_path, index_start);
+    return;
+  }
+  index_length = st.st_size;
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::InWriteBuffers(const BlockInfo& blk) const {
+  if (InBuffer(blk)) {
+    return true;
+  }
+  for (size_t i = 0; i < flushing_.size(); ++i) {
+    if (blk.position >= flushing_[i]->position && blk.position - flushing_[i]->position < flushing_[i]->length) {
+      return true;
+    }
+  }
+  return false;
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Sync() {
+  SyncPoint point;
+  PrepareSync(&point);
+  try {
+    CommitSync(&point);
+  } catch (...) {
+    AbandonSync();
+    throw;
+  }
+}
+
+// the index is written from original_index_, which holds every live key
+// once the buffers are flushed. the data it points to is synced first.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Freeze() {
+  if (fd_ == -1 || frozen_) {
+    return;
+  }
+  if (compaction_) {
+    throw std::logic_error("freezing a compacting cabinet");
+  }
+  Sync();
+  FrozenIndexBuilder<BlockInfo> builder;
+  for (typename MapType::iterator itr = original_index_.begin();
+      itr != original_index_.end(); ++itr) {
+    builder.Add(OrderedKeyBytes(itr->first).piece(), itr->second);
+  }
+  builder.Write(path_ + "frozen", actual_bytes_);
+  SyncDirectory();
+}
+
+// sealed segments are synced when sealed, so only the active one and the
+// index are left. nothing is if nothing was flushed since the last call,
+// unless its CommitSync() failed, see AbandonSync().
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::PrepareSync(SyncPoint* point) {
+  if (fd_ == -1) {
+    return;
+  }
+
+  Flush();
+  if (synced_) {
+    return;
+  }
+  int fds[] = { fd_, index_fd_ };
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    int fd = dup(fds[i]);
+    if (fd == -1) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    point->fds.push_back(fd);
+  }
+  synced_ = true;
+}
+
+inline void CabinetBase::CommitSync(SyncPoint* point) {
+  int err = 0;
+  for (size_t i = 0; i < point->fds.size(); ++i) {
+    if (fdatasync(point->fds[i]) != 0 && err == 0) {
+      err = errno;
+    }
+    close(point->fds[i]);
+  }
+  point->fds.clear();
+  if (err != 0) {
+    throw SyncFileException(__FILE__, __LINE__, err, strerror(err));
+  }
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Compact() {
+  BeginCompact();
+  RunCompact();
+  FinishCompact();
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::BeginCompact() {
+  if (fd_ == -1 || compaction_) {
+    return;
+  }
+  if (frozen_) {
+    throw std::logic_error("read-only cabinet");
+  }
+  Flush();
+  // the values move, so a frozen index would point to the old files.
+  unlink((path_ + "frozen").c_str());
+
+  compaction_ = new Compaction;
+  compaction_->data_fd = -1;
+  compaction_->data_file = NULL;
+  compaction_->index_file = NULL;
+  compaction_->byte_count = 0;
+  compaction_->done = false;
+  compaction_->committed = false;
+  if (segment_size_) {
+    BeginSegmentCompact();
+    return;
+  }
+
+  pid_t pid = getpid();
   std::stringstream oss;
   oss << path_ << "tmp-index." << pid;
-  string tmpIndexPath = oss.str();
-  FILE* tmpIndexFile = fopen(tmpIndexPath.c_str(), "wb+");
-  if (!tmpIndexFile) {
-    throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
-  }
+  compaction_->index_path = oss.str();
   oss.str("");
   oss << path_ << "tmp-data." << pid;
-  string tmpDataPath = oss.str();
-  FILE* tmpDataFile = fopen(tmpDataPath.c_str(), "wb+");
-  if (!tmpDataFile) {
+  compaction_->data_path = oss.str();
+
+  compaction_->data_fd = open((path_ + "data").c_str(), O_RDONLY);
+  if (compaction_->data_fd != -1) {
+    posix_fadvise(compaction_->data_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  compaction_->index_file = fopen(compaction_->index_path.c_str(), "wb+");
+  compaction_->data_file = fopen(compaction_->data_path.c_str(), "wb+");
+  if (compaction_->data_fd == -1 || !compaction_->index_file || !compaction_->data_file) {
     int err = errno;
-    fclose(tmpIndexFile);
-    unlink(tmpIndexPath.c_str());
+    AbortCompact();
     throw OpenFileException(__FILE__, __LINE__, err, strerror(err));
   }
+  setvbuf(compaction_->data_file, NULL, _IOFBF, sFileBufferSize);
+  setvbuf(compaction_->index_file, NULL, _IOFBF, sFileBufferSize);
+  // the new index file is in the current format, whatever the old one's.
+  try {
+    IndexLogWriter<KeyType, KeyWriter>::WriteHeader(compaction_->index_file);
+  } catch (...) {
+    AbortCompact();
+    throw;
+  }
 
-  MapType dupIndex;
-  std::string value;
-  uint64_t byte_count = 0;
-  BlockInfo block;
-  for (typename MapType::iterator itr = original_index_.begin(); itr != original_index_.end(); ++itr) {
-    ReadBlockInfo(itr->second, &value);
-    KeyWriter()(tmpIndexFile, itr->first);
-    block.position = htole64(itr->second.position);
-    block.size = htole32(itr->second.size);
-    if (fwrite(&block, sizeof(block), 1, tmpIndexFile) != 1) {
-      int err = errno;
-      fclose(tmpIndexFile);
-      unlink(tmpIndexPath.c_str());
-      fclose(tmpDataFile);
-      unlink(tmpDataPath.c_str());
-      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+  compaction_->index = original_index_;
+  compaction_->data_length = data_file_length_;
+  compaction_->index_length = index_file_length_;
+}
+
+// copies the live values of the snapshot into the new data file, in the
+// order of their old positions so that the old file is read sequentially,
+// and writes the new index file.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::RunCompact() {
+  Compaction* c = compaction_;
+  if (!c || c->done) {
+    return;
+  }
+  if (segment_size_) {
+    try {
+      RunSegmentCompact();
+    } catch (...) {
+      AbortCompact();
+      throw;
+    }
+    return;
+  }
+  try {
+    std::vector<BlockInfo*> blocks;
+    blocks.reserve(c->index.size());
+    for (typename MapType::iterator itr = c->index.begin(); itr != c->index.end(); ++itr) {
+      if (itr->second.size > 0) {
+        blocks.push_back(&itr->second);
+      } else {
+        itr->second.position = 0;
+      }
     }
+    std::sort(blocks.begin(), blocks.end(), PositionLess);
 
-    if (!value.empty() && fwrite(value.c_str(), value.size(), 1, tmpDataFile) != 1) {
+    // values are copied out of a window of the old file. each window
+    // pays for its read and for the bytes written out of it.
+    RateLimiter* limiter = options_.compact_limiter;
+    std::vector<char> window;
+    uint64_t window_pos = 0;
+    uint64_t window_len = 0;
+    uint64_t written = 0;
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      BlockInfo* blk = blocks[i];
+      if (blk->position < window_pos || blk->position + blk->size > window_pos + window_len) {
+        CheckCancelled();
+        size_t want = std::max<size_t>(sFileBufferSize, blk->size);
+        if (window.size() < want) {
+          window.resize(want);
+        }
+        if (limiter) {
+          limiter->Acquire(want + written);
+          written = 0;
+        }
+        ssize_t got = pread(c->data_fd, &window[0], want, blk->position);
+        if (got < (ssize_t)blk->size) {
+          throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
+        }
+        window_pos = blk->position;
+        window_len = got;
+      }
+      // a corrupt value is not carried over.
+      CheckStored(&window[blk->position - window_pos], *blk);
+      uint32_t pad = PlacementPadding(c->byte_count, blk->size);
+      if (!WritePadding(c->data_file, pad) ||
+          fwrite(&window[blk->position - window_pos], blk->size, 1, c->data_file) != 1) {
+        throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+      blk->position = c->byte_count + pad;
+      c->byte_count += pad + blk->size;
+      written += pad + blk->size;
+    }
+
+    IndexLogWriter<KeyType, KeyWriter> writer(c->index_file, kIndexVersion);
+    for (typename MapType::iterator itr = c->index.begin(); itr != c->index.end(); ++itr) {
+      writer.Add(itr->first, itr->second);
+      // the keys are left out of the count.
+      written += sizeof(BlockInfo);
+      if (written >= sFileBufferSize) {
+        CheckCancelled();
+        if (limiter) {
+          limiter->Acquire(written);
+        }
+        written = 0;
+      }
+    }
+    writer.Finish();
+    if (fflush(c->data_file) != 0 || fflush(c->index_file) != 0) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    // the bulk is synced here, FinishCompact() only syncs what it appends.
+    if (fsync(fileno(c->data_file)) != 0 || fsync(fileno(c->index_file)) != 0) {
+      throw SyncFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    c->done = true;
+  } catch (...) {
+    AbortCompact();
+    throw;
+  }
+}
+
+// appends what was written since the snapshot to the new files, then
+// swaps them in. the values written since then follow the compacted
+// ones, so their positions move by the same offset.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::FinishCompact() {
+  if (compaction_ && !compaction_->done) {
+    RunCompact();
+  }
+  Compaction* c = compaction_;
+  if (!c) {
+    return;
+  }
+  try {
+    if (segment_size_) {
+      FinishSegmentCompact();
+      return;
+    }
+    Flush();
+
+    std::vector<char> buffer(sFileBufferSize);
+    uint64_t tail = data_file_length_ - c->data_length;
+    // the tail keeps the placement Set() gave its values if it starts at
+    // the same offset into a block as in the old file.
+    if (tail > 0 && options_.read_mode == kReadDirect) {
+      const uint64_t block = AlignedBufferPool::kAlignment;
+      uint32_t pad = (c->data_length + block - c->byte_count % block) % block;
+      if (!WritePadding(c->data_file, pad)) {
+        throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+      c->byte_count += pad;
+    }
+    for (uint64_t copied = 0; copied < tail; ) {
+      size_t want = std::min<uint64_t>(buffer.size(), tail - copied);
+      if (pread(fd_, &buffer[0], want, c->data_length + copied) != (ssize_t)want) {
+        throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+      if (fwrite(&buffer[0], want, 1, c->data_file) != 1) {
+        throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+      copied += want;
+    }
+
+    MapType tail_index;
+    if (index_file_length_ > c->index_length) {
+      buffer.resize(index_file_length_ - c->index_length);
+      int index_fd = open((path_ + "index").c_str(), O_RDONLY);
+      if (index_fd == -1) {
+        throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+      ssize_t got = pread(index_fd, &buffer[0], buffer.size(), c->index_length);
       int err = errno;
-      fclose(tmpIndexFile);
-      unlink(tmpIndexPath.c_str());
-      fclose(tmpDataFile);
-      unlink(tmpDataPath.c_str());
-      throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+      close(index_fd);
+      if (got != (ssize_t)buffer.size()) {
+        throw ReadFileException(__FILE__, __LINE__, err, strerror(err));
+      }
+      if (ApplyIndexLog(&buffer[0], buffer.size(), index_version_, tail_index, true,
+          NULL) != buffer.size()) {
+        throw FileCorruptException(__FILE__, __LINE__, 0, "corrupt index log");
+      }
+    }
+    IndexLogWriter<KeyType, KeyWriter> writer(c->index_file, kIndexVersion);
+    for (typename MapType::iterator itr = tail_index.begin(); itr != tail_index.end(); ++itr) {
+      BlockInfo block = itr->second;
+      if (block.position == sInvalidPosition && block.size == sInvalidSize) {
+        typename MapType::iterator old = c->index.find(itr->first);
+        if (old == c->index.end()) {
+          continue;
+        }
+        c->index.erase(old);
+      } else {
+        block.position = block.position - c->data_length + c->byte_count;
+        c->index[itr->first] = block;
+      }
+      writer.Add(itr->first, block);
     }
-    block.position = byte_count;
-    block.size = itr->second.size;
-    dupIndex[itr->first] = block;
-    byte_count += itr->second.size;
+    writer.Finish();
+    if (fflush(c->data_file) != 0 || fflush(c->index_file) != 0) {
+      throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    if (fsync(fileno(c->data_file)) != 0 || fsync(fileno(c->index_file)) != 0) {
+      throw SyncFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    CommitCompactFiles();
+    try {
+      SwapCompactFiles(c->data_path, c->index_path, true);
+    } catch (...) {
+      // the next Open() finishes the swap, the db stays closed until then
+      // and writes no checkpoint of the old index.
+      AbortCompact();
+      checkpoint_offset_ = index_file_length_;
+      Close();
+      throw;
+    }
+
+    Segment& segment = segments_[0];
+    if (segment.direct_fd != -1) {
+      posix_fadvise(fileno(c->data_file), 0, 0, POSIX_FADV_DONTNEED);
+      close(segment.direct_fd);
+      segment.direct_fd = -1;
+    }
+    close(fd_);
+    fd_ = -1;
+    segment.fd = -1;
+    index_version_ = kIndexVersion;
+
+    fd_ = open((path_ + "data").c_str(), O_RDWR | O_NONBLOCK);
+    if (fd_ == -1) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    segment.fd = fd_;
+    AdviseSegment(segment, path_ + "data");
+    close(index_fd_);
+    index_fd_ = open((path_ + "index").c_str(), O_RDONLY);
+    if (index_fd_ == -1) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+
+    // the positions start over in the new data file.
+    if (cache_) {
+      cache_->EraseOwner(cache_owner_);
+      cache_owner_ = cache_->NewOwner();
+    }
+    original_index_.swap(c->index);
+    data_file_length_ = c->byte_count + tail;
+    segment.length = data_file_length_;
+    // views of the old file keep their own reference to it.
+    if (segment.mapping) {
+      segment.mapping->Unref();
+      segment.mapping = NULL;
+    }
+    MapSegment(segment);
+
+    // the old checkpoint went with the replaced index file.
+    struct stat st;
+    if (lstat((path_ + "index").c_str(), &st) == -1) {
+      throw StatFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+    index_file_length_ = st.st_size;
+    // only closes the files now, they are renamed already.
+    AbortCompact();
+    WriteCheckpoint();
+  } catch (...) {
+    AbortCompact();
+    throw;
   }
-  fflush(tmpIndexFile);
-  fflush(tmpDataFile);
-  fsync(fileno(tmpIndexFile));
-  fsync(fileno(tmpDataFile));
-  fclose(tmpIndexFile);
-  fclose(tmpDataFile);
+}
 
-  close(fd_);
-  fd_ = -1;
-  rename(tmpIndexPath.c_str(), (path_ + "index").c_str());
-  rename(tmpDataPath.c_str(), (path_ + "data").c_str());
+// drops the compaction and its temporary files, if any.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::AbortCompact() {
+  Compaction* c = compaction_;
+  if (!c) {
+    return;
+  }
+  if (c->data_fd != -1) {
+    close(c->data_fd);
+  }
+  if (c->data_file) {
+    fclose(c->data_file);
+  }
+  if (c->index_file) {
+    fclose(c->index_file);
+  }
+  // already renamed if it was finished. once the swap began, the files
+  // are left for ResumeCompactSwap(). the index goes first, see there.
+  if (!c->committed) {
+    unlink(c->index_path.c_str());
+    unlink(c->data_path.c_str());
+  }
+  for (std::map<uint64_t, int>::iterator itr = c->victims.begin(); itr != c->victims.end(); ++itr) {
+    close(itr->second);
+  }
+  // the new segments are left only if they were not taken in.
+  for (size_t i = 0; i < c->outputs.size(); ++i) {
+    unlink(SegmentPath(c->outputs[i]).c_str());
+  }
+  delete c;
+  compaction_ = NULL;
+}
 
-  fd_ = open((path_ + "data").c_str(), O_RDWR | O_NONBLOCK);
-  if (fd_ == -1) {
+// the compacted files of a db without segments replace the old pair by
+// two renames. the "compacting" file names them first, so that Open()
+// can tell a swap cut off between the renames.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::CommitCompactFiles() {
+  Compaction* c = compaction_;
+  string tmpPath = path_ + "compacting.tmp";
+  FILE* file = fopen(tmpPath.c_str(), "w");
+  if (!file) {
     throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
   }
+  fprintf(file, "%s\n%s\n", c->data_path.substr(path_.size()).c_str(),
+    c->index_path.substr(path_.size()).c_str());
+  if (fflush(file) != 0 || fsync(fileno(file)) != 0) {
+    int err = errno;
+    fclose(file);
+    unlink(tmpPath.c_str());
+    throw SyncFileException(__FILE__, __LINE__, err, strerror(err));
+  }
+  fclose(file);
+  if (rename(tmpPath.c_str(), (path_ + "compacting").c_str()) != 0) {
+    int err = errno;
+    unlink(tmpPath.c_str());
+    throw WriteFileException(__FILE__, __LINE__, err, strerror(err));
+  }
+  SyncDirectory();
+  c->committed = true;
+}
 
-  original_index_.clear();
-  original_index_ = dupIndex;
-  actual_bytes_ = data_file_length_ = byte_count;
+// renames the new data file, unless with_data is false as it was renamed
+// already, then the new index file into place and drops the marker.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::SwapCompactFiles(const string& data_path,
+    const string& index_path, bool with_data) {
+  // the checkpoint refers to the old index file.
+  if (unlink((path_ + "checkpoint").c_str()) != 0 && errno != ENOENT) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  if (with_data && rename(data_path.c_str(), (path_ + "data").c_str()) != 0) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  if (rename(index_path.c_str(), (path_ + "index").c_str()) != 0) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  SyncDirectory();
+  if (unlink((path_ + "compacting").c_str()) != 0) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  SyncDirectory();
 }
 
+// finishes or drops the swap named by a "compacting" file. the data file
+// is renamed before the index file and AbortCompact() unlinks the index
+// file first, so a new index file means the swap is to be finished, and
+// a new data file alone that the compaction was given up.
 template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
-bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReadBlockInfo(const BlockInfo& blk,
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ResumeCompactSwap() {
+  unlink((path_ + "compacting.tmp").c_str());
+  FILE* file = fopen((path_ + "compacting").c_str(), "r");
+  if (!file) {
+    return;
+  }
+  char data_name[256], index_name[256];
+  int ret = fscanf(file, "%255s %255s", data_name, index_name);
+  fclose(file);
+  if (ret != 2) {
+    throw FileCorruptException(__FILE__, __LINE__, 0, "bad compacting file");
+  }
+  string data_path = path_ + data_name;
+  string index_path = path_ + index_name;
+  struct stat st;
+  bool has_data = lstat(data_path.c_str(), &st) == 0;
+  if (lstat(index_path.c_str(), &st) == 0) {
+    SwapCompactFiles(data_path, index_path, has_data);
+    return;
+  }
+  if (has_data && unlink(data_path.c_str()) != 0) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  if (unlink((path_ + "compacting").c_str()) != 0) {
+    throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  SyncDirectory();
+}
+
+// takes the sealed segments over compact_garbage_ratio as victims and
+// the index entries that still refer to them as the snapshot.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::BeginSegmentCompact() {
+  Compaction* c = compaction_;
+  for (typename SegmentMap::iterator itr = segments_.begin(); itr != segments_.end(); ++itr) {
+    if (IsReclaimable(itr->first, itr->second)) {
+      int fd = dup(itr->second.fd);
+      if (fd == -1) {
+        int err = errno;
+        AbortCompact();
+        throw OpenFileException(__FILE__, __LINE__, err, strerror(err));
+      }
+      c->victims[itr->first] = fd;
+    }
+  }
+  if (c->victims.empty()) {
+    AbortCompact();
+    return;
+  }
+  for (typename MapType::iterator itr = original_index_.begin();
+      itr != original_index_.end(); ++itr) {
+    if (itr->second.size > 0 &&
+        c->victims.find(SegmentOf(itr->second.position)) != c->victims.end()) {
+      c->index[itr->first] = itr->second;
+    }
+  }
+}
+
+// copies the live values of the victims into new segments, in the order
+// of their positions so that each victim is read sequentially.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::RunSegmentCompact() {
+  Compaction* c = compaction_;
+  std::vector<BlockInfo*> blocks;
+  blocks.reserve(c->index.size());
+  for (typename MapType::iterator itr = c->index.begin(); itr != c->index.end(); ++itr) {
+    blocks.push_back(&itr->second);
+  }
+  std::sort(blocks.begin(), blocks.end(), PositionLess);
+
+  RateLimiter* limiter = options_.compact_limiter;
+  std::vector<char> window;
+  uint64_t window_pos = 0;
+  uint64_t window_len = 0;
+  uint64_t written = 0;
+  FILE* file = NULL;
+  uint64_t id = 0;
+  uint64_t length = 0;
+  try {
+    for (size_t i = 0; i < blocks.size(); ++i) {
+      BlockInfo* blk = blocks[i];
+      // a window never crosses into the next victim, values do not
+      // straddle segments.
+      if (blk->position < window_pos || blk->position + blk->size > window_pos + window_len) {
+        CheckCancelled();
+        size_t want = std::max<size_t>(sFileBufferSize, blk->size);
+        if (window.size() < want) {
+          window.resize(want);
+        }
+        if (limiter) {
+          limiter->Acquire(want + written);
+          written = 0;
+        }
+        uint64_t victim = SegmentOf(blk->position);
+        ssize_t got = pread(c->victims[victim], &window[0], want,
+          blk->position - SegmentBase(victim));
+        if (got < (ssize_t)blk->size) {
+          throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
+        }
+        window_pos = blk->position;
+        window_len = got;
+      }
+
+      uint32_t pad = file ? PlacementPadding(length, blk->size) : 0;
+      if (!file || (length > 0 && length + pad + blk->size > segment_size_)) {
+        if (file) {
+          if (fflush(file) != 0) {
+            throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+          }
+          fsync(fileno(file));
+          if (options_.read_mode == kReadDirect) {
+            posix_fadvise(fileno(file), 0, 0, POSIX_FADV_DONTNEED);
+          }
+          fclose(file);
+          file = NULL;
+        }
+        id = __sync_fetch_and_add(&next_segment_id_, SegmentSpan(blk->size));
+        c->outputs.push_back(id);
+        file = fopen(SegmentPath(id).c_str(), "wb");
+        if (!file) {
+          throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+        }
+        setvbuf(file, NULL, _IOFBF, sFileBufferSize);
+        length = 0;
+        pad = 0;
+      }
+      CheckStored(&window[blk->position - window_pos], *blk);
+      if (!WritePadding(file, pad) ||
+          fwrite(&window[blk->position - window_pos], blk->size, 1, file) != 1) {
+        throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+      blk->position = SegmentBase(id) + length + pad;
+      length += pad + blk->size;
+      written += pad + blk->size;
+    }
+    if (file) {
+      if (fflush(file) != 0) {
+        throw WriteFileException(__FILE__, __LINE__, errno, strerror(errno));
+      }
+      fsync(fileno(file));
+      if (options_.read_mode == kReadDirect) {
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_DONTNEED);
+      }
+      fclose(file);
+    }
+  } catch (...) {
+    if (file) {
+      fclose(file);
+    }
+    throw;
+  }
+  c->done = true;
+}
+
+// takes the new segments in and moves the entries that still refer to a
+// victim, i.e. were not overwritten or deleted meanwhile. the victims go
+// once the moves are synced to the index log.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::FinishSegmentCompact() {
+  Compaction* c = compaction_;
+  Flush();
+  for (size_t i = 0; i < c->outputs.size(); ++i) {
+    OpenSegment(c->outputs[i]);
+  }
+  c->outputs.clear();
+
+  for (typename MapType::iterator itr = c->index.begin(); itr != c->index.end(); ++itr) {
+    typename MapType::iterator old = original_index_.find(itr->first);
+    if (old == original_index_.end() ||
+        c->victims.find(SegmentOf(old->second.position)) == c->victims.end()) {
+      continue;
+    }
+    original_index_.erase(old);
+    inses_[itr->first] = itr->second;
+    AddLiveBytes(itr->second, true);
+  }
+  Flush();
+  SyncDirectory();
+  // the victims go only once the records moving their values are durable.
+  if (fdatasync(index_fd_) != 0) {
+    throw SyncFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+
+  for (std::map<uint64_t, int>::iterator itr = c->victims.begin(); itr != c->victims.end(); ++itr) {
+    close(itr->second);
+    CloseSegment(segments_.find(itr->first), true);
+  }
+  c->victims.clear();
+  AbortCompact();
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint64_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::Scrub() {
+  BeginScrub();
+  return RunScrub();
+}
+
+// the segments are read through their own fds, so that one sealed or
+// compacted away meanwhile is still read as it was.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::BeginScrub() {
+  if (fd_ == -1 || scrub_) {
+    return;
+  }
+  Flush();
+  scrub_ = new ScrubSnapshot;
+  for (typename MapType::iterator itr = original_index_.begin(); itr != original_index_.end(); ++itr) {
+    if (itr->second.size > 0) {
+      scrub_->blocks.push_back(itr->second);
+    }
+  }
+  for (uint64_t i = 0; frozen_ && i < frozen_->size(); ++i) {
+    if (frozen_->ValueAt(i).size > 0) {
+      scrub_->blocks.push_back(frozen_->ValueAt(i));
+    }
+  }
+  for (typename SegmentMap::iterator itr = segments_.begin(); itr != segments_.end(); ++itr) {
+    int fd = dup(itr->second.fd);
+    if (fd == -1) {
+      int err = errno;
+      AbortScrub();
+      throw OpenFileException(__FILE__, __LINE__, err, strerror(err));
+    }
+    scrub_->fds[itr->first] = fd;
+  }
+}
+
+// reads the snapshot in position order a window at a time, as compaction
+// does, each window paying scrub_limiter.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint64_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::RunScrub() {
+  ScrubSnapshot* s = scrub_;
+  if (!s) {
+    return 0;
+  }
+  uint64_t bad = 0;
+  try {
+    std::sort(s->blocks.begin(), s->blocks.end(), BlockPositionLess);
+    std::vector<char> window;
+    uint64_t window_pos = 0;
+    uint64_t window_len = 0;
+    for (size_t i = 0; i < s->blocks.size(); ++i) {
+      const BlockInfo& blk = s->blocks[i];
+      // a window ends with its segment, values do not straddle segments.
+      if (blk.position < window_pos || blk.position + blk.size > window_pos + window_len) {
+        CheckCancelled();
+        size_t want = std::max<size_t>(sFileBufferSize, blk.size);
+        if (window.size() < want) {
+          window.resize(want);
+        }
+        if (options_.scrub_limiter) {
+          options_.scrub_limiter->Acquire(want);
+        }
+        uint64_t id = SegmentOf(blk.position);
+        std::map<uint64_t, int>::iterator fd = s->fds.find(id);
+        if (fd == s->fds.end()) {
+          throw FileCorruptException(__FILE__, __LINE__, 0, "missing data segment");
+        }
+        ssize_t got = pread(fd->second, &window[0], want, blk.position - SegmentBase(id));
+        if (got < (ssize_t)blk.size) {
+          throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
+        }
+        window_pos = blk.position;
+        window_len = got;
+      }
+      if (checksums_ && !ChecksumMatches(&window[blk.position - window_pos], blk.size)) {
+        ++bad;
+      }
+    }
+  } catch (...) {
+    AbortScrub();
+    throw;
+  }
+  AbortScrub();
+  __sync_fetch_and_add(&checksum_errors_, bad);
+  return bad;
+}
+
+// called by compaction and scrub before each window they read.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::CheckCancelled() const {
+  if (cancels_ > 0) {
+    throw CancelledException(__FILE__, __LINE__, ECANCELED, "maintenance cancelled");
+  }
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::AbortScrub() {
+  ScrubSnapshot* s = scrub_;
+  if (!s) {
+    return;
+  }
+  for (std::map<uint64_t, int>::iterator itr = s->fds.begin(); itr != s->fds.end(); ++itr) {
+    close(itr->second);
+  }
+  delete s;
+  scrub_ = NULL;
+}
+
+// the stored bytes of blk if they are in memory, i.e. in the buffer or
+// in a mapping, NULL otherwise.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+const char* TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::FindStoredBytes(const BlockInfo& blk) {
+  if (InBuffer(blk)) {
+    return (const char*)&buf_[blk.position - data_file_length_];
+  }
+  for (size_t i = 0; i < flushing_.size(); ++i) {
+    const FlushJob* job = flushing_[i];
+    if (blk.position >= job->position && blk.position - job->position < job->length) {
+      return (const char*)&job->buf[blk.position - job->position];
+    }
+  }
+  typename SegmentMap::iterator itr = segments_.find(SegmentOf(blk.position));
+  if (itr != segments_.end() && itr->second.mapping) {
+    return itr->second.mapping->data() + blk.position - SegmentBase(itr->first);
+  }
+  return NULL;
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReadStoredBytes(const BlockInfo& blk,
     std::string* value) {
-  value->clear();
+  typename SegmentMap::iterator itr = segments_.find(SegmentOf(blk.position));
+  if (itr == segments_.end()) {
+    throw FileCorruptException(__FILE__, __LINE__, 0, "missing data segment");
+  }
   value->resize(blk.size);
-  if (blk.size > 0) {
-    if (blk.position < data_file_length_) {
-      if (pread(fd_, &(*value)[0], blk.size, blk.position) != blk.size) {
-        throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
-        return false;
+  if (itr->second.direct_fd != -1) {
+    ReadDirect(itr->second.direct_fd, blk.position - SegmentBase(itr->first), blk.size, &(*value)[0]);
+  } else if (pread(itr->second.fd, &(*value)[0], blk.size, blk.position - SegmentBase(itr->first)) != blk.size) {
+    throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+}
+
+// reads size bytes at offset of a file opened with O_DIRECT through an
+// aligned buffer of the blocks around them.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReadDirect(int fd, uint64_t offset,
+    uint32_t size, char* out) {
+  const uint64_t block = AlignedBufferPool::kAlignment;
+  uint64_t begin = offset & ~(block - 1);
+  uint64_t end = (offset + size + block - 1) & ~(block - 1);
+  AlignedBuffer buffer(buffers_, end - begin);
+  ssize_t got;
+  do {
+    got = pread(fd, buffer.data(), end - begin, begin);
+  } while (got < 0 && errno == EINTR);
+  // short at the end of the file.
+  if (got < (ssize_t)(offset + size - begin)) {
+    throw ReadFileException(__FILE__, __LINE__, errno, strerror(errno));
+  }
+  memcpy(out, buffer.data() + offset - begin, size);
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReadBlockInfo(const BlockInfo& blk,
+    std::string* value) {
+  if (blk.size == 0) {
+    value->clear();
+    return true;
+  }
+  const char* data = FindStoredBytes(blk);
+  if (!compressor_) {
+    if (data) {
+      value->assign(data, CheckStored(data, blk));
+    } else if (!LookupCache(blk, value)) {
+      ReadStoredBytes(blk, value);
+      value->resize(CheckStored(value->data(), blk));
+      if (cache_) {
+        cache_->Insert(cache_owner_, blk.position, *value);
       }
-    } else {  // read from memory
-      memcpy(&(*value)[0], &buf_[blk.position - data_file_length_], blk.size);
     }
+    return true;
   }
 
+  if (!InWriteBuffers(blk) && LookupCache(blk, value)) {
+    return true;
+  }
+  std::string stored;
+  if (!data) {
+    ReadStoredBytes(blk, &stored);
+    data = stored.data();
+  }
+  if (!ValueCompressor::Decompress(data, CheckStored(data, blk), compressor_->dictionary(), value)) {
+    throw FileCorruptException(__FILE__, __LINE__, 0, "bad compressed value");
+  }
+  if (cache_ && !InWriteBuffers(blk)) {
+    cache_->Insert(cache_owner_, blk.position, *value);
+  }
   return true;
 }
 
+// counts a hit or a miss of cache_, if any.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::LookupCache(const BlockInfo& blk,
+    std::string* value) {
+  if (!cache_) {
+    return false;
+  }
+  if (cache_->Lookup(cache_owner_, blk.position, value)) {
+    __sync_fetch_and_add(&cache_hits_, 1);
+    return true;
+  }
+  __sync_fetch_and_add(&cache_misses_, 1);
+  return false;
+}
+
+// a buffered value was never cached.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::EraseCache(const BlockInfo& blk) {
+  if (cache_ && blk.size > 0 && !InWriteBuffers(blk)) {
+    cache_->Erase(cache_owner_, blk.position);
+  }
+}
+
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+bool TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::ReadBlockInfo(const BlockInfo& blk,
+    ValueView* value) {
+  // a mapping covers its whole segment, see MapSegment(). a compressed
+  // value is inflated into the view, a raw one pinned past its tag.
+  if (blk.size > 0 && !InWriteBuffers(blk)) {
+    typename SegmentMap::iterator itr = segments_.find(SegmentOf(blk.position));
+    if (itr != segments_.end() && itr->second.mapping) {
+      const char* data = itr->second.mapping->data() + blk.position - SegmentBase(itr->first);
+      uint32_t size = CheckStored(data, blk);
+      if (!compressor_) {
+        value->Pin(itr->second.mapping, data, size);
+        return true;
+      } else if (data[0] == ValueCompressor::kRaw) {
+        value->Pin(itr->second.mapping, data + 1, size - 1);
+        return true;
+      }
+    }
+  }
+  return ReadBlockInfo(blk, value->Own());
+}
+
+// (re)maps a segment once it outgrows the mapping. called whenever a
+// segment grows, which happens under the writer's lock, so that readers
+// only take references.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::MapSegment(Segment& segment) {
+  if (!options_.mmap_reads || segment.fd == -1 || segment.direct_fd != -1 ||
+      (segment.mapping && segment.length <= segment.mapping->length())) {
+    return;
+  }
+  uint64_t length = segment_size_ ? std::max(segment_size_, segment.length) :
+    std::max(sMinMappingSize, segment.length * 2);
+  if (segment.mapping) {
+    segment.mapping->Unref();
+  }
+  // reads fall back to pread if mmap fails, it is retried as the file grows.
+  segment.mapping = DataMapping::Create(segment.fd, length);
+}
+
+// applies options_.read_mode to a segment opened at path. a file system
+// that refuses O_DIRECT leaves the segment to buffered reads.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+void TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::AdviseSegment(Segment& segment,
+    const string& path) {
+  if (options_.read_mode == kReadRandom) {
+    posix_fadvise(segment.fd, 0, 0, POSIX_FADV_RANDOM);
+  } else if (options_.read_mode == kReadDirect) {
+    segment.direct_fd = open(path.c_str(), O_RDONLY | O_DIRECT);
+    if (segment.direct_fd == -1 && errno != EINVAL) {
+      throw OpenFileException(__FILE__, __LINE__, errno, strerror(errno));
+    }
+  }
+}
+
+// with kReadDirect, the bytes skipped before a value of size written
+// next so that it spans no more blocks than it must.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint32_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::PlacementPadding(uint32_t size) const {
+  return PlacementPadding(data_file_length_ + buf_pos_ - SegmentBase(active_id_), size);
+}
+
+// the same for a value at offset of its file, as compaction writes them.
+// a value that fits where it is goes there, so that small values pay for
+// padding rarely.
+template <class KeyType, class KeyReader, class KeyWriter, class KeyHashFunc>
+uint32_t TCabinet<KeyType, KeyReader, KeyWriter, KeyHashFunc>::PlacementPadding(uint64_t offset,
+    uint32_t size) const {
+  if (options_.read_mode != kReadDirect || size == 0) {
+    return 0;
+  }
+  const uint64_t block = AlignedBufferPool::kAlignment;
+  offset %= block;
+  if (offset == 0 || (offset + size + block - 1) / block == (size + block - 1) / block) {
+    return 0;
+  }
+  return block - offset;
+}
+
 }  // namespace cabinet
@@ -0,0 +1,243 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Byte Budgeted Cache Of Hot Values
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_VALUE_CACHE_H_
+#define CABINET_VALUE_CACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <algorithm>
+#include <hash_map>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "CabinetHash.h"
+
+namespace cabinet {
+// class ValueCache
+// values by the data file position they were read from. the bytes at a
+// position never change, a Set writes its value elsewhere, so an entry
+// is never stale. a cabinet takes an owner id at Open and a new one when
+// it reuses positions, i.e. when a single data file is compacted. it
+// erases the entries of values it deletes or overwrites, so that dead
+// values do not hold the budget.
+//
+// a value is admitted on its second miss only: a doorkeeper remembers a
+// hash of recent misses, so that values read once, e.g. by a scan or in
+// the long tail of a Zipfian load, cost no insert and push nothing out.
+// admitted values enter the probation segment of a segmented LRU and
+// move to the protected one on a hit, which holds at most
+// kProtectedPercent of the bytes, so that values hit twice survive a
+// churn of probation. entries are spread over kStripes stripes with a
+// lock and a share of the budget each. one may be shared by threads and
+// by cabinets, e.g. all dbs of a server.
+class ValueCache {
+ public:
+  static const size_t kStripes = 16;
+  static const uint64_t kProtectedPercent = 80;
+  // bookkeeping counted along with the value bytes of an entry.
+  static const uint64_t kEntryOverhead = 96;
+  // a doorkeeper slot per this many bytes of budget, at least 64 a
+  // stripe. slots form sets of kDoorkeeperWays, a miss takes a free slot
+  // of its set or else the slot whose turn it is, so that keys read in
+  // turn do not keep pushing each other out.
+  static const uint64_t kDoorkeeperBytes = 512;
+  static const size_t kDoorkeeperWays = 4;
+
+  explicit ValueCache(uint64_t capacity) : capacity_(capacity), owners_(0), hits_(0), misses_(0) {
+    for (size_t i = 0; i < kStripes; ++i) {
+      pthread_mutex_init(&stripes_[i].mutex, NULL);
+      stripes_[i].bytes = 0;
+      stripes_[i].protected_bytes = 0;
+      stripes_[i].doorkeeper_turn = 0;
+      stripes_[i].doorkeeper.assign(std::max<uint64_t>(StripeCapacity() / kDoorkeeperBytes, 64), 0);
+    }
+  }
+  ~ValueCache() {
+    for (size_t i = 0; i < kStripes; ++i) {
+      pthread_mutex_destroy(&stripes_[i].mutex);
+    }
+  }
+
+  uint64_t NewOwner() { return __sync_add_and_fetch(&owners_, 1); }
+
+  bool Lookup(uint64_t owner, uint64_t position, std::string* value) {
+    Key key(owner, position);
+    Stripe& stripe = StripeOf(key);
+    pthread_mutex_lock(&stripe.mutex);
+    EntryMap::iterator itr = stripe.map.find(key);
+    if (itr == stripe.map.end()) {
+      pthread_mutex_unlock(&stripe.mutex);
+      __sync_fetch_and_add(&misses_, 1);
+      return false;
+    }
+    List::iterator entry = itr->second;
+    value->assign(entry->value);
+    if (entry->hot) {
+      stripe.hot.splice(stripe.hot.begin(), stripe.hot, entry);
+    } else {
+      entry->hot = true;
+      stripe.protected_bytes += Charge(*entry);
+      stripe.hot.splice(stripe.hot.begin(), stripe.probation, entry);
+      // the coldest protected values go back on probation.
+      while (stripe.protected_bytes > StripeCapacity() * kProtectedPercent / 100) {
+        List::iterator cold = --stripe.hot.end();
+        cold->hot = false;
+        stripe.protected_bytes -= Charge(*cold);
+        stripe.probation.splice(stripe.probation.begin(), stripe.hot, cold);
+      }
+    }
+    pthread_mutex_unlock(&stripe.mutex);
+    __sync_fetch_and_add(&hits_, 1);
+    return true;
+  }
+
+  // offers a value that missed. values over an eighth of a stripe are
+  // never admitted, they would push out many small ones.
+  void Insert(uint64_t owner, uint64_t position, const std::string& value) {
+    if (value.size() + kEntryOverhead > StripeCapacity() / 8) {
+      return;
+    }
+    Key key(owner, position);
+    uint64_t hash = KeyHash()(key) | 1;
+    Stripe& stripe = StripeOf(key);
+    pthread_mutex_lock(&stripe.mutex);
+    uint64_t* set = &stripe.doorkeeper[hash % (stripe.doorkeeper.size() / kDoorkeeperWays) *
+      kDoorkeeperWays];
+    uint64_t* seen = std::find(set, set + kDoorkeeperWays, hash);
+    if (seen == set + kDoorkeeperWays) {
+      uint64_t* free = std::find(set, set + kDoorkeeperWays, 0);
+      *(free != set + kDoorkeeperWays ? free : set + stripe.doorkeeper_turn++ % kDoorkeeperWays) = hash;
+    } else if (stripe.map.find(key) == stripe.map.end()) {
+      *seen = 0;
+      stripe.probation.push_front(Entry());
+      Entry& entry = stripe.probation.front();
+      entry.key = key;
+      entry.value = value;
+      entry.hot = false;
+      stripe.map[key] = stripe.probation.begin();
+      stripe.bytes += Charge(entry);
+      while (stripe.bytes > StripeCapacity()) {
+        List& list = stripe.probation.empty() ? stripe.hot : stripe.probation;
+        Remove(stripe, --list.end());
+      }
+    }
+    pthread_mutex_unlock(&stripe.mutex);
+  }
+
+  void Erase(uint64_t owner, uint64_t position) {
+    Key key(owner, position);
+    Stripe& stripe = StripeOf(key);
+    pthread_mutex_lock(&stripe.mutex);
+    EntryMap::iterator itr = stripe.map.find(key);
+    if (itr != stripe.map.end()) {
+      Remove(stripe, itr->second);
+    }
+    pthread_mutex_unlock(&stripe.mutex);
+  }
+
+  // erases all values of owner, which is not used again.
+  void EraseOwner(uint64_t owner) {
+    for (size_t i = 0; i < kStripes; ++i) {
+      Stripe& stripe = stripes_[i];
+      pthread_mutex_lock(&stripe.mutex);
+      List* lists[] = { &stripe.probation, &stripe.hot };
+      for (size_t j = 0; j < 2; ++j) {
+        for (List::iterator itr = lists[j]->begin(); itr != lists[j]->end(); ) {
+          List::iterator entry = itr++;
+          if (entry->key.owner == owner) {
+            Remove(stripe, entry);
+          }
+        }
+      }
+      pthread_mutex_unlock(&stripe.mutex);
+    }
+  }
+
+  uint64_t GetCapacity() const { return capacity_; }
+  uint64_t GetBytes() {
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < kStripes; ++i) {
+      pthread_mutex_lock(&stripes_[i].mutex);
+      bytes += stripes_[i].bytes;
+      pthread_mutex_unlock(&stripes_[i].mutex);
+    }
+    return bytes;
+  }
+  uint64_t GetHits() const { return hits_; }
+  uint64_t GetMisses() const { return misses_; }
+
+ private:
+  struct Key {
+    uint64_t owner;
+    uint64_t position;
+
+    Key() : owner(0), position(0) {}
+    Key(uint64_t o, uint64_t p) : owner(o), position(p) {}
+    bool operator==(const Key& other) const {
+      return owner == other.owner && position == other.position;
+    }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return Mix64(key.position ^ (key.owner << 48));
+    }
+  };
+  struct Entry {
+    Key key;
+    std::string value;
+    bool hot;  // in the protected segment.
+  };
+  typedef std::list<Entry> List;
+  typedef __gnu_cxx::hash_map<Key, List::iterator, KeyHash> EntryMap;
+
+  struct Stripe {
+    pthread_mutex_t mutex;
+    List probation;  // most recent first.
+    List hot;
+    EntryMap map;
+    uint64_t bytes;
+    uint64_t protected_bytes;
+    std::vector<uint64_t> doorkeeper;  // hashes of keys that missed once.
+    uint64_t doorkeeper_turn;
+  };
+
+  static uint64_t Charge(const Entry& entry) {
+    return entry.value.size() + kEntryOverhead;
+  }
+  uint64_t StripeCapacity() const { return capacity_ / kStripes; }
+
+  // the low bits of the hash pick the bucket of the stripe's map.
+  Stripe& StripeOf(const Key& key) {
+    return stripes_[(KeyHash()(key) >> 56) % kStripes];
+  }
+
+  void Remove(Stripe& stripe, List::iterator entry) {
+    stripe.bytes -= Charge(*entry);
+    stripe.map.erase(entry->key);
+    if (entry->hot) {
+      stripe.protected_bytes -= Charge(*entry);
+      stripe.hot.erase(entry);
+    } else {
+      stripe.probation.erase(entry);
+    }
+  }
+
+  ValueCache(const ValueCache&);
+  void operator=(const ValueCache&);
+
+  const uint64_t capacity_;
+  uint64_t owners_;
+  uint64_t hits_;
+  uint64_t misses_;
+  Stripe stripes_[kStripes];
+};
+}  // namespace cabinet
+
+#endif  // CABINET_VALUE_CACHE_H_
@@ -0,0 +1,237 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Per Value Compression With An Optional Trained Dictionary
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_VALUE_COMPRESSOR_H_
+#define CABINET_VALUE_COMPRESSOR_H_
+
+#include <endian.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cabinet {
+// class ValueCompressor
+// stores a value as a one byte tag and a payload:
+//   kRaw         the value as is.
+//   kDeflate     little endian uint32_t value size, raw deflate stream.
+//   kDictionary  the same, deflated with the db's dictionary preset.
+// a value that does not shrink by an eighth is kept raw. after a run of
+// those only every kRetryInterval-th value is tried, so incompressible
+// data costs little CPU. Compress() and the dictionary belong to the
+// writer, Decompress() may run on any thread.
+class ValueCompressor {
+ public:
+  enum Tag {
+    kRaw = 0,
+    kDeflate = 1,
+    kDictionary = 2,
+  };
+  static const size_t kHeaderSize = 5;
+  // shorter values are not worth a deflate stream.
+  static const size_t kMinSize = 64;
+  static const size_t kMaxDictionarySize = 32 * 1024;
+  static const uint32_t kRetryInterval = 16;
+
+  ValueCompressor() : initialized_(false), misses_(0), skipped_(0) {
+    memset(&stream_, 0, sizeof(stream_));
+  }
+  ~ValueCompressor() {
+    if (initialized_) {
+      deflateEnd(&stream_);
+    }
+  }
+
+  const std::string& dictionary() const { return dictionary_; }
+  void SetDictionary(const std::string& dictionary) { dictionary_ = dictionary; }
+
+  // sets out to the stored form of size bytes at data.
+  void Compress(const char* data, size_t size, std::string* out) {
+    if (size < kMinSize || (misses_ >= kRetryInterval && ++skipped_ % kRetryInterval != 0) ||
+        !Deflate(data, size, out)) {
+      out->assign(1, (char)kRaw);
+      out->append(data, size);
+    }
+  }
+
+  // sets out to the value stored in size bytes at data, false if they do
+  // not hold one.
+  static bool Decompress(const char* data, size_t size, const std::string& dictionary,
+      std::string* out) {
+    if (size == 0) {
+      out->clear();
+      return false;
+    }
+    if (data[0] == kRaw) {
+      out->assign(data + 1, size - 1);
+      return true;
+    }
+    if (size < kHeaderSize || (data[0] != kDeflate && data[0] != kDictionary) ||
+        (data[0] == kDictionary && dictionary.empty())) {
+      return false;
+    }
+    uint32_t raw_size;
+    memcpy(&raw_size, data + 1, sizeof(raw_size));
+    raw_size = le32toh(raw_size);
+    out->resize(raw_size);
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+      return false;
+    }
+    if (data[0] == kDictionary &&
+        inflateSetDictionary(&stream, (const Bytef*)dictionary.data(), dictionary.size()) != Z_OK) {
+      inflateEnd(&stream);
+      return false;
+    }
+    stream.next_in = (Bytef*)(data + kHeaderSize);
+    stream.avail_in = size - kHeaderSize;
+    stream.next_out = (Bytef*)(raw_size ? &(*out)[0] : NULL);
+    stream.avail_out = raw_size;
+    int ret = inflate(&stream, Z_FINISH);
+    bool ok = ret == Z_STREAM_END && stream.total_out == raw_size;
+    inflateEnd(&stream);
+    return ok;
+  }
+
+  // builds a dictionary out of sample values: the 64 byte pieces that
+  // share the most 8 byte substrings with the samples, each substring
+  // counted once, the most common last as deflate reaches it cheapest.
+  static std::string Train(const std::vector<std::string>& samples) {
+    static const size_t kGram = 8;
+    static const size_t kPiece = 64;
+    std::vector<uint64_t> grams;
+    for (size_t i = 0; i < samples.size(); ++i) {
+      const std::string& sample = samples[i];
+      for (size_t j = 0; j + kGram <= sample.size(); ++j) {
+        grams.push_back(Gram(sample.data() + j));
+      }
+    }
+    std::sort(grams.begin(), grams.end());
+    std::vector<uint64_t> unique;
+    std::vector<uint32_t> counts;
+    for (size_t i = 0; i < grams.size(); ) {
+      size_t j = i;
+      while (j < grams.size() && grams[j] == grams[i]) {
+        ++j;
+      }
+      unique.push_back(grams[i]);
+      counts.push_back(j - i);
+      i = j;
+    }
+
+    // greedy: take the best piece, then forget its substrings and rescore
+    // the next best lazily.
+    std::vector<std::pair<uint64_t, const char*> > heap;
+    for (size_t i = 0; i < samples.size(); ++i) {
+      const std::string& sample = samples[i];
+      for (size_t j = 0; j + kPiece <= sample.size(); j += kPiece) {
+        heap.push_back(std::make_pair(Score(sample.data() + j, kPiece, unique, counts),
+          sample.data() + j));
+      }
+    }
+    std::make_heap(heap.begin(), heap.end());
+    std::vector<const char*> picked;
+    while (!heap.empty() && picked.size() * kPiece < kMaxDictionarySize) {
+      std::pop_heap(heap.begin(), heap.end());
+      std::pair<uint64_t, const char*> top = heap.back();
+      heap.pop_back();
+      uint64_t score = Score(top.second, kPiece, unique, counts);
+      if (score == 0) {
+        break;
+      }
+      if (score < top.first) {
+        top.first = score;
+        heap.push_back(top);
+        std::push_heap(heap.begin(), heap.end());
+        continue;
+      }
+      picked.push_back(top.second);
+      for (size_t j = 0; j + kGram <= kPiece; ++j) {
+        size_t index = std::lower_bound(unique.begin(), unique.end(), Gram(top.second + j)) -
+          unique.begin();
+        counts[index] = 0;
+      }
+    }
+    std::string dictionary;
+    for (size_t i = picked.size(); i > 0; --i) {
+      dictionary.append(picked[i - 1], kPiece);
+    }
+    return dictionary;
+  }
+
+ private:
+  bool Deflate(const char* data, size_t size, std::string* out) {
+    if (!initialized_) {
+      if (deflateInit2(&stream_, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8,
+          Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+      }
+      initialized_ = true;
+    } else {
+      deflateReset(&stream_);
+    }
+    if (!dictionary_.empty()) {
+      deflateSetDictionary(&stream_, (const Bytef*)dictionary_.data(), dictionary_.size());
+    }
+    // kept raw unless an eighth smaller.
+    size_t limit = size - size / 8;
+    out->resize(std::max<size_t>(limit, kHeaderSize + 1));
+    (*out)[0] = dictionary_.empty() ? kDeflate : kDictionary;
+    uint32_t raw_size = htole32(size);
+    memcpy(&(*out)[1], &raw_size, sizeof(raw_size));
+    stream_.next_in = (Bytef*)data;
+    stream_.avail_in = size;
+    stream_.next_out = (Bytef*)&(*out)[kHeaderSize];
+    stream_.avail_out = out->size() - kHeaderSize;
+    if (deflate(&stream_, Z_FINISH) != Z_STREAM_END) {
+      ++misses_;
+      return false;
+    }
+    out->resize(kHeaderSize + stream_.total_out);
+    misses_ = 0;
+    return true;
+  }
+
+  static uint64_t Gram(const char* data) {
+    uint64_t gram;
+    memcpy(&gram, data, sizeof(gram));
+    return gram;
+  }
+
+  static uint64_t Score(const char* data, size_t size, const std::vector<uint64_t>& unique,
+      const std::vector<uint32_t>& counts) {
+    uint64_t score = 0;
+    for (size_t j = 0; j + 8 <= size; ++j) {
+      size_t index = std::lower_bound(unique.begin(), unique.end(), Gram(data + j)) -
+        unique.begin();
+      // a substring seen once is no better than no dictionary.
+      if (counts[index] > 1) {
+        score += counts[index];
+      }
+    }
+    return score;
+  }
+
+  ValueCompressor(const ValueCompressor&);
+  void operator=(const ValueCompressor&);
+
+  z_stream stream_;
+  bool initialized_;
+  std::string dictionary_;
+  uint32_t misses_;  // values in a row that did not compress.
+  uint32_t skipped_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_VALUE_COMPRESSOR_H_
@@ -0,0 +1,126 @@
+/**
+ * Copyright 2013 i-MD.com. All Rights Reserved.
+ *
+ * Memory Mapped Data File And Views Of Values In It.
+ *
+ * @author junhao.zhang@i-md.com (Bryan Zhang)
+*/
+
+#ifndef CABINET_VALUE_VIEW_H_
+#define CABINET_VALUE_VIEW_H_
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <string>
+
+#include "StringPiece.h"
+
+namespace cabinet {
+// a read only shared mapping of a data file. it is reference counted, a
+// view keeps the mapping alive after the cabinet remaps a grown file or
+// replaces it by Compact() or Drop(), as the old file is only unlinked.
+class DataMapping {
+ public:
+  // maps the first length bytes of fd, pages past the end of the file
+  // become readable as the file grows. returns NULL if mmap fails.
+  static DataMapping* Create(int fd, size_t length) {
+    void* addr = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      return NULL;
+    }
+    return new DataMapping(static_cast<const char*>(addr), length);
+  }
+
+  const char* data() const { return data_; }
+  size_t length() const { return length_; }
+
+  void Ref() { __sync_add_and_fetch(&refs_, 1); }
+  void Unref() {
+    if (__sync_sub_and_fetch(&refs_, 1) == 0) {
+      delete this;
+    }
+  }
+
+ private:
+  DataMapping(const char* data, size_t length)
+    : data_(data), length_(length), refs_(1) {}
+  ~DataMapping() { munmap(const_cast<char*>(data_), length_); }
+  DataMapping(const DataMapping&);
+  void operator=(const DataMapping&);
+
+  const char* data_;
+  size_t length_;
+  int refs_;
+};
+
+// the value returned by TCabinet::Get(key, ValueView*). a value in the
+// mapped data file is pinned and not copied, one still in the write
+// buffer or read without a mapping is copied into the view.
+class ValueView {
+ public:
+  ValueView() : data_(NULL), size_(0), mapping_(NULL) {}
+  ValueView(const ValueView& other)
+    : data_(other.data_), size_(other.size_), mapping_(other.mapping_),
+      copy_(other.copy_) {
+    if (mapping_) {
+      mapping_->Ref();
+    }
+  }
+  ValueView& operator=(const ValueView& other) {
+    if (this != &other) {
+      if (other.mapping_) {
+        other.mapping_->Ref();
+      }
+      Reset();
+      data_ = other.data_;
+      size_ = other.size_;
+      mapping_ = other.mapping_;
+      copy_ = other.copy_;
+    }
+    return *this;
+  }
+  ~ValueView() { Reset(); }
+
+  const char* data() const { return mapping_ ? data_ : copy_.data(); }
+  size_t size() const { return mapping_ ? size_ : copy_.size(); }
+  bool empty() const { return size() == 0; }
+  // true if the view points into the data file mapping.
+  bool pinned() const { return mapping_ != NULL; }
+
+  StringPiece ToStringPiece() const { return StringPiece(data(), size()); }
+  std::string ToString() const { return std::string(data(), size()); }
+
+  void Reset() {
+    if (mapping_) {
+      mapping_->Unref();
+      mapping_ = NULL;
+    }
+    data_ = NULL;
+    size_ = 0;
+    copy_.clear();
+  }
+
+  // points the view at size bytes of mapping.
+  void Pin(DataMapping* mapping, const char* data, size_t size) {
+    mapping->Ref();
+    Reset();
+    mapping_ = mapping;
+    data_ = data;
+    size_ = size;
+  }
+
+  // drops the pin and returns the storage to copy a value into.
+  std::string* Own() {
+    Reset();
+    return &copy_;
+  }
+
+ private:
+  const char* data_;
+  size_t size_;
+  DataMapping* mapping_;
+  std::string copy_;
+};
+}  // namespace cabinet
+
+#endif  // CABINET_VALUE_VIEW_H_
@@ -17,6 +17,25 @@ enum DbType {
 struct DbMeta {
   1: bool compressed;
   2: DbType type;
+  // keys are spread over this many shards with a lock each, so that
+  // writes scale with cores. set at Create, 1 if unset.
+  3: optional i32 shards;
+  // reads values with O_DIRECT, so that the db takes no page cache and
+  // its memory is the server's read buffers. set at Create.
+  4: optional bool directIo;
+  // keeps the keys in order too, for GetRange and GetPrefix, which takes
+  // memory, see DbInfo.orderedIndexBytes. set at Create.
+  5: optional bool orderedIndex;
+  // set by Freeze: the db is read only and opens from its frozen index,
+  // which is mapped rather than loaded.
+  6: optional bool frozen;
+  // stores a CRC32C with each value, checked whenever it is read, see
+  // ChecksumMismatch. set at Create.
+  7: optional bool checksums;
+  // values of up to this many bytes are kept in memory as well, so that
+  // reading them never touches disk, see DbInfo.inlineValueBytes. not
+  // for a frozen db. set at Create, 0 if unset.
+  8: optional i32 inlineValueBytes;
 }
 
 struct DbInfo {
@@ -24,11 +43,37 @@ struct DbInfo {
   2: i64 entryCount;
   3: i64 dataBytes;
   4: i64 dataFileSize;
+  // value bytes given to Set since the db was opened, and what they
+  // took stored. compressionRatio is raw / stored, 1 if nothing stored.
+  5: i64 rawBytesWritten;
+  6: i64 storedBytesWritten;
+  7: double compressionRatio;
+  // reads of values from disk since the db was opened that the server's
+  // value cache served, and that it did not.
+  8: i64 cacheHits;
+  9: i64 cacheMisses;
+  // heap bytes of the ordered index, 0 without orderedIndex.
+  10: i64 orderedIndexBytes;
+  // values read since the db was opened, scrubs included, whose checksum
+  // failed.
+  11: i64 checksumErrors;
+  // values kept in memory for meta.inlineValueBytes, and the heap bytes
+  // they take, which is what reading them from memory costs.
+  12: i64 inlineValueCount;
+  13: i64 inlineValueBytes;
 }
 
 struct ServerInfo {
   1: i32 connections;
   2: map<string, DbInfo> dbs;
+  // the value cache shared by all dbs, 0 capacity if disabled.
+  3: i64 cacheCapacity;
+  4: i64 cacheBytes;
+  5: i64 cacheHits;
+  6: i64 cacheMisses;
+  // aligned buffers kept for the reads of directIo dbs.
+  7: i64 readBufferCapacity;
+  8: i64 readBufferBytes;
 }
 
 struct KeyType {
@@ -42,26 +87,73 @@ struct GetInfo {
   2: string value;
 }
 
+// entries of a cursor, keys[i] has values[i].
+struct CursorBatch {
+  1: list<KeyType> keys;
+  2: list<binary> values;
+  // no entries are left, the cursor is closed.
+  3: bool done;
+}
+
+// entries in key order, keys[i] has values[i].
+struct RangeBatch {
+  1: list<KeyType> keys;
+  2: list<binary> values;
+  // entries are left after the last one, the next call may start right
+  // after its key.
+  3: bool more;
+}
+
 exception BadDbName{}
 exception DbExists{}
 exception DbNotExist{}
 exception IOException{}
+exception CursorNotExist{}
+exception NoOrderedIndex{}
+// a value of a db with checksums does not match its checksum: it is
+// corrupt on disk, and the read is better retried on a replica.
+exception ChecksumMismatch{}
 
 service CabinetStorageService {
   string Ping(),
   ServerInfo GetServerInfo(),
 
   void Create(1: string dbName, 2: DbMeta meta) throws (1: BadDbName badDbName, 2: DbExists dbExists, 3: IOException ioException),
+  // opens a db written into the server's data path meanwhile, e.g. by
+  // cabinet_bulkload, as a db of meta.
+  void Attach(1: string dbName, 2: DbMeta meta) throws (1: BadDbName badDbName, 2: DbExists dbExists, 3: IOException ioException),
   void Drop(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbExists, 3: IOException ioException),
   DbInfo GetDbInfo(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist),
-  void Compact(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist),
+  void Compact(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
+  // reads every value of a db with checksums and returns how many are
+  // corrupt, see DbInfo.checksumErrors. the server also scrubs its dbs
+  // every scrub_interval hours.
+  i64 Scrub(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
 
-  GetInfo Get(1: string dbName, 2: KeyType key) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
+  GetInfo Get(1: string dbName, 2: KeyType key) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException, 4: ChecksumMismatch checksumMismatch),
   void Set(1: string dbName, 2: KeyType key, 3: binary value) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
   void Delete(1: string dbName, 2: KeyType key) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
   void Flush(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
   void Sync(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
+  // writes the frozen index of a db and reopens it read only. writes and
+  // Compact fail with IOException from then on, Drop still works.
+  void Freeze(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
 
-  list<GetInfo> BatchGet(1: string dbName, 2: list<KeyType> keys) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
+  list<GetInfo> BatchGet(1: string dbName, 2: list<KeyType> keys) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException, 4: ChecksumMismatch checksumMismatch),
   void BatchSet(1: string dbName, 2: list<KeyType> keys, 3: list<binary> values) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
+
+  // scans the entries of a db live at OpenCursor in data file order. an
+  // entry deleted since is skipped, one set since gives its new value.
+  // a cursor unused for the server's cursor_timeout is closed, and so are
+  // those of a dropped db.
+  i64 OpenCursor(1: string dbName) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: IOException ioException),
+  CursorBatch Next(1: i64 cursorId, 2: i32 batchSize) throws (1: CursorNotExist cursorNotExist, 2: IOException ioException, 3: ChecksumMismatch checksumMismatch),
+  void CloseCursor(1: i64 cursorId),
+
+  // entries of a db created with orderedIndex in key order, at most limit
+  // of them. GetRange gives the keys from begin on, and before end unless
+  // end has no key set. GetPrefix gives the keys starting with prefix,
+  // for integer keys a prefix of their big endian bytes.
+  RangeBatch GetRange(1: string dbName, 2: KeyType begin, 3: KeyType end, 4: i32 limit) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: NoOrderedIndex noOrderedIndex, 4: IOException ioException, 5: ChecksumMismatch checksumMismatch),
+  RangeBatch GetPrefix(1: string dbName, 2: binary prefix, 3: i32 limit) throws (1: BadDbName badDbName, 2: DbNotExist dbNotExist, 3: NoOrderedIndex noOrderedIndex, 4: IOException ioException, 5: ChecksumMismatch checksumMismatch),
 }